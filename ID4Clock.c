@@ -20,321 +20,309 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <pthread.h>
 
 #include "id4-pi.h"
 #include "ID4Serial.h"
 #include "threadqueue.h"
+#include "vclock.h"
+#include "timesvc.h"
+#include "wxpipe.h"
+#include "wxstream.h"
 
-extern int ftpUpload(char *srcFile, char *dstFile);
-
-int NewLog(int xTime);
-int OpenLog(void);
-void CloseLog(void);
-void LogMessage(int xTime, char *sMsg);
-void LogWeatherData(int xTime);
 void LogMinMaxData(int xTime);
-void LogMinMax(unsigned char *sBuf1, unsigned char *sBuf2);
-void LogCurrentReadings(int xTime, unsigned char *sWeatherBuf);
+void LogHistoryData(void);
+int LogWeatherData(int xTime);
+void SampleWeatherData(void);
 
-static FILE *hLog;
-static char *sFileBuf;
-static char sLogPath[64];
-static char sTargetName[16];
 static unsigned char sTimeBuf[8];
 static int iSaveDST = 0;
 
-#define WEATHER_LOG_HEADER1	"Time,Indoor,Outdoor,Wind,Dir,Pressure\n"
-#define WEATHER_LOG_HEADER2	"Midnite,TLow,Time,THigh,Time,Wind,Time,PLow,Time,PHigh,Time\n"
-#define NOWEATHER_LOG_HEADER "*** Log start - Weather data disabled\n"
+// Gap check queued (ID4 thread only)
+static int bClockUp = FALSE;
+static int bGapPending = FALSE;
 
-void *xID4Clock(void *args)
-{
-    struct threadqueue *id4_mq = (struct threadqueue *)args;
-    struct threadmsg msg;
-    ID4Cmd  xCmd;
-    char *xBuf;
-    time_t ltime;
-    struct tm *timenow;
+// Fast sample queued (set by scheduler, cleared by ID4 thread)
+static int bSamplePending = FALSE;
 
-    // Get current system time
-    ltime = time(NULL);
-    timenow = localtime(&ltime);
+// Max clock error (seconds) accepted after time set
+#define CLOCK_VERIFY_SLOP   2
 
-    // Create ID4 weather log
-    if (!NewLog((60 * timenow->tm_hour) + timenow->tm_min))
+//
+// Set ID4 clock, schedule verification on success
+//
+static int SetClock(int xTime, struct tm *timenow, char *sFailMsg)
+{
+    if (SetDateTime('6', timenow) < 0)
     {
-        printf("Log file creation failed: %s\n", strerror(errno));
-        return NULL;
+        WxPostMessage(xTime, sFailMsg);
+        return -1;
     }
 
-    while (TRUE)
-    {
-        if (thread_queue_get(id4_mq, NULL, &msg) != 0)
-        {
-            printf("thread_queue_get returned %d (%s)\n", errno, strerror(errno));
-            break;
-        }
-        // Fill in the parts
-        xCmd.time = (time_t)msg.data;
-        xCmd.cmd = (unsigned char)msg.msgtype;
+    WxStreamEvent("clock", "set");
 
-#if defined(DEBUG)
-        // Service request
-        printf("->ID4 command: %d at %d\n", xCmd.cmd, xCmd.time);
-#endif
+    // Check setting took after things settle
+    if (ID4_PostDelayed(ID4_TIME_VERIFY, xTime, ID4_VERIFY_DELAY))
+        printf("Clock verify not scheduled: %s\n", strerror(errno));
 
-        // Process item
-        switch(xCmd.cmd)
-        {
-        case ID4_LOG_WEATHER:
-            if (bLogWeather)
-                LogWeatherData(xCmd.time);
-            break;
+    return 0;
+}
 
-        case ID4_LOG_MIDNITE:
-            if (bLogWeather)
-            {
-                // Log min/max from past 24hrs
-                LogMinMaxData(xCmd.time);
-                // Only if we have path
-                if (sWLogPath)
-                {
-                    // Strip log path prefix
-                    strcpy(sTargetName, &sLogPath[strlen(sWLogPath)]);
-                    // Flatten name, Ex: /May02/12 -> wMay02-12
-                    xBuf = &sTargetName[0];
-                    *xBuf = 'w';
-                    while ((xBuf = strchr(xBuf, '/')))
-                        *xBuf = '-';
-
-                    // Send current log to FTP server
-                    printf("MIDNITE: Upload to: %s\n", sTargetName);
-                    ftpUpload(sLogPath, sTargetName);
-                }
-            }
+//
+// Compare ID4 clock with system time, re-set once if off
+//
+static void VerifyClock(int xTime)
+{
+    int nDiff;
+    TimeSnap xNow;
+    struct tm *tmNow = &xNow.tmLocal;
 
-            // Start new log w/current weather (midnite implied)
-            if (!NewLog(0))
-                printf("Log file creation failed: %s\n", strerror(errno));
+    if (ReadDateTime(sTimeBuf) != 0)
+    {
+        WxPostMessage(xTime, "--Clock verify failed--\n");
+        return;
+    }
 
-            if (bLogWeather)
-                LogWeatherData(0);
+    ts_refresh();
+    ts_get(&xNow);
 
-            // Sync up date/time
-            printf("MIDNITE: Clock set\n");
-            if (SetDateTime('6', NULL) < 0)
-                LogMessage(xCmd.time, "--Set clock failed--\n");
+    // Seconds of day difference (wrapped)
+    nDiff = ((x24hr(sTimeBuf[3]) * 3600) + (sTimeBuf[2] * 60) + sTimeBuf[1]) -
+            ((tmNow->tm_hour * 3600) + (tmNow->tm_min * 60) + tmNow->tm_sec);
+    if (nDiff > 43200)
+        nDiff -= 86400;
+    else if (nDiff < -43200)
+        nDiff += 86400;
 
-            // For time sync check
-            iSaveDST = tmLocalTime.tm_isdst;
+    if ((nDiff > CLOCK_VERIFY_SLOP) || (nDiff < -CLOCK_VERIFY_SLOP))
+    {
+        printf("Clock verify: off by %d sec, re-setting\n", nDiff);
+        if (SetDateTime('6', NULL) < 0)
+            WxPostMessage(xTime, "--Set clock failed--\n");
+        else
+            WxPostMessage(xTime, "--Clock re-set--\n");
+    }
 
-            // Reset weather data
-            printf("MIDNITE: Reset weather min/max data\n");
-            ID4_LOCK();
-            SendSingleCmd('C');
-            ID4_UNLOCK();
-            printf("MIDNITE: Done\n");
-#if defined(ONION)
-            if (bOnionDpy)
-            {
-                dpyStatus("MIDNITE", timenow);
-            }
-#endif
-            break;
+    return;
+}
 
-        case ID4_TIME_SYNC:
-            // Check clock against system time
-            // Get current system date/time
-            ltime = time(NULL);
-            timenow = localtime(&ltime);
+//
+// Startup -- open (or create) today's log
+//
+int ID4ClockStart(void)
+{
+    TimeSnap xNow;
 
-            // Force time-set at 1 minute before hour
-            if (timenow->tm_min == 59)
-            {
-                if (SetDateTime('6', timenow) < 0)
-                    LogMessage(xCmd.time, "--Clock sync failed--\n");
-
-	    } else {
-		// Check DST change
-                if ((timenow->tm_min == 1) &&
-                    (iSaveDST != timenow->tm_isdst))
-                {
-                    if (SetDateTime('6', timenow) < 0)
-                        LogMessage(xCmd.time, "--Clock sync failed--\n");
-
-                    iSaveDST = timenow->tm_isdst;
-                    LogMessage(xCmd.time, "--Clock sync for DST--\n");
-		}
-	    }
+    ts_get(&xNow);
 
-            break;
+    // Create ID4 weather log (pipeline idle until commands flow)
+    if (!WxLogStart(xNow.nMinutes))
+    {
+        printf("Log file creation failed: %s\n", strerror(errno));
+        return FALSE;
+    }
 
-        case ID4_TIME_SET:
-            if (SetDateTime('6', NULL) < 0)
-                LogMessage(xCmd.time, "--Set clock failed--\n");
+    // Look for gaps left by downtime
+    bClockUp = TRUE;
+    ID4GapCheck();
 
-            iSaveDST = tmLocalTime.tm_isdst;
-            break;
+    return TRUE;
+}
 
-        default:
-            printf("?Bogus request: %d\n", xCmd.cmd);
-            break;
-        }
+//
+// Queue one device history read to backfill log gaps (no more than one
+// pending, nothing before the command thread is up)
+//
+void ID4GapCheck(void)
+{
+    if (!bClockUp || bGapPending || !bLogWeather || !sWLogPath)
+        return;
 
-    }
+    if (ID4_Post(ID4_GAP_CHECK, 0) == 0)
+        bGapPending = TRUE;
 
-    return NULL;
+    return;
 }
 
 //
-// Output message to log file
+// Queue one fast sample - skipped while the last one is still waiting,
+// so a busy device sheds samples rather than backing up the queue
 //
-void LogMessage(int xTime, char *sMsg)
+void ID4Sample(void)
 {
-    size_t nCnt;
+    if (__atomic_exchange_n(&bSamplePending, TRUE, __ATOMIC_ACQ_REL))
+        return;
 
-    // Open log file for append
-    if (OpenLog())
-    {
-        nCnt = sprintf(sFileBuf, "%d,%s", xTime, sMsg);
-        fwrite(sFileBuf, nCnt, 1, hLog);
-        CloseLog();
-        printf("LOG: %s", sFileBuf);
-    }
+    if (ID4_Post(ID4_SAMPLE, 0) != 0)
+        __atomic_store_n(&bSamplePending, FALSE, __ATOMIC_RELEASE);
 
     return;
 }
 
 //
-// Weather log file handling
+// Process one queued ID4 command
 //
-
-// Open/Append current log file
-int OpenLog(void)
+void ID4Dispatch(struct threadmsg *pMsg)
 {
-    // Do nothing if no path
-    if (!sWLogPath)
-        return FALSE;
+    ID4Cmd  xCmd;
+    TimeSnap xNow;
+    struct tm *timenow = &xNow.tmLocal;
 
-    hLog = fopen(sLogPath, "a");
-    if (hLog == NULL)
-    {
-        printf("Log open failed: %s\n", strerror(errno));
-        return FALSE;
-    }
+    // Fill in the parts
+    xCmd.time = (time_t)pMsg->data;
+    xCmd.cmd = (unsigned char)pMsg->msgtype;
 
-    // Allocate write buffer
-    sFileBuf = (char *)malloc(128);
-    if (!sFileBuf)
-    {
-        CloseLog();
-        return FALSE;
-    }
+    // Get current system date/time
+    ts_get(&xNow);
 
-    return TRUE;
-}
+#if defined(DEBUG)
+    // Service request
+    printf("->ID4 command: %d at %d\n", xCmd.cmd, xCmd.time);
+#endif
 
-// Close current log file
-void CloseLog(void)
-{
-    // Close log file
-    if (hLog)
+    // Process item
+    switch(xCmd.cmd)
     {
-        fclose(hLog);
-        hLog = NULL;
-    }
-    // Free buffer
-    if (sFileBuf)
-    {
-        free(sFileBuf);
-        sFileBuf = NULL;
-    }
+    case ID4_LOG_WEATHER:
+        if (bLogWeather)
+        {
+            // Try once more later if device is out to lunch
+            if ((LogWeatherData(xCmd.time) != 0) &&
+                ID4_PostDelayed(ID4_LOG_RETRY, xCmd.time, ID4_RETRY_DELAY))
+                printf("Weather retry not scheduled: %s\n", strerror(errno));
+        }
+        break;
 
-    return;
-}
+    case ID4_LOG_RETRY:
+        if (bLogWeather)
+        {
+            // Log at time actually read
+            LogWeatherData((60 * timenow->tm_hour) + timenow->tm_min);
+        }
+        break;
 
-// Create new, empty, daily log
-int NewLog(int xTime)
-{
-    struct stat	xInfo;
-    size_t	nOut;
-    int		nRes;
-    int		nRet = FALSE;
-
-    // No action if no path
-    if (!sWLogPath)
-        return TRUE;
-
-    // Create path name from date (/mmmyy)
-    nOut = sprintf(sLogPath, "%s/%s%02d", sWLogPath, sMonName[tmLocalTime.tm_mon], tmLocalTime.tm_year - 100);
-    if (stat(sLogPath, &xInfo))
-    {
-        if ((errno == ENOTDIR) || (errno == ENOENT))
+    case ID4_TIME_VERIFY:
+        VerifyClock(xCmd.time);
+        break;
+
+    case ID4_LOG_MIDNITE:
+        if (bLogWeather)
         {
-            // Create path if non-existing
-            if (mkdir(sLogPath, 0755) == 0)
-                nRet = TRUE;
+            // Log min/max from past 24hrs
+            LogMinMaxData(xCmd.time);
         }
-    }
-    else
-    {
-        // Must be a directory
-        nRet = TRUE;
-    }
 
-    // nRet := TRUE if path OK
-    if (nRet)
-    {
-        nRet = FALSE;
-        // Create file name from date (/mmmyy/dd)
-        sprintf(&sLogPath[nOut], "/%02d", tmLocalTime.tm_mday);
-        // Create file
-        hLog = fopen(sLogPath, "a+");
-        if (hLog != NULL)
+        // Start new log w/current weather (midnite implied), old one uploads
+        WxPostNewLog(0, bLogWeather);
+
+        if (bLogWeather)
+            LogWeatherData(0);
+
+        // Sync up date/time
+        printf("MIDNITE: Clock set\n");
+        SetClock(xCmd.time, NULL, "--Set clock failed--\n");
+
+        // For time sync check
+        ts_get(&xNow);
+        iSaveDST = timenow->tm_isdst;
+
+        // Reset weather data
+        printf("MIDNITE: Reset weather min/max data\n");
+        ID4_LOCK();
+        SendSingleCmd('C');
+        ID4_UNLOCK();
+
+        // Day just cleared is now in device history
+        if (bLogWeather && sWLogPath)
+            LogHistoryData();
+        printf("MIDNITE: Done\n");
+#if defined(ONION)
+        if (bOnionDpy)
         {
-            // Check if new file
-            stat(sLogPath, &xInfo);
-            if (xInfo.st_size == 0)
-            {
-                if (bLogWeather)
-                {
-                    // Write weather header
-                    fwrite(WEATHER_LOG_HEADER1, sizeof(WEATHER_LOG_HEADER1) - 1, 1, hLog);
-                }
-                else
-                {
-                    // No weather date logging
-                    fwrite(NOWEATHER_LOG_HEADER, sizeof(NOWEATHER_LOG_HEADER) -1, 1, hLog);
-                }
-            }
-            else
+            dpyStatus("MIDNITE", timenow);
+        }
+#endif
+        break;
+
+    case ID4_TIME_SYNC:
+        // Check clock against system time
+
+        // Force time-set at 1 minute before hour
+        if (timenow->tm_min == 59)
+        {
+            SetClock(xCmd.time, timenow, "--Clock sync failed--\n");
+        }
+        else
+        {
+            // Check DST change
+            if ((timenow->tm_min == 1) &&
+                (iSaveDST != timenow->tm_isdst))
             {
-                // No message if no time
-                if (xTime >= 0)
-                {
-                    // Allocate temp write buffer
-                    sFileBuf = (char *)malloc(40);
-                    if (sFileBuf)
-                    {
-                        // Append restart data
-                        nRes = sprintf(sFileBuf, "%d,--System restart--\n", xTime);
-                        fwrite(sFileBuf, nRes, 1, hLog);
-                    }
-                }
+                SetClock(xCmd.time, timenow, "--Clock sync failed--\n");
+
+                iSaveDST = timenow->tm_isdst;
+                WxPostMessage(xCmd.time, "--Clock sync for DST--\n");
             }
-            nRet = TRUE;
         }
+
+        break;
+
+    case ID4_TIME_SET:
+        SetClock(xCmd.time, NULL, "--Set clock failed--\n");
+
+        ts_get(&xNow);
+        iSaveDST = timenow->tm_isdst;
+        break;
+
+    case ID4_GAP_CHECK:
+        bGapPending = FALSE;
+        if (bLogWeather && sWLogPath)
+            LogHistoryData();
+        break;
+
+    case ID4_SAMPLE:
+        __atomic_store_n(&bSamplePending, FALSE, __ATOMIC_RELEASE);
+        if (bLogWeather)
+            SampleWeatherData();
+        break;
+
+    default:
+        printf("?Bogus request: %d\n", xCmd.cmd);
+        break;
     }
 
-    // Close file and release FS (ready for logging)
-    CloseLog();
+    return;
+}
+
+//
+// ID4 command thread
+//
+void *xID4Clock(void *args)
+{
+    struct threadqueue *id4_mq = (struct threadqueue *)args;
+    struct threadmsg msg;
+
+    if (!ID4ClockStart())
+        return NULL;
 
-    return nRet;
+    while (TRUE)
+    {
+        if (thread_queue_get(id4_mq, NULL, &msg) != 0)
+        {
+            printf("thread_queue_get returned %d (%s)\n", errno, strerror(errno));
+            break;
+        }
+
+        ID4Dispatch(&msg);
+    }
+
+    return NULL;
 }
-static int x24hr(unsigned char nHour)
+
+//
+// Device 12hr clock (PM in bit 7) to 0-23
+//
+int x24hr(unsigned char nHour)
 {
     unsigned char xPM = nHour & 0x80;
     // Strip AM/PM indicator
@@ -370,18 +358,53 @@ void LogMinMaxData(int xTime)
 
     if (rc == 0)
     {
-        LogMinMax(sWBuf1, sWBuf2);
+        WxPostMinMax(xTime, sWBuf1, sWBuf2);
     }
     else
     {
-        LogMessage(xTime, "--No MinMax data--\n");
+        WxPostMessage(xTime, "--No MinMax data--\n");
     }
 
     return;
 }
 
+//
+// Pull device 31 day history for the summary store and log backfill
+//
+void LogHistoryData(void)
+{
+    int rc;
+    unsigned char *sHBuf;
+
+    sHBuf = (unsigned char *)malloc(HISTORY_BUF_SIZE);
+    if (!sHBuf)
+        return;
+
+    do
+    {
+        rc = ReadHistory(sHBuf);
+        if (rc)
+        {
+            if (ReSyncID4())
+                break;
+            // Resync OK - retry
+            continue;
+        }
+    }
+    while (rc != 0);
+
+    if (rc == 0)
+        WxPostHistory(sHBuf);
+    else
+        printf("No history data\n");
+    free(sHBuf);
+
+    return;
+}
+
 // Read and log current weather data
-void LogWeatherData(int xTime)
+// Returns non-zero if device could not be read
+int LogWeatherData(int xTime)
 {
     int rc = 0;
     unsigned char *sWBuf;
@@ -405,79 +428,28 @@ void LogWeatherData(int xTime)
         // check success
         if (rc == 0)
         {
-            LogCurrentReadings(xTime, sWBuf);
+            WxPostWeather(xTime, sWBuf);
         }
         else
         {
-            LogMessage(xTime, "--No weather--\n");
+            WxPostMessage(xTime, "--No weather--\n");
         }
         free(sWBuf);
     }
 
-    return;
+    return rc;
 }
 
-void LogMinMax(unsigned char *sBuf1, unsigned char *sBuf2)
-{
-    int     nPres1, nPres2;
-    size_t  nCnt;
-
-    // Open log file for append
-    if (OpenLog())
-    {
-        // Write min/max header
-        fwrite(WEATHER_LOG_HEADER2, sizeof(WEATHER_LOG_HEADER2) - 1, 1, hLog);
-
-        // sbuf1 contains temp high/low & wind speed
-        // Log Tlow/Thigh (1440 := midnite)
-        nCnt = sprintf(sFileBuf, "1440,%d,%02d:%02d,%d,%02d:%02d", sBuf1[1] - 40, x24hr(sBuf1[3]), sBuf1[2],
-                       sBuf1[6] - 40, x24hr(sBuf1[8]), sBuf1[7]);
-
-        // Log Wind
-        nCnt += sprintf(&sFileBuf[nCnt], ",%d,%02d:%02d", (sBuf1[11] * 99) / 256, x24hr(sBuf1[13]), sBuf1[12]);
-
-        // sBuf2 contains barometric pressure high/low data
-        nPres1 = (sBuf2[1] + 2900) / 100;
-        nPres2 = (sBuf2[1] + 2900) - (nPres1 * 100);
-
-        // Log Plow
-        nCnt += sprintf(&sFileBuf[nCnt], ",%d.%02d,%02d:%02d", nPres1, nPres2, x24hr(sBuf2[3]), sBuf2[2]);
-
-        nPres1 = (sBuf2[6] + 2900) / 100;
-        nPres2 = (sBuf2[6] + 2900) - (nPres1 * 100);
-
-        // Log Phigh
-        nCnt += sprintf(&sFileBuf[nCnt], ",%d.%02d,%02d:%02d\n", nPres1, nPres2, x24hr(sBuf2[8]), sBuf2[7]);
-
-        fwrite(sFileBuf, nCnt, 1, hLog);
-        CloseLog();
-    }
-
-    return;
-}
-
-void LogCurrentReadings(int xTime, unsigned char *sWeatherBuf)
+//
+// One fast sample - a failed read is left for the next logged reading
+// to resync
+//
+void SampleWeatherData(void)
 {
-    int nPres1, nPres2, nWinDir;
-    size_t nCnt;
+    unsigned char sWBuf[WEATHER_BUF_SIZE];
 
-    // Open log file for append
-    if (OpenLog())
-    {
-        // Convert presure
-        nPres1 = (sWeatherBuf[11] + 2900) / 100;
-        nPres2 = (sWeatherBuf[11] + 2900) - (nPres1 * 100);
-
-        // Fold input 4-bit gray code to table index (wind direction)
-        nWinDir = (sWeatherBuf[1] & 0x1C) >> 2;
-        nWinDir |= (sWeatherBuf[1] & 0x80) >> 4;
-        // time, indoor, outdoor, Wind, Direction, Pressure
-        nCnt = sprintf(sFileBuf, "%d,%d,%d,%d,%s,%d.%02d\n", xTime, sWeatherBuf[9] - 40, sWeatherBuf[10] - 40,
-                       (sWeatherBuf[8] * 99) / 256, sWinDir[nWinDir], nPres1, nPres2);
-        fwrite(sFileBuf, nCnt, 1, hLog);
-        CloseLog();
-    }
+    if (ReadWeather(sWBuf) == 0)
+        WxPostSample(sWBuf);
 
     return;
 }
-
@@ -11,6 +11,8 @@
 #include "id4-pi.h"
 #include "ID4Serial.h"
 #include "serport.h"
+#include "vclock.h"
+#include "timesvc.h"
 
 //
 // A few notes about input values
@@ -87,7 +89,7 @@ int SetDateTime(unsigned char sClkMode, struct tm *timenow)
     unsigned char nHour;
     unsigned char bAmPm;
     unsigned char sCmdBuf[4];
-    time_t ltime;
+    TimeSnap xNow;
 
     ID4_LOCK();
 
@@ -97,13 +99,10 @@ int SetDateTime(unsigned char sClkMode, struct tm *timenow)
 
         if (timenow == NULL)
         {
-            // Get current system date/time
-            ltime = time(NULL);
-            localtime_r(&ltime, &tmLocalTime);
-            timenow = &tmLocalTime;
-        } else {
-            // Update local time if supplied
-            memcpy(&tmLocalTime, timenow, sizeof(struct tm));
+            // Get current system date/time (up to the second)
+            ts_refresh();
+            ts_get(&xNow);
+            timenow = &xNow.tmLocal;
         }
 
         // Use current time
@@ -143,7 +142,7 @@ int SetDateTime(unsigned char sClkMode, struct tm *timenow)
         }
 
         // Wait 100ms between commands
-        usleep(100 * 1000);
+        vc_usleep(100 * 1000);
 
         sCmdBuf[0] = 'd';
         sCmdBuf[1] = timenow->tm_mday;
@@ -276,7 +275,7 @@ int ReadMinMaxData(unsigned char *sBuf1, unsigned char *sBuf2)
         if (nRet < 0)
             break;
 
-        usleep(100 * 1000);
+        vc_usleep(100 * 1000);
 
         sCmd = 'b';
         nRet = WriteSerPort(fPort, &sCmd, 1);
@@ -295,6 +294,38 @@ int ReadMinMaxData(unsigned char *sBuf1, unsigned char *sBuf2)
     return (nRet < 0) ? nRet : 0;
 }
 
+//
+// Fetch 31 day history of daily extremes
+//
+int ReadHistory(unsigned char *sHistBuf)
+{
+    int nRet;
+    unsigned char sCmd;
+
+    ID4_LOCK();
+
+    do
+    {
+        sCmd = 'i';
+        nRet = WriteSerPort(fPort, &sCmd, 1);
+        if (nRet < 0)
+            break;
+
+        nRet = ReadSerPort(fPort, sHistBuf, HISTORY_BUF_SIZE, sCmd);
+        if (nRet < 0)
+            break;
+#if defined(RECORD_MODE)
+        if (bRecording)
+            DumpResponseToFile(fLog, 'i', sHistBuf, HISTORY_BUF_SIZE);
+#endif
+    }
+    while(FALSE);
+
+    ID4_UNLOCK();
+
+    return (nRet < 0) ? nRet : 0;
+}
+
 //
 // Display date-time in US. 12hr format
 //
@@ -402,36 +433,18 @@ void ShowMinMax(void)
 //
 void ShowHistory(void)
 {
-    int nErr;
     int nPres1, nPres2;
     int n;
 
-    unsigned char sCmd;
-    unsigned char sHistory[466];
+    unsigned char sHistory[HISTORY_BUF_SIZE];
     unsigned char *sRecord;
 
-    ID4_LOCK();
-
-    sCmd = 'i';
-    nErr = WriteSerPort(fPort, &sCmd, 1);
-    if (nErr < 0)
-    {
-        ID4_UNLOCK();
-        return;
-    }
-
-    nErr = ReadSerPort(fPort, sHistory, 466, sCmd);
-    if (nErr < 0)
-    {
-        ID4_UNLOCK();
+    if (ReadHistory(sHistory) != 0)
         return;
-    }
-
-    ID4_UNLOCK();
 
     for (n = 0; n < 31; n++)
     {
-        sRecord = &sHistory[15 * n];
+        sRecord = &sHistory[HISTORY_REC_SIZE * n];
         printf("Day %d:\tTlow = %d at %d:%02d %s, Thigh = %d at %d:%02d %s\n", n + 1,
                sRecord[1] - 40, sRecord[3] & 0x7F, sRecord[2], sAmPm(sRecord[3]),
                sRecord[4] - 40, sRecord[6] & 0x7F, sRecord[5], sAmPm(sRecord[6]));
@@ -12,6 +12,7 @@ extern int ReadDateTime(unsigned char *sTimeBuf);
 extern int SetDateTime(unsigned char sClkMode, struct tm *timenow);
 extern int ReadWeather(unsigned char *sWeatherBuf);
 extern int ReadMinMaxData(unsigned char *sBuf1, unsigned char *sBuf2);
+extern int ReadHistory(unsigned char *sHistBuf);
 extern int SendSingleCmd(unsigned char sCmd);
 extern int ReadVersion(unsigned char *sVersion);
 extern void ShowDateTime(char *sPrefix, unsigned char *sTimeBuf);
@@ -19,11 +20,14 @@ extern void ShowWeather(char *sPrefix, unsigned char *sWeatherBuf);
 extern void ShowMinMax(void);
 extern void ShowHistory(void);
 extern void ShowVersion(void);
+extern int x24hr(unsigned char nHour);
 
 // Define various weather data buffer sizes
 #define WEATHER_BUF_SIZE	17
 #define MMTEMP_BUF_SIZE		16
 #define MMPRES_BUF_SIZE		11
+#define HISTORY_BUF_SIZE	466     // 'i' + 31 days by day of month
+#define HISTORY_REC_SIZE	15
 
 //
 // ID4 Command item
@@ -39,9 +43,22 @@ typedef enum
     ID4_LOG_WEATHER = 1,
     ID4_LOG_MIDNITE,
     ID4_TIME_SYNC,
-    ID4_TIME_SET
+    ID4_TIME_SET,
+    ID4_LOG_RETRY,      // Delayed retry of failed weather sample
+    ID4_TIME_VERIFY,    // Deferred check of clock set
+    ID4_GAP_CHECK,      // Read device history, backfill log gaps
+    ID4_SAMPLE          // Fast sample for the recent readings ring
 } ID4_CMDFUNC;
 
+// Command queue lanes (see ID4_Post)
+#define ID4_LANE_TIME       0
+#define ID4_LANE_LOG        1
+#define ID4_LANE_BULK       2
+
+// Delays (seconds) for deferred commands
+#define ID4_RETRY_DELAY     120
+#define ID4_VERIFY_DELAY    5
+
 #define ID4_LOCK()      ID4_Reserve()
 #define ID4_UNLOCK()    ID4_Release()
 
@@ -27,6 +27,23 @@
 #include "serport.h"
 #include "ID4Serial.h"
 #include "threadqueue.h"
+#include "timerwheel.h"
+#include "vclock.h"
+#include "timesvc.h"
+#include "wxpipe.h"
+#include "wxbin.h"
+#include "wxarch.h"
+#include "wxquery.h"
+#include "wxroll.h"
+#include "wxnorm.h"
+#include "wxkern.h"
+#include "wxmemo.h"
+#include "wximport.h"
+#include "wxarrow.h"
+#include "wxstream.h"
+#include "wxring.h"
+#include "wxstage.h"
+#include "id4emu.h"
 
 const char * const sMonName[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
                                     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
@@ -56,6 +73,17 @@ short           sMinutesPastMidnite;
 
 timer_t     id4timerid;
 
+// Delayed command wheel (1 sec ticks) - runs on the scheduler thread
+static TimerWheel   id4_wheel;
+static short        sLastMinute = -1;
+
+typedef struct _ID4Delayed
+{
+    TWTimer     timer;
+    long        cmd;
+    time_t      time;
+} ID4Delayed;
+
 // Serial port for ID4001
 int fPort;
 
@@ -66,6 +94,18 @@ int bWebEnable;
 int bWebOnly;
 int bLogWeather;
 static int cImmediate;
+static int nSimDays;
+static char *sSimStart;
+static int nBenchMillions;
+static long nMemoKB;
+static char *sConvertPath;
+static char *sQuerySpec;
+static char *sArrowSpec;
+static char *sStreamSpec;
+static char *sRingSpec;
+static char *sStageSpec;
+static char *sImportPath;
+static int bBackfill;
 char *sWLogPath;
 
 #if defined(ONION)
@@ -81,6 +121,8 @@ extern void *xWebStart(void *);
 pthread_t   tID4Clock;
 extern void *xID4Clock(void *);
 
+pthread_t   tID4Sched;
+
 // Serialze access to serial device
 pthread_mutex_t id4_mutex;
 
@@ -95,22 +137,100 @@ int bRecording;
 #endif // defined
 //-------------------------------------------------------------------------------
 
-// Timer proc -- called from 1M recurring timer
-static void do_timer_proc(int sig, siginfo_t *si, void *uc)
+// Command -> queue lane. Time critical work preempts logging and bulk.
+static int ID4Lane(long cmd)
+{
+    switch (cmd)
+    {
+    case ID4_TIME_SET:
+    case ID4_TIME_SYNC:
+    case ID4_TIME_VERIFY:
+        return ID4_LANE_TIME;
+
+    case ID4_GAP_CHECK:
+    case ID4_SAMPLE:
+        return ID4_LANE_BULK;
+
+    default:
+        return ID4_LANE_LOG;
+    }
+}
+
+//
+// Queue command for ID4 thread on the lane for its priority
+//
+int ID4_Post(long cmd, void *data)
+{
+    return thread_queue_add_lane(&id4_mq, data, cmd, ID4Lane(cmd));
+}
+
+// Wheel callback -- post the deferred command to the ID4 thread
+static void do_delayed_cmd(void *arg)
+{
+    ID4Delayed *xItem = (ID4Delayed *)arg;
+
+    if (ID4_Post(xItem->cmd, (void *)xItem->time))
+        printf("Delayed command %ld dropped: %s\n", xItem->cmd, strerror(errno));
+
+    free(xItem);
+
+    return;
+}
+
+//
+// Post ID4 command to run 'nDelay' seconds from now
+// Returns non-zero on failure (as ID4_Post)
+//
+int ID4_PostDelayed(long cmd, time_t xTime, unsigned int nDelay)
+{
+    ID4Delayed *xItem;
+
+    xItem = (ID4Delayed *)calloc(1, sizeof(ID4Delayed));
+    if (xItem == NULL)
+        return -1;
+
+    xItem->cmd = cmd;
+    xItem->time = xTime;
+    tw_add(&id4_wheel, &xItem->timer, nDelay, do_delayed_cmd, xItem);
+
+    return 0;
+}
+
+// TRUE if delayed commands are waiting on the wheel
+int ID4_DelayedPending(void)
+{
+    return id4_wheel.count != 0;
+}
+
+//
+// One scheduler tick -- fire due delayed commands, post the
+// minute schedule on minute rollover. Returns non-zero on queue failure.
+//
+int ID4_Tick(void)
 {
     int rc = 0;
     time_t xCmdTime;
+    TimeSnap xNow;
 
-    // make sure this is for us
-    if (si->si_value.sival_ptr != &id4timerid)
-    {
-        printf("!Spurious signal\n");
-        return;
-    }
+    // Fire any delayed commands due
+    tw_advance(&id4_wheel, vc_ticks());
+
+    // Publish this second's time, scheduler keeps its own copy
+    ts_tick();
+    ts_get(&xNow);
+    ttLocalTime = xNow.ttNow;
+    tmLocalTime = xNow.tmLocal;
+    sMinutesPastMidnite = xNow.nMinutes;
+
+    // Fast samples between the logged readings (:00, :20, :40)
+    if ((nSampleSecs > 0) && bLogWeather && ((xNow.ttNow % nSampleSecs) == 0) &&
+        !((xNow.tmLocal.tm_sec == 0) && ((xNow.tmLocal.tm_min % 20) == 0)))
+        ID4Sample();
 
-    ttLocalTime = time(NULL);
-    localtime_r(&ttLocalTime, &tmLocalTime);
-    sMinutesPastMidnite = (60 * tmLocalTime.tm_hour) + tmLocalTime.tm_min;
+    // Scheduled work runs once per minute
+    if (sMinutesPastMidnite == sLastMinute)
+        return 0;
+    sLastMinute = sMinutesPastMidnite;
 
     xCmdTime = sMinutesPastMidnite;
 
@@ -121,12 +241,12 @@ static void do_timer_proc(int sig, siginfo_t *si, void *uc)
         if (tmLocalTime.tm_hour == 0)
         {
             // Log and clear min-max, sync time
-            rc = thread_queue_add(&id4_mq, (void *)xCmdTime, ID4_LOG_MIDNITE);
+            rc = ID4_Post(ID4_LOG_MIDNITE, (void *)xCmdTime);
         }
         else
         {
             // Send log current weather
-            rc = thread_queue_add(&id4_mq, (void *)xCmdTime, ID4_LOG_WEATHER);
+            rc = ID4_Post(ID4_LOG_WEATHER, (void *)xCmdTime);
         }
     }
     else
@@ -136,7 +256,7 @@ static void do_timer_proc(int sig, siginfo_t *si, void *uc)
                 (tmLocalTime.tm_min == 40))
         {
             // Send log current weather
-            rc = thread_queue_add(&id4_mq, (void *)xCmdTime, ID4_LOG_WEATHER);
+            rc = ID4_Post(ID4_LOG_WEATHER, (void *)xCmdTime);
         }
 
     }
@@ -146,12 +266,25 @@ static void do_timer_proc(int sig, siginfo_t *si, void *uc)
 	(tmLocalTime.tm_min == 1))
     {
         // Read and set system time
-        rc = thread_queue_add(&id4_mq, (void *)xCmdTime, ID4_TIME_SYNC);
+        rc = ID4_Post(ID4_TIME_SYNC, (void *)xCmdTime);
+    }
+
+    return rc;
+}
+
+// Timer proc -- called from 1S recurring timer on scheduler thread
+static void do_timer_proc(siginfo_t *si)
+{
+    // make sure this is for us
+    if (si->si_value.sival_ptr != &id4timerid)
+    {
+        printf("!Spurious signal\n");
+        return;
     }
 
-    if (rc)
+    if (ID4_Tick())
     {
-        printf("Fatal: thread_queue_add failed: %s\n", strerror(errno));
+        printf("Fatal: ID4_Post failed: %s\n", strerror(errno));
         if (bWebEnable)
             pthread_cancel(tWebIO);
     }
@@ -159,6 +292,36 @@ static void do_timer_proc(int sig, siginfo_t *si, void *uc)
     return;
 }
 
+// Scheduler thread -- waits for timer signal, runs schedule and timer wheel
+static void *xID4Sched(void *args)
+{
+    sigset_t *pSigSet = (sigset_t *)args;
+    siginfo_t si;
+
+    while (TRUE)
+    {
+        if (sigwaitinfo(pSigSet, &si) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("sigwaitinfo failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // Shutdown - main thread stops the rest and flushes the pipeline
+        if ((si.si_signo == SIGTERM) || (si.si_signo == SIGINT))
+        {
+            printf("Shutdown on signal %d\n", si.si_signo);
+            if (bWebEnable)
+                pthread_cancel(tWebIO);
+            break;
+        }
+        do_timer_proc(&si);
+    }
+
+    return NULL;
+}
+
 void do_time_sync(int signo)
 {
     time_t xCmdTime = (60 * tmLocalTime.tm_hour) + tmLocalTime.tm_min;
@@ -166,7 +329,7 @@ void do_time_sync(int signo)
     if (signo == SIGUSR1)
     {
         // Check if clock needs correcting
-        thread_queue_add(&id4_mq, (void *)xCmdTime, ID4_TIME_SET);
+        ID4_Post(ID4_TIME_SET, (void *)xCmdTime);
     }
 
     return;
@@ -218,7 +381,7 @@ int ReSyncID4(void)
     {
         // Close and reopen serial port
         CloseSerPort(fPort);
-        sleep(1);
+        vc_sleep(1);
         fPort = OpenSerPort(sPortName);
         if (fPort < 0)
             break;
@@ -232,11 +395,15 @@ int ReSyncID4(void)
             }
             // OK response
             printf("OK\n");
+            WxStreamEvent("resync", "ok");
+            // Whatever the device was doing may have cost log entries
+            ID4GapCheck();
             return 0;
         }
     }
 
     printf("Failed\n");
+    WxStreamEvent("resync", "failed");
 
     return -1;
 }
@@ -259,6 +426,30 @@ void ShowHelp(void)
     printf("   -R          Web server only (implies -Z)\n");
     printf("   -r          Record serial comms to file: weather.log\n");
     printf("   -l path     Path for weather log files\n");
+    printf("   -e          Use ID4001 emulator (no hardware)\n");
+    printf("   -S days[,start] Simulate schedule for days from YYYY-MM-DD (default %s) on virtual clock\n"
+           "               and exit (implies -e)\n", SIM_START);
+    printf("   -X pct      Emulator: drop pct%% of commands\n");
+    printf("   -F sync     Log fsync: a (every write), r (at midnite, default) or secs\n");
+    printf("   -O fmt      Log format: c (CSV), b (binary) or a (both, default)\n");
+    printf("   -E file     Write binary (.wxb) or archived (Mmmyy/dd) log as CSV to stdout and exit\n");
+    printf("   -Q from,to[,op] Query logs (-l), dates YYYY-MM-DD[THH:MM], op: points, extremes, history (device daily), normals, gaps, pNN[,pNN] percentiles, chart:field:points, bucket secs, hour|day|month rollups or [count:]field<|<=|=|>=|>value\n");
+    printf("   -a from,to,level,file Export logs (-l) as Arrow IPC stream, level: raw|hour|day|month\n"
+           "               (rollups: every hour/day/month the range touches, in full)\n");
+    printf("   -I path     Import CSV log tree at path into -l (formats per -O) and exit\n");
+    printf("   -U          Rebuild rollups, zone maps and normals of all logged days (-l) and exit\n");
+    printf("   -P url[,n,ms] Stream readings/events as line protocol to udp://host:port, tcp://host:port,\n"
+           "               unix:path or unixgram:path, sent every n lines (default %d) or ms (default %d)\n",
+           WXS_BATCH_LINES, WXS_FLUSH_MS);
+    printf("   -G secs[,h] Also sample every secs (%d-%d) into memory for the last h hours (default %d),\n"
+           "               served at recent/<minutes>.csv, not logged\n", WXRING_MIN_SECS, WXRING_MAX_SECS, WXRING_HOURS);
+    printf("   -K dir[,secs] Stage today's logs in dir (tmpfs), copied to -l every secs (default %d),\n"
+           "               at midnite and on SIGTERM. Web queries read today from dir; -Q, rollups\n"
+           "               and the tree copy lag by up to secs\n", WXSTAGE_SECS);
+    printf("   -Y n        Benchmark aggregation kernels over n million readings and exit\n");
+    printf("   -q kb       Query result cache budget (default %d, 0 := off), stats at query/cache.csv\n",
+           WXM_DEF_BUDGET);
+    printf("   -A k[,r,h]  Archive months older than k, hourly after r, daily after h (default: off,12,36)\n");
 
     return;
 }
@@ -268,7 +459,7 @@ void parse_options(int argc, char **argv)
     int opt, nSize;
 
     optind = 0;
-    while ((opt = getopt(argc, argv, "?Bhs:l:CTWVMHrRZD")) != -1)
+    while ((opt = getopt(argc, argv, "?Bhs:l:CTWVMHrRZDeS:X:F:O:E:A:Q:I:Ua:P:G:K:Y:q:")) != -1)
     {
         switch (opt)
         {
@@ -298,6 +489,112 @@ void parse_options(int argc, char **argv)
             }
             break;
 
+        case 'e':
+            bEmulate = TRUE;
+            break;
+
+        case 'S':
+            nSimDays = atoi(optarg);
+            sSimStart = strchr(optarg, ',');
+            if (nSimDays <= 0)
+            {
+                printf("Bad simulation days: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'X':
+            nEmuFailRate = atoi(optarg);
+            break;
+
+        case 'F':
+            // Log sync policy
+            if (optarg[0] == 'a')
+                nLogSync = WX_SYNC_ALWAYS;
+            else if (optarg[0] == 'r')
+                nLogSync = WX_SYNC_ROTATE;
+            else if ((nLogSync = atoi(optarg)) <= 0)
+            {
+                printf("Bad log sync: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'O':
+            // Log file format(s)
+            if (optarg[0] == 'c')
+                nLogFormat = WX_FMT_CSV;
+            else if (optarg[0] == 'b')
+                nLogFormat = WX_FMT_WXB;
+            else if (optarg[0] == 'a')
+                nLogFormat = WX_FMT_CSV | WX_FMT_WXB;
+            else
+            {
+                printf("Bad log format: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'E':
+            sConvertPath = optarg;
+            break;
+
+        case 'Y':
+            nBenchMillions = atoi(optarg);
+            if (nBenchMillions <= 0)
+            {
+                printf("Bad benchmark size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'Q':
+            sQuerySpec = optarg;
+            break;
+
+        case 'q':
+            nMemoKB = atol(optarg);
+            if (nMemoKB < 0)
+            {
+                printf("Bad query cache size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'a':
+            sArrowSpec = optarg;
+            break;
+
+        case 'P':
+            sStreamSpec = optarg;
+            break;
+
+        case 'G':
+            sRingSpec = optarg;
+            break;
+
+        case 'K':
+            sStageSpec = optarg;
+            break;
+
+        case 'I':
+            sImportPath = optarg;
+            break;
+
+        case 'U':
+            bBackfill = TRUE;
+            break;
+
+        case 'A':
+            // Archive retention (months)
+            sscanf(optarg, "%d,%d,%d", &nArchKeep, &nArchRaw, &nArchHourly);
+            if ((nArchKeep < 1) || (nArchRaw < nArchKeep) || (nArchHourly < nArchRaw))
+            {
+                printf("Bad archive policy: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         // Immediate commands
         case 'C':
         case 'T':
@@ -339,13 +636,14 @@ void parse_options(int argc, char **argv)
 
 int main(int argc, char **argv)
 {
-    int rc;
+    int rc, nSize;
     unsigned char sTimeBuf[8];
     unsigned char sWeatherBuf[17];
 
-    struct sigaction sa;
+    static sigset_t ssTimer;
     struct sigevent sev;
     struct itimerspec its;
+    TimeSnap xStart;
 
     bDaemonize = FALSE;
     bWebEnable = TRUE;
@@ -358,10 +656,72 @@ int main(int argc, char **argv)
     sWLogPath = NULL;
     strcpy(sPortName, "USB0");
     cImmediate = 0;
+    nSimDays = 0;
+    nBenchMillions = 0;
+    nMemoKB = WXM_DEF_BUDGET;
+    sConvertPath = NULL;
+    sQuerySpec = NULL;
+    sArrowSpec = NULL;
+    sStreamSpec = NULL;
+    sRingSpec = NULL;
+    sStageSpec = NULL;
+    sImportPath = NULL;
+    bBackfill = FALSE;
     fPort = -1;
 
     parse_options(argc, argv);
 
+    // Vector kernels for queries and rollups
+    WxkInit();
+    if (nBenchMillions)
+        exit(WxkBench(nBenchMillions) ? EXIT_FAILURE : EXIT_SUCCESS);
+
+    // Log conversion needs no device
+    if (sConvertPath)
+    {
+        nSize = strlen(sConvertPath);
+        if ((nSize > 4) && (strcmp(&sConvertPath[nSize - 4], WXB_EXT) == 0))
+            rc = WxbToCsv(sConvertPath, stdout);
+        else
+            rc = WxaDayToCsv(sConvertPath, stdout);
+        exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if ((sImportPath || bBackfill || sQuerySpec || sArrowSpec) && !sWLogPath)
+    {
+        printf("%s needs log path (-l)\n", sImportPath ? "Import" : bBackfill ? "Backfill" :
+                                            sQuerySpec ? "Query" : "Export");
+        exit(EXIT_FAILURE);
+    }
+
+    // Virtual clock must be in place before anything reads the time
+    if ((nSimDays > 0) && (SimInit(sSimStart ? (sSimStart + 1) : SIM_START) != 0))
+        exit(EXIT_FAILURE);
+
+    // Index of logged days (queries), rollups for months without them
+    if (sWLogPath)
+    {
+        // Logs before today (on the clock in use) are final until the
+        // logger says otherwise
+        WxmInit(nMemoKB * 1024, WxqDateTime(WxqDateOf(vc_time()), 0));
+        WxqOpen(sWLogPath);
+        if (sImportPath)
+            exit(WxImportCli(sImportPath) ? EXIT_FAILURE : EXIT_SUCCESS);
+
+        // Queries and exports read the stores as they are - only the
+        // logger at startup (or -U) builds them
+        if (sQuerySpec)
+            exit(WxqRunCli(sQuerySpec) ? EXIT_FAILURE : EXIT_SUCCESS);
+        if (sArrowSpec)
+            exit(WxArrowCli(sArrowSpec) ? EXIT_FAILURE : EXIT_SUCCESS);
+
+        rc = WxRollRebuild(0, bBackfill);
+        if (WxnRebuild(0, bBackfill) < 0)
+            rc = -1;
+        if (bBackfill)
+            exit((rc < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
     // Check for too many args
     if (argc > optind)
     {
@@ -491,6 +851,45 @@ int main(int argc, char **argv)
             printf("thread_queue_init error %d %s\n", errno, strerror(errno));
             exit(EXIT_FAILURE);
         }
+
+        // Lanes: time set/sync strict, logging ahead of uploads
+        thread_queue_set_lane(&id4_mq, ID4_LANE_TIME, 0);
+        thread_queue_set_lane(&id4_mq, ID4_LANE_LOG, 4);
+        thread_queue_set_lane(&id4_mq, ID4_LANE_BULK, 1);
+
+        // Delayed command wheel
+        if (tw_init(&id4_wheel, vc_ticks()) != 0)
+        {
+            printf("tw_init error %d %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        // Block timer and shutdown signals in all threads (serviced by scheduler thread)
+        sigemptyset(&ssTimer);
+        sigaddset(&ssTimer, ID4SIG);
+        sigaddset(&ssTimer, SIGTERM);
+        sigaddset(&ssTimer, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &ssTimer, NULL);
+
+        // Staged logging ahead of the log start
+        if (sStageSpec && (WxStageStart(sStageSpec) != 0))
+            exit(EXIT_FAILURE);
+
+        // Recent readings ring ahead of the first record
+        if (sRingSpec && (WxRingStart(sRingSpec) != 0))
+            exit(EXIT_FAILURE);
+
+        // Line protocol sink ahead of the first record
+        if (sStreamSpec && (WxStreamStart(sStreamSpec) != 0))
+            exit(EXIT_FAILURE);
+
+        // Decode, persistence and export stages (inline when simulated)
+        if (WxPipeStart(nSimDays == 0) != 0)
+            exit(EXIT_FAILURE);
+
+        // Simulated run drives schedule and commands itself
+        if (nSimDays > 0)
+            exit(RunSimulation(nSimDays));
     }
 
     if (bWebEnable)
@@ -513,23 +912,19 @@ int main(int argc, char **argv)
         }
 
         // Startup -- sync clock to system time
-        if (thread_queue_add(&id4_mq, 0, ID4_TIME_SET))
+        if (ID4_Post(ID4_TIME_SET, 0))
         {
-            printf("thread_queue_add failure: %s\n", strerror(errno));
+            printf("ID4_Post failure: %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
 
         // Setup USR1 signal handler (re-sync time)
         signal(SIGUSR1, do_time_sync);
 
-        // Setup timer signal hander
-        sa.sa_flags = SA_SIGINFO | SA_RESTART;
-        sa.sa_sigaction = do_timer_proc;
-        sigemptyset(&sa.sa_mask);
-
-        if (sigaction(ID4SIG, &sa, NULL))
+        // Thread to run schedule and delayed commands
+        if (pthread_create(&tID4Sched, NULL, &xID4Sched, (void *)&ssTimer))
         {
-            printf("Signal action bind failure: %s\n", strerror(errno));
+            printf("ID4Sched thread create failure: %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
 
@@ -544,13 +939,15 @@ int main(int argc, char **argv)
             exit(EXIT_FAILURE);
         }
 
-        // Declare timer (1M ticks)
-        ttLocalTime = time(NULL);
-        localtime_r(&ttLocalTime, &tmLocalTime);
+        // Declare timer (1S ticks, minute work done on rollover)
+        ts_get(&xStart);
+        ttLocalTime = xStart.ttNow;
+        tmLocalTime = xStart.tmLocal;
+        sLastMinute = xStart.nMinutes;
 
-        its.it_value.tv_sec = 60 - tmLocalTime.tm_sec;
+        its.it_value.tv_sec = 1;
         its.it_value.tv_nsec = 0;
-        its.it_interval.tv_sec = 60;
+        its.it_interval.tv_sec = 1;
         its.it_interval.tv_nsec = 0;
         // Start timer
         if (timer_settime(id4timerid, 0, &its, NULL))
@@ -577,8 +974,13 @@ int main(int argc, char **argv)
     {
         // Cleanup timers, threads & queues
         timer_delete(id4timerid);
+        pthread_cancel(tID4Sched);
+        pthread_join(tID4Sched, NULL);
+        tw_cleanup(&id4_wheel);
         pthread_cancel(tID4Clock);
         pthread_join(tID4Clock, NULL);
+        // Flush records still in the pipeline
+        WxPipeStop();
 
         thread_queue_cleanup(&id4_mq, FALSE);
     }
@@ -23,11 +23,26 @@
 #endif
 
 extern int ReSyncID4(void);
+struct threadmsg;
+
+extern int ID4_Post(long cmd, void *data);
+extern int ID4_Tick(void);
+extern int ID4_DelayedPending(void);
+extern int ID4ClockStart(void);
+extern void ID4GapCheck(void);
+extern void ID4Sample(void);
+extern void ID4Dispatch(struct threadmsg *pMsg);
+// Simulation start (local midnite) unless -S gives one
+#define SIM_START   "2024-01-01"
+
+extern int SimInit(const char *sStart);
+extern int RunSimulation(int nDays);
+extern int ID4_PostDelayed(long cmd, time_t xTime, unsigned int nDelay);
 
 extern struct tm    tmLocalTime;
 extern time_t       ttLocalTime;
 extern int          iTZOffset;
-short               sMinutesPastMidnite;
+extern short        sMinutesPastMidnite;
 
 extern const char * const sDayOfWeek[];
 extern const char * const sMonName[];
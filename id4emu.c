@@ -0,0 +1,454 @@
+// id4emu.c - ID4001-5 emulator (no hardware required)
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "id4emu.h"
+#include "vclock.h"
+
+//
+// The emulator answers the same byte protocol as the real unit:
+// every response starts with the command echo. Weather is a smooth,
+// deterministic function of (virtual) time so runs are repeatable.
+// The device clock is naive local time (no DST) and drifts slowly.
+//
+
+// Device clock drift (parts per million)
+#define EMU_DRIFT_PPM       20
+// Seconds the emulated port 'waits' on an injected failure
+#define EMU_TIMEOUT         3
+
+int bEmulate = FALSE;
+int nEmuFailRate = 0;           // Percent of commands to drop
+
+// Min/max tracking for one day
+typedef struct _EmuExtreme
+{
+    int     nValue;
+    time_t  ttWhen;             // Device (naive) time
+} EmuExtreme;
+
+typedef struct _EmuDay
+{
+    EmuExtreme  xTLow, xTHigh, xWind, xPLow, xPHigh;
+    int         bValid;
+} EmuDay;
+
+static pthread_mutex_t emu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int bEmuInit = FALSE;
+static EmuStats xStats;
+
+// Device clock: naive time ttDevBase at virtual time ttSetAt
+static time_t ttDevBase, ttSetAt;
+
+// Current day min/max, last sample folded in, 31 day history (by mday)
+static EmuDay xToday;
+static time_t ttLastSample;
+static EmuDay xHistory[31];
+
+// Pending response
+static unsigned char sResp[512];
+static int nResp, nRespPos;
+static unsigned int nSeed = 0x1D4001;
+
+//
+// Sine approximation (Bhaskara) - phase in [0,1) of a period
+//
+static double EmuSine(double fPhase)
+{
+    double f, g;
+    int bNeg = FALSE;
+
+    f = fPhase - (long)fPhase;
+    if (f < 0)
+        f += 1.0;
+    if (f >= 0.5)
+    {
+        f -= 0.5;
+        bNeg = TRUE;
+    }
+    f *= 2.0;
+    g = f * (1.0 - f);
+    g = (16.0 * g) / (5.0 - (4.0 * g));
+
+    return bNeg ? -g : g;
+}
+
+// Repeatable noise in [-1, 1) from a time value
+static double EmuNoise(time_t t, unsigned int nSalt)
+{
+    unsigned int h = (unsigned int)(t / 60) * 2654435761U ^ nSalt;
+
+    h ^= h >> 15;
+    h *= 2246822519U;
+    h ^= h >> 13;
+
+    return ((double)(h & 0xFFFF) / 32768.0) - 1.0;
+}
+
+// Virtual local wall clock as naive seconds
+static time_t EmuLocalNaive(time_t t)
+{
+    struct tm tmNow;
+
+    vc_localtime(&t, &tmNow);
+
+    return timegm(&tmNow);
+}
+
+// Device clock (naive seconds) now
+static time_t EmuDevNow(void)
+{
+    time_t t = vc_time();
+    long long llElapsed = (long long)(t - ttSetAt);
+
+    return ttDevBase + (time_t)(llElapsed + ((llElapsed * EMU_DRIFT_PPM) / 1000000));
+}
+
+//
+// Weather model at naive time t (raw device units)
+//
+static void EmuWeather(time_t t, int *pIndoor, int *pOutdoor, int *pWind, int *pDir, int *pPres)
+{
+    struct tm tmNow;
+    double fDay, fYear;
+
+    gmtime_r(&t, &tmNow);
+    fDay = (double)((tmNow.tm_hour * 3600) + (tmNow.tm_min * 60) + tmNow.tm_sec) / 86400.0;
+    fYear = (double)tmNow.tm_yday / 365.0;
+
+    // Temps F (offset 40 on the wire)
+    *pOutdoor = (int)(50.0 + (25.0 * EmuSine(fYear - 0.30)) + (9.0 * EmuSine(fDay - 0.375)) +
+                      (2.0 * EmuNoise(t, 1)));
+    *pIndoor = (int)(68.0 + (2.0 * EmuSine(fDay - 0.40)) + EmuNoise(t, 2));
+    // Wind mph, always >= 0
+    *pWind = (int)(8.0 + (6.0 * EmuSine((double)t / 172800.0)) + (3.0 * EmuNoise(t, 3)));
+    if (*pWind < 0)
+        *pWind = 0;
+    // Direction drifts around the compass
+    *pDir = (int)((((double)t / 21600.0) + EmuNoise(t, 4)) * 1.0) & 0x0F;
+    // Pressure .01 inHg over 29.00
+    *pPres = (int)(100.0 + (55.0 * EmuSine((double)t / 432000.0)) + (4.0 * EmuNoise(t, 5)));
+
+    return;
+}
+
+static void EmuUpdate(EmuExtreme *pExt, int nValue, time_t t, int bHigh)
+{
+    if ((pExt->ttWhen == 0) || (bHigh ? (nValue > pExt->nValue) : (nValue < pExt->nValue)))
+    {
+        pExt->nValue = nValue;
+        pExt->ttWhen = t;
+    }
+
+    return;
+}
+
+//
+// Fold samples up to device time 'tDev' into today's min/max (1/minute)
+//
+static void EmuTrack(time_t tDev)
+{
+    int nIndoor, nOutdoor, nWind, nDir, nPres;
+
+    if (ttLastSample == 0)
+        ttLastSample = tDev - 60;
+
+    while ((ttLastSample + 60) <= tDev)
+    {
+        ttLastSample += 60;
+        EmuWeather(ttLastSample, &nIndoor, &nOutdoor, &nWind, &nDir, &nPres);
+        EmuUpdate(&xToday.xTLow, nOutdoor, ttLastSample, FALSE);
+        EmuUpdate(&xToday.xTHigh, nOutdoor, ttLastSample, TRUE);
+        EmuUpdate(&xToday.xWind, nWind, ttLastSample, TRUE);
+        EmuUpdate(&xToday.xPLow, nPres, ttLastSample, FALSE);
+        EmuUpdate(&xToday.xPHigh, nPres, ttLastSample, TRUE);
+        xToday.bValid = TRUE;
+    }
+
+    return;
+}
+
+// 12hr + PM bit as the device reports hours
+static unsigned char EmuHour(int nHour)
+{
+    if (nHour == 0)
+        return 12;
+    if (nHour < 12)
+        return nHour;
+    if (nHour == 12)
+        return 12 | 0x80;
+
+    return (nHour - 12) | 0x80;
+}
+
+// Put min:hour[:day:mon] of an extreme
+static unsigned char *EmuPutWhen(unsigned char *p, time_t t, int bDate)
+{
+    struct tm tmWhen;
+
+    gmtime_r(&t, &tmWhen);
+    *p++ = tmWhen.tm_min;
+    *p++ = EmuHour(tmWhen.tm_hour);
+    if (bDate)
+    {
+        *p++ = tmWhen.tm_mday;
+        *p++ = tmWhen.tm_mon + 1;
+    }
+
+    return p;
+}
+
+static int EmuClamp(int nValue)
+{
+    return (nValue < 0) ? 0 : ((nValue > 255) ? 255 : nValue);
+}
+
+// Check and record device clock error against local wall time
+static void EmuClockCheck(time_t tDev)
+{
+    long nErr = (long)(tDev - EmuLocalNaive(vc_time()));
+
+    if (nErr < 0)
+        nErr = -nErr;
+    if (nErr > xStats.nMaxClockErr)
+        xStats.nMaxClockErr = nErr;
+
+    return;
+}
+
+static void EmuInit(void)
+{
+    time_t t = vc_time();
+
+    // Clock starts slightly off, like a unit that has been unplugged
+    ttSetAt = t;
+    ttDevBase = EmuLocalNaive(t) - 90;
+    memset(&xToday, 0, sizeof(xToday));
+    memset(xHistory, 0, sizeof(xHistory));
+    ttLastSample = 0;
+    bEmuInit = TRUE;
+
+    return;
+}
+
+int EmuOpen(void)
+{
+    pthread_mutex_lock(&emu_mutex);
+    if (!bEmuInit)
+        EmuInit();
+    nResp = nRespPos = 0;
+    pthread_mutex_unlock(&emu_mutex);
+
+    return EMU_FD;
+}
+
+//
+// Accept command bytes, build response
+//
+int EmuWrite(unsigned char *psOutput, int nCount)
+{
+    unsigned char *p;
+    time_t tDev;
+    struct tm tmDev;
+    int nIndoor, nOutdoor, nWind, nDir, nPres, n;
+    EmuDay *pDay;
+
+    pthread_mutex_lock(&emu_mutex);
+
+    nResp = nRespPos = 0;
+    p = sResp;
+
+    // Injected failure - no answer
+    if ((nEmuFailRate > 0) && ((int)(rand_r(&nSeed) % 100) < nEmuFailRate))
+    {
+        xStats.nFailed++;
+        pthread_mutex_unlock(&emu_mutex);
+        return nCount;
+    }
+
+    xStats.nCommands++;
+    tDev = EmuDevNow();
+    EmuTrack(tDev);
+    gmtime_r(&tDev, &tmDev);
+
+    *p++ = psOutput[0];
+    switch (psOutput[0])
+    {
+    case 'W':
+        EmuWeather(tDev, &nIndoor, &nOutdoor, &nWind, &nDir, &nPres);
+        // Direction index -> gray code bits
+        *p++ = ((nDir & 0x07) << 2) | ((nDir & 0x08) << 4);
+        *p++ = tmDev.tm_sec;
+        *p++ = tmDev.tm_min;
+        *p++ = EmuHour(tmDev.tm_hour);
+        *p++ = tmDev.tm_mday;
+        *p++ = tmDev.tm_mon + 1;
+        *p++ = tmDev.tm_year - 100;
+        *p++ = EmuClamp(((nWind * 256) + 98) / 99);
+        *p++ = EmuClamp(nIndoor + 40);
+        *p++ = EmuClamp(nOutdoor + 40);
+        *p++ = EmuClamp(nPres);
+        while ((p - sResp) < 17)
+            *p++ = 0;
+        break;
+
+    case 'e':
+        *p++ = EmuClamp(xToday.xTLow.nValue + 40);
+        p = EmuPutWhen(p, xToday.xTLow.ttWhen, TRUE);
+        *p++ = EmuClamp(xToday.xTHigh.nValue + 40);
+        p = EmuPutWhen(p, xToday.xTHigh.ttWhen, TRUE);
+        *p++ = EmuClamp(((xToday.xWind.nValue * 256) + 98) / 99);
+        p = EmuPutWhen(p, xToday.xWind.ttWhen, TRUE);
+        break;
+
+    case 'b':
+        *p++ = EmuClamp(xToday.xPLow.nValue);
+        p = EmuPutWhen(p, xToday.xPLow.ttWhen, TRUE);
+        *p++ = EmuClamp(xToday.xPHigh.nValue);
+        p = EmuPutWhen(p, xToday.xPHigh.ttWhen, TRUE);
+        break;
+
+    case 'i':
+        for (n = 0; n < 31; n++)
+        {
+            pDay = &xHistory[n];
+            *p++ = EmuClamp(pDay->xTLow.nValue + 40);
+            p = EmuPutWhen(p, pDay->xTLow.ttWhen, FALSE);
+            *p++ = EmuClamp(pDay->xTHigh.nValue + 40);
+            p = EmuPutWhen(p, pDay->xTHigh.ttWhen, FALSE);
+            *p++ = EmuClamp(pDay->xPLow.nValue);
+            p = EmuPutWhen(p, pDay->xPLow.ttWhen, FALSE);
+            *p++ = EmuClamp(pDay->xPHigh.nValue);
+            p = EmuPutWhen(p, pDay->xPHigh.ttWhen, FALSE);
+            *p++ = EmuClamp(((pDay->xWind.nValue * 256) + 98) / 99);
+            p = EmuPutWhen(p, pDay->xWind.ttWhen, FALSE);
+        }
+        break;
+
+    case 'T':
+        EmuClockCheck(tDev);
+        *p++ = tmDev.tm_sec;
+        *p++ = tmDev.tm_min;
+        *p++ = EmuHour(tmDev.tm_hour);
+        break;
+
+    case 'D':
+        *p++ = tmDev.tm_mday;
+        *p++ = tmDev.tm_mon + 1;
+        *p++ = tmDev.tm_year - 100;
+        break;
+
+    case 't':
+        if (nCount < 4)
+            break;
+        EmuClockCheck(tDev);
+        // 12hr + PM -> 24hr
+        n = psOutput[3] & 0x7F;
+        if (psOutput[3] & 0x80)
+            n = (n == 12) ? 12 : n + 12;
+        else if (n == 12)
+            n = 0;
+        tmDev.tm_sec = psOutput[1];
+        tmDev.tm_min = psOutput[2];
+        tmDev.tm_hour = n;
+        ttDevBase = timegm(&tmDev);
+        ttSetAt = vc_time();
+        xStats.nClockSets++;
+        break;
+
+    case 'd':
+        if (nCount < 4)
+            break;
+        tmDev.tm_mday = psOutput[1];
+        tmDev.tm_mon = psOutput[2] - 1;
+        tmDev.tm_year = psOutput[3] + 100;
+        ttDevBase = timegm(&tmDev);
+        ttSetAt = vc_time();
+        break;
+
+    case 'C':
+        // Close out the day into history (slot by day of month)
+        if (xToday.bValid && xToday.xTLow.ttWhen)
+        {
+            gmtime_r(&xToday.xTLow.ttWhen, &tmDev);
+            xHistory[tmDev.tm_mday - 1] = xToday;
+        }
+        memset(&xToday, 0, sizeof(xToday));
+        ttLastSample = tDev;
+        xStats.nClears++;
+        break;
+
+    case 'v':
+        *p++ = 5;
+        *p++ = 6;
+        *p++ = 28;
+        break;
+
+    default:
+        break;
+    }
+
+    nResp = p - sResp;
+
+    pthread_mutex_unlock(&emu_mutex);
+
+    return nCount;
+}
+
+//
+// Hand back response - same return convention as ReadSerPort
+//
+int EmuRead(unsigned char *psResponse, int iMax, unsigned char cCmd)
+{
+    int nAvail;
+
+    pthread_mutex_lock(&emu_mutex);
+
+    nAvail = nResp - nRespPos;
+    if (nAvail > iMax)
+        nAvail = iMax;
+    memcpy(psResponse, &sResp[nRespPos], nAvail);
+    nRespPos += nAvail;
+
+    pthread_mutex_unlock(&emu_mutex);
+
+    if (nAvail < iMax)
+    {
+        // Port would have timed out
+        vc_sleep(EMU_TIMEOUT);
+        printf("timeout - %d read\n", nAvail);
+        return -(nAvail + 1);
+    }
+
+    if ((cCmd != 0) && (psResponse[0] != cCmd))
+    {
+        printf("*** Cmd '%c' (0x%02X) not equal 0x%02X\n", cCmd, cCmd, psResponse[0]);
+        return -1;
+    }
+
+    return iMax;
+}
+
+void EmuGetStats(EmuStats *pStats)
+{
+    pthread_mutex_lock(&emu_mutex);
+    *pStats = xStats;
+    pthread_mutex_unlock(&emu_mutex);
+
+    return;
+}
@@ -0,0 +1,32 @@
+// id4emu.h
+//
+// Software emulation of the ID4001-5 serial protocol
+//
+
+#ifndef ID4EMU_H_INCLUDED
+#define ID4EMU_H_INCLUDED
+
+// Fake descriptor returned by emulated port open
+#define EMU_FD      1000
+
+extern int bEmulate;
+extern int nEmuFailRate;
+
+//
+// Emulator statistics
+//
+typedef struct _EmuStats
+{
+    unsigned long   nCommands;      // Commands answered
+    unsigned long   nFailed;        // Commands dropped (injected timeout)
+    unsigned long   nClockSets;     // 't' commands
+    unsigned long   nClears;        // 'C' commands
+    long            nMaxClockErr;   // Worst device clock error seen (sec)
+} EmuStats;
+
+extern int EmuOpen(void);
+extern int EmuWrite(unsigned char *psOutput, int nCount);
+extern int EmuRead(unsigned char *psResponse, int iMax, unsigned char cCmd);
+extern void EmuGetStats(EmuStats *pStats);
+
+#endif // ID4EMU_H_INCLUDED
@@ -0,0 +1,315 @@
+// id4sim.c - Run the daemon schedule on a virtual clock
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "ID4Serial.h"
+#include "threadqueue.h"
+#include "vclock.h"
+#include "id4emu.h"
+#include "wxpipe.h"
+
+//
+// The simulation drives the same scheduler (ID4_Tick) and command
+// dispatcher (ID4Dispatch) as the daemon, single threaded, against the
+// emulated ID4001. Virtual time steps a minute at a time, dropping to
+// one second steps while delayed commands are pending.
+//
+
+// Anomalies printed before going quiet
+#define SIM_REPORT_MAX  32
+
+extern struct threadqueue id4_mq;
+
+// Per local day schedule slot counters
+typedef struct _SimDay
+{
+    int             nYear, nYDay;
+    unsigned char   nWeather[24][3];    // :00, :20, :40
+    unsigned char   nSync[24][2];       // :01, :59
+    unsigned char   nMidnite;
+} SimDay;
+
+static SimDay xDay, xExpect;
+static unsigned long nEvents[ID4_SAMPLE + 1];
+static unsigned long nMissed, nDuplicated, nReported;
+
+static void SimAnomaly(char *sKind, char *sWhat, int nHour, int nMin)
+{
+    struct tm tmDay;
+
+    if (nReported++ >= SIM_REPORT_MAX)
+        return;
+
+    // Rebuild date for message
+    memset(&tmDay, 0, sizeof(tmDay));
+    tmDay.tm_year = xDay.nYear;
+    tmDay.tm_mday = xDay.nYDay + 1;
+    tmDay.tm_isdst = -1;
+    mktime(&tmDay);
+
+    printf("SIM: %s %s %d-%s-%d %02d:%02d\n", sKind, sWhat, tmDay.tm_mday, sMonName[tmDay.tm_mon],
+           tmDay.tm_year + 1900, nHour, nMin);
+
+    return;
+}
+
+static void SimCheckSlot(unsigned char nCount, unsigned char nExpect, char *sWhat, int nHour, int nMin)
+{
+    if (nCount < nExpect)
+    {
+        nMissed += nExpect - nCount;
+        SimAnomaly("MISSED", sWhat, nHour, nMin);
+    }
+    else if (nCount > nExpect)
+    {
+        nDuplicated += nCount - nExpect;
+        SimAnomaly("DUPLICATE", sWhat, nHour, nMin);
+    }
+
+    return;
+}
+
+//
+// Slots the local day really has - a slot in the hour skipped by the
+// spring DST change never comes round, one in the repeated autumn hour
+// comes round twice. Midnite is due once whatever the zone does at
+// 00:00, since the day's log must still roll over.
+//
+static void SimExpectDay(struct tm *pDay)
+{
+    struct tm tmWhen;
+    time_t t, ttEnd;
+
+    memset(&xExpect, 0, sizeof(xExpect));
+    xExpect.nMidnite = 1;
+
+    tmWhen = *pDay;
+    tmWhen.tm_hour = tmWhen.tm_min = tmWhen.tm_sec = 0;
+    tmWhen.tm_isdst = -1;
+    t = mktime(&tmWhen);
+    tmWhen.tm_mday++;
+    tmWhen.tm_hour = tmWhen.tm_min = tmWhen.tm_sec = 0;
+    tmWhen.tm_isdst = -1;
+    ttEnd = mktime(&tmWhen);
+
+    for (; t < ttEnd; t += 60)
+    {
+        localtime_r(&t, &tmWhen);
+        if ((tmWhen.tm_min % 20) == 0)
+            xExpect.nWeather[tmWhen.tm_hour][tmWhen.tm_min / 20]++;
+        else if (tmWhen.tm_min == 1)
+            xExpect.nSync[tmWhen.tm_hour][0]++;
+        else if (tmWhen.tm_min == 59)
+            xExpect.nSync[tmWhen.tm_hour][1]++;
+    }
+
+    return;
+}
+
+//
+// Day complete - every schedule slot should have fired as often as the
+// local clock showed it
+//
+static void SimCloseDay(void)
+{
+    int h;
+
+    if (xDay.nYear == 0)
+        return;
+
+    SimCheckSlot(xDay.nMidnite, xExpect.nMidnite, "midnite", 0, 0);
+    for (h = 0; h < 24; h++)
+    {
+        if (h != 0)
+            SimCheckSlot(xDay.nWeather[h][0], xExpect.nWeather[h][0], "weather", h, 0);
+        SimCheckSlot(xDay.nWeather[h][1], xExpect.nWeather[h][1], "weather", h, 20);
+        SimCheckSlot(xDay.nWeather[h][2], xExpect.nWeather[h][2], "weather", h, 40);
+        SimCheckSlot(xDay.nSync[h][0], xExpect.nSync[h][0], "sync", h, 1);
+        SimCheckSlot(xDay.nSync[h][1], xExpect.nSync[h][1], "sync", h, 59);
+    }
+
+    return;
+}
+
+// Account for a command about to be dispatched
+static void SimCount(struct threadmsg *pMsg)
+{
+    time_t ltime = vc_time();
+    struct tm tmNow;
+    int nMin, nHour;
+
+    if ((pMsg->msgtype > 0) && (pMsg->msgtype <= ID4_TIME_VERIFY))
+        nEvents[pMsg->msgtype]++;
+
+    vc_localtime(&ltime, &tmNow);
+    if ((tmNow.tm_year != xDay.nYear) || (tmNow.tm_yday != xDay.nYDay))
+    {
+        SimCloseDay();
+        memset(&xDay, 0, sizeof(xDay));
+        xDay.nYear = tmNow.tm_year;
+        xDay.nYDay = tmNow.tm_yday;
+        SimExpectDay(&tmNow);
+    }
+
+    // Scheduled commands carry their minute past midnite
+    nHour = (int)(long)pMsg->data / 60;
+    nMin = (int)(long)pMsg->data % 60;
+    if ((nHour < 0) || (nHour > 23))
+        return;
+
+    switch (pMsg->msgtype)
+    {
+    case ID4_LOG_MIDNITE:
+        xDay.nMidnite++;
+        break;
+
+    case ID4_LOG_WEATHER:
+        if ((nMin % 20) == 0)
+            xDay.nWeather[nHour][nMin / 20]++;
+        break;
+
+    case ID4_TIME_SYNC:
+        if (nMin == 1)
+            xDay.nSync[nHour][0]++;
+        else if (nMin == 59)
+            xDay.nSync[nHour][1]++;
+        break;
+
+    default:
+        break;
+    }
+
+    return;
+}
+
+// Run everything queued so far
+static void SimDrain(void)
+{
+    struct threadmsg msg;
+
+    // Sole consumer - length check avoids a timed wait per tick
+    while (thread_queue_length(&id4_mq) > 0)
+    {
+        if (thread_queue_get(&id4_mq, NULL, &msg) != 0)
+            break;
+        SimCount(&msg);
+        ID4Dispatch(&msg);
+    }
+
+    return;
+}
+
+//
+// Switch to virtual clock and emulator - must precede any other setup.
+// Simulation starts at local midnite of sStart (YYYY-MM-DD), so a run
+// is the same whenever it is made.
+//
+int SimInit(const char *sStart)
+{
+    struct tm tmStart;
+
+    memset(&tmStart, 0, sizeof(tmStart));
+    if ((sscanf(sStart, "%d-%d-%d", &tmStart.tm_year, &tmStart.tm_mon, &tmStart.tm_mday) != 3) ||
+        (tmStart.tm_year < 1970) || (tmStart.tm_mon < 1) || (tmStart.tm_mon > 12) ||
+        (tmStart.tm_mday < 1) || (tmStart.tm_mday > 31))
+    {
+        printf("Bad simulation start: %s\n", sStart);
+        return -1;
+    }
+    tmStart.tm_year -= 1900;
+    tmStart.tm_mon--;
+    tmStart.tm_isdst = -1;
+
+    bEmulate = TRUE;
+    vc_start(mktime(&tmStart));
+
+    return 0;
+}
+
+int RunSimulation(int nDays)
+{
+    struct timespec tsStart, tsEnd;
+    struct tm tmEnd;
+    time_t t, ttStart, ttEnd;
+    int s;
+    unsigned long nTotal = 0;
+    double fWall;
+    EmuStats xEmu;
+    WxPipeStats xPipe;
+
+    ttStart = vc_time();
+    vc_localtime(&ttStart, &tmEnd);
+    tmEnd.tm_mday += nDays;
+    tmEnd.tm_isdst = -1;
+    ttEnd = mktime(&tmEnd);
+
+    printf("SIM: %d days from %s", nDays, ctime(&ttStart));
+
+    clock_gettime(CLOCK_MONOTONIC, &tsStart);
+
+    if (!ID4ClockStart())
+        return EXIT_FAILURE;
+
+    // As at daemon startup
+    ID4_Post(ID4_TIME_SET, 0);
+
+    for (t = ttStart; t < ttEnd; t += 60)
+    {
+        vc_advance_to(t);
+        if (ID4_Tick())
+            return EXIT_FAILURE;
+        SimDrain();
+
+        // Second resolution only while delayed commands wait
+        for (s = 1; (s < 60) && ID4_DelayedPending(); s++)
+        {
+            vc_advance_to(t + s);
+            ID4_Tick();
+            SimDrain();
+        }
+    }
+    SimCloseDay();
+    WxPipeStop();
+
+    clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+    fWall = (double)(tsEnd.tv_sec - tsStart.tv_sec) + ((double)(tsEnd.tv_nsec - tsStart.tv_nsec) / 1e9);
+    if (fWall <= 0.0)
+        fWall = 1e-9;
+
+    for (s = 0; s <= ID4_TIME_VERIFY; s++)
+        nTotal += nEvents[s];
+
+    EmuGetStats(&xEmu);
+    WxPipeGetStats(&xPipe);
+
+    printf("SIM: %d days in %.2f sec (%.1f days/sec)\n", nDays, fWall, nDays / fWall);
+    printf("SIM: %lu events, %.0f events/sec\n", nTotal, nTotal / fWall);
+    printf("SIM:   weather %lu, midnite %lu, sync %lu, set %lu, retry %lu, verify %lu, upload %lu\n",
+           nEvents[ID4_LOG_WEATHER], nEvents[ID4_LOG_MIDNITE], nEvents[ID4_TIME_SYNC],
+           nEvents[ID4_TIME_SET], nEvents[ID4_LOG_RETRY], nEvents[ID4_TIME_VERIFY], xPipe.nUploads);
+    printf("SIM: emulator %lu commands, %lu dropped, %lu clock sets, %lu clears, max clock error %ld sec\n",
+           xEmu.nCommands, xEmu.nFailed, xEmu.nClockSets, xEmu.nClears, xEmu.nMaxClockErr);
+    printf("SIM: pipeline %lu weather, %lu min/max, %lu messages, %lu logs, %lu garbled\n",
+           xPipe.nRecords[WX_REC_WEATHER], xPipe.nRecords[WX_REC_MINMAX], xPipe.nRecords[WX_REC_MESSAGE],
+           xPipe.nRecords[WX_REC_NEWLOG], xPipe.nRejected);
+    printf("SIM: log %lu writes, %lu syncs, %lu journal errors\n", xPipe.nWrites, xPipe.nSyncs, xPipe.nWalErrors);
+    printf("SIM: %lu missed, %lu duplicated\n", nMissed, nDuplicated);
+
+    return ((nMissed == 0) && (nDuplicated == 0)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
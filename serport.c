@@ -15,6 +15,7 @@
 #include <errno.h>
 
 #include "serport.h"
+#include "id4emu.h"
 
 // Used to reset port opts on close
 static struct termios saved_opts;
@@ -30,6 +31,10 @@ int OpenSerPort(char* sDeviceName)
     int nMode = O_RDWR | O_NOCTTY;
     struct termios serial_opts;
 
+    // No hardware - talk to emulator
+    if (bEmulate)
+        return EmuOpen();
+
     sprintf(sPortName, "/dev/tty%s", sDeviceName);
 
     fd = open(sPortName, nMode);
@@ -73,6 +78,9 @@ int WriteSerPort(int fd, unsigned char* psOutput, int nCount)
         return -1;
     }
 
+    if (bEmulate)
+        return EmuWrite(psOutput, nCount);
+
     iOut = write(fd, psOutput, nCount);
     if (iOut < 0)
     {
@@ -102,6 +110,9 @@ int ReadSerPort(int fd, unsigned char* psResponse, int iMax, unsigned char cCmd)
         return -1;
     }
 
+    if (bEmulate)
+        return EmuRead(psResponse, iMax, cCmd);
+
     // Init vars
     nRead = 0;
     FD_ZERO(&infds);
@@ -169,6 +180,9 @@ int ReadSerPort(int fd, unsigned char* psResponse, int iMax, unsigned char cCmd)
 // closes the serial port
 void CloseSerPort(int fd)
 {
+    if (bEmulate)
+        return;
+
     if (fd > 0)
     {
         tcflush(fd, TCIOFLUSH);
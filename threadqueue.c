@@ -45,6 +45,7 @@ static inline void release_msglist(struct threadqueue *queue, struct msglist *no
 int thread_queue_init(struct threadqueue *queue)
 {
     int ret = 0;
+    int i;
     if (queue == NULL) {
         return EINVAL;
     }
@@ -54,20 +55,143 @@ int thread_queue_init(struct threadqueue *queue)
         return ret;
     }
 
+    ret = pthread_cond_init(&queue->space, NULL);
+    if (ret != 0) {
+        pthread_cond_destroy(&queue->cond);
+        return ret;
+    }
+
     ret = pthread_mutex_init(&queue->mutex, NULL);
     if (ret != 0) {
+        pthread_cond_destroy(&queue->space);
         pthread_cond_destroy(&queue->cond);
         return ret;
     }
 
+    for (i = 0; i < THREADQUEUE_LANES; i++) {
+        queue->lanes[i].weight = 1;
+        queue->lanes[i].credit = 1;
+    }
+    queue->starve_limit = THREADQUEUE_STARVE_LIMIT;
+
+    return 0;
+
+}
+
+int thread_queue_set_lane(struct threadqueue *queue, int lane, int weight)
+{
+    if (queue == NULL || lane < 0 || lane >= THREADQUEUE_LANES || weight < 0) {
+        return EINVAL;
+    }
+    pthread_mutex_lock(&queue->mutex);
+    queue->lanes[lane].weight = weight;
+    queue->lanes[lane].credit = weight;
+    pthread_mutex_unlock(&queue->mutex);
+
+    return 0;
+}
+
+int thread_queue_set_limit(struct threadqueue *queue, long limit)
+{
+    if (queue == NULL || limit < 0) {
+        return EINVAL;
+    }
+    pthread_mutex_lock(&queue->mutex);
+    queue->limit = limit;
+    /* Growing the bound may release blocked adders */
+    pthread_cond_broadcast(&queue->space);
+    pthread_mutex_unlock(&queue->mutex);
+
     return 0;
+}
+
+/* Pick the lane to serve next, queue must be non-empty. Lock held. */
+static int select_lane(struct threadqueue *queue)
+{
+    struct threadlane *ln;
+    int i, pick = -1;
+
+    /* Strict lanes always go first, in lane order */
+    for (i = 0; i < THREADQUEUE_LANES; i++) {
+        ln = &queue->lanes[i];
+        if (ln->weight == 0 && ln->first != NULL) {
+            return i;
+        }
+    }
 
+    /* Starving weighted lane jumps the round */
+    if (queue->starve_limit > 0) {
+        for (i = 0; i < THREADQUEUE_LANES; i++) {
+            ln = &queue->lanes[i];
+            if (ln->weight > 0 && ln->first != NULL && ln->skipped >= queue->starve_limit) {
+                pick = i;
+                break;
+            }
+        }
+    }
+
+    /* Weighted round robin: stay on current lane while it has credit */
+    if (pick < 0) {
+        ln = &queue->lanes[queue->curlane];
+        if (ln->weight > 0 && ln->first != NULL && ln->credit > 0) {
+            pick = queue->curlane;
+        } else {
+            for (i = 1; i <= THREADQUEUE_LANES; i++) {
+                pick = (queue->curlane + i) % THREADQUEUE_LANES;
+                ln = &queue->lanes[pick];
+                if (ln->weight > 0 && ln->first != NULL) {
+                    break;
+                }
+            }
+            queue->curlane = pick;
+            ln->credit = ln->weight;
+        }
+        queue->lanes[pick].credit--;
+    }
+
+    /* Age the weighted lanes left waiting */
+    for (i = 0; i < THREADQUEUE_LANES; i++) {
+        ln = &queue->lanes[i];
+        if (i == pick) {
+            ln->skipped = 0;
+        } else if (ln->weight > 0 && ln->first != NULL) {
+            ln->skipped++;
+        }
+    }
+
+    return pick;
 }
 
 int thread_queue_add(struct threadqueue *queue, void *data, long msgtype)
+{
+    return thread_queue_add_lane(queue, data, msgtype, 0);
+}
+
+/* Cancelled while waiting (shutdown) - don't leave the queue locked */
+static void unlock_queue(void *arg)
+{
+    pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+int thread_queue_add_lane(struct threadqueue *queue, void *data, long msgtype, int lane)
 {
     struct msglist *newmsg;
+    struct threadlane *ln;
+
+    if (queue == NULL || lane < 0 || lane >= THREADQUEUE_LANES) {
+        return EINVAL;
+    }
+    ln = &queue->lanes[lane];
+
     pthread_mutex_lock(&queue->mutex);
+
+    /* Bounded queue: wait for the consumer to make room */
+    pthread_cleanup_push(unlock_queue, &queue->mutex);
+    while (queue->limit > 0 && queue->length >= queue->limit) {
+        pthread_cond_wait(&queue->space, &queue->mutex);
+    }
+    pthread_cleanup_pop(0);
+
     newmsg = get_msglist(queue);
     if (newmsg == NULL) {
         pthread_mutex_unlock(&queue->mutex);
@@ -77,13 +201,14 @@ int thread_queue_add(struct threadqueue *queue, void *data, long msgtype)
     newmsg->msg.msgtype = msgtype;
 
     newmsg->next = NULL;
-    if (queue->last == NULL) {
-        queue->last = newmsg;
-        queue->first = newmsg;
+    if (ln->last == NULL) {
+        ln->last = newmsg;
+        ln->first = newmsg;
     } else {
-        queue->last->next = newmsg;
-        queue->last = newmsg;
+        ln->last->next = newmsg;
+        ln->last = newmsg;
     }
+    ln->length++;
 
     if(queue->length == 0)
 	pthread_cond_broadcast(&queue->cond);
@@ -97,6 +222,7 @@ int thread_queue_add(struct threadqueue *queue, void *data, long msgtype)
 int thread_queue_get(struct threadqueue *queue, const struct timespec *timeout, struct threadmsg *msg)
 {
     struct msglist *firstrec;
+    struct threadlane *ln;
     int ret = 0;
     struct timespec abstimeout;
 
@@ -118,7 +244,8 @@ int thread_queue_get(struct threadqueue *queue, const struct timespec *timeout,
     pthread_mutex_lock(&queue->mutex);
 
     /* Will wait until awakened by a signal or broadcast */
-    while (queue->first == NULL && ret != ETIMEDOUT) {  //Need to loop to handle spurious wakeups
+    pthread_cleanup_push(unlock_queue, &queue->mutex);
+    while (queue->length == 0 && ret != ETIMEDOUT) {  //Need to loop to handle spurious wakeups
         if (timeout) {
             ret = pthread_cond_timedwait(&queue->cond, &queue->mutex, &abstimeout);
 	} else {
@@ -126,18 +253,21 @@ int thread_queue_get(struct threadqueue *queue, const struct timespec *timeout,
 
 	}
     }
+    pthread_cleanup_pop(0);
     if (ret == ETIMEDOUT) {
         pthread_mutex_unlock(&queue->mutex);
         return ret;
     }
 
-    firstrec = queue->first;
-    queue->first = queue->first->next;
+    ln = &queue->lanes[select_lane(queue)];
+    firstrec = ln->first;
+    ln->first = ln->first->next;
+    ln->length--;
     queue->length--;
 
-    if (queue->first == NULL) {
-        queue->last = NULL;     // we know this since we hold the lock
-        queue->length = 0;
+    if (ln->first == NULL) {
+        ln->last = NULL;     // we know this since we hold the lock
+        ln->length = 0;
     }
 
 
@@ -145,6 +275,10 @@ int thread_queue_get(struct threadqueue *queue, const struct timespec *timeout,
     msg->msgtype = firstrec->msg.msgtype;
         msg->qlength = queue->length;
 
+    if (queue->limit > 0 && queue->length == queue->limit - 1) {
+        pthread_cond_broadcast(&queue->space);
+    }
+
     release_msglist(queue,firstrec);
     pthread_mutex_unlock(&queue->mutex);
 
@@ -156,16 +290,18 @@ int thread_queue_cleanup(struct threadqueue *queue, int freedata)
 {
     struct msglist *rec;
     struct msglist *next;
-    struct msglist *recs[2];
+    struct msglist *recs[THREADQUEUE_LANES + 1];
     int ret,i;
     if (queue == NULL) {
         return EINVAL;
     }
 
     pthread_mutex_lock(&queue->mutex);
-    recs[0] = queue->first;
-    recs[1] = queue->msgpool;
-    for(i = 0; i < 2 ; i++) {
+    for(i = 0; i < THREADQUEUE_LANES; i++) {
+        recs[i] = queue->lanes[i].first;
+    }
+    recs[THREADQUEUE_LANES] = queue->msgpool;
+    for(i = 0; i < THREADQUEUE_LANES + 1 ; i++) {
         rec = recs[i];
         while (rec) {
             next = rec->next;
@@ -181,6 +317,7 @@ int thread_queue_cleanup(struct threadqueue *queue, int freedata)
     pthread_mutex_unlock(&queue->mutex);
     ret = pthread_mutex_destroy(&queue->mutex);
     pthread_cond_destroy(&queue->cond);
+    pthread_cond_destroy(&queue->space);
 
     return ret;
 
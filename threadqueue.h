@@ -58,6 +58,40 @@ struct threadmsg{
 };
 
 
+/**
+ * Number of priority lanes in a queue. Lane 0 is the highest priority.
+ *
+ * @ingroup ThreadQueue
+ */
+#define THREADQUEUE_LANES 4
+
+/**
+ * Number of dispatches a waiting weighted lane may be passed over
+ * before it is served regardless of weights.
+ *
+ * @ingroup ThreadQueue
+ */
+#define THREADQUEUE_STARVE_LIMIT 16
+
+/**
+ * One priority lane of a queue, never touch.
+ *
+ * @ingroup ThreadQueue
+ */
+struct threadlane {
+        struct msglist *first,*last;
+        long length;
+/**
+ * 0 = strict priority, else messages served per weighted round
+ */
+        int weight;
+        int credit;
+/**
+ * Dispatches this lane has been passed over while non-empty
+ */
+        int skipped;
+};
+
 /**
  * A TthreadQueue
  *
@@ -81,9 +115,25 @@ struct threadqueue {
  */
         pthread_cond_t cond;
 /**
- * Internal pointers for the queue, never touch.
+ * Condition variable signalled when a bounded queue has room, never touch.
  */
-        struct msglist *first,*last;
+        pthread_cond_t space;
+/**
+ * Maximum queued messages before adders block, 0 for unbounded.
+ */
+        long limit;
+/**
+ * Internal priority lanes for the queue, never touch.
+ */
+        struct threadlane lanes[THREADQUEUE_LANES];
+/**
+ * Weighted lane currently holding the round, never touch.
+ */
+        int curlane;
+/**
+ * Starvation limit for weighted lanes
+ */
+        int starve_limit;
 /**
  * Internal cache of msglists
  */
@@ -107,6 +157,57 @@ struct threadqueue {
  */
 int thread_queue_init(struct threadqueue *queue);
 
+/**
+ * Sets the dispatch policy of a lane
+ *
+ * @ingroup ThreadQueue
+ *
+ * A lane with weight 0 is strict: whenever it holds messages they are
+ * returned before those of any lower strict or weighted lane. Weighted
+ * lanes share what is left in round robin, each getting up to weight
+ * messages per turn. A non-empty weighted lane that has been passed over
+ * more than the starvation limit is served next regardless of weights.
+ * After #thread_queue_init every lane is weighted 1 (plain FIFO if only
+ * one lane is used).
+ *
+ * @param queue Pointer to the queue.
+ * @param lane lane number, 0 to THREADQUEUE_LANES - 1
+ * @param weight 0 for strict priority, else messages per round
+ * @return 0 on success EINVAL if queue is NULL or lane out of range
+ */
+int thread_queue_set_lane(struct threadqueue *queue, int lane, int weight);
+
+/**
+ * Bounds the number of queued messages
+ *
+ * @ingroup ThreadQueue
+ *
+ * Once a bounded queue holds limit messages #thread_queue_add and
+ * #thread_queue_add_lane block until #thread_queue_get makes room.
+ * This gives a producer backpressure from a slower consumer.
+ *
+ * @param queue Pointer to the queue.
+ * @param limit maximum queued messages, 0 for unbounded (the default)
+ * @return 0 on success EINVAL if queue is NULL or limit negative
+ */
+int thread_queue_set_limit(struct threadqueue *queue, long limit);
+
+/**
+ * Adds a message to a priority lane of a queue
+ *
+ * @ingroup ThreadQueue
+ *
+ * Same as #thread_queue_add but the message is queued on the given lane.
+ *
+ * @param queue Pointer to the queue on where the message should be added.
+ * @param data the "message".
+ * @param msgtype a long specifying the message type, choice of the user.
+ * @param lane lane number, 0 to THREADQUEUE_LANES - 1
+ * @return 0 on succes ENOMEM if out of memory EINVAL if queue is NULL
+ * or lane out of range
+ */
+int thread_queue_add_lane(struct threadqueue *queue, void *data, long msgtype, int lane);
+
 /**
  * Adds a message to a queue
  *
@@ -117,6 +218,7 @@ int thread_queue_init(struct threadqueue *queue);
  * so the user must keep track on (de)allocation of the data.
  * A message type is also specified, it is not used for anything else than
  * given back when a message is retreived from the queue.
+ * The message goes on lane 0.
  *
  * @param queue Pointer to the queue on where the message should be added.
  * @param data the "message".
@@ -0,0 +1,204 @@
+// timerwheel.c - Hierarchical timer wheel
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "timerwheel.h"
+
+// Longest delay handled without re-cascading from the top level
+#define TW_MAXDELAY     (1UL << (TW_LEVELS * TW_SLOTBITS))
+
+//
+// Link timer into the slot matching its expiry (lock held)
+//
+static void tw_link(TimerWheel *tw, TWTimer *t)
+{
+    unsigned long xDelta;
+    unsigned long xSlotTime = t->expires;
+    int nLevel;
+    TWSlot *pSlot;
+
+    // Overdue - lands in current tick (collected after cascade)
+    if (xSlotTime < tw->now)
+        xSlotTime = tw->now;
+
+    // Beyond the top level - park in furthest slot, re-cascade later
+    xDelta = xSlotTime - tw->now;
+    if (xDelta >= TW_MAXDELAY)
+    {
+        xSlotTime = tw->now + TW_MAXDELAY - 1;
+        xDelta = TW_MAXDELAY - 1;
+    }
+
+    // Find level: each level spans SLOTS times the one below
+    for (nLevel = 0; nLevel < (TW_LEVELS - 1); nLevel++)
+    {
+        if (xDelta < (1UL << ((nLevel + 1) * TW_SLOTBITS)))
+            break;
+    }
+
+    pSlot = &tw->slots[nLevel][(xSlotTime >> (nLevel * TW_SLOTBITS)) & TW_SLOTMASK];
+
+    // Push at head
+    t->slot = pSlot;
+    t->prev = NULL;
+    t->next = pSlot->first;
+    if (pSlot->first)
+        pSlot->first->prev = t;
+    pSlot->first = t;
+
+    return;
+}
+
+//
+// Remove timer from its slot (lock held)
+//
+static void tw_unlink(TWTimer *t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        t->slot->first = t->next;
+
+    if (t->next)
+        t->next->prev = t->prev;
+
+    t->next = t->prev = NULL;
+    t->slot = NULL;
+
+    return;
+}
+
+//
+// Re-distribute an upper level slot into the levels below (lock held)
+//
+static void tw_cascade(TimerWheel *tw, int nLevel, int nIndex)
+{
+    TWTimer *t, *xNext;
+
+    t = tw->slots[nLevel][nIndex].first;
+    tw->slots[nLevel][nIndex].first = NULL;
+
+    while (t)
+    {
+        xNext = t->next;
+        tw_link(tw, t);
+        t = xNext;
+    }
+
+    return;
+}
+
+int tw_init(TimerWheel *tw, unsigned long now)
+{
+    memset(tw, 0, sizeof(TimerWheel));
+    tw->now = now;
+
+    return pthread_mutex_init(&tw->mutex, NULL);
+}
+
+//
+// Arm timer to fire 'delay' ticks from now
+//
+void tw_add(TimerWheel *tw, TWTimer *t, unsigned long delay, tw_callback func, void *arg)
+{
+    pthread_mutex_lock(&tw->mutex);
+
+    // Re-arm if already pending
+    if (t->slot)
+    {
+        tw_unlink(t);
+        tw->count--;
+    }
+
+    t->func = func;
+    t->arg = arg;
+    t->expires = tw->now + ((delay > 0) ? delay : 1);
+    tw_link(tw, t);
+    tw->count++;
+
+    pthread_mutex_unlock(&tw->mutex);
+
+    return;
+}
+
+//
+// Run wheel up to tick 'now', firing expired timers.
+// Callbacks run with the wheel unlocked and may re-arm or free their timer.
+// Returns number of timers fired.
+//
+int tw_advance(TimerWheel *tw, unsigned long now)
+{
+    int nLevel, nIndex, nFired = 0;
+    unsigned long xTick;
+    TWTimer *t, *xNext;
+    TWTimer *xExpired = NULL;
+
+    pthread_mutex_lock(&tw->mutex);
+
+    while (tw->now < now)
+    {
+        xTick = ++tw->now;
+
+        // Cascade upper levels when the level below wraps
+        for (nLevel = 1; nLevel < TW_LEVELS; nLevel++)
+        {
+            if (xTick & ((1UL << (nLevel * TW_SLOTBITS)) - 1))
+                break;
+            nIndex = (xTick >> (nLevel * TW_SLOTBITS)) & TW_SLOTMASK;
+            tw_cascade(tw, nLevel, nIndex);
+        }
+
+        // Collect everything due in this tick
+        t = tw->slots[0][xTick & TW_SLOTMASK].first;
+        while (t)
+        {
+            xNext = t->next;
+            if (t->expires <= xTick)
+            {
+                tw_unlink(t);
+                tw->count--;
+                t->next = xExpired;
+                xExpired = t;
+            }
+            t = xNext;
+        }
+
+        // Nothing pending - jump ahead
+        if (tw->count == 0)
+            tw->now = now;
+    }
+
+    pthread_mutex_unlock(&tw->mutex);
+
+    // Fire callbacks outside the lock
+    while (xExpired)
+    {
+        t = xExpired;
+        xExpired = t->next;
+        t->next = NULL;
+        t->func(t->arg);
+        nFired++;
+    }
+
+    return nFired;
+}
+
+void tw_cleanup(TimerWheel *tw)
+{
+    pthread_mutex_destroy(&tw->mutex);
+
+    return;
+}
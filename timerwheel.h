@@ -0,0 +1,51 @@
+// timerwheel.h
+//
+// Hierarchical timer wheel - O(1) insert of one-shot timers
+//
+
+#ifndef TIMERWHEEL_H_INCLUDED
+#define TIMERWHEEL_H_INCLUDED
+
+#include <pthread.h>
+
+// Wheel geometry: 3 levels of 64 slots, 1 tick = 1 second
+// Level 0: 64s, level 1: ~68min, level 2: ~3 days (longer delays cascade)
+#define TW_LEVELS       3
+#define TW_SLOTBITS     6
+#define TW_SLOTS        (1 << TW_SLOTBITS)
+#define TW_SLOTMASK     (TW_SLOTS - 1)
+
+typedef void (*tw_callback)(void *arg);
+
+//
+// Timer entry - caller owns the storage until fired
+//
+typedef struct tw_timer
+{
+    struct tw_timer *next;
+    struct tw_timer *prev;
+    struct tw_slot  *slot;      // Owning slot (for O(1) unlink)
+    unsigned long   expires;    // Absolute tick of expiry
+    tw_callback     func;       // Called on the wheel thread
+    void            *arg;
+} TWTimer;
+
+typedef struct tw_slot
+{
+    TWTimer *first;
+} TWSlot;
+
+typedef struct timerwheel
+{
+    pthread_mutex_t mutex;
+    unsigned long   now;        // Last processed tick
+    unsigned long   count;      // Timers pending
+    TWSlot          slots[TW_LEVELS][TW_SLOTS];
+} TimerWheel;
+
+extern int tw_init(TimerWheel *tw, unsigned long now);
+extern void tw_add(TimerWheel *tw, TWTimer *t, unsigned long delay, tw_callback func, void *arg);
+extern int tw_advance(TimerWheel *tw, unsigned long now);
+extern void tw_cleanup(TimerWheel *tw);
+
+#endif // TIMERWHEEL_H_INCLUDED
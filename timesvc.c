@@ -0,0 +1,152 @@
+// timesvc.c - Cached time of day
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "timesvc.h"
+
+//
+// One writer at a time (mutex) publishes the snapshot under a sequence
+// count: odd while an update is in progress. Readers copy the snapshot
+// and retry if the count moved, so they never block the scheduler or
+// each other. The scheduler refreshes every second via ts_tick(); without
+// it (web only) readers refresh on demand.
+//
+
+static TimeSnap xSnap;
+static unsigned int nSeq;
+static int bTicked = FALSE;
+static pthread_mutex_t ts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Two digit field, zero filled
+static char *Put2(char *sOut, int nVal)
+{
+    *sOut++ = '0' + (nVal / 10);
+    *sOut++ = '0' + (nVal % 10);
+
+    return sOut;
+}
+
+static char *PutStr(char *sOut, const char *sIn)
+{
+    while (*sIn)
+        *sOut++ = *sIn++;
+
+    return sOut;
+}
+
+//
+// "Mon, 26 Feb 2007 01:43:54" (runs every second - no printf)
+//
+static void FormatDate(char *sBuf, struct tm *tmTime)
+{
+    char *sOut = sBuf;
+    int nYear = tmTime->tm_year + 1900;
+
+    sOut = PutStr(sOut, sDayOfWeek[tmTime->tm_wday]);
+    *sOut++ = ',';
+    *sOut++ = ' ';
+    if (tmTime->tm_mday >= 10)
+        *sOut++ = '0' + (tmTime->tm_mday / 10);
+    *sOut++ = '0' + (tmTime->tm_mday % 10);
+    *sOut++ = ' ';
+    sOut = PutStr(sOut, sMonName[tmTime->tm_mon]);
+    *sOut++ = ' ';
+    sOut = Put2(sOut, nYear / 100);
+    sOut = Put2(sOut, nYear % 100);
+    *sOut++ = ' ';
+    sOut = Put2(sOut, tmTime->tm_hour);
+    *sOut++ = ':';
+    sOut = Put2(sOut, tmTime->tm_min);
+    *sOut++ = ':';
+    sOut = Put2(sOut, tmTime->tm_sec);
+    *sOut = '\0';
+
+    return;
+}
+
+//
+// Rebuild snapshot if the clock has moved to another second
+//
+void ts_refresh(void)
+{
+    TimeSnap xNew;
+
+    xNew.ttNow = vc_time();
+    if ((__atomic_load_n(&nSeq, __ATOMIC_RELAXED) != 0) &&
+        (xNew.ttNow == __atomic_load_n(&xSnap.ttNow, __ATOMIC_RELAXED)))
+        return;
+
+    // Do the libc work outside the write window
+    vc_localtime(&xNew.ttNow, &xNew.tmLocal);
+    vc_gmtime(&xNew.ttNow, &xNew.tmUTC);
+    xNew.nMinutes = (60 * xNew.tmLocal.tm_hour) + xNew.tmLocal.tm_min;
+    FormatDate(xNew.sLocalDate, &xNew.tmLocal);
+    FormatDate(xNew.sHttpDate, &xNew.tmUTC);
+
+    pthread_mutex_lock(&ts_mutex);
+    __atomic_store_n(&nSeq, nSeq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    xSnap = xNew;
+    __atomic_store_n(&nSeq, nSeq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ts_mutex);
+
+    return;
+}
+
+// Scheduler (1 sec) refresh
+void ts_tick(void)
+{
+    bTicked = TRUE;
+    ts_refresh();
+
+    return;
+}
+
+void ts_get(TimeSnap *pSnap)
+{
+    unsigned int nStart;
+
+    if (!bTicked)
+        ts_refresh();
+
+    // Odd := writer busy; retry until a copy spans no update
+    for (;;)
+    {
+        nStart = __atomic_load_n(&nSeq, __ATOMIC_ACQUIRE);
+        if (nStart & 1)
+            continue;
+        *pSnap = xSnap;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&nSeq, __ATOMIC_RELAXED) == nStart)
+            break;
+    }
+
+    return;
+}
+
+//
+// Copy current HTTP style date string (local or UTC)
+//
+void ts_getdate(char *sBuf, int bLocal)
+{
+    TimeSnap xNow;
+
+    ts_get(&xNow);
+    strcpy(sBuf, bLocal ? xNow.sLocalDate : xNow.sHttpDate);
+
+    return;
+}
@@ -0,0 +1,33 @@
+// timesvc.h
+//
+// Time service - broken down local/UTC time and preformatted date
+// strings, refreshed once per second and read without locking
+//
+
+#ifndef TIMESVC_H_INCLUDED
+#define TIMESVC_H_INCLUDED
+
+#include <time.h>
+
+// "Mon, 26 Feb 2007 01:43:54" + NUL
+#define TS_DATE_SIZE    32
+
+//
+// Consistent view of the current second
+//
+typedef struct _TimeSnap
+{
+    time_t      ttNow;                      // Wall clock (vc_time)
+    struct tm   tmLocal;
+    struct tm   tmUTC;
+    short       nMinutes;                   // Minutes past local midnite
+    char        sLocalDate[TS_DATE_SIZE];   // Local time, HTTP date format
+    char        sHttpDate[TS_DATE_SIZE];    // UTC (caller appends " GMT")
+} TimeSnap;
+
+extern void ts_refresh(void);
+extern void ts_tick(void);
+extern void ts_get(TimeSnap *pSnap);
+extern void ts_getdate(char *sBuf, int bLocal);
+
+#endif // TIMESVC_H_INCLUDED
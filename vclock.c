@@ -0,0 +1,149 @@
+// vclock.c - Real or virtual time source
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+
+#define NSEC_PER_SEC    1000000000LL
+
+// TRUE when running against simulated time
+int bVirtualClock = FALSE;
+
+// Virtual wall clock (ns since epoch) and its monotonic origin
+static long long    llVirtualNs;
+static time_t       ttVirtualBase;
+static pthread_mutex_t vc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Current wall clock time (sec + ns)
+//
+void vc_gettime(struct timespec *ts)
+{
+    long long llNow;
+
+    if (!bVirtualClock)
+    {
+        clock_gettime(CLOCK_REALTIME, ts);
+        return;
+    }
+
+    pthread_mutex_lock(&vc_mutex);
+    llNow = llVirtualNs;
+    pthread_mutex_unlock(&vc_mutex);
+
+    ts->tv_sec = (time_t)(llNow / NSEC_PER_SEC);
+    ts->tv_nsec = (long)(llNow % NSEC_PER_SEC);
+
+    return;
+}
+
+time_t vc_time(void)
+{
+    struct timespec ts;
+
+    if (!bVirtualClock)
+        return time(NULL);
+
+    vc_gettime(&ts);
+
+    return ts.tv_sec;
+}
+
+struct tm *vc_localtime(const time_t *pTime, struct tm *tmOut)
+{
+    return localtime_r(pTime, tmOut);
+}
+
+struct tm *vc_gmtime(const time_t *pTime, struct tm *tmOut)
+{
+    return gmtime_r(pTime, tmOut);
+}
+
+//
+// Monotonic seconds (timer wheel time base)
+//
+unsigned long vc_ticks(void)
+{
+    struct timespec ts;
+
+    if (bVirtualClock)
+        return (unsigned long)(vc_time() - ttVirtualBase);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long)ts.tv_sec;
+}
+
+//
+// Sleeps advance virtual time instead of blocking
+//
+void vc_usleep(unsigned long usec)
+{
+    if (!bVirtualClock)
+    {
+        usleep(usec);
+        return;
+    }
+
+    pthread_mutex_lock(&vc_mutex);
+    llVirtualNs += (long long)usec * 1000LL;
+    pthread_mutex_unlock(&vc_mutex);
+
+    return;
+}
+
+void vc_sleep(unsigned int sec)
+{
+    if (!bVirtualClock)
+    {
+        sleep(sec);
+        return;
+    }
+
+    vc_usleep(sec * 1000000UL);
+
+    return;
+}
+
+//
+// Switch to virtual time starting at ttStart
+//
+void vc_start(time_t ttStart)
+{
+    pthread_mutex_lock(&vc_mutex);
+    llVirtualNs = (long long)ttStart * NSEC_PER_SEC;
+    ttVirtualBase = ttStart;
+    bVirtualClock = TRUE;
+    pthread_mutex_unlock(&vc_mutex);
+
+    return;
+}
+
+//
+// Move virtual time forward (never backward - sleeps may have passed it)
+//
+void vc_advance_to(time_t ttNow)
+{
+    long long llNew = (long long)ttNow * NSEC_PER_SEC;
+
+    pthread_mutex_lock(&vc_mutex);
+    if (llNew > llVirtualNs)
+        llVirtualNs = llNew;
+    pthread_mutex_unlock(&vc_mutex);
+
+    return;
+}
@@ -0,0 +1,26 @@
+// vclock.h
+//
+// Clock abstraction - all daemon time(), localtime and sleep calls go
+// through here so the schedule can run against a virtual clock
+//
+
+#ifndef VCLOCK_H_INCLUDED
+#define VCLOCK_H_INCLUDED
+
+#include <time.h>
+
+extern int bVirtualClock;
+
+extern time_t vc_time(void);
+extern struct tm *vc_localtime(const time_t *pTime, struct tm *tmOut);
+extern struct tm *vc_gmtime(const time_t *pTime, struct tm *tmOut);
+extern void vc_gettime(struct timespec *ts);
+extern unsigned long vc_ticks(void);
+extern void vc_usleep(unsigned long usec);
+extern void vc_sleep(unsigned int sec);
+
+// Virtual clock control (simulation only)
+extern void vc_start(time_t ttStart);
+extern void vc_advance_to(time_t ttNow);
+
+#endif // VCLOCK_H_INCLUDED
@@ -92,6 +92,7 @@ wi_filesys * wi_filesystems[] =    /* list of file systems */
 
 
 wi_file *      wi_allfiles;   /* list of all open files */
+wi_sess *      wi_opensess;   /* session whose file is being opened */
 
 /* wi_fopen()
  *
@@ -116,7 +117,9 @@ wi_fopen(wi_sess * sess, char * name, char * mode)
         fsys = wi_filesystems[i];
         if(fsys == NULL)
             continue;
+        wi_opensess = sess;
         fd = fsys->wfs_fopen(name, mode);
+        wi_opensess = NULL;
         if(fd)
         {
             /* Got an open - create a wi_file & fill it in. */
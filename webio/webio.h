@@ -117,6 +117,7 @@ typedef struct wi_form_s
 } wi_form;
 
 extern   wi_sess * wi_sessions;
+extern   wi_sess * wi_opensess;   /* requester during wfs_fopen() */
 
 #define WF_READINGCMDS     0x0001      /* Still reading socket for commands from browser */
 #define WF_SSL             0x0004      /* Socket is SSL socket */
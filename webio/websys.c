@@ -58,26 +58,22 @@ extern char *sDayOfWeek[];
 extern char *sMonName[];
 extern struct tm tmLocalTime;
 
+/* Application time service (preformatted once per second) */
+extern void ts_getdate(char *sBuf, int bLocal);
+
+/* &tmLocalTime := local now, NULL := GMT now, else the given time */
 char *
 wi_getdate(wi_sess * sess, struct tm *tmtime)
 {
-    time_t	timeval;
-
     USE_ARG(sess);
 
-    timeval = time(NULL);
-    if (tmtime == &tmLocalTime)
-    {
-        // Get local time
-        tmLocalTime = *(localtime(&timeval));
-    }
-    else
+    if ((tmtime == NULL) || (tmtime == &tmLocalTime))
     {
-        // GMT time
-        tmtime = gmtime(&timeval);
+        ts_getdate(datebuf, tmtime != NULL);
+        return datebuf;
     }
 
-    sprintf(datebuf, "%s, %u %s %u %02u:%02u:%02u",
+    snprintf(datebuf, sizeof(datebuf), "%s, %u %s %u %02u:%02u:%02u",
             sDayOfWeek[tmtime->tm_wday],
             tmtime->tm_mday,
             sMonName[tmtime->tm_mon],
@@ -515,6 +515,8 @@ struct wi_ftype
     { 0x574D5600, "video/x-ms-wmv", FT_BINARY },     /* WMV */
     { 0x50444600, "application/pdf", FT_BINARY },    /* PDF */
     { 0x53574600, "application/x-shockwave-flash", FT_BINARY },    /* SWF */
+    { 0x4152524F, "application/vnd.apache.arrow.stream", FT_BINARY },  /* ARROWS */
+    { 0x43535600, "text/csv", 0 },     /* CSV */
 };
 
 
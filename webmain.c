@@ -16,11 +16,20 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 
 #include "webio/websys.h"
 #include "webio/webio.h"
 #include "webio/webfs.h"
 #include "wsfdata.h"
+#include "wxarrow.h"
+#include "wxquery.h"
+#include "wxhist.h"
+#include "wxnorm.h"
+#include "wxchart.h"
+#include "wxring.h"
 
 #if defined(_FREERTOS)
 #include "Board.h"
@@ -37,6 +46,23 @@ static const char *test_passwd = "tourist";
 
 int   wfs_auth(void *fd, char *name, char *password);
 
+#if !defined(_FREERTOS)
+/* History exports (Arrow, daily summary CSV) - generated at open, read back as a plain file */
+static WI_FILE *wx_fopen(char *name, char *mode);
+static int wx_fgetsize(void *fd);
+
+static wi_filesys wxfs =
+{
+    wx_fopen,
+    (void*)fread,
+    NULL,
+    (void*)fclose,
+    NULL,
+    wx_fgetsize,
+    NULL, NULL
+};
+#endif
+
 void *xWebStart(void *args)
 {
     int error;
@@ -54,6 +80,17 @@ thread_restart:
     /* Install our port-local authentication routine */
     emfs.wfs_fauth = wfs_auth;
 
+#if !defined(_FREERTOS)
+    /* History exports go in the runtime slot at the end of the FS list */
+    {
+        int i;
+
+        for (i = 0; wi_filesystems[i] && (wi_filesystems[i] != &wxfs); i++)
+            ;
+        wi_filesystems[i] = &wxfs;
+    }
+#endif
+
     error = wi_thread();   /* blocks here until killed */
     if(error < 0)
     {
@@ -94,6 +131,64 @@ int wfs_auth(void *fd, char *name, char *password)
     return 1;
 }
 
+#if !defined(_FREERTOS)
+/* Browser hung up on a query still being built? (peek, never blocks) */
+static int wx_gone(void *ctx)
+{
+    wi_sess *sess = (wi_sess *)ctx;
+    char c;
+    ssize_t n;
+
+    n = recv((int)sess->ws_socket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if(n == 0)
+        return 1;
+    return (n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR);
+}
+
+static WI_FILE *wx_fopen(char *name, char *mode)
+{
+    FILE *fd;
+
+    if(mode[0] != 'r')
+        return NULL;
+
+    /* Long range queries give up when the requester does */
+    if(wi_opensess)
+        WxqSetCancel(wx_gone, wi_opensess);
+
+    fd = WxArrowOpenUri(name);
+    if(fd == NULL)
+        fd = WxhOpenUri(name);
+    if(fd == NULL)
+        fd = WxnOpenUri(name);
+    if(fd == NULL)
+        fd = WxcOpenUri(name);
+    if(fd == NULL)
+        fd = WxRingOpenUri(name);
+    if(fd == NULL)
+        fd = WxqOpenUri(name);
+
+    if(fd && WxqCancelled())
+    {
+        dprintf("%s: requester gone\n", name);
+        fclose(fd);
+        fd = NULL;
+    }
+    WxqSetCancel(NULL, NULL);
+
+    return (WI_FILE *)fd;
+}
+
+static int wx_fgetsize(void *fd)
+{
+    struct stat st;
+
+    if(fstat(fileno((FILE *)fd), &st) != 0)
+        return -1;
+    return (int)st.st_size;
+}
+#endif
+
 
 void
 ws_dtrap(void)
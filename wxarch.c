@@ -0,0 +1,1127 @@
+// wxarch.c - Compressed cold archive of closed months
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxbin.h"
+#include "wxarch.h"
+
+//
+// Once a month is nArchKeep months old its directory of day logs is
+// replaced by <Mmmyy>.wxa. Each day is a block of columns: minutes,
+// indoor, outdoor, wind and pressure as delta-of-delta in variable
+// length bit buckets (readings every 20 minutes that barely move cost a
+// bit or two each), direction as a per-day dictionary. Min/max lines
+// and messages follow as-is, placed by reading number.
+//
+// Until nArchRaw months old every reading is kept and a day is only
+// archived if it renders back to the identical CSV. After that days are
+// cut to hourly means, and past nArchHourly to a daily mean, keeping the
+// min/max line. Runs on the export stage after each midnite rotation.
+//
+
+int nArchKeep = 0;
+int nArchRaw = 12;
+int nArchHourly = 36;
+
+// Largest encoded day, rendered day
+#define WXA_BLOCK_MAX   (16 * 1024)
+#define WXA_CSV_MAX     (64 * 1024)
+
+// Months considered per run
+#define WXA_MAX_MONTHS  512
+
+// Reading fields as shorts (WxSample order)
+#define WXA_F_DIR       4
+#define WXA_FIELDS      6
+#define SAMPLE_FIELD(p, k)  (((short *)(p))[k])
+
+//-------------------------------------------------------------------------------
+// Bit packing (MSB first)
+
+typedef struct _BitBuf
+{
+    unsigned char   *pBuf;
+    size_t          nBits;
+    size_t          nMax;           // Capacity (bits)
+} BitBuf;
+
+static void PutBits(BitBuf *pB, uint32_t nVal, int nCnt)
+{
+    while (nCnt-- > 0)
+    {
+        if (pB->nBits < pB->nMax)
+        {
+            if ((nVal >> nCnt) & 1)
+                pB->pBuf[pB->nBits >> 3] |= 0x80 >> (pB->nBits & 7);
+        }
+        pB->nBits++;
+    }
+
+    return;
+}
+
+static uint32_t GetBits(BitBuf *pB, int nCnt)
+{
+    uint32_t nVal = 0;
+
+    while (nCnt-- > 0)
+    {
+        nVal <<= 1;
+        if (pB->nBits < pB->nMax)
+            nVal |= (pB->pBuf[pB->nBits >> 3] >> (7 - (pB->nBits & 7))) & 1;
+        pB->nBits++;
+    }
+
+    return nVal;
+}
+
+// Sign extend nCnt bit field
+static int SignExt(uint32_t nVal, int nCnt)
+{
+    return (int)(nVal << (32 - nCnt)) >> (32 - nCnt);
+}
+
+//
+// Delta-of-delta buckets: 0, 7, 9, 12 or 20 bit values
+//
+static void PutDod(BitBuf *pB, int nDod)
+{
+    if (nDod == 0)
+        PutBits(pB, 0, 1);
+    else if ((nDod >= -64) && (nDod < 64))
+    {
+        PutBits(pB, 0x2, 2);
+        PutBits(pB, nDod & 0x7F, 7);
+    }
+    else if ((nDod >= -256) && (nDod < 256))
+    {
+        PutBits(pB, 0x6, 3);
+        PutBits(pB, nDod & 0x1FF, 9);
+    }
+    else if ((nDod >= -2048) && (nDod < 2048))
+    {
+        PutBits(pB, 0xE, 4);
+        PutBits(pB, nDod & 0xFFF, 12);
+    }
+    else
+    {
+        PutBits(pB, 0xF, 4);
+        PutBits(pB, nDod & 0xFFFFF, 20);
+    }
+
+    return;
+}
+
+static int GetDod(BitBuf *pB)
+{
+    if (GetBits(pB, 1) == 0)
+        return 0;
+    if (GetBits(pB, 1) == 0)
+        return SignExt(GetBits(pB, 7), 7);
+    if (GetBits(pB, 1) == 0)
+        return SignExt(GetBits(pB, 9), 9);
+    if (GetBits(pB, 1) == 0)
+        return SignExt(GetBits(pB, 12), 12);
+
+    return SignExt(GetBits(pB, 20), 20);
+}
+
+static void PutColumn(BitBuf *pB, WxaDay *pDay, int k)
+{
+    int n, nDelta, nPrev = 0;
+
+    if (pDay->nSamples == 0)
+        return;
+
+    PutBits(pB, (uint16_t)SAMPLE_FIELD(&pDay->xSamples[0], k), 16);
+    for (n = 1; n < pDay->nSamples; n++)
+    {
+        nDelta = SAMPLE_FIELD(&pDay->xSamples[n], k) - SAMPLE_FIELD(&pDay->xSamples[n - 1], k);
+        PutDod(pB, nDelta - nPrev);
+        nPrev = nDelta;
+    }
+
+    return;
+}
+
+static void GetColumn(BitBuf *pB, WxaDay *pDay, int k)
+{
+    int n, nDelta = 0;
+
+    if (pDay->nSamples == 0)
+        return;
+
+    SAMPLE_FIELD(&pDay->xSamples[0], k) = (short)SignExt(GetBits(pB, 16), 16);
+    for (n = 1; n < pDay->nSamples; n++)
+    {
+        nDelta += GetDod(pB);
+        SAMPLE_FIELD(&pDay->xSamples[n], k) = (short)(SAMPLE_FIELD(&pDay->xSamples[n - 1], k) + nDelta);
+    }
+
+    return;
+}
+
+// Bits to hold 0..nMax
+static int BitWidth(int nMax)
+{
+    int nBits = 0;
+
+    while (nMax > 0)
+    {
+        nBits++;
+        nMax >>= 1;
+    }
+
+    return nBits;
+}
+
+//
+// Direction - dictionary of the day's points, then an index per reading
+//
+static void PutDirs(BitBuf *pB, WxaDay *pDay)
+{
+    short nDict[16];
+    int nCnt = 0;
+    int n, i, nWidth;
+
+    for (n = 0; n < pDay->nSamples; n++)
+    {
+        for (i = 0; (i < nCnt) && (nDict[i] != pDay->xSamples[n].nDir); i++)
+            ;
+        if (i == nCnt)
+            nDict[nCnt++] = pDay->xSamples[n].nDir & 0x0F;
+    }
+
+    PutBits(pB, nCnt, 5);
+    for (i = 0; i < nCnt; i++)
+        PutBits(pB, nDict[i], 4);
+
+    nWidth = BitWidth(nCnt - 1);
+    for (n = 0; n < pDay->nSamples; n++)
+    {
+        for (i = 0; nDict[i] != pDay->xSamples[n].nDir; i++)
+            ;
+        PutBits(pB, i, nWidth);
+    }
+
+    return;
+}
+
+static int GetDirs(BitBuf *pB, WxaDay *pDay)
+{
+    short nDict[16];
+    int nCnt, n, i, nWidth;
+
+    nCnt = GetBits(pB, 5);
+    if (nCnt > 16)
+        return -1;
+    for (i = 0; i < nCnt; i++)
+        nDict[i] = GetBits(pB, 4);
+
+    nWidth = BitWidth(nCnt - 1);
+    for (n = 0; n < pDay->nSamples; n++)
+    {
+        i = GetBits(pB, nWidth);
+        if (i >= nCnt)
+            return -1;
+        pDay->xSamples[n].nDir = nDict[i];
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------
+// Day blocks
+//
+// nHead(1) nSamples(2) nExtras(1) nBitBytes(2) columns... extras...
+//
+
+static unsigned char *Put16(unsigned char *p, int nVal)
+{
+    uint16_t n = (uint16_t)nVal;
+
+    memcpy(p, &n, 2);
+
+    return p + 2;
+}
+
+static int Get16(const unsigned char *p)
+{
+    int16_t n;
+
+    memcpy(&n, p, 2);
+
+    return n;
+}
+
+static int EncodeDay(WxaDay *pDay, unsigned char *pBuf, size_t nSize)
+{
+    BitBuf xBits;
+    unsigned char *p;
+    WxaExtra *pX;
+    size_t nBytes, nLen;
+    int k, n;
+
+    if (nSize < 6)
+        return -1;
+
+    memset(pBuf, 0, nSize);
+    pBuf[0] = (unsigned char)pDay->nHead;
+    Put16(&pBuf[1], pDay->nSamples);
+    pBuf[3] = (unsigned char)pDay->nExtras;
+
+    xBits.pBuf = &pBuf[6];
+    xBits.nBits = 0;
+    xBits.nMax = (nSize - 6) * 8;
+    for (k = 0; k < WXA_FIELDS; k++)
+    {
+        if (k == WXA_F_DIR)
+            PutDirs(&xBits, pDay);
+        else
+            PutColumn(&xBits, pDay, k);
+    }
+    if (xBits.nBits > xBits.nMax)
+        return -1;
+
+    nBytes = (xBits.nBits + 7) / 8;
+    Put16(&pBuf[4], nBytes);
+    p = &pBuf[6 + nBytes];
+
+    for (n = 0; n < pDay->nExtras; n++)
+    {
+        pX = &pDay->xExtras[n];
+        nLen = (pX->nKind == WXA_X_MINMAX) ? sizeof(pX->xMinMax) : strlen(pX->sMsg);
+        if ((size_t)(p - pBuf) + 6 + nLen > nSize)
+            return -1;
+
+        p = Put16(p, pX->nAt);
+        *p++ = (unsigned char)pX->nKind;
+        p = Put16(p, pX->nTime);
+        if (pX->nKind == WXA_X_MINMAX)
+            memcpy(p, &pX->xMinMax, nLen);
+        else
+        {
+            *p++ = (unsigned char)nLen;
+            memcpy(p, pX->sMsg, nLen);
+        }
+        p += nLen;
+    }
+
+    return p - pBuf;
+}
+
+static int DecodeDay(const unsigned char *pBuf, size_t nSize, WxaDay *pDay)
+{
+    BitBuf xBits;
+    const unsigned char *p, *pEnd = pBuf + nSize;
+    WxaExtra *pX;
+    size_t nBytes, nLen;
+    int k, n;
+
+    memset(pDay, 0, sizeof(*pDay));
+    if (nSize < 6)
+        return -1;
+
+    pDay->nHead = pBuf[0];
+    pDay->nSamples = (uint16_t)Get16(&pBuf[1]);
+    pDay->nExtras = pBuf[3];
+    nBytes = (uint16_t)Get16(&pBuf[4]);
+    if ((pDay->nSamples > WXA_MAX_SAMPLES) || (pDay->nExtras > WXA_MAX_EXTRAS) ||
+        ((6 + nBytes) > nSize))
+        return -1;
+
+    xBits.pBuf = (unsigned char *)&pBuf[6];
+    xBits.nBits = 0;
+    xBits.nMax = nBytes * 8;
+    for (k = 0; k < WXA_FIELDS; k++)
+    {
+        if (k == WXA_F_DIR)
+        {
+            if (GetDirs(&xBits, pDay) != 0)
+                return -1;
+        }
+        else
+            GetColumn(&xBits, pDay, k);
+    }
+    if (xBits.nBits > xBits.nMax)
+        return -1;
+
+    p = &pBuf[6 + nBytes];
+    for (n = 0; n < pDay->nExtras; n++)
+    {
+        pX = &pDay->xExtras[n];
+        if ((p + 5) > pEnd)
+            return -1;
+        pX->nAt = Get16(p);
+        pX->nKind = p[2];
+        pX->nTime = Get16(&p[3]);
+        p += 5;
+
+        if (pX->nKind == WXA_X_MINMAX)
+        {
+            nLen = sizeof(pX->xMinMax);
+            if ((p + nLen) > pEnd)
+                return -1;
+            memcpy(&pX->xMinMax, p, nLen);
+        }
+        else
+        {
+            if (p >= pEnd)
+                return -1;
+            nLen = *p++;
+            if ((nLen >= sizeof(pX->sMsg)) || ((p + nLen) > pEnd))
+                return -1;
+            memcpy(pX->sMsg, p, nLen);
+        }
+        p += nLen;
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------
+// CSV day logs
+
+static int MatchLine(const char *sLine, size_t nLen, const char *sText)
+{
+    return (strlen(sText) == nLen) && (memcmp(sLine, sText, nLen) == 0);
+}
+
+static WxaExtra *AddExtra(WxaDay *pDay, int nKind, int nTime)
+{
+    WxaExtra *pX;
+
+    if (pDay->nExtras >= WXA_MAX_EXTRAS)
+        return NULL;
+
+    pX = &pDay->xExtras[pDay->nExtras++];
+    memset(pX, 0, sizeof(*pX));
+    pX->nAt = pDay->nSamples;
+    pX->nKind = nKind;
+    pX->nTime = nTime;
+
+    return pX;
+}
+
+// One CSV line (incl. newline). Returns FALSE if not understood.
+static int ParseLine(WxaDay *pDay, const char *sLine, size_t nLen, int *pbMinMax)
+{
+    char sText[128];
+    char sDir[8];
+    WxSample *pS;
+    WxaExtra *pX;
+    WxMinMax *pM;
+    int nVal[17];
+    int nTime, nPos, n;
+
+    if ((nLen == 0) || (nLen >= sizeof(sText)) || (sLine[nLen - 1] != '\n'))
+        return FALSE;
+    memcpy(sText, sLine, nLen);
+    sText[nLen] = '\0';
+
+    if (MatchLine(sLine, nLen, WEATHER_LOG_HEADER2))
+    {
+        *pbMinMax = TRUE;
+        return TRUE;
+    }
+
+    if (*pbMinMax)
+    {
+        *pbMinMax = FALSE;
+        n = sscanf(sText, "1440,%d,%d:%d,%d,%d:%d,%d,%d:%d,%d.%d,%d:%d,%d.%d,%d:%d\n",
+                   &nVal[0], &nVal[1], &nVal[2], &nVal[3], &nVal[4], &nVal[5], &nVal[6], &nVal[7], &nVal[8],
+                   &nVal[9], &nVal[10], &nVal[11], &nVal[12], &nVal[13], &nVal[14], &nVal[15], &nVal[16]);
+        if ((n != 17) || !(pX = AddExtra(pDay, WXA_X_MINMAX, 1440)))
+            return FALSE;
+        pM = &pX->xMinMax;
+        pM->nTLow = nVal[0];
+        pM->nTLowTime = (nVal[1] * 60) + nVal[2];
+        pM->nTHigh = nVal[3];
+        pM->nTHighTime = (nVal[4] * 60) + nVal[5];
+        pM->nWind = nVal[6];
+        pM->nWindTime = (nVal[7] * 60) + nVal[8];
+        pM->nPLow = (nVal[9] * 100) + nVal[10];
+        pM->nPLowTime = (nVal[11] * 60) + nVal[12];
+        pM->nPHigh = (nVal[13] * 100) + nVal[14];
+        pM->nPHighTime = (nVal[15] * 60) + nVal[16];
+        return TRUE;
+    }
+
+    // Reading
+    if ((sscanf(sText, "%d,%d,%d,%d,%7[A-Z],%d.%d\n", &nTime, &nVal[0], &nVal[1], &nVal[2],
+                sDir, &nVal[3], &nVal[4]) == 7) && (pDay->nSamples < WXA_MAX_SAMPLES))
+    {
+        for (n = 0; (n < 16) && strcmp(sDir, sWinDir[n]); n++)
+            ;
+        if (n == 16)
+            return FALSE;
+
+        pS = &pDay->xSamples[pDay->nSamples++];
+        pS->nTime = nTime;
+        pS->nIndoor = nVal[0];
+        pS->nOutdoor = nVal[1];
+        pS->nWind = nVal[2];
+        pS->nDir = n;
+        pS->nPressure = (nVal[3] * 100) + nVal[4];
+        return TRUE;
+    }
+
+    // Message
+    if ((sscanf(sText, "%d,%n", &nTime, &nPos) == 1) && ((nLen - nPos) < WX_MSG_SIZE))
+    {
+        if (!(pX = AddExtra(pDay, WXA_X_MESSAGE, nTime)))
+            return FALSE;
+        strcpy(pX->sMsg, &sText[nPos]);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+//
+// Parse day log text. bStrict fails on anything not understood, else
+// such lines are skipped.
+//
+static int ParseBuf(const char *pBuf, size_t nSize, WxaDay *pDay, int bStrict)
+{
+    const char *p, *pEnd = pBuf + nSize;
+    const char *pNext;
+    int bMinMax = FALSE;
+
+    memset(pDay, 0, sizeof(*pDay));
+
+    for (p = pBuf; p < pEnd; p = pNext)
+    {
+        pNext = memchr(p, '\n', pEnd - p);
+        pNext = pNext ? pNext + 1 : pEnd;
+
+        if (p == pBuf)
+        {
+            if (MatchLine(p, pNext - p, WEATHER_LOG_HEADER1))
+            {
+                pDay->nHead = WXA_HEAD_WEATHER;
+                continue;
+            }
+            if (MatchLine(p, pNext - p, NOWEATHER_LOG_HEADER))
+            {
+                pDay->nHead = WXA_HEAD_NOWEATHER;
+                continue;
+            }
+        }
+
+        if (!ParseLine(pDay, p, pNext - p, &bMinMax) && bStrict)
+            return -1;
+    }
+
+    return 0;
+}
+
+static char *ReadFile(const char *sPath, size_t *pSize)
+{
+    struct stat xInfo;
+    char *pBuf;
+    int fd;
+
+    fd = open(sPath, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    pBuf = NULL;
+    if ((fstat(fd, &xInfo) == 0) && (pBuf = (char *)malloc(xInfo.st_size + 1)))
+    {
+        if (read(fd, pBuf, xInfo.st_size) != xInfo.st_size)
+        {
+            free(pBuf);
+            pBuf = NULL;
+        }
+        *pSize = xInfo.st_size;
+    }
+    close(fd);
+
+    return pBuf;
+}
+
+int WxaParseCsv(const char *sPath, WxaDay *pDay, int bStrict)
+{
+    size_t nSize;
+    char *pBuf;
+    int nRet;
+
+    pBuf = ReadFile(sPath, &nSize);
+    if (!pBuf)
+        return -1;
+
+    nRet = ParseBuf(pBuf, nSize, pDay, bStrict);
+    free(pBuf);
+
+    return nRet;
+}
+
+//
+// Day back to CSV text (same formatting as the live log)
+//
+int WxaRender(WxaDay *pDay, char *sBuf, size_t nSize)
+{
+    WxaExtra *pX;
+    WxWeather xW;
+    size_t nLen = 0;
+    int n, x = 0;
+
+    if (pDay->nHead == WXA_HEAD_WEATHER)
+        nLen = sprintf(sBuf, "%s", WEATHER_LOG_HEADER1);
+    else if (pDay->nHead == WXA_HEAD_NOWEATHER)
+        nLen = sprintf(sBuf, "%s", NOWEATHER_LOG_HEADER);
+
+    for (n = 0; n <= pDay->nSamples; n++)
+    {
+        for ( ; (x < pDay->nExtras) && (pDay->xExtras[x].nAt <= n); x++)
+        {
+            if ((nLen + 256) > nSize)
+                return -1;
+
+            pX = &pDay->xExtras[x];
+            if (pX->nKind == WXA_X_MINMAX)
+            {
+                nLen += sprintf(&sBuf[nLen], "%s", WEATHER_LOG_HEADER2);
+                nLen += WxFormatMinMax(&sBuf[nLen], &pX->xMinMax);
+            }
+            else
+                nLen += WxFormatMessage(&sBuf[nLen], pX->nTime, pX->sMsg);
+        }
+
+        if (n == pDay->nSamples)
+            break;
+        if ((nLen + 128) > nSize)
+            return -1;
+
+        xW.nIndoor = pDay->xSamples[n].nIndoor;
+        xW.nOutdoor = pDay->xSamples[n].nOutdoor;
+        xW.nWind = pDay->xSamples[n].nWind;
+        xW.nDir = pDay->xSamples[n].nDir & 0x0F;
+        xW.nPressure = pDay->xSamples[n].nPressure;
+        nLen += WxFormatWeather(&sBuf[nLen], pDay->xSamples[n].nTime, &xW);
+    }
+
+    return nLen;
+}
+
+//-------------------------------------------------------------------------------
+// Thinning
+
+static short Mean(long nSum, int nCnt)
+{
+    return (short)((nSum >= 0) ? ((nSum + (nCnt / 2)) / nCnt) : -((-nSum + (nCnt / 2)) / nCnt));
+}
+
+//
+// Cut readings to hourly (or one daily) means. Messages go, min/max stays.
+//
+static void ThinDay(WxaDay *pDay, int nRes)
+{
+    long nSum[24][WXA_FIELDS];
+    int nCnt[24];
+    int nDirs[24][16];
+    WxaExtra xMinMax;
+    int bMinMax = FALSE;
+    int n, b, k, d, nBuckets;
+
+    if (nRes == WXA_RES_RAW)
+        return;
+
+    memset(nSum, 0, sizeof(nSum));
+    memset(nCnt, 0, sizeof(nCnt));
+    memset(nDirs, 0, sizeof(nDirs));
+    nBuckets = (nRes == WXA_RES_HOURLY) ? 24 : 1;
+
+    for (n = 0; n < pDay->nSamples; n++)
+    {
+        if ((pDay->xSamples[n].nTime < 0) || (pDay->xSamples[n].nTime >= 1440))
+            continue;
+        b = (nBuckets == 24) ? (pDay->xSamples[n].nTime / 60) : 0;
+        for (k = 0; k < WXA_FIELDS; k++)
+            nSum[b][k] += SAMPLE_FIELD(&pDay->xSamples[n], k);
+        nDirs[b][pDay->xSamples[n].nDir & 0x0F]++;
+        nCnt[b]++;
+    }
+
+    for (n = 0; n < pDay->nExtras; n++)
+    {
+        if (pDay->xExtras[n].nKind == WXA_X_MINMAX)
+        {
+            xMinMax = pDay->xExtras[n];
+            bMinMax = TRUE;
+        }
+    }
+
+    pDay->nSamples = 0;
+    for (b = 0; b < nBuckets; b++)
+    {
+        if (nCnt[b] == 0)
+            continue;
+        for (k = 0; k < WXA_FIELDS; k++)
+            SAMPLE_FIELD(&pDay->xSamples[pDay->nSamples], k) = Mean(nSum[b][k], nCnt[b]);
+        pDay->xSamples[pDay->nSamples].nTime = (nBuckets == 24) ? (b * 60) : 0;
+        // Prevailing direction
+        for (d = 0, k = 1; k < 16; k++)
+        {
+            if (nDirs[b][k] > nDirs[b][d])
+                d = k;
+        }
+        pDay->xSamples[pDay->nSamples].nDir = d;
+        pDay->nSamples++;
+    }
+
+    pDay->nExtras = 0;
+    if (bMinMax)
+    {
+        xMinMax.nAt = pDay->nSamples;
+        pDay->xExtras[pDay->nExtras++] = xMinMax;
+    }
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Archive files
+
+unsigned char *WxaLoad(const char *sPath, size_t *pSize)
+{
+    WxaHeader *pHead;
+    unsigned char *pBuf;
+
+    pBuf = (unsigned char *)ReadFile(sPath, pSize);
+    if (!pBuf)
+        return NULL;
+
+    pHead = (WxaHeader *)pBuf;
+    if ((*pSize < sizeof(WxaHeader)) || (pHead->nMagic != WXA_MAGIC) || (pHead->nVersion != WXA_VERSION))
+    {
+        free(pBuf);
+        return NULL;
+    }
+
+    return pBuf;
+}
+
+static int GetDay(unsigned char *pArch, size_t nSize, int nDay, WxaDay *pDay)
+{
+    WxaHeader *pHead = (WxaHeader *)pArch;
+
+    if ((nDay < 1) || (nDay > 31) || (pHead->nOffset[nDay] == 0) ||
+        ((pHead->nOffset[nDay] + pHead->nLen[nDay]) > nSize))
+        return -1;
+
+    return DecodeDay(&pArch[pHead->nOffset[nDay]], pHead->nLen[nDay], pDay);
+}
+
+//
+// Append encoded day to archive being built
+//
+static int AddDay(unsigned char **ppArch, size_t *pSize, int nDay, WxaDay *pDay)
+{
+    unsigned char xBlock[WXA_BLOCK_MAX];
+    unsigned char *pNew;
+    WxaHeader *pHead;
+    int nLen;
+
+    nLen = EncodeDay(pDay, xBlock, sizeof(xBlock));
+    if (nLen < 0)
+        return -1;
+
+    pNew = (unsigned char *)realloc(*ppArch, *pSize + nLen);
+    if (!pNew)
+        return -1;
+    memcpy(&pNew[*pSize], xBlock, nLen);
+
+    pHead = (WxaHeader *)pNew;
+    pHead->nOffset[nDay] = *pSize;
+    pHead->nLen[nDay] = nLen;
+    pHead->nDays++;
+
+    *ppArch = pNew;
+    *pSize += nLen;
+
+    return 0;
+}
+
+static unsigned char *NewArchive(int nRes, size_t *pSize)
+{
+    WxaHeader *pHead;
+
+    pHead = (WxaHeader *)calloc(1, sizeof(WxaHeader));
+    if (!pHead)
+        return NULL;
+
+    pHead->nMagic = WXA_MAGIC;
+    pHead->nVersion = WXA_VERSION;
+    pHead->nRes = nRes;
+    *pSize = sizeof(WxaHeader);
+
+    return (unsigned char *)pHead;
+}
+
+// Write via temp file so a crash leaves old or new, never half
+static int SaveArchive(const char *sPath, unsigned char *pArch, size_t nSize)
+{
+    char sTemp[PATH_MAX + 8];
+    int fd, nRet = -1;
+
+    snprintf(sTemp, sizeof(sTemp), "%s.tmp", sPath);
+    fd = open(sTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Archive create failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if ((write(fd, pArch, nSize) == (ssize_t)nSize) && (fdatasync(fd) == 0))
+        nRet = 0;
+    close(fd);
+
+    if ((nRet == 0) && (rename(sTemp, sPath) != 0))
+        nRet = -1;
+    if (nRet != 0)
+    {
+        printf("Archive write failed: %s\n", strerror(errno));
+        unlink(sTemp);
+    }
+
+    return nRet;
+}
+
+// Make a rename in sDir durable
+static int SyncDir(const char *sDir)
+{
+    int fd, nRet;
+
+    fd = open(sDir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return -1;
+    nRet = fsync(fd);
+    close(fd);
+
+    return nRet;
+}
+
+//
+// Day log directory -> archive, then remove the day logs
+//
+static int ArchiveMonth(const char *sMon, int nRes)
+{
+    char sDir[PATH_MAX], sPath[PATH_MAX + 16], sArch[PATH_MAX + 8];
+    char *pCsv, *pText;
+    unsigned char *pArch;
+    struct dirent *pEnt;
+    struct stat xInfo;
+    WxaDay *pDay;
+    size_t nCsv, nArch;
+    long nTotal = 0;
+    int nDay, nLen, nRet = -1;
+    DIR *pDir;
+
+    if (snprintf(sDir, sizeof(sDir), "%s/%s", sWLogPath, sMon) >= (int)sizeof(sDir))
+    {
+        printf("Archive: %s path too long, left as is\n", sMon);
+        return -1;
+    }
+    snprintf(sArch, sizeof(sArch), "%s" WXA_EXT, sDir);
+    if (stat(sArch, &xInfo) == 0)
+    {
+        printf("Archive: %s exists, %s left as is\n", &sArch[strlen(sWLogPath) + 1], sMon);
+        return -1;
+    }
+
+    // Only day logs here (a day must have its CSV)
+    pDir = opendir(sDir);
+    if (!pDir)
+        return -1;
+    while ((pEnt = readdir(pDir)))
+    {
+        if (pEnt->d_name[0] == '.')
+            continue;
+        nDay = atoi(pEnt->d_name);
+        snprintf(sPath, sizeof(sPath), "%s/%02d", sDir, nDay);
+        if ((nDay < 1) || (nDay > 31) || (strlen(pEnt->d_name) < 2) ||
+            (strcmp(&pEnt->d_name[2], "") && strcmp(&pEnt->d_name[2], WXB_EXT)) ||
+            (stat(sPath, &xInfo) != 0))
+        {
+            printf("Archive: %s/%s unexpected, month left as is\n", sMon, pEnt->d_name);
+            closedir(pDir);
+            return -1;
+        }
+    }
+    closedir(pDir);
+
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    pText = (char *)malloc(WXA_CSV_MAX);
+    pArch = NewArchive(nRes, &nArch);
+    if (!pDay || !pText || !pArch)
+        goto done;
+
+    for (nDay = 1; nDay <= 31; nDay++)
+    {
+        snprintf(sPath, sizeof(sPath), "%s/%02d", sDir, nDay);
+        pCsv = ReadFile(sPath, &nCsv);
+        if (!pCsv)
+            continue;
+        nTotal += nCsv;
+
+        // Full resolution must come back byte for byte
+        if (ParseBuf(pCsv, nCsv, pDay, nRes == WXA_RES_RAW) == 0)
+        {
+            nLen = WxaRender(pDay, pText, WXA_CSV_MAX);
+            if ((nRes != WXA_RES_RAW) || ((nLen == (int)nCsv) && (memcmp(pCsv, pText, nCsv) == 0)))
+            {
+                ThinDay(pDay, nRes);
+                nLen = AddDay(&pArch, &nArch, nDay, pDay);
+            }
+            else
+                nLen = -1;
+        }
+        else
+            nLen = -1;
+        free(pCsv);
+
+        if (nLen < 0)
+        {
+            printf("Archive: %s/%02d not archivable, month left as is\n", sMon, nDay);
+            goto done;
+        }
+    }
+
+    if (SaveArchive(sArch, pArch, nArch) != 0)
+        goto done;
+
+    // Archive is safe once its name is - then drop the day logs
+    if (SyncDir(sWLogPath) != 0)
+    {
+        printf("Archive: %s sync failed: %s, day logs kept\n", sMon, strerror(errno));
+        goto done;
+    }
+    for (nDay = 1; nDay <= 31; nDay++)
+    {
+        snprintf(sPath, sizeof(sPath), "%s/%02d", sDir, nDay);
+        unlink(sPath);
+        strcat(sPath, WXB_EXT);
+        unlink(sPath);
+    }
+    if (rmdir(sDir) != 0)
+        printf("Archive: %s not removed: %s\n", sMon, strerror(errno));
+
+    printf("Archive: %s - %d days, %ld bytes -> %ld\n", sMon, ((WxaHeader *)pArch)->nDays, nTotal, (long)nArch);
+    nRet = 0;
+
+done:
+    free(pArch);
+    free(pText);
+    free(pDay);
+
+    return nRet;
+}
+
+//
+// Thin an existing archive to a coarser tier
+//
+static int ThinArchive(const char *sName, int nRes)
+{
+    char sPath[PATH_MAX];
+    unsigned char *pOld, *pNew;
+    size_t nOld, nNew;
+    WxaDay *pDay;
+    int nDay, nRet = -1;
+
+    if (snprintf(sPath, sizeof(sPath), "%s/%s", sWLogPath, sName) >= (int)sizeof(sPath))
+        return -1;
+    pOld = WxaLoad(sPath, &nOld);
+    if (!pOld)
+        return -1;
+    if (((WxaHeader *)pOld)->nRes >= nRes)
+    {
+        free(pOld);
+        return 0;
+    }
+
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    pNew = NewArchive(nRes, &nNew);
+    if (!pDay || !pNew)
+        goto done;
+
+    for (nDay = 1; nDay <= 31; nDay++)
+    {
+        if (((WxaHeader *)pOld)->nOffset[nDay] == 0)
+            continue;
+        if (GetDay(pOld, nOld, nDay, pDay) != 0)
+        {
+            printf("Archive: %s day %d unreadable\n", sName, nDay);
+            goto done;
+        }
+        ThinDay(pDay, nRes);
+        if (AddDay(&pNew, &nNew, nDay, pDay) != 0)
+            goto done;
+    }
+
+    if (SaveArchive(sPath, pNew, nNew) == 0)
+    {
+        printf("Archive: %s thinned to %s - %ld bytes -> %ld\n", sName,
+               (nRes == WXA_RES_HOURLY) ? "hourly" : "daily", (long)nOld, (long)nNew);
+        nRet = 0;
+    }
+
+done:
+    free(pNew);
+    free(pDay);
+    free(pOld);
+
+    return nRet;
+}
+
+// "Mmmyy" or "Mmmyy.wxa" -> months since 1900 (-1 if neither)
+int WxaMonthIndex(const char *sName, int *pbArchive)
+{
+    int nMon;
+
+    for (nMon = 0; (nMon < 12) && strncmp(sName, sMonName[nMon], 3); nMon++)
+        ;
+    if ((nMon == 12) || (sName[3] < '0') || (sName[3] > '9') || (sName[4] < '0') || (sName[4] > '9'))
+        return -1;
+
+    if (sName[5] == '\0')
+        *pbArchive = FALSE;
+    else if (strcmp(&sName[5], WXA_EXT) == 0)
+        *pbArchive = TRUE;
+    else
+        return -1;
+
+    return ((100 + ((sName[3] - '0') * 10) + (sName[4] - '0')) * 12) + nMon;
+}
+
+//
+// Apply retention policy to closed months
+//
+int WxArchiveRun(time_t ttNow)
+{
+    char (*sNames)[16];
+    struct dirent *pEnt;
+    struct tm tmNow;
+    DIR *pDir;
+    int nNames = 0, nDone = 0;
+    int n, nAge, nRes, bArchive;
+
+    if ((nArchKeep <= 0) || !sWLogPath)
+        return 0;
+
+    // Collect first, the directory changes under us
+    sNames = malloc(WXA_MAX_MONTHS * sizeof(*sNames));
+    pDir = opendir(sWLogPath);
+    if (!sNames || !pDir)
+    {
+        free(sNames);
+        if (pDir)
+            closedir(pDir);
+        return -1;
+    }
+    while ((pEnt = readdir(pDir)) && (nNames < WXA_MAX_MONTHS))
+    {
+        if ((strlen(pEnt->d_name) < sizeof(sNames[0])) && (WxaMonthIndex(pEnt->d_name, &bArchive) >= 0))
+            strcpy(sNames[nNames++], pEnt->d_name);
+    }
+    closedir(pDir);
+
+    vc_localtime(&ttNow, &tmNow);
+    for (n = 0; n < nNames; n++)
+    {
+        nAge = ((tmNow.tm_year * 12) + tmNow.tm_mon) - WxaMonthIndex(sNames[n], &bArchive);
+        if (nAge < nArchKeep)
+            continue;
+
+        if (nAge < nArchRaw)
+            nRes = WXA_RES_RAW;
+        else if (nAge < nArchHourly)
+            nRes = WXA_RES_HOURLY;
+        else
+            nRes = WXA_RES_DAILY;
+
+        if ((bArchive ? ThinArchive(sNames[n], nRes) : ArchiveMonth(sNames[n], nRes)) == 0)
+            nDone++;
+    }
+    free(sNames);
+
+    return nDone;
+}
+
+//-------------------------------------------------------------------------------
+// Readers
+
+int WxaReadDay(const char *sArchive, int nDay, WxaDay *pDay, int *pRes)
+{
+    unsigned char *pArch;
+    size_t nSize;
+    int nRet;
+
+    pArch = WxaLoad(sArchive, &nSize);
+    if (!pArch)
+        return -1;
+
+    if (pRes)
+        *pRes = ((WxaHeader *)pArch)->nRes;
+    nRet = GetDay(pArch, nSize, nDay, pDay);
+    free(pArch);
+
+    return nRet;
+}
+
+//
+// Archived day log (<path>/Mmmyy/dd) as CSV
+//
+int WxaDayToCsv(const char *sDayPath, FILE *fOut)
+{
+    char sArch[128];
+    const char *sDay;
+    char *pText;
+    WxaDay *pDay;
+    int nLen = -1;
+
+    sDay = strrchr(sDayPath, '/');
+    if (!sDay || ((sDay - sDayPath) + sizeof(WXA_EXT) > sizeof(sArch)))
+        return -1;
+    memcpy(sArch, sDayPath, sDay - sDayPath);
+    strcpy(&sArch[sDay - sDayPath], WXA_EXT);
+
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    pText = (char *)malloc(WXA_CSV_MAX);
+    if (pDay && pText && (WxaReadDay(sArch, atoi(&sDay[1]), pDay, NULL) == 0))
+        nLen = WxaRender(pDay, pText, WXA_CSV_MAX);
+
+    if (nLen >= 0)
+        fwrite(pText, 1, nLen, fOut);
+    else
+        printf("No archived log for: %s\n", sDayPath);
+
+    free(pText);
+    free(pDay);
+
+    return (nLen >= 0) ? 0 : -1;
+}
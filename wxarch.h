@@ -0,0 +1,105 @@
+// wxarch.h
+//
+// Cold archive - closed months of daily logs compacted into one
+// compressed, columnar file per month (<Mmmyy>.wxa), thinned to hourly
+// and then daily readings as they age
+//
+
+#ifndef WXARCH_H_INCLUDED
+#define WXARCH_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wxpipe.h"
+
+#define WXA_EXT             ".wxa"
+
+#define WXA_MAGIC           0x31415857      // "WXA1"
+#define WXA_VERSION         1
+
+// Archive resolution (retention tier)
+#define WXA_RES_RAW         0               // Every reading, log rebuilt exactly
+#define WXA_RES_HOURLY      1               // Hourly means + min/max
+#define WXA_RES_DAILY       2               // Daily mean + min/max
+
+// Day limits
+#define WXA_MAX_SAMPLES     512
+#define WXA_MAX_EXTRAS      32
+
+// How the CSV day log began
+#define WXA_HEAD_NONE       0
+#define WXA_HEAD_WEATHER    1
+#define WXA_HEAD_NOWEATHER  2
+
+// Non-reading lines (kind)
+#define WXA_X_MINMAX        1
+#define WXA_X_MESSAGE       2
+
+//
+// One reading
+//
+typedef struct _WxSample
+{
+    short   nTime;          // Minutes past midnite
+    short   nIndoor;
+    short   nOutdoor;
+    short   nWind;
+    short   nDir;
+    short   nPressure;
+} WxSample;
+
+//
+// Min/max block or message, logged ahead of reading nAt
+//
+typedef struct _WxaExtra
+{
+    short       nAt;
+    short       nKind;
+    short       nTime;
+    WxMinMax    xMinMax;
+    char        sMsg[WX_MSG_SIZE];
+} WxaExtra;
+
+//
+// A day's log
+//
+typedef struct _WxaDay
+{
+    int         nHead;
+    int         nSamples;
+    int         nExtras;
+    WxSample    xSamples[WXA_MAX_SAMPLES];
+    WxaExtra    xExtras[WXA_MAX_EXTRAS];
+} WxaDay;
+
+//
+// Archive file header - day blocks follow
+//
+typedef struct _WxaHeader
+{
+    uint32_t    nMagic;
+    uint16_t    nVersion;
+    uint8_t     nRes;               // WXA_RES_xxx
+    uint8_t     nDays;              // Days present
+    uint32_t    nOffset[32];        // Day block (by day of month, 0 := none)
+    uint32_t    nLen[32];
+} WxaHeader;
+
+// Retention policy (months), nArchKeep == 0 := no archiving
+extern int nArchKeep;               // Left as daily log files
+extern int nArchRaw;                // Archived with every reading
+extern int nArchHourly;             // Archived hourly, then daily
+
+extern int WxArchiveRun(time_t ttNow);
+extern int WxaMonthIndex(const char *sName, int *pbArchive);
+extern unsigned char *WxaLoad(const char *sPath, size_t *pSize);
+
+// Day logs
+extern int WxaParseCsv(const char *sPath, WxaDay *pDay, int bStrict);
+extern int WxaRender(WxaDay *pDay, char *sBuf, size_t nSize);
+extern int WxaReadDay(const char *sArchive, int nDay, WxaDay *pDay, int *pRes);
+extern int WxaDayToCsv(const char *sDayPath, FILE *fOut);
+
+#endif // WXARCH_H_INCLUDED
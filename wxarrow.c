@@ -0,0 +1,745 @@
+// wxarrow.c - Weather history export as an Arrow IPC stream
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxquery.h"
+#include "wxroll.h"
+#include "wxarrow.h"
+
+//
+// The stream is a schema message, the wind direction dictionary, then
+// record batches, then an end marker. Each message is a flatbuffer
+// (Message.fbs) framed as 0xFFFFFFFF, length, metadata, body - all
+// padded to 8 bytes. Arrow is little-endian as are the targets.
+//
+// The flatbuffers are built front to back: a parent table first with
+// its offsets to children patched as each child is appended (offsets
+// only ever point forward), each table right after its vtable.
+//
+
+// Message header types
+#define MH_SCHEMA           1
+#define MH_DICTIONARY       2
+#define MH_RECORDBATCH      3
+
+// Type union
+#define TT_INT              2
+#define TT_FLOAT            3
+#define TT_UTF8             5
+#define TT_TIMESTAMP        10
+
+#define METADATA_V5         4
+#define PRECISION_DOUBLE    2
+
+// Column types
+#define COL_TIME            0
+#define COL_I16             1
+#define COL_I32             2
+#define COL_F64             3
+#define COL_DIR             4       // int8 index into sWinDir[]
+
+#define MAX_COLS            16
+#define MAX_SLOTS           8
+#define MAX_BUFFERS         ((MAX_COLS * 2) + 1)
+
+#define DIR_COUNT           16
+#define DIR_ID              0
+
+typedef struct _ArrCol
+{
+    const char  *sName;
+    int         nType;
+} ArrCol;
+
+static const ArrCol xRawCols[] =
+{
+    { "time", COL_TIME },
+    { "indoor", COL_I16 },
+    { "outdoor", COL_I16 },
+    { "wind", COL_I16 },
+    { "wind_dir", COL_DIR },
+    { "pressure", COL_F64 },
+};
+
+static const ArrCol xRollCols[] =
+{
+    { "start", COL_TIME },
+    { "count", COL_I32 },
+    { "indoor_min", COL_I16 }, { "indoor_max", COL_I16 }, { "indoor_avg", COL_F64 },
+    { "outdoor_min", COL_I16 }, { "outdoor_max", COL_I16 }, { "outdoor_avg", COL_F64 },
+    { "wind_min", COL_I16 }, { "wind_max", COL_I16 }, { "wind_avg", COL_F64 },
+    { "pressure_min", COL_F64 }, { "pressure_max", COL_F64 }, { "pressure_avg", COL_F64 },
+    { "wind_dir", COL_DIR },
+    { "wind_vec", COL_I16 },
+};
+
+static const int nColWidth[] = { 8, 2, 4, 8, 1 };
+
+//
+// Flatbuffer under construction
+//
+typedef struct _FbBuf
+{
+    unsigned char   *pData;
+    size_t          nLen, nAlloc;
+    int             bFail;
+} FbBuf;
+
+//
+// Table field - nSize 0 := absent, offsets are 4 byte fields with nPos
+// set once the table is placed
+//
+typedef struct _FbSlot
+{
+    int         nSize;
+    int64_t     nVal;
+    size_t      nPos;
+} FbSlot;
+
+// Body buffer
+typedef struct _ArrBuf
+{
+    const void  *pData;
+    int64_t     nLen;
+} ArrBuf;
+
+typedef struct _ArrCtx
+{
+    FILE            *fOut;
+    const ArrCol    *pCols;
+    int             nCols;
+    int             nRows;              // In current batch
+    long            nTotal;
+    int             bFail;
+    unsigned char   *pCol[MAX_COLS];
+} ArrCtx;
+
+static const unsigned char xZero[8];
+
+//-------------------------------------------------------------------------------
+// Flatbuffer builder
+
+// Append nLen bytes (pData NULL := zeros), returns where
+static size_t FbPut(FbBuf *pB, const void *pData, size_t nLen)
+{
+    size_t nPos = pB->nLen;
+    unsigned char *p;
+
+    if ((nPos + nLen) > pB->nAlloc)
+    {
+        p = realloc(pB->pData, pB->nAlloc + nLen + 256);
+        if (p == NULL)
+        {
+            pB->bFail = TRUE;
+            return nPos;
+        }
+        pB->pData = p;
+        pB->nAlloc += nLen + 256;
+    }
+    if (pData)
+        memcpy(pB->pData + nPos, pData, nLen);
+    else
+        memset(pB->pData + nPos, 0, nLen);
+    pB->nLen += nLen;
+
+    return nPos;
+}
+
+static size_t FbAlign(FbBuf *pB, size_t nAlign)
+{
+    if (pB->nLen % nAlign)
+        FbPut(pB, NULL, nAlign - (pB->nLen % nAlign));
+
+    return pB->nLen;
+}
+
+// Point the offset field at nAt to nTarget
+static void FbLink(FbBuf *pB, size_t nAt, size_t nTarget)
+{
+    uint32_t nOff = (uint32_t)(nTarget - nAt);
+
+    if (!pB->bFail)
+        memcpy(pB->pData + nAt, &nOff, sizeof(nOff));
+
+    return;
+}
+
+//
+// Vtable then table - fields largest first so each is naturally aligned
+//
+static size_t FbTable(FbBuf *pB, FbSlot *pSlot, int nSlots)
+{
+    uint16_t nVt[2 + MAX_SLOTS];
+    unsigned char xTable[4 + (MAX_SLOTS * 8)];
+    size_t nVtPos, nTable, nOff = 4;
+    int32_t nSoff;
+    int k, nSize;
+
+    memset(nVt, 0, sizeof(nVt));
+    memset(xTable, 0, sizeof(xTable));
+    for (nSize = 8; nSize > 0; nSize /= 2)
+    {
+        for (k = 0; k < nSlots; k++)
+        {
+            if (pSlot[k].nSize != nSize)
+                continue;
+            nOff = (nOff + nSize - 1) & ~(size_t)(nSize - 1);
+            nVt[2 + k] = (uint16_t)nOff;
+            memcpy(xTable + nOff, &pSlot[k].nVal, nSize);
+            nOff += nSize;
+        }
+    }
+    nVt[0] = (uint16_t)(4 + (2 * nSlots));
+    nVt[1] = (uint16_t)nOff;
+
+    FbAlign(pB, 2);
+    nVtPos = FbPut(pB, nVt, nVt[0]);
+    nTable = FbAlign(pB, 8);
+    nSoff = (int32_t)(nTable - nVtPos);
+    memcpy(xTable, &nSoff, sizeof(nSoff));
+    FbPut(pB, xTable, nOff);
+
+    for (k = 0; k < nSlots; k++)
+        pSlot[k].nPos = nTable + nVt[2 + k];
+
+    return nTable;
+}
+
+// Vector of nCount elements (pData NULL := zeros, e.g. offsets to fill in)
+static size_t FbVector(FbBuf *pB, const void *pData, int nCount, size_t nElem, size_t nAlign)
+{
+    uint32_t nLen = (uint32_t)nCount;
+    size_t nPos;
+
+    FbAlign(pB, 4);
+    while ((pB->nLen + 4) % nAlign)
+        FbPut(pB, NULL, 4);
+    nPos = FbPut(pB, &nLen, sizeof(nLen));
+    FbPut(pB, pData, nCount * nElem);
+
+    return nPos;
+}
+
+static size_t FbString(FbBuf *pB, const char *sStr)
+{
+    size_t nPos = FbVector(pB, sStr, strlen(sStr), 1, 4);
+
+    FbPut(pB, NULL, 1);
+    return nPos;
+}
+
+static void FbSet(FbSlot *pSlot, int nSize, int64_t nVal)
+{
+    pSlot->nSize = nSize;
+    pSlot->nVal = nVal;
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Messages
+
+// Message table, returns offset field of its header
+static size_t BeginMessage(FbBuf *pB, int nHeader, int64_t nBodyLen)
+{
+    FbSlot xMsg[4];
+    size_t nRoot;
+
+    memset(xMsg, 0, sizeof(xMsg));
+    FbSet(&xMsg[0], 2, METADATA_V5);
+    FbSet(&xMsg[1], 1, nHeader);
+    FbSet(&xMsg[2], 4, 0);
+    FbSet(&xMsg[3], 8, nBodyLen);
+
+    nRoot = FbPut(pB, NULL, 4);
+    FbLink(pB, nRoot, FbTable(pB, xMsg, 4));
+
+    return xMsg[2].nPos;
+}
+
+// Int table
+static size_t IntType(FbBuf *pB, int nBits)
+{
+    FbSlot xInt[2];
+
+    memset(xInt, 0, sizeof(xInt));
+    FbSet(&xInt[0], 4, nBits);
+    FbSet(&xInt[1], 1, 1);
+
+    return FbTable(pB, xInt, 2);
+}
+
+static size_t ColumnField(FbBuf *pB, const ArrCol *pCol)
+{
+    static const int nTypeType[] = { TT_TIMESTAMP, TT_INT, TT_INT, TT_FLOAT, TT_UTF8 };
+    FbSlot xField[6], xType[2], xDict[2];
+    size_t nTable;
+
+    memset(xField, 0, sizeof(xField));
+    FbSet(&xField[0], 4, 0);                // name
+    FbSet(&xField[2], 1, nTypeType[pCol->nType]);
+    FbSet(&xField[3], 4, 0);                // type
+    if (pCol->nType == COL_DIR)
+        FbSet(&xField[4], 4, 0);            // dictionary
+    FbSet(&xField[5], 4, 0);                // children (none)
+    nTable = FbTable(pB, xField, 6);
+
+    FbLink(pB, xField[0].nPos, FbString(pB, pCol->sName));
+
+    memset(xType, 0, sizeof(xType));
+    switch (pCol->nType)
+    {
+        case COL_TIME:
+            FbSet(&xType[0], 2, 0);         // SECOND
+            FbSet(&xType[1], 4, 0);         // timezone
+            FbLink(pB, xField[3].nPos, FbTable(pB, xType, 2));
+            FbLink(pB, xType[1].nPos, FbString(pB, "UTC"));
+            break;
+        case COL_I16:
+        case COL_I32:
+            FbLink(pB, xField[3].nPos, IntType(pB, nColWidth[pCol->nType] * 8));
+            break;
+        case COL_F64:
+            FbSet(&xType[0], 2, PRECISION_DOUBLE);
+            FbLink(pB, xField[3].nPos, FbTable(pB, xType, 1));
+            break;
+        case COL_DIR:
+            FbLink(pB, xField[3].nPos, FbTable(pB, xType, 0));
+            memset(xDict, 0, sizeof(xDict));
+            FbSet(&xDict[0], 8, DIR_ID);
+            FbSet(&xDict[1], 4, 0);         // indexType
+            FbLink(pB, xField[4].nPos, FbTable(pB, xDict, 2));
+            FbLink(pB, xDict[1].nPos, IntType(pB, 8));
+            break;
+    }
+
+    FbLink(pB, xField[5].nPos, FbVector(pB, NULL, 0, 4, 4));
+
+    return nTable;
+}
+
+//
+// Frame and write a message and its body
+//
+static int WriteMessage(ArrCtx *pC, FbBuf *pB, const ArrBuf *pBufs, int nBufs)
+{
+    uint32_t nHead[2];
+    int k;
+
+    FbAlign(pB, 8);
+    if (pB->bFail)
+    {
+        printf("Arrow export: out of memory\n");
+        pC->bFail = TRUE;
+        return -1;
+    }
+
+    nHead[0] = 0xFFFFFFFF;
+    nHead[1] = (uint32_t)pB->nLen;
+    if ((fwrite(nHead, sizeof(nHead), 1, pC->fOut) != 1) ||
+        (fwrite(pB->pData, pB->nLen, 1, pC->fOut) != 1))
+        pC->bFail = TRUE;
+
+    for (k = 0; (k < nBufs) && !pC->bFail; k++)
+    {
+        if ((pBufs[k].nLen > 0) && (fwrite(pBufs[k].pData, pBufs[k].nLen, 1, pC->fOut) != 1))
+            pC->bFail = TRUE;
+        if ((pBufs[k].nLen % 8) && (fwrite(xZero, 8 - (pBufs[k].nLen % 8), 1, pC->fOut) != 1))
+            pC->bFail = TRUE;
+    }
+
+    if (pC->bFail)
+    {
+        printf("Arrow export write failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int WriteSchema(ArrCtx *pC)
+{
+    FbBuf xB;
+    FbSlot xSchema[2];
+    size_t nHeader, nFields;
+    int k, rc;
+
+    memset(&xB, 0, sizeof(xB));
+    nHeader = BeginMessage(&xB, MH_SCHEMA, 0);
+
+    memset(xSchema, 0, sizeof(xSchema));
+    FbSet(&xSchema[1], 4, 0);               // fields (endianness defaults to little)
+    FbLink(&xB, nHeader, FbTable(&xB, xSchema, 2));
+
+    nFields = FbVector(&xB, NULL, pC->nCols, 4, 4);
+    FbLink(&xB, xSchema[1].nPos, nFields);
+    for (k = 0; k < pC->nCols; k++)
+        FbLink(&xB, nFields + 4 + (k * 4), ColumnField(&xB, &pC->pCols[k]));
+
+    rc = WriteMessage(pC, &xB, NULL, 0);
+    free(xB.pData);
+
+    return rc;
+}
+
+//
+// RecordBatch - one node per column, buffers packed in order each
+// padded to 8 (bDict := as the dictionary's data)
+//
+static int WriteBatch(ArrCtx *pC, int bDict, int nRows, int nNodes, const ArrBuf *pBufs, int nBufs)
+{
+    FbBuf xB;
+    FbSlot xBatch[3], xDict[2];
+    int64_t xNodes[MAX_COLS][2], xBufs[MAX_BUFFERS][2], nBody = 0;
+    size_t nHeader;
+    int k, rc;
+
+    for (k = 0; k < nNodes; k++)
+    {
+        xNodes[k][0] = nRows;
+        xNodes[k][1] = 0;                   // No nulls
+    }
+    for (k = 0; k < nBufs; k++)
+    {
+        xBufs[k][0] = nBody;
+        xBufs[k][1] = pBufs[k].nLen;
+        nBody += (pBufs[k].nLen + 7) & ~7;
+    }
+
+    memset(&xB, 0, sizeof(xB));
+    nHeader = BeginMessage(&xB, bDict ? MH_DICTIONARY : MH_RECORDBATCH, nBody);
+
+    if (bDict)
+    {
+        memset(xDict, 0, sizeof(xDict));
+        FbSet(&xDict[0], 8, DIR_ID);
+        FbSet(&xDict[1], 4, 0);             // data
+        FbLink(&xB, nHeader, FbTable(&xB, xDict, 2));
+        nHeader = xDict[1].nPos;
+    }
+
+    memset(xBatch, 0, sizeof(xBatch));
+    FbSet(&xBatch[0], 8, nRows);
+    FbSet(&xBatch[1], 4, 0);
+    FbSet(&xBatch[2], 4, 0);
+    FbLink(&xB, nHeader, FbTable(&xB, xBatch, 3));
+    FbLink(&xB, xBatch[1].nPos, FbVector(&xB, xNodes, nNodes, 16, 8));
+    FbLink(&xB, xBatch[2].nPos, FbVector(&xB, xBufs, nBufs, 16, 8));
+
+    rc = WriteMessage(pC, &xB, pBufs, nBufs);
+    free(xB.pData);
+
+    return rc;
+}
+
+// Utf8 array of the direction names
+static int WriteDictionary(ArrCtx *pC)
+{
+    int32_t nOffsets[DIR_COUNT + 1];
+    char sNames[DIR_COUNT * 4];
+    ArrBuf xBufs[3];
+    int k;
+
+    nOffsets[0] = 0;
+    for (k = 0; k < DIR_COUNT; k++)
+    {
+        memcpy(sNames + nOffsets[k], sWinDir[k], strlen(sWinDir[k]));
+        nOffsets[k + 1] = nOffsets[k] + strlen(sWinDir[k]);
+    }
+
+    xBufs[0].pData = NULL;                  // Validity (none)
+    xBufs[0].nLen = 0;
+    xBufs[1].pData = nOffsets;
+    xBufs[1].nLen = sizeof(nOffsets);
+    xBufs[2].pData = sNames;
+    xBufs[2].nLen = nOffsets[DIR_COUNT];
+
+    return WriteBatch(pC, TRUE, DIR_COUNT, 1, xBufs, 3);
+}
+
+static int FlushRows(ArrCtx *pC)
+{
+    ArrBuf xBufs[MAX_BUFFERS];
+    int k;
+
+    if (pC->nRows == 0)
+        return 0;
+
+    for (k = 0; k < pC->nCols; k++)
+    {
+        xBufs[k * 2].pData = NULL;
+        xBufs[k * 2].nLen = 0;
+        xBufs[(k * 2) + 1].pData = pC->pCol[k];
+        xBufs[(k * 2) + 1].nLen = (int64_t)pC->nRows * nColWidth[pC->pCols[k].nType];
+    }
+
+    k = WriteBatch(pC, FALSE, pC->nRows, pC->nCols, xBufs, pC->nCols * 2);
+    pC->nTotal += pC->nRows;
+    pC->nRows = 0;
+
+    return k;
+}
+
+//-------------------------------------------------------------------------------
+// Rows
+
+static void PutInt(ArrCtx *pC, int nCol, int64_t nVal)
+{
+    unsigned char *p = pC->pCol[nCol] + (pC->nRows * nColWidth[pC->pCols[nCol].nType]);
+    int16_t n16 = (int16_t)nVal;
+    int32_t n32 = (int32_t)nVal;
+    int8_t n8 = (int8_t)nVal;
+
+    switch (pC->pCols[nCol].nType)
+    {
+        case COL_TIME:
+            memcpy(p, &nVal, 8);
+            break;
+        case COL_I16:
+            memcpy(p, &n16, 2);
+            break;
+        case COL_I32:
+            memcpy(p, &n32, 4);
+            break;
+        case COL_DIR:
+            memcpy(p, &n8, 1);
+            break;
+    }
+
+    return;
+}
+
+static void PutReal(ArrCtx *pC, int nCol, double fVal)
+{
+    memcpy(pC->pCol[nCol] + (pC->nRows * 8), &fVal, 8);
+
+    return;
+}
+
+// Non-zero := stop
+static int EndRow(ArrCtx *pC)
+{
+    if (++pC->nRows == WXARROW_BATCH)
+        FlushRows(pC);
+
+    return pC->bFail;
+}
+
+static int RawPoint(const WxqPoint *pPt, void *pCtx)
+{
+    ArrCtx *pC = (ArrCtx *)pCtx;
+
+    PutInt(pC, 0, pPt->ttTime);
+    PutInt(pC, 1, pPt->xS.nIndoor);
+    PutInt(pC, 2, pPt->xS.nOutdoor);
+    PutInt(pC, 3, pPt->xS.nWind);
+    PutInt(pC, 4, pPt->xS.nDir & 0x0F);
+    PutReal(pC, 5, pPt->xS.nPressure / 100.0);
+
+    return EndRow(pC);
+}
+
+static int RollRow(const WxRollup *pRow, void *pCtx)
+{
+    ArrCtx *pC = (ArrCtx *)pCtx;
+    int k, nCol, nDir, nSpeed;
+    double fScale;
+
+    PutInt(pC, 0, pRow->ttStart);
+    PutInt(pC, 1, pRow->nCount);
+    for (k = 0, nCol = 2; k < WXR_FIELDS; k++, nCol += 3)
+    {
+        fScale = (k == WXQ_PRESSURE) ? 100.0 : 1.0;
+        if (k == WXQ_PRESSURE)
+        {
+            PutReal(pC, nCol, pRow->xStat[k].nMin / fScale);
+            PutReal(pC, nCol + 1, pRow->xStat[k].nMax / fScale);
+        }
+        else
+        {
+            PutInt(pC, nCol, pRow->xStat[k].nMin);
+            PutInt(pC, nCol + 1, pRow->xStat[k].nMax);
+        }
+        PutReal(pC, nCol + 2, (double)pRow->xStat[k].nSum / pRow->nCount / fScale);
+    }
+    nDir = WxRollWind(pRow, &nSpeed);
+    PutInt(pC, nCol, nDir);
+    PutInt(pC, nCol + 1, nSpeed);
+
+    return EndRow(pC);
+}
+
+//-------------------------------------------------------------------------------
+// Export
+
+// Start of the hour, day or month holding ttTime
+static time_t BucketStart(int nLevel, time_t ttTime)
+{
+    struct tm tmTime;
+    int nDate = WxqDateOf(ttTime);
+
+    switch (nLevel)
+    {
+    case WXR_HOUR:
+        vc_localtime(&ttTime, &tmTime);
+        return WxqDateTime(nDate, tmTime.tm_hour * 60);
+    case WXR_DAY:
+        return WxqDateTime(nDate, 0);
+    default:
+        return WxqDateTime(((nDate / 100) * 100) + 1, 0);
+    }
+}
+
+long WxArrowWrite(time_t ttFrom, time_t ttTo, int nLevel, FILE *fOut)
+{
+    ArrCtx xC;
+    uint32_t nEnd[2] = { 0xFFFFFFFF, 0 };
+    long rc;
+    int k;
+
+    memset(&xC, 0, sizeof(xC));
+    xC.fOut = fOut;
+    xC.pCols = (nLevel == WXARROW_RAW) ? xRawCols : xRollCols;
+    xC.nCols = (nLevel == WXARROW_RAW) ? (int)(sizeof(xRawCols) / sizeof(ArrCol))
+                                       : (int)(sizeof(xRollCols) / sizeof(ArrCol));
+    for (k = 0; k < xC.nCols; k++)
+    {
+        xC.pCol[k] = malloc(WXARROW_BATCH * nColWidth[xC.pCols[k].nType]);
+        if (xC.pCol[k] == NULL)
+        {
+            printf("Arrow export: out of memory\n");
+            xC.bFail = TRUE;
+        }
+    }
+
+    if (!xC.bFail && (WriteSchema(&xC) == 0) && (WriteDictionary(&xC) == 0))
+    {
+        if (nLevel == WXARROW_RAW)
+            rc = WxqScan(ttFrom, ttTo, RawPoint, &xC);
+        else
+            // Whole rows for every bucket the range touches - the
+            // leading one too, not just those starting in it
+            rc = WxRollRead(nLevel, BucketStart(nLevel, ttFrom), ttTo, RollRow, &xC);
+        if (rc < 0)
+            xC.bFail = TRUE;
+        if ((FlushRows(&xC) == 0) && (fwrite(nEnd, sizeof(nEnd), 1, fOut) != 1))
+            xC.bFail = TRUE;
+    }
+
+    for (k = 0; k < xC.nCols; k++)
+        free(xC.pCol[k]);
+
+    return xC.bFail ? -1 : xC.nTotal;
+}
+
+static int ParseLevel(const char *sLevel)
+{
+    if (strcmp(sLevel, "raw") == 0)
+        return WXARROW_RAW;
+    if (strcmp(sLevel, "hour") == 0)
+        return WXR_HOUR;
+    if (strcmp(sLevel, "day") == 0)
+        return WXR_DAY;
+    if (strcmp(sLevel, "month") == 0)
+        return WXR_MONTH;
+
+    return -2;
+}
+
+//
+// export/<from>/<to>[/<level>].arrows - dates as for -Q. The stream goes
+// to an unlinked temp file so the server has its length up front and
+// memory stays at one batch.
+//
+FILE *WxArrowOpenUri(const char *sUri)
+{
+    char sFrom[24], sTo[24], sLevel[16];
+    time_t ttFrom, ttTo;
+    FILE *fOut;
+    int n, nLevel;
+
+    if (sWLogPath == NULL)
+        return NULL;
+
+    strcpy(sLevel, "raw");
+    n = sscanf(sUri, "export/%23[^/]/%23[^/.]%*[/]%15[^.]", sFrom, sTo, sLevel);
+    if ((n < 2) || (strcmp(sUri + strlen(sUri) - strlen(WXARROW_EXT), WXARROW_EXT) != 0))
+        return NULL;
+
+    nLevel = ParseLevel(sLevel);
+    if ((nLevel < WXARROW_RAW) || (WxqParseWhen(sFrom, &ttFrom, FALSE) != 0) ||
+        (WxqParseWhen(sTo, &ttTo, TRUE) != 0))
+        return NULL;
+
+    fOut = tmpfile();
+    if (fOut == NULL)
+        return NULL;
+
+    if (WxArrowWrite(ttFrom, ttTo, nLevel, fOut) < 0)
+    {
+        fclose(fOut);
+        return NULL;
+    }
+    rewind(fOut);
+
+    return fOut;
+}
+
+//
+// -a from,to,raw|hour|day|month,file
+//
+int WxArrowCli(const char *sSpec)
+{
+    char sFrom[24], sTo[24], sLevel[16], sFile[PATH_MAX];
+    time_t ttFrom, ttTo;
+    FILE *fOut;
+    long nRows;
+    int nLevel;
+
+    if ((sscanf(sSpec, "%23[^,],%23[^,],%15[^,],%4095s", sFrom, sTo, sLevel, sFile) != 4) ||
+        ((nLevel = ParseLevel(sLevel)) < WXARROW_RAW) ||
+        (WxqParseWhen(sFrom, &ttFrom, FALSE) != 0) || (WxqParseWhen(sTo, &ttTo, TRUE) != 0))
+    {
+        printf("Bad export: %s\n", sSpec);
+        return -1;
+    }
+
+    fOut = fopen(sFile, "wb");
+    if (fOut == NULL)
+    {
+        printf("Cannot create %s\n", sFile);
+        return -1;
+    }
+
+    nRows = WxArrowWrite(ttFrom, ttTo, nLevel, fOut);
+    if (fclose(fOut) != 0)
+        nRows = -1;
+    if (nRows < 0)
+    {
+        unlink(sFile);
+        return -1;
+    }
+
+    printf("Exported %ld rows to %s\n", nRows, sFile);
+    return 0;
+}
@@ -0,0 +1,38 @@
+// wxarrow.h
+//
+// Weather history as an Apache Arrow IPC stream - raw readings or
+// hour/day/month rollups for a date range, written a record batch at
+// a time
+//
+// Raw:     time (timestamp[s, UTC]), indoor, outdoor, wind (int16, F/mph),
+//          wind_dir (dictionary<int8, utf8>), pressure (float64, inHg)
+// Rollup:  start, count (int32), <field>_min, <field>_max, <field>_avg
+//          per field (pressure and averages float64), wind_dir (prevailing),
+//          wind_vec (int16, resultant mph) - a whole row for each bucket
+//          the range touches, partial first and last ones included
+//
+
+#ifndef WXARROW_H_INCLUDED
+#define WXARROW_H_INCLUDED
+
+#include <stdio.h>
+#include <time.h>
+
+// Level (else WXR_HOUR, WXR_DAY, WXR_MONTH)
+#define WXARROW_RAW         (-1)
+
+// Rows per record batch
+#define WXARROW_BATCH       4096
+
+#define WXARROW_EXT         ".arrows"
+
+// Write [ttFrom, ttTo) to fOut, returns rows written or -1
+extern long WxArrowWrite(time_t ttFrom, time_t ttTo, int nLevel, FILE *fOut);
+
+// Web: export/<from>/<to>[/<level>].arrows - stream in a temp file (NULL := not ours)
+extern FILE *WxArrowOpenUri(const char *sUri);
+
+// CLI: -a from,to,raw|hour|day|month,file
+extern int WxArrowCli(const char *sSpec);
+
+#endif // WXARROW_H_INCLUDED
@@ -0,0 +1,612 @@
+// wxbin.c - Binary daily weather log
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "id4-pi.h"
+#include "wxpipe.h"
+#include "wxbin.h"
+
+//
+// Record n of a .wxb file is at WXB_HEAD_SIZE + 16n, so any record is
+// one seek away and the hour index in the header gives the first record
+// of each hour. Records carry what the CSV line was made from; min/max
+// and message text ride in continuation records after their main record.
+// WxbToCsv formats with the same routines as the CSV log, so its output
+// matches the CSV byte for byte.
+//
+// Host byte order - the files are read where they are written.
+//
+
+// Group buffer (records)
+#define WXB_BUF_RECS    256
+
+static int fdWxb = -1;
+static WxbHeader xWxbHead;
+static int bHeadDirty;
+static long nWxbRecs;               // Records in file (incl. buffered)
+static WxbRecord xWxbBuf[WXB_BUF_RECS];
+static int nWxbBuf;
+static int bWxbUnsynced;
+
+// Continuation records needed for nLen payload bytes
+#define WXB_EXT_RECS(n) (((n) + WXB_EXT_DATA - 1) / WXB_EXT_DATA)
+
+//
+// Index hours the header missed. The header only goes out at a sync,
+// so records after it can start hours it does not list yet.
+//
+static void WxbFillIndex(WxbHeader *pHead, const WxbRecord *pRec, long nRec)
+{
+    int nHour;
+
+    if ((pRec->nFlags & WXB_F_EXT) || (pRec->nTime < 0) || (pRec->nTime >= 1440))
+        return;
+
+    nHour = pRec->nTime / 60;
+    if (pHead->nIndex[nHour] == WXB_NO_INDEX)
+        pHead->nIndex[nHour] = (uint32_t)nRec;
+
+    return;
+}
+
+//
+// Cut a torn tail back to the last complete record (group), indexing
+// the hours it holds
+//
+static long WxbRepair(int fd, off_t nSize)
+{
+    WxbRecord xRec;
+    off_t nKeep;
+    long nRecs, nGood, n;
+
+    nRecs = (nSize - WXB_HEAD_SIZE) / sizeof(WxbRecord);
+    nGood = 0;
+    for (n = 0; n < nRecs; )
+    {
+        if (pread(fd, &xRec, sizeof(xRec), WXB_HEAD_SIZE + (n * sizeof(xRec))) != sizeof(xRec))
+            break;
+        if (xRec.nFlags & WXB_F_EXT)
+            break;
+        WxbFillIndex(&xWxbHead, &xRec, n);
+        if (xRec.nFlags & (WXB_F_MINMAX | WXB_F_MESSAGE))
+            n += xRec.nDir;
+        n++;
+        if (n > nRecs)
+            break;
+        nGood = n;
+    }
+
+    nKeep = (off_t)(WXB_HEAD_SIZE + (nGood * sizeof(WxbRecord)));
+    if (nKeep != nSize)
+    {
+        printf("Log recovery: %ld bytes dropped from binary log\n", (long)(nSize - nKeep));
+        if (ftruncate(fd, nKeep) != 0)
+            printf("Log truncate failed: %s\n", strerror(errno));
+    }
+
+    return nGood;
+}
+
+//
+// Open (or create) binary log. Returns 1 if created, 0 if appending
+// to an existing log, -1 on failure.
+//
+int WxbOpen(const char *sPath, time_t ttStamp, int nHeadFlags)
+{
+    struct stat xInfo;
+    int n;
+
+    WxbClose();
+
+    fdWxb = open(sPath, O_RDWR | O_CREAT, 0644);
+    if (fdWxb < 0)
+    {
+        printf("Log open failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    fstat(fdWxb, &xInfo);
+    if ((xInfo.st_size >= WXB_HEAD_SIZE) &&
+        (pread(fdWxb, &xWxbHead, sizeof(xWxbHead), 0) == sizeof(xWxbHead)) &&
+        (xWxbHead.nMagic == WXB_MAGIC) && (xWxbHead.nRecSize == sizeof(WxbRecord)))
+    {
+        nWxbRecs = WxbRepair(fdWxb, xInfo.st_size);
+        bHeadDirty = TRUE;
+        // Forget hours lost with a torn tail
+        for (n = 0; n < 24; n++)
+        {
+            if ((xWxbHead.nIndex[n] != WXB_NO_INDEX) && (xWxbHead.nIndex[n] >= nWxbRecs))
+                xWxbHead.nIndex[n] = WXB_NO_INDEX;
+        }
+        return 0;
+    }
+
+    // New (or unusable) - start over
+    memset(&xWxbHead, 0, sizeof(xWxbHead));
+    xWxbHead.nMagic = WXB_MAGIC;
+    xWxbHead.nVersion = WXB_VERSION;
+    xWxbHead.nRecSize = sizeof(WxbRecord);
+    xWxbHead.ttCreated = (int32_t)ttStamp;
+    xWxbHead.nFlags = nHeadFlags;
+    for (n = 0; n < 24; n++)
+        xWxbHead.nIndex[n] = WXB_NO_INDEX;
+
+    // Header first, so a crash leaves a log that can be appended to
+    if ((ftruncate(fdWxb, 0) != 0) ||
+        (pwrite(fdWxb, &xWxbHead, sizeof(xWxbHead), 0) != sizeof(xWxbHead)))
+        printf("Log write failed: %s\n", strerror(errno));
+    nWxbRecs = 0;
+    bHeadDirty = FALSE;
+    bWxbUnsynced = TRUE;
+
+    return 1;
+}
+
+static WxbRecord *WxbNext(void)
+{
+    WxbRecord *pRec;
+
+    if (nWxbBuf >= WXB_BUF_RECS)
+        WxbFlush();
+    if (nWxbBuf >= WXB_BUF_RECS)
+    {
+        // Still failing - make room rather than run over
+        printf("Log buffer full, %d records dropped\n", nWxbBuf);
+        nWxbRecs -= nWxbBuf;
+        nWxbBuf = 0;
+    }
+
+    pRec = &xWxbBuf[nWxbBuf++];
+    memset(pRec, 0, sizeof(*pRec));
+    nWxbRecs++;
+
+    return pRec;
+}
+
+// Index first record of each hour
+static void WxbIndex(int xTime)
+{
+    int nHour;
+
+    if ((xTime < 0) || (xTime >= 1440))
+        return;
+
+    nHour = xTime / 60;
+    if (xWxbHead.nIndex[nHour] == WXB_NO_INDEX)
+    {
+        xWxbHead.nIndex[nHour] = (uint32_t)nWxbRecs;
+        bHeadDirty = TRUE;
+    }
+
+    return;
+}
+
+// Main record plus continuation records for payload
+static void WxbAppendExt(int nFlags, int xTime, time_t ttStamp, const void *pData, size_t nLen)
+{
+    const unsigned char *p = (const unsigned char *)pData;
+    WxbRecord *pRec;
+    size_t nCnt;
+
+    if (fdWxb < 0)
+        return;
+
+    WxbIndex(xTime);
+    pRec = WxbNext();
+    pRec->ttStamp = (int32_t)ttStamp;
+    pRec->nTime = (int16_t)xTime;
+    pRec->nWind = (int16_t)nLen;
+    pRec->nDir = (uint8_t)WXB_EXT_RECS(nLen);
+    pRec->nFlags = (uint8_t)nFlags;
+
+    while (nLen > 0)
+    {
+        nCnt = (nLen > WXB_EXT_DATA) ? WXB_EXT_DATA : nLen;
+        pRec = WxbNext();
+        memcpy(pRec, p, nCnt);
+        pRec->nFlags = WXB_F_EXT;
+        p += nCnt;
+        nLen -= nCnt;
+    }
+
+    return;
+}
+
+void WxbWeather(int xTime, time_t ttStamp, WxWeather *pW)
+{
+    WxbRecord *pRec;
+
+    if (fdWxb < 0)
+        return;
+
+    WxbIndex(xTime);
+    pRec = WxbNext();
+    pRec->ttStamp = (int32_t)ttStamp;
+    pRec->nTime = (int16_t)xTime;
+    pRec->nIndoor = pW->nIndoor;
+    pRec->nOutdoor = pW->nOutdoor;
+    pRec->nWind = pW->nWind;
+    pRec->nPressure = pW->nPressure;
+    pRec->nDir = (uint8_t)pW->nDir;
+    pRec->nFlags = WXB_F_WEATHER;
+
+    return;
+}
+
+void WxbMinMax(time_t ttStamp, WxMinMax *pM)
+{
+    // Logged as 1440 (midnite)
+    WxbAppendExt(WXB_F_MINMAX, 1440, ttStamp, pM, sizeof(*pM));
+
+    return;
+}
+
+void WxbMessage(int xTime, time_t ttStamp, const char *sMsg)
+{
+    WxbAppendExt(WXB_F_MESSAGE, xTime, ttStamp, sMsg, strlen(sMsg));
+
+    return;
+}
+
+//
+// Write buffered records. Returns TRUE if they went, FALSE if there
+// were none, -1 if the write failed (they stay buffered for the next).
+// The header waits for the sync.
+//
+int WxbFlush(void)
+{
+    size_t nLen;
+    off_t nOffset;
+
+    if (fdWxb < 0)
+    {
+        nWxbBuf = 0;
+        return FALSE;
+    }
+
+    if (nWxbBuf == 0)
+        return FALSE;
+
+    nLen = nWxbBuf * sizeof(WxbRecord);
+    nOffset = WXB_HEAD_SIZE + ((nWxbRecs - nWxbBuf) * sizeof(WxbRecord));
+    bWxbUnsynced = TRUE;
+    if (pwrite(fdWxb, xWxbBuf, nLen, nOffset) != (ssize_t)nLen)
+    {
+        printf("Log write failed: %s\n", strerror(errno));
+        return -1;
+    }
+    nWxbBuf = 0;
+
+    return TRUE;
+}
+
+void WxbSync(void)
+{
+    if (fdWxb < 0)
+        return;
+
+    // Header after records - index never points past the data
+    if (bHeadDirty && (nWxbBuf == 0))
+    {
+        if (pwrite(fdWxb, &xWxbHead, sizeof(xWxbHead), 0) != sizeof(xWxbHead))
+            printf("Log write failed: %s\n", strerror(errno));
+        else
+            bHeadDirty = FALSE;
+        bWxbUnsynced = TRUE;
+    }
+
+    if (bWxbUnsynced)
+        fdatasync(fdWxb);
+    bWxbUnsynced = FALSE;
+
+    return;
+}
+
+void WxbClose(void)
+{
+    if (fdWxb >= 0)
+    {
+        WxbFlush();
+        WxbSync();
+        close(fdWxb);
+        fdWxb = -1;
+    }
+
+    return;
+}
+
+//
+// Whole day log in one go (importer) - any thread, written to a temp
+// file and renamed into place. Records are stamped from ttDay (local
+// midnite) and their minutes.
+//
+int WxbWriteDay(const char *sPath, const WxaDay *pDay, time_t ttDay)
+{
+    char sTemp[256];
+    WxbHeader xHead;
+    WxbRecord *pRecs, *pRec;
+    const WxaExtra *pX;
+    const WxSample *pS;
+    const unsigned char *pData;
+    size_t nLen, nCnt;
+    long nRecs = 0;
+    int n, x, fd, nRet = -1;
+
+    // Size it
+    nRecs = pDay->nSamples;
+    for (x = 0; x < pDay->nExtras; x++)
+        nRecs += 1 + WXB_EXT_RECS((pDay->xExtras[x].nKind == WXA_X_MINMAX) ? sizeof(WxMinMax) :
+                                  strlen(pDay->xExtras[x].sMsg));
+    pRecs = (WxbRecord *)calloc(nRecs ? nRecs : 1, sizeof(WxbRecord));
+    if (!pRecs)
+        return -1;
+
+    memset(&xHead, 0, sizeof(xHead));
+    xHead.nMagic = WXB_MAGIC;
+    xHead.nVersion = WXB_VERSION;
+    xHead.nRecSize = sizeof(WxbRecord);
+    xHead.ttCreated = (int32_t)ttDay;
+    xHead.nFlags = (pDay->nHead == WXA_HEAD_WEATHER) ? WXB_H_WEATHER :
+                   (pDay->nHead == WXA_HEAD_NOWEATHER) ? WXB_H_NOWEATHER : 0;
+    for (n = 0; n < 24; n++)
+        xHead.nIndex[n] = WXB_NO_INDEX;
+
+    // Same order as the CSV - extras ahead of the reading they precede
+    pRec = pRecs;
+    for (n = 0, x = 0; n <= pDay->nSamples; n++)
+    {
+        for ( ; (x < pDay->nExtras) && (pDay->xExtras[x].nAt <= n); x++)
+        {
+            pX = &pDay->xExtras[x];
+            if ((pX->nTime >= 0) && (pX->nTime < 1440) && (xHead.nIndex[pX->nTime / 60] == WXB_NO_INDEX))
+                xHead.nIndex[pX->nTime / 60] = (uint32_t)(pRec - pRecs);
+
+            if (pX->nKind == WXA_X_MINMAX)
+            {
+                pData = (const unsigned char *)&pX->xMinMax;
+                nLen = sizeof(pX->xMinMax);
+            }
+            else
+            {
+                pData = (const unsigned char *)pX->sMsg;
+                nLen = strlen(pX->sMsg);
+            }
+            pRec->ttStamp = (int32_t)(ttDay + (pX->nTime * 60));
+            pRec->nTime = pX->nTime;
+            pRec->nWind = (int16_t)nLen;
+            pRec->nDir = (uint8_t)WXB_EXT_RECS(nLen);
+            pRec->nFlags = (pX->nKind == WXA_X_MINMAX) ? WXB_F_MINMAX : WXB_F_MESSAGE;
+            pRec++;
+            for ( ; nLen > 0; nLen -= nCnt, pData += nCnt)
+            {
+                nCnt = (nLen > WXB_EXT_DATA) ? WXB_EXT_DATA : nLen;
+                memcpy(pRec, pData, nCnt);
+                pRec->nFlags = WXB_F_EXT;
+                pRec++;
+            }
+        }
+
+        if (n == pDay->nSamples)
+            break;
+
+        pS = &pDay->xSamples[n];
+        if ((pS->nTime >= 0) && (pS->nTime < 1440) && (xHead.nIndex[pS->nTime / 60] == WXB_NO_INDEX))
+            xHead.nIndex[pS->nTime / 60] = (uint32_t)(pRec - pRecs);
+        pRec->ttStamp = (int32_t)(ttDay + (pS->nTime * 60));
+        pRec->nTime = pS->nTime;
+        pRec->nIndoor = pS->nIndoor;
+        pRec->nOutdoor = pS->nOutdoor;
+        pRec->nWind = pS->nWind;
+        pRec->nPressure = pS->nPressure;
+        pRec->nDir = (uint8_t)(pS->nDir & 0x0F);
+        pRec->nFlags = WXB_F_WEATHER;
+        pRec++;
+    }
+
+    snprintf(sTemp, sizeof(sTemp), "%s.tmp", sPath);
+    fd = open(sTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        nLen = nRecs * sizeof(WxbRecord);
+        if ((pwrite(fd, &xHead, sizeof(xHead), 0) == sizeof(xHead)) &&
+            (pwrite(fd, pRecs, nLen, WXB_HEAD_SIZE) == (ssize_t)nLen) && (fdatasync(fd) == 0))
+            nRet = 0;
+        close(fd);
+        if ((nRet == 0) && (rename(sTemp, sPath) != 0))
+            nRet = -1;
+    }
+    if (nRet != 0)
+    {
+        printf("Log write failed: %s: %s\n", sPath, strerror(errno));
+        unlink(sTemp);
+    }
+    free(pRecs);
+
+    return nRet;
+}
+
+//-------------------------------------------------------------------------------
+
+//
+// Read whole log (a day is a few KB)
+//
+int WxbLoad(const char *sPath, WxbFile *pFile)
+{
+    struct stat xInfo;
+    size_t nLen;
+    long n;
+    int fd;
+
+    memset(pFile, 0, sizeof(*pFile));
+
+    fd = open(sPath, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if ((fstat(fd, &xInfo) != 0) || (xInfo.st_size < WXB_HEAD_SIZE) ||
+        (read(fd, &pFile->xHead, sizeof(pFile->xHead)) != sizeof(pFile->xHead)) ||
+        (pFile->xHead.nMagic != WXB_MAGIC) || (pFile->xHead.nRecSize != sizeof(WxbRecord)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    pFile->nRecs = (xInfo.st_size - WXB_HEAD_SIZE) / sizeof(WxbRecord);
+    nLen = pFile->nRecs * sizeof(WxbRecord);
+    if (nLen > 0)
+    {
+        pFile->pRecs = (WxbRecord *)malloc(nLen);
+        if (!pFile->pRecs ||
+            (pread(fd, pFile->pRecs, nLen, WXB_HEAD_SIZE) != (ssize_t)nLen))
+        {
+            close(fd);
+            WxbFree(pFile);
+            return -1;
+        }
+    }
+    close(fd);
+
+    for (n = 0; n < pFile->nRecs; n++)
+        WxbFillIndex(&pFile->xHead, &pFile->pRecs[n], n);
+
+    return 0;
+}
+
+void WxbFree(WxbFile *pFile)
+{
+    free(pFile->pRecs);
+    pFile->pRecs = NULL;
+    pFile->nRecs = 0;
+
+    return;
+}
+
+//
+// First record logged at or after nHour (nRecs if none)
+//
+long WxbHourStart(const WxbFile *pFile, int nHour)
+{
+    if (nHour < 0)
+        nHour = 0;
+
+    for ( ; nHour < 24; nHour++)
+    {
+        if ((pFile->xHead.nIndex[nHour] != WXB_NO_INDEX) &&
+            (pFile->xHead.nIndex[nHour] < pFile->nRecs))
+            return pFile->xHead.nIndex[nHour];
+    }
+
+    return pFile->nRecs;
+}
+
+//
+// Gather payload of MINMAX/MESSAGE record nRec. Returns length or -1.
+//
+int WxbPayload(const WxbFile *pFile, long nRec, void *pBuf, size_t nSize)
+{
+    const WxbRecord *pRec = &pFile->pRecs[nRec];
+    unsigned char *p = (unsigned char *)pBuf;
+    size_t nLen, nCnt;
+    int n;
+
+    nLen = (size_t)pRec->nWind;
+    if ((nLen > nSize) || ((nRec + pRec->nDir) >= pFile->nRecs) ||
+        (pRec->nDir != WXB_EXT_RECS(nLen)))
+        return -1;
+
+    for (n = 1; nLen > 0; n++)
+    {
+        nCnt = (nLen > WXB_EXT_DATA) ? WXB_EXT_DATA : nLen;
+        memcpy(p, &pRec[n], nCnt);
+        p += nCnt;
+        nLen -= nCnt;
+    }
+
+    return pRec->nWind;
+}
+
+//
+// Rebuild the CSV log
+//
+int WxbToCsv(const char *sPath, FILE *fOut)
+{
+    WxbFile xFile;
+    WxbRecord *pRec;
+    WxWeather xWeather;
+    WxMinMax xMinMax;
+    char sMsg[WX_MSG_SIZE + 1];
+    char sLine[128];
+    long n;
+    int nLen;
+
+    if (WxbLoad(sPath, &xFile) != 0)
+    {
+        printf("Not a binary weather log: %s\n", sPath);
+        return -1;
+    }
+
+    if (xFile.xHead.nFlags & WXB_H_WEATHER)
+        fputs(WEATHER_LOG_HEADER1, fOut);
+    else if (xFile.xHead.nFlags & WXB_H_NOWEATHER)
+        fputs(NOWEATHER_LOG_HEADER, fOut);
+
+    for (n = 0; n < xFile.nRecs; n++)
+    {
+        pRec = &xFile.pRecs[n];
+        nLen = 0;
+
+        if (pRec->nFlags & WXB_F_WEATHER)
+        {
+            xWeather.nIndoor = pRec->nIndoor;
+            xWeather.nOutdoor = pRec->nOutdoor;
+            xWeather.nWind = pRec->nWind;
+            xWeather.nDir = pRec->nDir;
+            xWeather.nPressure = pRec->nPressure;
+            nLen = WxFormatWeather(sLine, pRec->nTime, &xWeather);
+        }
+        else if (pRec->nFlags & WXB_F_MINMAX)
+        {
+            if (WxbPayload(&xFile, n, &xMinMax, sizeof(xMinMax)) == sizeof(xMinMax))
+            {
+                fputs(WEATHER_LOG_HEADER2, fOut);
+                nLen = WxFormatMinMax(sLine, &xMinMax);
+            }
+        }
+        else if (pRec->nFlags & WXB_F_MESSAGE)
+        {
+            nLen = WxbPayload(&xFile, n, sMsg, sizeof(sMsg) - 1);
+            if (nLen >= 0)
+            {
+                sMsg[nLen] = '\0';
+                nLen = WxFormatMessage(sLine, pRec->nTime, sMsg);
+            }
+            else
+                nLen = 0;
+        }
+
+        if (nLen > 0)
+            fwrite(sLine, 1, nLen, fOut);
+    }
+
+    WxbFree(&xFile);
+
+    return ferror(fOut) ? -1 : 0;
+}
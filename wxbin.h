@@ -0,0 +1,98 @@
+// wxbin.h
+//
+// Binary daily weather log (.wxb) - fixed size records behind a small
+// header with an hour index, convertible back to the CSV log
+//
+
+#ifndef WXBIN_H_INCLUDED
+#define WXBIN_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wxpipe.h"
+#include "wxarch.h"
+
+// Binary log sits next to the CSV log: <Mmmyy>/<dd>.wxb
+#define WXB_EXT             ".wxb"
+
+#define WXB_MAGIC           0x31425857      // "WXB1"
+#define WXB_VERSION         1
+#define WXB_HEAD_SIZE       128
+#define WXB_NO_INDEX        0xFFFFFFFF
+
+// Header flags - how the CSV log began
+#define WXB_H_WEATHER       0x0001          // WEATHER_LOG_HEADER1
+#define WXB_H_NOWEATHER     0x0002          // NOWEATHER_LOG_HEADER
+
+// Record flags
+#define WXB_F_WEATHER       0x01            // Current readings
+#define WXB_F_MINMAX        0x02            // 24hr min/max (payload follows)
+#define WXB_F_MESSAGE       0x04            // Log message (payload follows)
+#define WXB_F_EXT           0x80            // Payload continuation
+
+// Payload bytes carried per continuation record
+#define WXB_EXT_DATA        15
+
+//
+// File header (WXB_HEAD_SIZE bytes)
+//
+typedef struct _WxbHeader
+{
+    uint32_t    nMagic;
+    uint16_t    nVersion;
+    uint16_t    nRecSize;
+    int32_t     ttCreated;          // System time log was started
+    uint16_t    nFlags;             // WXB_H_xxx
+    uint16_t    nReserved;
+    uint32_t    nIndex[24];         // First record logged in each hour
+    uint32_t    nSpare[4];
+} WxbHeader;
+
+//
+// Log record (16 bytes). MINMAX and MESSAGE records are followed by
+// nDir continuation records holding nWind bytes of payload.
+//
+typedef struct _WxbRecord
+{
+    int32_t     ttStamp;            // System time when acquired
+    int16_t     nTime;              // Minutes past midnite (as logged)
+    int16_t     nIndoor;
+    int16_t     nOutdoor;
+    int16_t     nWind;
+    int16_t     nPressure;
+    uint8_t     nDir;
+    uint8_t     nFlags;             // WXB_F_xxx (always last byte)
+} WxbRecord;
+
+//
+// Loaded log
+//
+typedef struct _WxbFile
+{
+    WxbHeader   xHead;
+    WxbRecord   *pRecs;
+    long        nRecs;
+} WxbFile;
+
+// Writer (persistence stage)
+extern int WxbOpen(const char *sPath, time_t ttStamp, int nHeadFlags);
+extern void WxbWeather(int xTime, time_t ttStamp, WxWeather *pW);
+extern void WxbMinMax(time_t ttStamp, WxMinMax *pM);
+extern void WxbMessage(int xTime, time_t ttStamp, const char *sMsg);
+extern int WxbFlush(void);
+extern void WxbSync(void);
+extern void WxbClose(void);
+
+// Whole day (importer, any thread)
+extern int WxbWriteDay(const char *sPath, const WxaDay *pDay, time_t ttDay);
+
+// Reader
+extern int WxbLoad(const char *sPath, WxbFile *pFile);
+extern void WxbFree(WxbFile *pFile);
+extern long WxbHourStart(const WxbFile *pFile, int nHour);
+extern int WxbPayload(const WxbFile *pFile, long nRec, void *pBuf, size_t nSize);
+extern int WxbToCsv(const char *sPath, FILE *fOut);
+
+#endif // WXBIN_H_INCLUDED
@@ -0,0 +1,413 @@
+// wxchart.c - Downsampled chart series (LTTB with envelopes)
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxquery.h"
+#include "wxroll.h"
+#include "wxchart.h"
+
+//
+// A series is built from the finest source with no more than
+// WXC_MAX_INPUT points in the range - the readings, else hour, day or
+// month rollups (mean, with the period's low and high) - so the work
+// and the answer are the same size however long the range. Largest
+// triangle three buckets then keeps the point of each bucket that best
+// holds the line's shape, and the bucket's low/high goes with it so
+// spikes LTTB passes over still show.
+//
+// Requests repeat (page reloads, several clients), so finished series
+// are kept by field, range and width. One whose range runs past the
+// time it was built is only good for WXC_LIVE_SECS.
+//
+
+static const char * const sField[WXQ_FIELDS] = { "Indoor", "Outdoor", "Wind", "Pressure" };
+
+typedef struct _WxcEntry
+{
+    int         nField;
+    time_t      ttFrom, ttTo;
+    int         nWidth;
+    time_t      ttMade;
+    unsigned long nUsed;
+    int         nPoints;            // 0 := free
+    WxcPoint    *pPoints;
+} WxcEntry;
+
+static WxcEntry xCache[WXC_CACHE_SIZE];
+static unsigned long nCacheUse;
+static pthread_mutex_t chart_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int WxcField(const char *sName)
+{
+    int k;
+
+    for (k = 0; k < WXQ_FIELDS; k++)
+    {
+        if (strcasecmp(sName, sField[k]) == 0)
+            return k;
+    }
+
+    return -1;
+}
+
+//-------------------------------------------------------------------------------
+// Source points
+
+typedef struct _WxcInput
+{
+    int         nField;
+    int         nPoints;
+    WxcPoint    xPoints[WXC_MAX_INPUT];
+} WxcInput;
+
+static int TakeReading(const WxqPoint *pPt, void *pCtx)
+{
+    WxcInput *pIn = (WxcInput *)pCtx;
+    WxcPoint *pP;
+    short nVal;
+
+    // One too many - range is for the rollups
+    if (pIn->nPoints == WXC_MAX_INPUT)
+    {
+        pIn->nPoints++;
+        return 1;
+    }
+
+    switch (pIn->nField)
+    {
+    case WXQ_INDOOR:
+        nVal = pPt->xS.nIndoor;
+        break;
+    case WXQ_OUTDOOR:
+        nVal = pPt->xS.nOutdoor;
+        break;
+    case WXQ_WIND:
+        nVal = pPt->xS.nWind;
+        break;
+    default:
+        nVal = pPt->xS.nPressure;
+        break;
+    }
+
+    pP = &pIn->xPoints[pIn->nPoints++];
+    pP->ttTime = pPt->ttTime;
+    pP->nValue = pP->nLow = pP->nHigh = nVal;
+
+    return 0;
+}
+
+static int TakeRollup(const WxRollup *pRow, void *pCtx)
+{
+    WxcInput *pIn = (WxcInput *)pCtx;
+    WxcPoint *pP;
+
+    if (pIn->nPoints == WXC_MAX_INPUT)
+    {
+        pIn->nPoints++;
+        return 1;
+    }
+
+    pP = &pIn->xPoints[pIn->nPoints++];
+    pP->ttTime = pRow->ttStart;
+    pP->nValue = WxRollAvg(pRow, pIn->nField);
+    pP->nLow = pRow->xStat[pIn->nField].nMin;
+    pP->nHigh = pRow->xStat[pIn->nField].nMax;
+
+    return 0;
+}
+
+static int LoadInput(WxcInput *pIn, time_t ttFrom, time_t ttTo)
+{
+    static const long nPeriod[3] = { 60 * 60, 24 * 60 * 60, 31 * 24 * 60 * 60 };
+    int nLevel;
+
+    pIn->nPoints = 0;
+    if (WxqScan(ttFrom, ttTo, TakeReading, pIn) < 0)
+        return -1;
+
+    // Coarser until it fits (periods only estimate the row count)
+    for (nLevel = WXR_HOUR; (pIn->nPoints > WXC_MAX_INPUT) && (nLevel <= WXR_MONTH); nLevel++)
+    {
+        if ((nLevel < WXR_MONTH) && (((ttTo - ttFrom) / nPeriod[nLevel]) > WXC_MAX_INPUT))
+            continue;
+        pIn->nPoints = 0;
+        if (WxRollRead(nLevel, ttFrom, ttTo, TakeRollup, pIn) < 0)
+            return -1;
+    }
+    if (pIn->nPoints > WXC_MAX_INPUT)
+        pIn->nPoints = WXC_MAX_INPUT;
+
+    return pIn->nPoints;
+}
+
+//-------------------------------------------------------------------------------
+// Largest triangle three buckets
+
+static void Envelope(WxcPoint *pOut, const WxcPoint *pIn, int nFrom, int nTo)
+{
+    int n;
+
+    pOut->nLow = pIn[nFrom].nLow;
+    pOut->nHigh = pIn[nFrom].nHigh;
+    for (n = nFrom + 1; n < nTo; n++)
+    {
+        if (pIn[n].nLow < pOut->nLow)
+            pOut->nLow = pIn[n].nLow;
+        if (pIn[n].nHigh > pOut->nHigh)
+            pOut->nHigh = pIn[n].nHigh;
+    }
+
+    return;
+}
+
+static int Downsample(const WxcPoint *pIn, int nIn, WxcPoint *pOut, int nWidth)
+{
+    double fEvery, fAvgX, fAvgY, fAX, fAY, fArea, fMax;
+    int i, n, nA, nPick, nFrom, nTo, nNext, nNextTo;
+
+    if ((nIn <= nWidth) || (nWidth < 3))
+    {
+        memcpy(pOut, pIn, nIn * sizeof(WxcPoint));
+        return nIn;
+    }
+
+    // First and last are kept, the rest split evenly
+    fEvery = (double)(nIn - 2) / (nWidth - 2);
+    pOut[0] = pIn[0];
+    nA = 0;
+
+    for (i = 0; i < (nWidth - 2); i++)
+    {
+        nFrom = (int)(i * fEvery) + 1;
+        nTo = (int)((i + 1) * fEvery) + 1;
+        nNext = nTo;
+        nNextTo = (int)((i + 2) * fEvery) + 1;
+        if (nNextTo > nIn)
+            nNextTo = nIn;
+
+        // Third corner - mean of the next bucket (the last point at the end)
+        fAvgX = fAvgY = 0.0;
+        for (n = nNext; n < nNextTo; n++)
+        {
+            fAvgX += (double)(pIn[n].ttTime - pIn[0].ttTime);
+            fAvgY += pIn[n].nValue;
+        }
+        fAvgX /= (nNextTo - nNext);
+        fAvgY /= (nNextTo - nNext);
+
+        fAX = (double)(pIn[nA].ttTime - pIn[0].ttTime);
+        fAY = pIn[nA].nValue;
+        fMax = -1.0;
+        nPick = nFrom;
+        for (n = nFrom; n < nTo; n++)
+        {
+            fArea = ((fAX - fAvgX) * (pIn[n].nValue - fAY)) -
+                    ((fAX - (double)(pIn[n].ttTime - pIn[0].ttTime)) * (fAvgY - fAY));
+            if (fArea < 0)
+                fArea = -fArea;
+            if (fArea > fMax)
+            {
+                fMax = fArea;
+                nPick = n;
+            }
+        }
+
+        pOut[i + 1] = pIn[nPick];
+        Envelope(&pOut[i + 1], pIn, nFrom, nTo);
+        nA = nPick;
+    }
+    pOut[nWidth - 1] = pIn[nIn - 1];
+
+    return nWidth;
+}
+
+//-------------------------------------------------------------------------------
+// Cache (chart_mutex held)
+
+static WxcEntry *CacheFind(int nField, time_t ttFrom, time_t ttTo, int nWidth, time_t ttNow)
+{
+    WxcEntry *pE;
+    int n;
+
+    for (n = 0; n < WXC_CACHE_SIZE; n++)
+    {
+        pE = &xCache[n];
+        if ((pE->nPoints == 0) || (pE->nField != nField) || (pE->ttFrom != ttFrom) ||
+            (pE->ttTo != ttTo) || (pE->nWidth != nWidth))
+            continue;
+        if ((ttTo > pE->ttMade) && ((ttNow - pE->ttMade) > WXC_LIVE_SECS))
+            return NULL;
+        pE->nUsed = ++nCacheUse;
+        return pE;
+    }
+
+    return NULL;
+}
+
+static void CacheAdd(int nField, time_t ttFrom, time_t ttTo, int nWidth, time_t ttNow,
+                     const WxcPoint *pPoints, int nPoints)
+{
+    WxcEntry *pE = &xCache[0];
+    int n;
+
+    // Same request (stale), else a free one, else least recently used
+    for (n = 0; n < WXC_CACHE_SIZE; n++)
+    {
+        if ((xCache[n].nPoints > 0) && (xCache[n].nField == nField) && (xCache[n].ttFrom == ttFrom) &&
+            (xCache[n].ttTo == ttTo) && (xCache[n].nWidth == nWidth))
+        {
+            pE = &xCache[n];
+            break;
+        }
+        if ((xCache[n].nPoints == 0) || (xCache[n].nUsed < pE->nUsed))
+            pE = &xCache[n];
+    }
+
+    free(pE->pPoints);
+    pE->nPoints = 0;
+    pE->pPoints = (WxcPoint *)malloc(nPoints * sizeof(WxcPoint));
+    if (!pE->pPoints)
+        return;
+    memcpy(pE->pPoints, pPoints, nPoints * sizeof(WxcPoint));
+    pE->nField = nField;
+    pE->ttFrom = ttFrom;
+    pE->ttTo = ttTo;
+    pE->nWidth = nWidth;
+    pE->ttMade = ttNow;
+    pE->nUsed = ++nCacheUse;
+    pE->nPoints = nPoints;
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+
+int WxcSeries(int nField, time_t ttFrom, time_t ttTo, int nWidth, WxcPoint **ppPoints)
+{
+    WxcInput *pIn;
+    WxcEntry *pE;
+    time_t ttNow = vc_time();
+    int nPoints;
+
+    *ppPoints = NULL;
+    if ((nField < 0) || (nField >= WXQ_FIELDS) || (nWidth < 1) || (ttTo <= ttFrom))
+        return -1;
+    if (nWidth > WXC_MAX_POINTS)
+        nWidth = WXC_MAX_POINTS;
+
+    pthread_mutex_lock(&chart_mutex);
+    pE = CacheFind(nField, ttFrom, ttTo, nWidth, ttNow);
+    if (pE)
+    {
+        *ppPoints = (WxcPoint *)malloc(pE->nPoints * sizeof(WxcPoint));
+        nPoints = *ppPoints ? pE->nPoints : -1;
+        if (*ppPoints)
+            memcpy(*ppPoints, pE->pPoints, nPoints * sizeof(WxcPoint));
+        pthread_mutex_unlock(&chart_mutex);
+        return nPoints;
+    }
+    pthread_mutex_unlock(&chart_mutex);
+
+    pIn = (WxcInput *)malloc(sizeof(WxcInput));
+    *ppPoints = (WxcPoint *)malloc(nWidth * sizeof(WxcPoint));
+    if (!pIn || !*ppPoints)
+    {
+        free(pIn);
+        free(*ppPoints);
+        *ppPoints = NULL;
+        return -1;
+    }
+
+    pIn->nField = nField;
+    nPoints = LoadInput(pIn, ttFrom, ttTo);
+    if (nPoints > 0)
+        nPoints = Downsample(pIn->xPoints, pIn->nPoints, *ppPoints, nWidth);
+    free(pIn);
+
+    if (nPoints > 0)
+    {
+        pthread_mutex_lock(&chart_mutex);
+        CacheAdd(nField, ttFrom, ttTo, nWidth, ttNow, *ppPoints, nPoints);
+        pthread_mutex_unlock(&chart_mutex);
+    }
+
+    return nPoints;
+}
+
+static void PrintValue(FILE *fOut, int nField, int nVal)
+{
+    if (nField == WXQ_PRESSURE)
+        fprintf(fOut, "%d.%02d", nVal / 100, nVal % 100);
+    else
+        fprintf(fOut, "%d", nVal);
+
+    return;
+}
+
+int WxcPrint(int nField, time_t ttFrom, time_t ttTo, int nWidth, FILE *fOut)
+{
+    WxcPoint *pPoints;
+    struct tm tmTime;
+    int nPoints, n;
+
+    nPoints = WxcSeries(nField, ttFrom, ttTo, nWidth, &pPoints);
+    if (nPoints < 0)
+        return -1;
+
+    fprintf(fOut, "Time,%s,Low,High\n", sField[nField]);
+    for (n = 0; n < nPoints; n++)
+    {
+        vc_localtime(&pPoints[n].ttTime, &tmTime);
+        fprintf(fOut, "%d-%02d-%02d %02d:%02d,", tmTime.tm_year + 1900, tmTime.tm_mon + 1, tmTime.tm_mday,
+                tmTime.tm_hour, tmTime.tm_min);
+        PrintValue(fOut, nField, pPoints[n].nValue);
+        fputc(',', fOut);
+        PrintValue(fOut, nField, pPoints[n].nLow);
+        fputc(',', fOut);
+        PrintValue(fOut, nField, pPoints[n].nHigh);
+        fputc('\n', fOut);
+    }
+    free(pPoints);
+
+    return nPoints;
+}
+
+FILE *WxcOpenUri(const char *sUri)
+{
+    char sName[16], sFrom[24], sTo[24];
+    time_t ttFrom, ttTo;
+    int nField, nWidth;
+    FILE *fOut;
+
+    if (!sWLogPath || (sscanf(sUri, "chart/%15[^/]/%23[^/]/%23[^/]/%d", sName, sFrom, sTo, &nWidth) != 4) ||
+        (strcmp(sUri + strlen(sUri) - 4, ".csv") != 0) || ((nField = WxcField(sName)) < 0) ||
+        (WxqParseWhen(sFrom, &ttFrom, FALSE) != 0) || (WxqParseWhen(sTo, &ttTo, TRUE) != 0))
+        return NULL;
+
+    fOut = tmpfile();
+    if (fOut == NULL)
+        return NULL;
+
+    WxcPrint(nField, ttFrom, ttTo, nWidth, fOut);
+    rewind(fOut);
+
+    return fOut;
+}
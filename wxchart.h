@@ -0,0 +1,49 @@
+// wxchart.h
+//
+// Chart series - one field over any range cut down to a fixed number of
+// points (largest triangle three buckets) with the low/high envelope of
+// each, taken from the rollups when the range is long and cached by
+// request
+//
+
+#ifndef WXCHART_H_INCLUDED
+#define WXCHART_H_INCLUDED
+
+#include <stdio.h>
+#include <time.h>
+
+// Most points a series is cut to
+#define WXC_MAX_POINTS      2000
+
+// Source level - the finest (readings, hours, days, months) with no more
+// than this many points in range
+#define WXC_MAX_INPUT       4096
+
+// Series held (least recently used goes)
+#define WXC_CACHE_SIZE      16
+
+// Series of a range still being logged are held this long (seconds)
+#define WXC_LIVE_SECS       60
+
+//
+// One chart point - reading (or period mean) chosen for the bucket,
+// with the lowest and highest of the readings the bucket covers
+//
+typedef struct _WxcPoint
+{
+    time_t  ttTime;
+    short   nValue;
+    short   nLow, nHigh;
+} WxcPoint;
+
+// WXQ_xxx by name (case ignored), -1 if none
+extern int WxcField(const char *sName);
+
+// Up to nWidth points (caller frees), returns count or -1
+extern int WxcSeries(int nField, time_t ttFrom, time_t ttTo, int nWidth, WxcPoint **ppPoints);
+extern int WxcPrint(int nField, time_t ttFrom, time_t ttTo, int nWidth, FILE *fOut);
+
+// Web: chart/<field>/<from>/<to>/<width>.csv - CSV in a temp file (NULL := not ours)
+extern FILE *WxcOpenUri(const char *sUri);
+
+#endif // WXCHART_H_INCLUDED
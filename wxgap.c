@@ -0,0 +1,262 @@
+// wxgap.c - Log gap detection and backfill from device history
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxarch.h"
+#include "wxquery.h"
+#include "wximport.h"
+#include "wxhist.h"
+#include "wxgap.h"
+
+//
+// After downtime the log tree can be missing whole days, days closed
+// without the midnite min/max and stretches of readings. The device only
+// remembers daily extremes (31 days of them, see wxhist.c), so that is
+// all that comes back: a day missing or without its min/max gets the
+// day's extremes from the summary store, after a marker message so the
+// synthesized lines are never taken for logged ones. Missing readings
+// are reported, not made up.
+//
+// Runs on the export stage after each history capture - nightly, at
+// startup and after a resync - behind everything logged before it.
+//
+
+static const char * const sKind[] = { "", "missing", "minmax", "readings" };
+
+//
+// Archived months (<Mmmyy>.wxa) are left alone
+//
+static int Archived(int nDate)
+{
+    char sPath[PATH_MAX];
+
+    snprintf(sPath, sizeof(sPath), "%s/%s%02d" WXA_EXT, sWLogPath, sMonName[((nDate / 100) % 100) - 1],
+             (nDate / 10000) % 100);
+
+    return access(sPath, F_OK) == 0;
+}
+
+static int Report(WxgGap *pGap, int nDate, int nKind, int nFrom, int nTo, WxgGapFn fnGap, void *pCtx, int *pnGaps)
+{
+    pGap->nDate = nDate;
+    pGap->nKind = nKind;
+    pGap->nFrom = nFrom;
+    pGap->nTo = nTo;
+    (*pnGaps)++;
+
+    return fnGap(pGap, pCtx);
+}
+
+// Minutes between readings - clock minutes unless DST changes today
+static int Elapsed(int nDate, int bDst, int nFrom, int nTo)
+{
+    if (!bDst)
+        return nTo - nFrom;
+
+    return (int)((WxqDateTime(nDate, nTo) - WxqDateTime(nDate, nFrom)) / 60);
+}
+
+// Non-zero := stopped
+static int ScanDay(int nDate, WxaDay *pDay, WxgGapFn fnGap, void *pCtx, int *pnGaps)
+{
+    WxgGap xGap;
+    int n, nRes, nPrev, bDst, bMinMax = FALSE;
+
+    if (WxqLoadDay(nDate, pDay, &nRes) < 0)
+        return Report(&xGap, nDate, WXG_MISSING, 0, 1440, fnGap, pCtx, pnGaps);
+
+    // Thinned archive or logging disabled - no readings expected
+    if ((nRes != WXA_RES_RAW) || (pDay->nHead == WXA_HEAD_NOWEATHER))
+        return 0;
+
+    bDst = (WxqDateTime(nDate, 1440) - WxqDateTime(nDate, 0)) != (24 * 60 * 60);
+    for (n = 0, nPrev = 0; n <= pDay->nSamples; n++)
+    {
+        if (n == pDay->nSamples)
+        {
+            if (Elapsed(nDate, bDst, nPrev, 1440) > WXG_GAP_MINUTES)
+                if (Report(&xGap, nDate, WXG_READINGS, nPrev, 1440, fnGap, pCtx, pnGaps))
+                    return 1;
+            break;
+        }
+
+        if (Elapsed(nDate, bDst, nPrev, pDay->xSamples[n].nTime) > WXG_GAP_MINUTES)
+            if (Report(&xGap, nDate, WXG_READINGS, nPrev, pDay->xSamples[n].nTime, fnGap, pCtx, pnGaps))
+                return 1;
+        nPrev = pDay->xSamples[n].nTime;
+    }
+
+    for (n = 0; n < pDay->nExtras; n++)
+        bMinMax |= (pDay->xExtras[n].nKind == WXA_X_MINMAX);
+    if (!bMinMax)
+        return Report(&xGap, nDate, WXG_MINMAX, 1440, 1440, fnGap, pCtx, pnGaps);
+
+    return 0;
+}
+
+int WxgScan(int nFrom, int nTo, WxgGapFn fnGap, void *pCtx)
+{
+    WxaDay *pDay;
+    int nDate, nFirst, nLast, nToday, nGaps = 0;
+
+    // Nothing before the first log, today is still open
+    if (WxqDays(&nFirst, &nLast) == 0)
+        return 0;
+    nToday = WxqDateOf(vc_time());
+    if (nFrom < nFirst)
+        nFrom = nFirst;
+    if (nTo > nToday)
+        nTo = nToday;
+
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    if (!pDay)
+        return -1;
+
+    for (nDate = nFrom; nDate < nTo; nDate = WxqNextDate(nDate))
+    {
+        if (ScanDay(nDate, pDay, fnGap, pCtx, &nGaps))
+            break;
+    }
+    free(pDay);
+
+    return nGaps;
+}
+
+//-------------------------------------------------------------------------------
+// Report
+
+static int PrintGap(const WxgGap *pGap, void *pCtx)
+{
+    fprintf((FILE *)pCtx, "%04d-%02d-%02d,%s,%02d:%02d,%02d:%02d\n", pGap->nDate / 10000, (pGap->nDate / 100) % 100,
+            pGap->nDate % 100, sKind[pGap->nKind], pGap->nFrom / 60, pGap->nFrom % 60, pGap->nTo / 60, pGap->nTo % 60);
+
+    return 0;
+}
+
+int WxgPrint(int nFrom, int nTo, FILE *fOut)
+{
+    fputs("Date,Gap,From,To\n", fOut);
+
+    return WxgScan(nFrom, nTo, PrintGap, fOut);
+}
+
+//-------------------------------------------------------------------------------
+// Backfill
+
+typedef struct _WxgFill
+{
+    int     nDates[WXG_DAYS + 1];       // Days wanting extremes
+    int     nWant;
+    int     nCount[WXG_READINGS + 1];
+    int     nFilled;
+    WxaDay  xDay;
+} WxgFill;
+
+static int NoteGap(const WxgGap *pGap, void *pCtx)
+{
+    WxgFill *pF = (WxgFill *)pCtx;
+
+    pF->nCount[pGap->nKind]++;
+    if ((pGap->nKind != WXG_READINGS) && (pF->nWant <= WXG_DAYS))
+        pF->nDates[pF->nWant++] = pGap->nDate;
+
+    return 0;
+}
+
+static WxaExtra *AddExtra(WxaDay *pDay, int nKind)
+{
+    WxaExtra *pX = &pDay->xExtras[pDay->nExtras++];
+
+    memset(pX, 0, sizeof(*pX));
+    pX->nAt = pDay->nSamples;
+    pX->nKind = nKind;
+    pX->nTime = 1440;
+
+    return pX;
+}
+
+static int FillDay(const WxhDay *pDev, void *pCtx)
+{
+    WxgFill *pF = (WxgFill *)pCtx;
+    WxaDay *pDay = &pF->xDay;
+    int n, nRes;
+
+    for (n = 0; (n < pF->nWant) && (pF->nDates[n] != pDev->nDate); n++)
+        ;
+    if ((n == pF->nWant) || Archived(pDev->nDate))
+        return 0;
+
+    if (WxqLoadDay(pDev->nDate, pDay, &nRes) < 0)
+    {
+        memset(pDay, 0, sizeof(WxaDay));
+        pDay->nHead = WXA_HEAD_WEATHER;
+    }
+    else if (nRes != WXA_RES_RAW)
+        return 0;
+    if ((pDay->nExtras + 2) > WXA_MAX_EXTRAS)
+        return 0;
+
+    strcpy(AddExtra(pDay, WXA_X_MESSAGE)->sMsg, WXG_MARK);
+    AddExtra(pDay, WXA_X_MINMAX)->xMinMax = pDev->xM;
+
+    if (WxiWriteDay(pDev->nDate, pDay, nLogFormat) == 0)
+        pF->nFilled++;
+
+    return 0;
+}
+
+int WxgBackfill(time_t ttStamp)
+{
+    WxgFill *pF;
+    int nToday, nFrom, nFilled;
+
+    if (!sWLogPath)
+        return 0;
+
+    pF = (WxgFill *)calloc(1, sizeof(WxgFill));
+    if (!pF)
+        return -1;
+
+    nToday = WxqDateOf(ttStamp);
+    nFrom = WxqDateOf(WxqDateTime(nToday, 12 * 60) - (WXG_DAYS * 24 * 60 * 60));
+
+    if (WxgScan(nFrom, nToday, NoteGap, pF) > 0)
+    {
+        printf("Gaps since %04d-%02d-%02d: %d days missing, %d without min/max, %d in readings\n",
+               nFrom / 10000, (nFrom / 100) % 100, nFrom % 100,
+               pF->nCount[WXG_MISSING], pF->nCount[WXG_MINMAX], pF->nCount[WXG_READINGS]);
+    }
+
+    if (pF->nWant > 0)
+    {
+        WxhScan(nFrom, nToday, FillDay, pF);
+        if (pF->nFilled > 0)
+        {
+            printf("Backfilled %d days from device history\n", pF->nFilled);
+            WxqRescan();
+        }
+    }
+
+    nFilled = pF->nFilled;
+    free(pF);
+
+    return nFilled;
+}
@@ -0,0 +1,49 @@
+// wxgap.h
+//
+// Gap detection - days missing from the log tree, days closed without
+// their daily extremes and breaks in the readings, with the extremes
+// backfilled from the device's 31 day history
+//
+
+#ifndef WXGAP_H_INCLUDED
+#define WXGAP_H_INCLUDED
+
+#include <stdio.h>
+#include <time.h>
+
+// Days back checked after a capture (device history span)
+#define WXG_DAYS            31
+
+// Break in the readings reported (logged every 20 minutes)
+#define WXG_GAP_MINUTES     60
+
+// Logged ahead of backfilled extremes
+#define WXG_MARK            "--Backfilled from device history--\n"
+
+// Gap kinds
+#define WXG_MISSING         1       // No log for the day
+#define WXG_MINMAX          2       // Log closed without daily extremes
+#define WXG_READINGS        3       // Break in the readings
+
+//
+// One gap (minutes past midnite, readings either side - 0/1440 := none)
+//
+typedef struct _WxgGap
+{
+    int     nDate;                  // yyyymmdd
+    int     nKind;                  // WXG_xxx
+    short   nFrom;
+    short   nTo;
+} WxgGap;
+
+// Return non-zero to stop
+typedef int (*WxgGapFn)(const WxgGap *pGap, void *pCtx);
+
+// Closed days [nFrom, nTo) from the first logged day on, returns gaps found
+extern int WxgScan(int nFrom, int nTo, WxgGapFn fnGap, void *pCtx);
+extern int WxgPrint(int nFrom, int nTo, FILE *fOut);
+
+// Export stage, after a history capture - returns days backfilled
+extern int WxgBackfill(time_t ttStamp);
+
+#endif // WXGAP_H_INCLUDED
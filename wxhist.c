@@ -0,0 +1,376 @@
+// wxhist.c - Daily summary store fed from the device history
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "ID4Serial.h"
+#include "wxpipe.h"
+#include "wxquery.h"
+#include "wxhist.h"
+
+//
+// The device keeps one record per day of month, overwritten as each day
+// closes, with times but no dates. Taken after the midnite clear, slots
+// before today are this month and the rest last month. A slot for a day
+// the device never closed still holds the month before - one matching
+// that day last month exactly is taken as stale and skipped.
+//
+// The whole store (24 bytes a day) is held in memory in date order and
+// rewritten (temp + rename) when a capture changes it.
+//
+
+#define WXH_CSV_HEADER      "Date,TLow,Time,THigh,Time,Wind,Time,PLow,Time,PHigh,Time\n"
+
+static WxhDay *pStore;
+static int nStore, nStoreAlloc;
+static int bLoaded = FALSE;
+static pthread_mutex_t hist_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void StorePath(char *sPath, size_t nSize)
+{
+    snprintf(sPath, nSize, "%s/" WXH_FILE, sWLogPath);
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Store (hist_mutex held)
+
+// First day >= nDate
+static int FindDay(int nDate)
+{
+    int nLo = 0, nHi = nStore, nMid;
+
+    while (nLo < nHi)
+    {
+        nMid = (nLo + nHi) / 2;
+        if (pStore[nMid].nDate < nDate)
+            nLo = nMid + 1;
+        else
+            nHi = nMid;
+    }
+
+    return nLo;
+}
+
+static int Grow(int nDays)
+{
+    WxhDay *pNew;
+
+    if (nDays <= nStoreAlloc)
+        return 0;
+
+    nDays += 64;
+    pNew = (WxhDay *)realloc(pStore, nDays * sizeof(WxhDay));
+    if (!pNew)
+    {
+        printf("History store alloc failed\n");
+        return -1;
+    }
+    pStore = pNew;
+    nStoreAlloc = nDays;
+
+    return 0;
+}
+
+static void Load(void)
+{
+    char sPath[PATH_MAX];
+    WxhHead xHead;
+    ssize_t nLen;
+    int fd;
+
+    if (bLoaded || !sWLogPath)
+        return;
+    bLoaded = TRUE;
+
+    StorePath(sPath, sizeof(sPath));
+    fd = open(sPath, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    if ((read(fd, &xHead, sizeof(xHead)) != sizeof(xHead)) || (xHead.nMagic != WXH_MAGIC) ||
+        (xHead.nVersion != WXH_VERSION) || (xHead.nDaySize != sizeof(WxhDay)))
+    {
+        printf("History store %s: bad header, starting over\n", sPath);
+        close(fd);
+        return;
+    }
+
+    if (Grow(xHead.nDays) == 0)
+    {
+        nLen = (ssize_t)(xHead.nDays * sizeof(WxhDay));
+        if (read(fd, pStore, nLen) == nLen)
+            nStore = xHead.nDays;
+        else
+            printf("History store %s: short read\n", sPath);
+    }
+    close(fd);
+
+    return;
+}
+
+static int Save(void)
+{
+    char sPath[PATH_MAX], sTemp[PATH_MAX + 8];
+    WxhHead xHead;
+    ssize_t nLen;
+    int fd, nRet = -1;
+
+    StorePath(sPath, sizeof(sPath));
+    snprintf(sTemp, sizeof(sTemp), "%s.tmp", sPath);
+
+    memset(&xHead, 0, sizeof(xHead));
+    xHead.nMagic = WXH_MAGIC;
+    xHead.nVersion = WXH_VERSION;
+    xHead.nDaySize = sizeof(WxhDay);
+    xHead.nDays = nStore;
+
+    fd = open(sTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        nLen = (ssize_t)(nStore * sizeof(WxhDay));
+        if ((write(fd, &xHead, sizeof(xHead)) == sizeof(xHead)) && (write(fd, pStore, nLen) == nLen) &&
+            (fdatasync(fd) == 0))
+            nRet = 0;
+        close(fd);
+        if ((nRet == 0) && (rename(sTemp, sPath) != 0))
+            nRet = -1;
+    }
+    if (nRet != 0)
+    {
+        printf("History store write failed: %s: %s\n", sPath, strerror(errno));
+        unlink(sTemp);
+    }
+
+    return nRet;
+}
+
+//-------------------------------------------------------------------------------
+// Capture
+
+static int MonthDays(int nYear, int nMon)
+{
+    static const int nDays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+    if ((nMon == 2) && ((nYear % 4) == 0) && (((nYear % 100) != 0) || ((nYear % 400) == 0)))
+        return 29;
+
+    return nDays[nMon - 1];
+}
+
+// Same day of month, month before (0 := none)
+static int PrevMonthDate(int nDate)
+{
+    int nYear = nDate / 10000, nMon = (nDate / 100) % 100, nDay = nDate % 100;
+
+    if (--nMon == 0)
+    {
+        nMon = 12;
+        nYear--;
+    }
+    if (nDay > MonthDays(nYear, nMon))
+        return 0;
+
+    return (nYear * 10000) + (nMon * 100) + nDay;
+}
+
+static int ValidWhen(const unsigned char *p)
+{
+    // min, hour (12hr, PM in bit 7)
+    return (p[0] < 60) && ((p[1] & 0x7F) >= 1) && ((p[1] & 0x7F) <= 12);
+}
+
+// Cleared slot - one value and one time throughout
+static int BlankSlot(const unsigned char *pRec)
+{
+    return (pRec[1] == pRec[4]) && (pRec[7] == pRec[10]) &&
+           !memcmp(&pRec[2], &pRec[5], 2) && !memcmp(&pRec[2], &pRec[8], 2) &&
+           !memcmp(&pRec[2], &pRec[11], 2) && !memcmp(&pRec[2], &pRec[14], 2);
+}
+
+static short When(const unsigned char *p)
+{
+    return (short)((x24hr(p[1]) * 60) + p[0]);
+}
+
+//
+// Date each slot as of nToday, returns days decoded (slots cleared or
+// garbled are skipped)
+//
+int WxhDecode(const unsigned char *sRaw, int nToday, WxhDay *pDays)
+{
+    const unsigned char *pRec;
+    int nSlot, nYear, nMon, nDays = 0;
+
+    if (sRaw[0] != 'i')
+        return -1;
+
+    for (nSlot = 1; nSlot <= 31; nSlot++)
+    {
+        // Same offsets as ShowHistory - tag is byte 0, fields from 1
+        pRec = &sRaw[HISTORY_REC_SIZE * (nSlot - 1)];
+        if (!ValidWhen(&pRec[2]) || !ValidWhen(&pRec[5]) || !ValidWhen(&pRec[8]) ||
+            !ValidWhen(&pRec[11]) || !ValidWhen(&pRec[14]) || BlankSlot(pRec))
+            continue;
+
+        nYear = nToday / 10000;
+        nMon = (nToday / 100) % 100;
+        if (nSlot >= (nToday % 100))
+        {
+            if (--nMon == 0)
+            {
+                nMon = 12;
+                nYear--;
+            }
+        }
+        if (nSlot > MonthDays(nYear, nMon))
+            continue;
+
+        pDays[nDays].nDate = (nYear * 10000) + (nMon * 100) + nSlot;
+        pDays[nDays].xM.nTLow = pRec[1] - 40;
+        pDays[nDays].xM.nTLowTime = When(&pRec[2]);
+        pDays[nDays].xM.nTHigh = pRec[4] - 40;
+        pDays[nDays].xM.nTHighTime = When(&pRec[5]);
+        pDays[nDays].xM.nPLow = pRec[7] + 2900;
+        pDays[nDays].xM.nPLowTime = When(&pRec[8]);
+        pDays[nDays].xM.nPHigh = pRec[10] + 2900;
+        pDays[nDays].xM.nPHighTime = When(&pRec[11]);
+        pDays[nDays].xM.nWind = (pRec[13] * 99) / 256;
+        pDays[nDays].xM.nWindTime = When(&pRec[14]);
+        nDays++;
+    }
+
+    return nDays;
+}
+
+int WxhMerge(time_t ttStamp, const unsigned char *sRaw)
+{
+    WxhDay xDays[31];
+    int nDays, n, k, nPrev, nChanged = 0;
+
+    nDays = WxhDecode(sRaw, WxqDateOf(ttStamp), xDays);
+    if (nDays < 0)
+    {
+        printf("History: bad device response\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&hist_mutex);
+    Load();
+    for (n = 0; n < nDays; n++)
+    {
+        k = FindDay(xDays[n].nDate);
+        if ((k < nStore) && (pStore[k].nDate == xDays[n].nDate))
+        {
+            if (memcmp(&pStore[k], &xDays[n], sizeof(WxhDay)) != 0)
+            {
+                pStore[k] = xDays[n];
+                nChanged++;
+            }
+            continue;
+        }
+
+        nPrev = FindDay(PrevMonthDate(xDays[n].nDate));
+        if ((nPrev < nStore) && (pStore[nPrev].nDate == PrevMonthDate(xDays[n].nDate)) &&
+            (memcmp(&pStore[nPrev].xM, &xDays[n].xM, sizeof(WxMinMax)) == 0))
+            continue;
+
+        if (Grow(nStore + 1) != 0)
+            break;
+        memmove(&pStore[k + 1], &pStore[k], (nStore - k) * sizeof(WxhDay));
+        pStore[k] = xDays[n];
+        nStore++;
+        nChanged++;
+    }
+
+    if ((nChanged > 0) && (Save() != 0))
+        nChanged = -1;
+    pthread_mutex_unlock(&hist_mutex);
+
+    return nChanged;
+}
+
+//-------------------------------------------------------------------------------
+// Readers
+
+int WxhScan(int nFrom, int nTo, WxhDayFn fnDay, void *pCtx)
+{
+    int k, nCount = 0;
+
+    pthread_mutex_lock(&hist_mutex);
+    Load();
+    for (k = FindDay(nFrom); (k < nStore) && (pStore[k].nDate < nTo); k++)
+    {
+        nCount++;
+        if (fnDay(&pStore[k], pCtx))
+            break;
+    }
+    pthread_mutex_unlock(&hist_mutex);
+
+    return nCount;
+}
+
+static int PrintDay(const WxhDay *pDay, void *pCtx)
+{
+    const WxMinMax *pM = &pDay->xM;
+
+    fprintf((FILE *)pCtx, "%d-%02d-%02d,%d,%02d:%02d,%d,%02d:%02d,%d,%02d:%02d,%d.%02d,%02d:%02d,%d.%02d,%02d:%02d\n",
+            pDay->nDate / 10000, (pDay->nDate / 100) % 100, pDay->nDate % 100,
+            pM->nTLow, pM->nTLowTime / 60, pM->nTLowTime % 60,
+            pM->nTHigh, pM->nTHighTime / 60, pM->nTHighTime % 60,
+            pM->nWind, pM->nWindTime / 60, pM->nWindTime % 60,
+            pM->nPLow / 100, pM->nPLow % 100, pM->nPLowTime / 60, pM->nPLowTime % 60,
+            pM->nPHigh / 100, pM->nPHigh % 100, pM->nPHighTime / 60, pM->nPHighTime % 60);
+
+    return 0;
+}
+
+int WxhPrint(int nFrom, int nTo, FILE *fOut)
+{
+    fputs(WXH_CSV_HEADER, fOut);
+
+    return WxhScan(nFrom, nTo, PrintDay, fOut);
+}
+
+//
+// history/<from>/<to>.csv - dates as for -Q
+//
+FILE *WxhOpenUri(const char *sUri)
+{
+    char sFrom[24], sTo[24];
+    time_t ttFrom, ttTo;
+    FILE *fOut;
+
+    if (!sWLogPath || (sscanf(sUri, "history/%23[^/]/%23[^.]", sFrom, sTo) != 2) ||
+        (strcmp(sUri + strlen(sUri) - 4, ".csv") != 0) ||
+        (WxqParseWhen(sFrom, &ttFrom, FALSE) != 0) || (WxqParseWhen(sTo, &ttTo, TRUE) != 0))
+        return NULL;
+
+    fOut = tmpfile();
+    if (fOut == NULL)
+        return NULL;
+
+    WxhPrint(WxqDateOf(ttFrom), WxqDateOf(ttTo), fOut);
+    rewind(fOut);
+
+    return fOut;
+}
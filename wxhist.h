@@ -0,0 +1,57 @@
+// wxhist.h
+//
+// Daily summary store - the device's 31 day history of daily extremes
+// ('i'), pulled nightly and merged by date into one file beside the logs
+// (id4hist.wxh) so daily extremes never need the device or the logs
+//
+
+#ifndef WXHIST_H_INCLUDED
+#define WXHIST_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wxpipe.h"
+
+#define WXH_FILE            "id4hist.wxh"
+
+#define WXH_MAGIC           0x31485857      // "WXH1"
+#define WXH_VERSION         1
+
+//
+// File header - days follow in date order
+//
+typedef struct _WxhHead
+{
+    uint32_t    nMagic;
+    uint16_t    nVersion;
+    uint16_t    nDaySize;
+    uint32_t    nDays;
+    uint32_t    nSpare;
+} WxhHead;
+
+//
+// One day (times are minutes past midnite)
+//
+typedef struct _WxhDay
+{
+    int32_t     nDate;              // yyyymmdd
+    WxMinMax    xM;
+} WxhDay;
+
+// Return non-zero to stop
+typedef int (*WxhDayFn)(const WxhDay *pDay, void *pCtx);
+
+// Capture (export stage) - decode as of ttStamp and merge, returns days added/changed
+extern int WxhDecode(const unsigned char *sRaw, int nToday, WxhDay *pDays);
+extern int WxhMerge(time_t ttStamp, const unsigned char *sRaw);
+
+// Readers - dates [nFrom, nTo)
+extern int WxhScan(int nFrom, int nTo, WxhDayFn fnDay, void *pCtx);
+extern int WxhPrint(int nFrom, int nTo, FILE *fOut);
+
+// Web: history/<from>/<to>.csv - CSV in a temp file (NULL := not ours)
+extern FILE *WxhOpenUri(const char *sUri);
+
+#endif // WXHIST_H_INCLUDED
@@ -0,0 +1,673 @@
+// wximport.c - Bulk import of CSV weather logs
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "id4-pi.h"
+#include "wxpipe.h"
+#include "wxarch.h"
+#include "wxbin.h"
+#include "wxquery.h"
+#include "wxroll.h"
+#include "wxnorm.h"
+#include "wxmemo.h"
+#include "wximport.h"
+
+//
+// Every day file of the source tree becomes a task (its date - the path
+// follows from it). Tasks are dealt out to the workers in contiguous
+// runs; a worker takes from the front of its own run and, when that is
+// empty, steals the back half of someone else's. Day files are small
+// and uneven (restarts, missing days), so this keeps every core busy
+// without a shared queue to fight over.
+//
+// Each file is mapped and scanned in place - memchr() for line ends and
+// a table of field separators per line kind instead of sscanf. Results
+// match WxaParseCsv() (lenient) line for line.
+//
+
+typedef struct _WxiWorker
+{
+    pthread_mutex_t     xLock;
+    long                nLo, nHi;       // Own tasks [nLo, nHi) - thieves take from nHi
+    WxiStats            xStats;
+    struct _WxiPool     *pPool;
+    int                 nId;
+    pthread_t           xThread;
+} WxiWorker;
+
+typedef struct _WxiPool
+{
+    const char          *sSrc;
+    int                 *pDates;
+    WxiWorker           *pWorkers;
+    int                 nWorkers;
+    WxiSinkFn           fnSink;
+    void                *pCtx;
+} WxiPool;
+
+// Separator after each number of the min/max line
+static const char sMinMaxSep[] = ",:,,:,,:,.,:,.,:";
+
+static uint32_t nDirKey[16];
+static pthread_once_t xDirOnce = PTHREAD_ONCE_INIT;
+
+//-------------------------------------------------------------------------------
+// Scanner
+
+static void DirKeys(void)
+{
+    const char *p;
+    int n;
+
+    for (n = 0; n < 16; n++)
+    {
+        for (p = sWinDir[n]; *p; p++)
+            nDirKey[n] = (nDirKey[n] << 8) | (unsigned char)*p;
+    }
+
+    return;
+}
+
+// Signed decimal (blanks ahead, as %d), then cSep ('\0' := whatever follows)
+static const char *ScanNum(const char *p, const char *pEnd, char cSep, int *pVal)
+{
+    const char *pStart;
+    int nVal = 0, bNeg = FALSE;
+
+    while ((p < pEnd) && ((*p == ' ') || (*p == '\t')))
+        p++;
+    if ((p < pEnd) && ((*p == '-') || (*p == '+')))
+        bNeg = (*p++ == '-');
+    for (pStart = p; (p < pEnd) && ((unsigned)(*p - '0') < 10); p++)
+        nVal = (nVal * 10) + (*p - '0');
+
+    if ((p == pStart) || ((p - pStart) > 9))
+        return NULL;
+    *pVal = bNeg ? -nVal : nVal;
+    if (cSep == '\0')
+        return p;
+    if ((p >= pEnd) || (*p != cSep))
+        return NULL;
+
+    return p + 1;
+}
+
+static WxaExtra *AddExtra(WxaDay *pDay, int nKind, int nTime)
+{
+    WxaExtra *pX;
+
+    if (pDay->nExtras >= WXA_MAX_EXTRAS)
+        return NULL;
+
+    pX = &pDay->xExtras[pDay->nExtras++];
+    memset(pX, 0, sizeof(*pX));
+    pX->nAt = pDay->nSamples;
+    pX->nKind = nKind;
+    pX->nTime = nTime;
+
+    return pX;
+}
+
+static int ScanMinMax(WxaDay *pDay, const char *p, const char *pEnd)
+{
+    WxaExtra *pX;
+    WxMinMax *pM;
+    int nVal[17];
+    int n;
+
+    if (((pEnd - p) < 5) || (memcmp(p, "1440,", 5) != 0))
+        return FALSE;
+    for (p += 5, n = 0; p && (n < 17); n++)
+        p = ScanNum(p, pEnd, sMinMaxSep[n], &nVal[n]);
+    if (!p || !(pX = AddExtra(pDay, WXA_X_MINMAX, 1440)))
+        return FALSE;
+
+    pM = &pX->xMinMax;
+    pM->nTLow = nVal[0];
+    pM->nTLowTime = (nVal[1] * 60) + nVal[2];
+    pM->nTHigh = nVal[3];
+    pM->nTHighTime = (nVal[4] * 60) + nVal[5];
+    pM->nWind = nVal[6];
+    pM->nWindTime = (nVal[7] * 60) + nVal[8];
+    pM->nPLow = (nVal[9] * 100) + nVal[10];
+    pM->nPLowTime = (nVal[11] * 60) + nVal[12];
+    pM->nPHigh = (nVal[13] * 100) + nVal[14];
+    pM->nPHighTime = (nVal[15] * 60) + nVal[16];
+
+    return TRUE;
+}
+
+// Line [p, pEnd), pEnd just past its newline. Returns FALSE if not understood.
+static int ScanLine(WxaDay *pDay, const char *p, const char *pEnd, int *pbMinMax)
+{
+    const char *q, *pDir;
+    WxSample *pS;
+    WxaExtra *pX;
+    uint32_t nKey;
+    int nVal[7];
+    int n;
+
+    if (((pEnd - p) >= 128) || (pEnd[-1] != '\n'))
+        return FALSE;
+
+    if (((size_t)(pEnd - p) == sizeof(WEATHER_LOG_HEADER2) - 1) &&
+        (memcmp(p, WEATHER_LOG_HEADER2, pEnd - p) == 0))
+    {
+        *pbMinMax = TRUE;
+        return TRUE;
+    }
+    if (*pbMinMax)
+    {
+        *pbMinMax = FALSE;
+        return ScanMinMax(pDay, p, pEnd);
+    }
+
+    // Time first - all that is left is a reading or a message
+    if (!(q = ScanNum(p, pEnd, ',', &nVal[0])))
+        return FALSE;
+    p = q;
+
+    for (n = 1; q && (n <= 3); n++)
+        q = ScanNum(q, pEnd, ',', &nVal[n]);
+    if (q)
+    {
+        // Direction - up to 7 letters is a reading (known or not)
+        for (pDir = q, nKey = 0; (q < pEnd) && ((unsigned)(*q - 'A') < 26); q++)
+            nKey = (nKey << 8) | (unsigned char)*q;
+        if ((q == pDir) || ((q - pDir) > 7) || (q >= pEnd) || (*q != ','))
+            q = NULL;
+        else if ((q - pDir) > 3)
+            nKey = 0;
+        if (q)
+            q = ScanNum(q + 1, pEnd, '.', &nVal[4]);
+        if (q)
+            q = ScanNum(q, pEnd, '\0', &nVal[5]);
+    }
+
+    // Reading
+    if (q && (pDay->nSamples < WXA_MAX_SAMPLES))
+    {
+        for (n = 0; (n < 16) && (nDirKey[n] != nKey); n++)
+            ;
+        if (n == 16)
+            return FALSE;
+
+        pS = &pDay->xSamples[pDay->nSamples++];
+        pS->nTime = nVal[0];
+        pS->nIndoor = nVal[1];
+        pS->nOutdoor = nVal[2];
+        pS->nWind = nVal[3];
+        pS->nDir = n;
+        pS->nPressure = (nVal[4] * 100) + nVal[5];
+        return TRUE;
+    }
+
+    // Message (text with its newline)
+    if ((pEnd - p) < WX_MSG_SIZE)
+    {
+        if (!(pX = AddExtra(pDay, WXA_X_MESSAGE, nVal[0])))
+            return FALSE;
+        memcpy(pX->sMsg, p, pEnd - p);
+        pX->sMsg[pEnd - p] = '\0';
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+//
+// Parse a day log image. Returns malformed lines (skipped), the first
+// few reported against sName (NULL := quietly, none counted).
+//
+int WxiParseDay(const char *pBuf, size_t nSize, WxaDay *pDay, const char *sName, long *pnLines)
+{
+    const char *p, *pNext, *pEnd = pBuf + nSize;
+    int bMinMax = FALSE;
+    int nLine, nBad = 0;
+
+    pthread_once(&xDirOnce, DirKeys);
+
+    pDay->nHead = WXA_HEAD_NONE;
+    pDay->nSamples = 0;
+    pDay->nExtras = 0;
+
+    for (p = pBuf, nLine = 1; p < pEnd; p = pNext, nLine++)
+    {
+        pNext = memchr(p, '\n', pEnd - p);
+        pNext = pNext ? pNext + 1 : pEnd;
+
+        if (p == pBuf)
+        {
+            if (((size_t)(pNext - p) == sizeof(WEATHER_LOG_HEADER1) - 1) &&
+                (memcmp(p, WEATHER_LOG_HEADER1, pNext - p) == 0))
+            {
+                pDay->nHead = WXA_HEAD_WEATHER;
+                continue;
+            }
+            if (((size_t)(pNext - p) == sizeof(NOWEATHER_LOG_HEADER) - 1) &&
+                (memcmp(p, NOWEATHER_LOG_HEADER, pNext - p) == 0))
+            {
+                pDay->nHead = WXA_HEAD_NOWEATHER;
+                continue;
+            }
+        }
+
+        if (!ScanLine(pDay, p, pNext, &bMinMax))
+        {
+            if (sName && (nBad++ < WXI_MAX_REPORT))
+                printf("%s:%d: malformed line: %.*s%s", sName, nLine, (int)(pNext - p), p,
+                       (pNext[-1] == '\n') ? "" : "\n");
+        }
+    }
+    if (pnLines)
+        *pnLines += nLine - 1;
+
+    return nBad;
+}
+
+//-------------------------------------------------------------------------------
+// Workers
+
+static long TakeTask(WxiWorker *pW)
+{
+    long nTask = -1;
+
+    pthread_mutex_lock(&pW->xLock);
+    if (pW->nLo < pW->nHi)
+        nTask = pW->nLo++;
+    pthread_mutex_unlock(&pW->xLock);
+
+    return nTask;
+}
+
+// Back half of the first victim with work left
+static int StealTasks(WxiWorker *pW)
+{
+    WxiPool *pPool = pW->pPool;
+    WxiWorker *pV;
+    long nLo = 0, nHi = 0;
+    int k;
+
+    for (k = 1; (k < pPool->nWorkers) && (nLo == nHi); k++)
+    {
+        pV = &pPool->pWorkers[(pW->nId + k) % pPool->nWorkers];
+        pthread_mutex_lock(&pV->xLock);
+        if (pV->nLo < pV->nHi)
+        {
+            nHi = pV->nHi;
+            nLo = pV->nHi - ((pV->nHi - pV->nLo + 1) / 2);
+            pV->nHi = nLo;
+        }
+        pthread_mutex_unlock(&pV->xLock);
+    }
+    if (nLo == nHi)
+        return FALSE;
+
+    pthread_mutex_lock(&pW->xLock);
+    pW->nLo = nLo;
+    pW->nHi = nHi;
+    pthread_mutex_unlock(&pW->xLock);
+
+    return TRUE;
+}
+
+static void ImportDay(WxiWorker *pW, int nDate, WxaDay *pDay)
+{
+    WxiPool *pPool = pW->pPool;
+    struct stat xInfo;
+    char sPath[PATH_MAX];
+    char *pMap = NULL;
+    int fd;
+
+    snprintf(sPath, sizeof(sPath), "%s/%s%02d/%02d", pPool->sSrc, sMonName[((nDate / 100) % 100) - 1],
+             (nDate / 10000) % 100, nDate % 100);
+
+    fd = open(sPath, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &xInfo) != 0))
+    {
+        printf("%s: %s\n", sPath, strerror(errno));
+        pW->xStats.nFailed++;
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    if (xInfo.st_size > 0)
+    {
+        pMap = mmap(NULL, xInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pMap == MAP_FAILED)
+        {
+            printf("%s: %s\n", sPath, strerror(errno));
+            pW->xStats.nFailed++;
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    pW->xStats.nBad += WxiParseDay(pMap, pMap ? xInfo.st_size : 0, pDay, sPath, &pW->xStats.nLines);
+    if (pMap)
+        munmap(pMap, xInfo.st_size);
+
+    pW->xStats.nFiles++;
+    if (pPool->fnSink && pPool->fnSink(nDate, pDay, pPool->pCtx))
+        pW->xStats.nFailed++;
+
+    return;
+}
+
+static void *xImport(void *args)
+{
+    WxiWorker *pW = (WxiWorker *)args;
+    WxaDay *pDay;
+    long nTask;
+
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    if (!pDay)
+        return NULL;
+
+    for (;;)
+    {
+        while ((nTask = TakeTask(pW)) >= 0)
+            ImportDay(pW, pW->pPool->pDates[nTask], pDay);
+        if (!StealTasks(pW))
+            break;
+    }
+    free(pDay);
+
+    return NULL;
+}
+
+//-------------------------------------------------------------------------------
+
+static int CmpDate(const void *p1, const void *p2)
+{
+    return *(const int *)p1 - *(const int *)p2;
+}
+
+// Day files of the source tree (as dates, sorted)
+static long ListDays(const char *sSrc, int **ppDates)
+{
+    char sPath[PATH_MAX];
+    DIR *pDir, *pMonth;
+    struct dirent *pEnt, *pDay;
+    int *pDates = NULL, *pMore;
+    long nDates = 0, nAlloc = 0;
+    int nMonth, bArchive, nMday;
+
+    pDir = opendir(sSrc);
+    if (!pDir)
+    {
+        printf("%s: %s\n", sSrc, strerror(errno));
+        return -1;
+    }
+
+    while ((pEnt = readdir(pDir)))
+    {
+        nMonth = WxaMonthIndex(pEnt->d_name, &bArchive);
+        if ((nMonth < 0) || bArchive)
+            continue;
+
+        snprintf(sPath, sizeof(sPath), "%s/%s", sSrc, pEnt->d_name);
+        if (!(pMonth = opendir(sPath)))
+            continue;
+        while ((pDay = readdir(pMonth)))
+        {
+            if (((unsigned)(pDay->d_name[0] - '0') > 9) || ((unsigned)(pDay->d_name[1] - '0') > 9) ||
+                (pDay->d_name[2] != '\0'))
+                continue;
+            nMday = ((pDay->d_name[0] - '0') * 10) + (pDay->d_name[1] - '0');
+            if ((nMday < 1) || (nMday > 31))
+                continue;
+
+            if (nDates == nAlloc)
+            {
+                nAlloc = nAlloc ? (nAlloc * 2) : 1024;
+                if (!(pMore = (int *)realloc(pDates, nAlloc * sizeof(int))))
+                    break;
+                pDates = pMore;
+            }
+            pDates[nDates++] = ((1900 + (nMonth / 12)) * 10000) + (((nMonth % 12) + 1) * 100) + nMday;
+        }
+        closedir(pMonth);
+    }
+    closedir(pDir);
+
+    if (nDates)
+        qsort(pDates, nDates, sizeof(int), CmpDate);
+    *ppDates = pDates;
+
+    return nDates;
+}
+
+//
+// Import every day log under sSrcPath, each parsed day to fnSink.
+// Returns -1 if the tree can't be read.
+//
+int WxImport(const char *sSrcPath, int nThreads, WxiSinkFn fnSink, void *pCtx, WxiStats *pStats)
+{
+    WxiPool xPool;
+    WxiWorker *pW;
+    long nDates;
+    int n;
+
+    memset(pStats, 0, sizeof(*pStats));
+    memset(&xPool, 0, sizeof(xPool));
+    xPool.sSrc = sSrcPath;
+    xPool.fnSink = fnSink;
+    xPool.pCtx = pCtx;
+
+    nDates = ListDays(sSrcPath, &xPool.pDates);
+    if (nDates <= 0)
+        return (int)nDates;
+
+    if (nThreads <= 0)
+        nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nThreads > nDates)
+        nThreads = nDates;
+    if (nThreads < 1)
+        nThreads = 1;
+
+    xPool.pWorkers = (WxiWorker *)calloc(nThreads, sizeof(WxiWorker));
+    if (!xPool.pWorkers)
+    {
+        free(xPool.pDates);
+        return -1;
+    }
+    xPool.nWorkers = nThreads;
+
+    // Deal out contiguous runs
+    for (n = 0; n < nThreads; n++)
+    {
+        pW = &xPool.pWorkers[n];
+        pthread_mutex_init(&pW->xLock, NULL);
+        pW->pPool = &xPool;
+        pW->nId = n;
+        pW->nLo = (nDates * n) / nThreads;
+        pW->nHi = (nDates * (n + 1)) / nThreads;
+    }
+    // Worker 0 is this thread
+    for (n = 1; n < nThreads; n++)
+    {
+        pW = &xPool.pWorkers[n];
+        if (pthread_create(&pW->xThread, NULL, xImport, pW) != 0)
+            pW->nId = -1;
+    }
+    xImport(&xPool.pWorkers[0]);
+
+    for (n = 0; n < nThreads; n++)
+    {
+        pW = &xPool.pWorkers[n];
+        if (n && (pW->nId >= 0))
+            pthread_join(pW->xThread, NULL);
+        pthread_mutex_destroy(&pW->xLock);
+        pStats->nFiles += pW->xStats.nFiles;
+        pStats->nLines += pW->xStats.nLines;
+        pStats->nBad += pW->xStats.nBad;
+        pStats->nFailed += pW->xStats.nFailed;
+    }
+    free(xPool.pWorkers);
+    free(xPool.pDates);
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------
+// CLI - into the log tree
+
+// Months touched (rollups go stale), by months since 1900
+#define WXI_MONTHS      (200 * 12)
+
+typedef struct _WxiTarget
+{
+    int             nFormat;            // WX_FMT_xxx
+    int             bInPlace;           // Source is the log tree (no CSV rewrite)
+    unsigned char   bTouched[WXI_MONTHS];
+} WxiTarget;
+
+static int WriteFile(const char *sPath, const char *pData, size_t nLen)
+{
+    char sTemp[PATH_MAX + 8];
+    int fd, nRet = -1;
+
+    snprintf(sTemp, sizeof(sTemp), "%s.tmp", sPath);
+    fd = open(sTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    // On disk before the name is (as SaveArchive)
+    if ((write(fd, pData, nLen) == (ssize_t)nLen) && (fdatasync(fd) == 0))
+        nRet = 0;
+    close(fd);
+
+    if ((nRet == 0) && (rename(sTemp, sPath) == 0))
+        return 0;
+    unlink(sTemp);
+
+    return -1;
+}
+
+//
+// Write one day into the log tree (<Mmmyy>/<dd>) in the formats given
+//
+int WxiWriteDay(int nDate, const WxaDay *pDay, int nFormat)
+{
+    char sPath[PATH_MAX];
+    char *pBuf;
+    size_t nOut;
+    int nLen, nRet = 0;
+
+    nOut = snprintf(sPath, sizeof(sPath), "%s/%s%02d", sWLogPath, sMonName[((nDate / 100) % 100) - 1],
+                    (nDate / 10000) % 100);
+    if ((mkdir(sPath, 0755) != 0) && (errno != EEXIST))
+    {
+        printf("%s: %s\n", sPath, strerror(errno));
+        return -1;
+    }
+    snprintf(&sPath[nOut], sizeof(sPath) - nOut, "/%02d", nDate % 100);
+
+    if (nFormat & WX_FMT_CSV)
+    {
+        pBuf = (char *)malloc(WXA_MAX_SAMPLES * 128 + WXA_MAX_EXTRAS * 256);
+        nLen = pBuf ? WxaRender((WxaDay *)pDay, pBuf, WXA_MAX_SAMPLES * 128 + WXA_MAX_EXTRAS * 256) : -1;
+        if ((nLen < 0) || (WriteFile(sPath, pBuf, nLen) != 0))
+        {
+            printf("%s: write failed\n", sPath);
+            nRet = -1;
+        }
+        free(pBuf);
+    }
+
+    if (nFormat & WX_FMT_WXB)
+    {
+        strcat(sPath, WXB_EXT);
+        if (WxbWriteDay(sPath, pDay, WxqDateTime(nDate, 0)) != 0)
+            nRet = -1;
+    }
+
+    // Cached query results of the day are stale
+    WxmDrop(WxqDateTime(nDate, 0), WxqDateTime(WxqNextDate(nDate), 0));
+
+    return nRet;
+}
+
+static int SinkLogTree(int nDate, const WxaDay *pDay, void *pCtx)
+{
+    WxiTarget *pT = (WxiTarget *)pCtx;
+    int nMonth;
+
+    nMonth = (((nDate / 10000) - 1900) * 12) + ((nDate / 100) % 100) - 1;
+    if ((nMonth >= 0) && (nMonth < WXI_MONTHS))
+        pT->bTouched[nMonth] = TRUE;
+
+    // Source is the log tree - CSV stays as it is
+    return WxiWriteDay(nDate, pDay, pT->bInPlace ? (pT->nFormat & ~WX_FMT_CSV) : pT->nFormat);
+}
+
+int WxImportCli(const char *sSrcPath)
+{
+    char sSrc[PATH_MAX], sDst[PATH_MAX], sPath[PATH_MAX];
+    struct timespec tsStart, tsEnd;
+    WxiTarget *pT;
+    WxiStats xStats;
+    double fWall;
+    int n;
+
+    pT = (WxiTarget *)calloc(1, sizeof(WxiTarget));
+    if (!pT)
+        return -1;
+    pT->nFormat = nLogFormat;
+    pT->bInPlace = realpath(sSrcPath, sSrc) && realpath(sWLogPath, sDst) && (strcmp(sSrc, sDst) == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &tsStart);
+    if (WxImport(sSrcPath, 0, SinkLogTree, pT, &xStats) < 0)
+    {
+        free(pT);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+    fWall = (tsEnd.tv_sec - tsStart.tv_sec) + ((tsEnd.tv_nsec - tsStart.tv_nsec) / 1e9);
+
+    printf("Imported %ld days (%ld lines, %ld malformed, %ld failed) in %.2f sec\n",
+           xStats.nFiles, xStats.nLines, xStats.nBad, xStats.nFailed, fWall);
+
+    // Rollups of imported months are rebuilt from the new logs
+    for (n = 0; n < WXI_MONTHS; n++)
+    {
+        if (!pT->bTouched[n])
+            continue;
+        snprintf(sPath, sizeof(sPath), "%s/%s%02d" WXR_EXT, sWLogPath, sMonName[n % 12], (n / 12) % 100);
+        unlink(sPath);
+    }
+    free(pT);
+
+    WxqRescan();
+    WxRollRebuild(0, FALSE);
+
+    // Imported days may be older than the last one folded in
+    if (xStats.nFiles > xStats.nFailed)
+        WxnRebuild(0, TRUE);
+
+    return (xStats.nFailed > 0) ? -1 : 0;
+}
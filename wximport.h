@@ -0,0 +1,41 @@
+// wximport.h
+//
+// Bulk import of a CSV log tree (<Mmmyy>/<dd>) - day files mapped and
+// parsed in parallel, each day handed on as a normalized WxaDay
+//
+
+#ifndef WXIMPORT_H_INCLUDED
+#define WXIMPORT_H_INCLUDED
+
+#include "wxarch.h"
+
+// Malformed lines reported per file (all are counted)
+#define WXI_MAX_REPORT      4
+
+//
+// Import totals
+//
+typedef struct _WxiStats
+{
+    long    nFiles;
+    long    nLines;
+    long    nBad;                   // Malformed lines (skipped)
+    long    nFailed;                // Files not read or not written
+} WxiStats;
+
+// Called from the worker threads, non-zero := failed
+typedef int (*WxiSinkFn)(int nDate, const WxaDay *pDay, void *pCtx);
+
+// Parse one day log image (reentrant)
+extern int WxiParseDay(const char *pBuf, size_t nSize, WxaDay *pDay, const char *sName, long *pnLines);
+
+// nThreads == 0 := one per CPU
+extern int WxImport(const char *sSrcPath, int nThreads, WxiSinkFn fnSink, void *pCtx, WxiStats *pStats);
+
+// Write one day into the log tree (-l), WX_FMT_xxx
+extern int WxiWriteDay(int nDate, const WxaDay *pDay, int nFormat);
+
+// CLI: -I srcpath (into -l, formats per -O)
+extern int WxImportCli(const char *sSrcPath);
+
+#endif // WXIMPORT_H_INCLUDED
@@ -0,0 +1,709 @@
+// wxkern.c - Aggregation kernels
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "id4-pi.h"
+#include "wxarch.h"
+#include "wxkern.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WXK_X86
+#include <immintrin.h>
+#endif
+
+//
+// Queries and rollups reduce whole days of readings at a time; with
+// the readings turned into columns those reductions are the loops
+// below. The x86 sets are compiled per function (target attribute) so
+// the build needs no flags and the best set is picked at startup;
+// anything else (the Pi) runs the C loops. Wind at the SSE2 level stays
+// in C - without a byte shuffle the table lookup costs more than it
+// saves.
+//
+// Vector sums are kept in 32-bit lanes and moved out to 64 bits every
+// block, short enough that no lane can overflow.
+//
+
+// Readings per block of 32-bit sums
+#define WXK_BLOCK           16384
+
+// Vector steps per block of wind sums
+#define WXK_WIND_STEPS      16
+
+typedef struct _WxkOps
+{
+    void    (*fnStats)(const int16_t *pCol, int n, WxkStat *pStat);
+    int     (*fnCount)(const int16_t *pCol, int n, int nLo, int nHi);
+    int     (*fnFind)(const int16_t *pCol, int n, int nVal);
+    void    (*fnWind)(const int16_t *pSpeed, const int16_t *pDir, int n, const int16_t *pTabX,
+                      const int16_t *pTabY, int64_t *pnX, int64_t *pnY);
+} WxkOps;
+
+static const char * const sLevel[WXK_LEVELS] = { "scalar", "sse2", "avx2" };
+
+//-------------------------------------------------------------------------------
+// Plain C
+
+static void StatsScalar(const int16_t *pCol, int n, WxkStat *pStat)
+{
+    int nMin = 0, nMax = 0, i;
+    int64_t nSum = 0;
+
+    if (n > 0)
+        nMin = nMax = pCol[0];
+    for (i = 0; i < n; i++)
+    {
+        if (pCol[i] < nMin)
+            nMin = pCol[i];
+        if (pCol[i] > nMax)
+            nMax = pCol[i];
+        nSum += pCol[i];
+    }
+    pStat->nMin = nMin;
+    pStat->nMax = nMax;
+    pStat->nSum = nSum;
+
+    return;
+}
+
+static int CountScalar(const int16_t *pCol, int n, int nLo, int nHi)
+{
+    int nCnt = 0, i;
+
+    for (i = 0; i < n; i++)
+        nCnt += (pCol[i] >= nLo) && (pCol[i] <= nHi);
+
+    return nCnt;
+}
+
+static int FindScalar(const int16_t *pCol, int n, int nVal)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (pCol[i] == nVal)
+            return i;
+    }
+
+    return -1;
+}
+
+static void WindScalar(const int16_t *pSpeed, const int16_t *pDir, int n, const int16_t *pTabX,
+                       const int16_t *pTabY, int64_t *pnX, int64_t *pnY)
+{
+    int64_t nX = 0, nY = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        nX += pSpeed[i] * pTabX[pDir[i] & 0x0F];
+        nY += pSpeed[i] * pTabY[pDir[i] & 0x0F];
+    }
+    *pnX = nX;
+    *pnY = nY;
+
+    return;
+}
+
+static const WxkOps xScalar = { StatsScalar, CountScalar, FindScalar, WindScalar };
+
+#if defined(WXK_X86)
+//-------------------------------------------------------------------------------
+// SSE2 (8 readings a step)
+
+__attribute__((target("sse2")))
+static void StatsSse2(const int16_t *pCol, int n, WxkStat *pStat)
+{
+    __m128i vMin, vMax, vSum, v;
+    __m128i vOne = _mm_set1_epi16(1);
+    int16_t nLane[8];
+    int32_t nPart[4];
+    int64_t nSum = 0;
+    int nEnd, i = 0, k;
+
+    if (n < 8)
+    {
+        StatsScalar(pCol, n, pStat);
+        return;
+    }
+
+    vMin = vMax = _mm_loadu_si128((const __m128i *)pCol);
+    while ((i + 8) <= n)
+    {
+        nEnd = ((n - i) > WXK_BLOCK) ? (i + WXK_BLOCK) : n;
+        vSum = _mm_setzero_si128();
+        for ( ; (i + 8) <= nEnd; i += 8)
+        {
+            v = _mm_loadu_si128((const __m128i *)&pCol[i]);
+            vMin = _mm_min_epi16(vMin, v);
+            vMax = _mm_max_epi16(vMax, v);
+            vSum = _mm_add_epi32(vSum, _mm_madd_epi16(v, vOne));
+        }
+        _mm_storeu_si128((__m128i *)nPart, vSum);
+        nSum += (int64_t)nPart[0] + nPart[1] + nPart[2] + nPart[3];
+    }
+
+    _mm_storeu_si128((__m128i *)nLane, vMin);
+    pStat->nMin = nLane[0];
+    for (k = 1; k < 8; k++)
+    {
+        if (nLane[k] < pStat->nMin)
+            pStat->nMin = nLane[k];
+    }
+    _mm_storeu_si128((__m128i *)nLane, vMax);
+    pStat->nMax = nLane[0];
+    for (k = 1; k < 8; k++)
+    {
+        if (nLane[k] > pStat->nMax)
+            pStat->nMax = nLane[k];
+    }
+
+    for ( ; i < n; i++)
+    {
+        if (pCol[i] < pStat->nMin)
+            pStat->nMin = pCol[i];
+        if (pCol[i] > pStat->nMax)
+            pStat->nMax = pCol[i];
+        nSum += pCol[i];
+    }
+    pStat->nSum = nSum;
+
+    return;
+}
+
+__attribute__((target("sse2")))
+static int CountSse2(const int16_t *pCol, int n, int nLo, int nHi)
+{
+    __m128i vLo, vHi, vCnt, vOut, v;
+    __m128i vOne = _mm_set1_epi16(1);
+    int32_t nPart[4];
+    int nCnt = 0, nEnd, i = 0;
+
+    if (nLo < -32768)
+        nLo = -32768;
+    if (nHi > 32767)
+        nHi = 32767;
+    if (nLo > nHi)
+        return 0;
+
+    vLo = _mm_set1_epi16(nLo);
+    vHi = _mm_set1_epi16(nHi);
+    while ((i + 8) <= n)
+    {
+        nEnd = ((n - i) > WXK_BLOCK) ? (i + WXK_BLOCK) : n;
+        vCnt = _mm_setzero_si128();
+        for ( ; (i + 8) <= nEnd; i += 8)
+        {
+            v = _mm_loadu_si128((const __m128i *)&pCol[i]);
+            vOut = _mm_or_si128(_mm_cmplt_epi16(v, vLo), _mm_cmpgt_epi16(v, vHi));
+            vCnt = _mm_add_epi16(vCnt, _mm_andnot_si128(vOut, vOne));
+        }
+        _mm_storeu_si128((__m128i *)nPart, _mm_madd_epi16(vCnt, vOne));
+        nCnt += nPart[0] + nPart[1] + nPart[2] + nPart[3];
+    }
+
+    return nCnt + CountScalar(&pCol[i], n - i, nLo, nHi);
+}
+
+__attribute__((target("sse2")))
+static int FindSse2(const int16_t *pCol, int n, int nVal)
+{
+    __m128i vVal;
+    int nMask, i, k;
+
+    if ((nVal < -32768) || (nVal > 32767))
+        return -1;
+
+    vVal = _mm_set1_epi16(nVal);
+    for (i = 0; (i + 8) <= n; i += 8)
+    {
+        nMask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)&pCol[i]), vVal));
+        if (nMask)
+            return i + (__builtin_ctz(nMask) / 2);
+    }
+    k = FindScalar(&pCol[i], n - i, nVal);
+
+    return (k < 0) ? -1 : (i + k);
+}
+
+static const WxkOps xSse2 = { StatsSse2, CountSse2, FindSse2, WindScalar };
+
+//-------------------------------------------------------------------------------
+// AVX2 (16 readings a step)
+
+__attribute__((target("avx2")))
+static void StatsAvx2(const int16_t *pCol, int n, WxkStat *pStat)
+{
+    __m256i vMin, vMax, vSum, v;
+    __m256i vOne = _mm256_set1_epi16(1);
+    __m128i vMin4, vMax4;
+    int16_t nLane[8];
+    int32_t nPart[8];
+    int64_t nSum = 0;
+    int nEnd, i = 0, k;
+
+    if (n < 16)
+    {
+        StatsScalar(pCol, n, pStat);
+        return;
+    }
+
+    vMin = vMax = _mm256_loadu_si256((const __m256i *)pCol);
+    while ((i + 16) <= n)
+    {
+        nEnd = ((n - i) > WXK_BLOCK) ? (i + WXK_BLOCK) : n;
+        vSum = _mm256_setzero_si256();
+        for ( ; (i + 16) <= nEnd; i += 16)
+        {
+            v = _mm256_loadu_si256((const __m256i *)&pCol[i]);
+            vMin = _mm256_min_epi16(vMin, v);
+            vMax = _mm256_max_epi16(vMax, v);
+            vSum = _mm256_add_epi32(vSum, _mm256_madd_epi16(v, vOne));
+        }
+        _mm256_storeu_si256((__m256i *)nPart, vSum);
+        for (k = 0; k < 8; k++)
+            nSum += nPart[k];
+    }
+
+    vMin4 = _mm_min_epi16(_mm256_castsi256_si128(vMin), _mm256_extracti128_si256(vMin, 1));
+    vMax4 = _mm_max_epi16(_mm256_castsi256_si128(vMax), _mm256_extracti128_si256(vMax, 1));
+    _mm_storeu_si128((__m128i *)nLane, vMin4);
+    pStat->nMin = nLane[0];
+    for (k = 1; k < 8; k++)
+    {
+        if (nLane[k] < pStat->nMin)
+            pStat->nMin = nLane[k];
+    }
+    _mm_storeu_si128((__m128i *)nLane, vMax4);
+    pStat->nMax = nLane[0];
+    for (k = 1; k < 8; k++)
+    {
+        if (nLane[k] > pStat->nMax)
+            pStat->nMax = nLane[k];
+    }
+
+    for ( ; i < n; i++)
+    {
+        if (pCol[i] < pStat->nMin)
+            pStat->nMin = pCol[i];
+        if (pCol[i] > pStat->nMax)
+            pStat->nMax = pCol[i];
+        nSum += pCol[i];
+    }
+    pStat->nSum = nSum;
+
+    return;
+}
+
+__attribute__((target("avx2")))
+static int CountAvx2(const int16_t *pCol, int n, int nLo, int nHi)
+{
+    __m256i vLo, vHi, vCnt, vOut, v;
+    __m256i vOne = _mm256_set1_epi16(1);
+    int32_t nPart[8];
+    int nCnt = 0, nEnd, i = 0, k;
+
+    if (nLo < -32768)
+        nLo = -32768;
+    if (nHi > 32767)
+        nHi = 32767;
+    if (nLo > nHi)
+        return 0;
+
+    vLo = _mm256_set1_epi16(nLo);
+    vHi = _mm256_set1_epi16(nHi);
+    while ((i + 16) <= n)
+    {
+        nEnd = ((n - i) > WXK_BLOCK) ? (i + WXK_BLOCK) : n;
+        vCnt = _mm256_setzero_si256();
+        for ( ; (i + 16) <= nEnd; i += 16)
+        {
+            v = _mm256_loadu_si256((const __m256i *)&pCol[i]);
+            vOut = _mm256_or_si256(_mm256_cmpgt_epi16(vLo, v), _mm256_cmpgt_epi16(v, vHi));
+            vCnt = _mm256_add_epi16(vCnt, _mm256_andnot_si256(vOut, vOne));
+        }
+        _mm256_storeu_si256((__m256i *)nPart, _mm256_madd_epi16(vCnt, vOne));
+        for (k = 0; k < 8; k++)
+            nCnt += nPart[k];
+    }
+
+    return nCnt + CountScalar(&pCol[i], n - i, nLo, nHi);
+}
+
+__attribute__((target("avx2")))
+static int FindAvx2(const int16_t *pCol, int n, int nVal)
+{
+    __m256i vVal;
+    unsigned int nMask;
+    int i, k;
+
+    if ((nVal < -32768) || (nVal > 32767))
+        return -1;
+
+    vVal = _mm256_set1_epi16(nVal);
+    for (i = 0; (i + 16) <= n; i += 16)
+    {
+        nMask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)&pCol[i]),
+                                                                       vVal));
+        if (nMask)
+            return i + (__builtin_ctz(nMask) / 2);
+    }
+    k = FindScalar(&pCol[i], n - i, nVal);
+
+    return (k < 0) ? -1 : (i + k);
+}
+
+// 16-bit entries of a 16 entry table for direction codes in 16-bit lanes
+__attribute__((target("avx2")))
+static __m256i Lookup16(__m256i vLow, __m256i vHigh, __m256i vIdx)
+{
+    return _mm256_or_si256(_mm256_shuffle_epi8(vLow, vIdx),
+                           _mm256_slli_epi16(_mm256_shuffle_epi8(vHigh, vIdx), 8));
+}
+
+__attribute__((target("avx2")))
+static __m256i Widen64(__m256i vSum64, __m256i vSum32)
+{
+    vSum64 = _mm256_add_epi64(vSum64, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(vSum32)));
+
+    return _mm256_add_epi64(vSum64, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(vSum32, 1)));
+}
+
+__attribute__((target("avx2")))
+static void WindAvx2(const int16_t *pSpeed, const int16_t *pDir, int n, const int16_t *pTabX,
+                     const int16_t *pTabY, int64_t *pnX, int64_t *pnY)
+{
+    unsigned char nXLow[32], nXHigh[32], nYLow[32], nYHigh[32];
+    __m256i vXLow, vXHigh, vYLow, vYHigh, vIdx, vS, vX, vY, vX64, vY64;
+    int64_t nPart[4], nX = 0, nY = 0;
+    int i = 0, nStep, k;
+
+    // Table bytes in both halves - shuffles index within each
+    for (k = 0; k < 32; k++)
+    {
+        nXLow[k] = pTabX[k & 0x0F] & 0xFF;
+        nXHigh[k] = (pTabX[k & 0x0F] >> 8) & 0xFF;
+        nYLow[k] = pTabY[k & 0x0F] & 0xFF;
+        nYHigh[k] = (pTabY[k & 0x0F] >> 8) & 0xFF;
+    }
+    vXLow = _mm256_loadu_si256((const __m256i *)nXLow);
+    vXHigh = _mm256_loadu_si256((const __m256i *)nXHigh);
+    vYLow = _mm256_loadu_si256((const __m256i *)nYLow);
+    vYHigh = _mm256_loadu_si256((const __m256i *)nYHigh);
+
+    vX64 = vY64 = _mm256_setzero_si256();
+    while ((i + 16) <= n)
+    {
+        vX = vY = _mm256_setzero_si256();
+        for (nStep = 0; (nStep < WXK_WIND_STEPS) && ((i + 16) <= n); nStep++, i += 16)
+        {
+            // Direction in the low byte, high byte 0x80 (shuffles to 0)
+            vIdx = _mm256_or_si256(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)&pDir[i]),
+                                                    _mm256_set1_epi16(0x0F)), _mm256_set1_epi16((short)0x8000));
+            vS = _mm256_loadu_si256((const __m256i *)&pSpeed[i]);
+            vX = _mm256_add_epi32(vX, _mm256_madd_epi16(vS, Lookup16(vXLow, vXHigh, vIdx)));
+            vY = _mm256_add_epi32(vY, _mm256_madd_epi16(vS, Lookup16(vYLow, vYHigh, vIdx)));
+        }
+        vX64 = Widen64(vX64, vX);
+        vY64 = Widen64(vY64, vY);
+    }
+
+    _mm256_storeu_si256((__m256i *)nPart, vX64);
+    nX = nPart[0] + nPart[1] + nPart[2] + nPart[3];
+    _mm256_storeu_si256((__m256i *)nPart, vY64);
+    nY = nPart[0] + nPart[1] + nPart[2] + nPart[3];
+
+    WindScalar(&pSpeed[i], &pDir[i], n - i, pTabX, pTabY, pnX, pnY);
+    *pnX += nX;
+    *pnY += nY;
+
+    return;
+}
+
+static const WxkOps xAvx2 = { StatsAvx2, CountAvx2, FindAvx2, WindAvx2 };
+#endif // WXK_X86
+
+//-------------------------------------------------------------------------------
+// Dispatch
+
+// Plain C until WxkInit (before any threads)
+static const WxkOps *pOps = &xScalar;
+
+static const WxkOps *LevelOps(int nLevel)
+{
+#if defined(WXK_X86)
+    __builtin_cpu_init();
+    if ((nLevel == WXK_AVX2) && __builtin_cpu_supports("avx2"))
+        return &xAvx2;
+    if ((nLevel == WXK_SSE2) && __builtin_cpu_supports("sse2"))
+        return &xSse2;
+#endif
+
+    return (nLevel == WXK_SCALAR) ? &xScalar : NULL;
+}
+
+int WxkSetLevel(int nLevel)
+{
+    const WxkOps *pSet;
+
+    if ((nLevel < 0) || (nLevel >= WXK_LEVELS) || !(pSet = LevelOps(nLevel)))
+        return -1;
+    pOps = pSet;
+
+    return 0;
+}
+
+int WxkInit(void)
+{
+    int nLevel;
+
+    for (nLevel = WXK_LEVELS - 1; (nLevel > WXK_SCALAR) && (WxkSetLevel(nLevel) != 0); nLevel--)
+        ;
+    if (nLevel == WXK_SCALAR)
+        WxkSetLevel(WXK_SCALAR);
+
+    return nLevel;
+}
+
+const char *WxkName(int nLevel)
+{
+    return ((nLevel >= 0) && (nLevel < WXK_LEVELS)) ? sLevel[nLevel] : "?";
+}
+
+int WxkColumns(const WxaDay *pDay, WxkCols *pCols)
+{
+    const WxSample *pS;
+    int n, k = 0;
+
+    for (n = 0; n < pDay->nSamples; n++)
+    {
+        pS = &pDay->xSamples[n];
+        if ((pS->nTime < 0) || (pS->nTime >= 1440))
+            continue;
+        pCols->nCol[WXK_INDOOR][k] = pS->nIndoor;
+        pCols->nCol[WXK_OUTDOOR][k] = pS->nOutdoor;
+        pCols->nCol[WXK_WIND][k] = pS->nWind;
+        pCols->nCol[WXK_PRESSURE][k] = pS->nPressure;
+        pCols->nCol[WXK_TIME][k] = pS->nTime;
+        pCols->nCol[WXK_DIR][k] = pS->nDir;
+        k++;
+    }
+    pCols->nCount = k;
+
+    return k;
+}
+
+void WxkStats(const int16_t *pCol, int n, WxkStat *pStat)
+{
+    pOps->fnStats(pCol, n, pStat);
+
+    return;
+}
+
+// Readings in [nLo, nHi]
+int WxkCount(const int16_t *pCol, int n, int nLo, int nHi)
+{
+    return pOps->fnCount(pCol, n, nLo, nHi);
+}
+
+// First reading equal to nVal (-1 := none)
+int WxkFind(const int16_t *pCol, int n, int nVal)
+{
+    return pOps->fnFind(pCol, n, nVal);
+}
+
+// Sums of speed * table entry for direction (low 4 bits), |entry| <= WXK_WIND_SCALE
+void WxkWind(const int16_t *pSpeed, const int16_t *pDir, int n, const int16_t *pTabX,
+             const int16_t *pTabY, int64_t *pnX, int64_t *pnY)
+{
+    pOps->fnWind(pSpeed, pDir, n, pTabX, pTabY, pnX, pnY);
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Benchmark
+
+typedef struct _BenchOut
+{
+    WxkStat     xStat[WXK_PRESSURE + 1];
+    int         nFreezing;
+    int         nFind;
+    int64_t     nWindX, nWindY;
+} BenchOut;
+
+// Wind vectors by direction code (as the rollups)
+static const int16_t nBenchX[16] = { 0, -383, -924, -707, -383, -707, -1000, -924,
+                                     383, 707, 1000, 924, 0, 383, 924, 707 };
+static const int16_t nBenchY[16] = { 1000, 924, 383, 707, -924, -707, 0, -383,
+                                     924, 707, 0, 383, -1000, -924, -383, -707 };
+
+static double Elapsed(const struct timespec *pStart)
+{
+    struct timespec tsNow;
+
+    clock_gettime(CLOCK_MONOTONIC, &tsNow);
+
+    return ((tsNow.tv_sec - pStart->tv_sec) * 1000.0) + ((tsNow.tv_nsec - pStart->tv_nsec) / 1000000.0);
+}
+
+// Plain loops over readings as decoded
+static void BenchReference(const WxSample *pS, int n, int nFind, BenchOut *pOut)
+{
+    int nVal[WXK_PRESSURE + 1];
+    int i, k;
+
+    memset(pOut, 0, sizeof(*pOut));
+    pOut->nFind = -1;
+    for (i = 0; i < n; i++)
+    {
+        nVal[WXK_INDOOR] = pS[i].nIndoor;
+        nVal[WXK_OUTDOOR] = pS[i].nOutdoor;
+        nVal[WXK_WIND] = pS[i].nWind;
+        nVal[WXK_PRESSURE] = pS[i].nPressure;
+        for (k = 0; k <= WXK_PRESSURE; k++)
+        {
+            if ((i == 0) || (nVal[k] < pOut->xStat[k].nMin))
+                pOut->xStat[k].nMin = nVal[k];
+            if ((i == 0) || (nVal[k] > pOut->xStat[k].nMax))
+                pOut->xStat[k].nMax = nVal[k];
+            pOut->xStat[k].nSum += nVal[k];
+        }
+        if (pS[i].nOutdoor <= 32)
+            pOut->nFreezing++;
+        if ((pOut->nFind < 0) && (pS[i].nPressure == nFind))
+            pOut->nFind = i;
+        pOut->nWindX += pS[i].nWind * nBenchX[pS[i].nDir & 0x0F];
+        pOut->nWindY += pS[i].nWind * nBenchY[pS[i].nDir & 0x0F];
+    }
+
+    return;
+}
+
+static void BenchKernels(int16_t **pCol, int n, int nFind, BenchOut *pOut)
+{
+    int k;
+
+    memset(pOut, 0, sizeof(*pOut));
+    for (k = 0; k <= WXK_PRESSURE; k++)
+        WxkStats(pCol[k], n, &pOut->xStat[k]);
+    pOut->nFreezing = WxkCount(pCol[WXK_OUTDOOR], n, -32768, 32);
+    pOut->nFind = WxkFind(pCol[WXK_PRESSURE], n, nFind);
+    WxkWind(pCol[WXK_WIND], pCol[WXK_DIR], n, nBenchX, nBenchY, &pOut->nWindX, &pOut->nWindY);
+
+    return;
+}
+
+//
+// Readings that wander like the weather, reduced by the plain loops and
+// by each kernel set the CPU has (best of a few runs)
+//
+int WxkBench(int nMillions)
+{
+    struct timespec tsStart;
+    WxSample *pSamples;
+    int16_t *pCol[WXK_COLS];
+    BenchOut xRef, xOut;
+    double fRef = 0, fMs, fBest;
+    unsigned int nSeed = 4001;
+    int nLevel, nBest, n, i, k, nRet = 0;
+    int nOut = 40, nPress = 2992;
+
+    if ((nMillions < 1) || (nMillions > 100))
+    {
+        printf("Bad benchmark size: %d (1-100 million readings)\n", nMillions);
+        return -1;
+    }
+
+    n = nMillions * 1000000;
+    pSamples = (WxSample *)malloc(n * sizeof(WxSample));
+    for (k = 0; k < WXK_COLS; k++)
+        pCol[k] = (int16_t *)aligned_alloc(32, ((n * sizeof(int16_t)) + 31) & ~31);
+    if (!pSamples || !pCol[0] || !pCol[1] || !pCol[2] || !pCol[3] || !pCol[4] || !pCol[5])
+    {
+        printf("Benchmark alloc failed (%d million readings)\n", nMillions);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        nSeed = (nSeed * 1103515245) + 12345;
+        nOut += (int)((nSeed >> 16) % 3) - 1;
+        nOut = (nOut < -20) ? -20 : (nOut > 105) ? 105 : nOut;
+        nPress += (int)((nSeed >> 20) % 5) - 2;
+        nPress = (nPress < 2850) ? 2850 : (nPress > 3110) ? 3110 : nPress;
+        pSamples[i].nTime = (i % 72) * 20;
+        pSamples[i].nIndoor = 65 + ((nSeed >> 8) % 8);
+        pSamples[i].nOutdoor = nOut;
+        pSamples[i].nWind = (nSeed >> 24) % 40;
+        pSamples[i].nDir = (nSeed >> 12) & 0x0F;
+        pSamples[i].nPressure = nPress;
+    }
+    // Nowhere near the start
+    pSamples[n - 7].nPressure = 3120;
+
+    for (i = 0; i < n; i++)
+    {
+        pCol[WXK_INDOOR][i] = pSamples[i].nIndoor;
+        pCol[WXK_OUTDOOR][i] = pSamples[i].nOutdoor;
+        pCol[WXK_WIND][i] = pSamples[i].nWind;
+        pCol[WXK_PRESSURE][i] = pSamples[i].nPressure;
+        pCol[WXK_TIME][i] = pSamples[i].nTime;
+        pCol[WXK_DIR][i] = pSamples[i].nDir;
+    }
+
+    printf("Kernels: %d million readings, best of 5\n", nMillions);
+    for (k = 0; k < 5; k++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &tsStart);
+        BenchReference(pSamples, n, 3120, &xRef);
+        fMs = Elapsed(&tsStart);
+        if ((k == 0) || (fMs < fRef))
+            fRef = fMs;
+    }
+    printf("  %-10s %9.2f ms %7.2f ns/reading\n", "reference", fRef, (fRef * 1000000.0) / n);
+
+    nBest = WxkInit();
+    for (nLevel = WXK_SCALAR; nLevel < WXK_LEVELS; nLevel++)
+    {
+        if (WxkSetLevel(nLevel) != 0)
+        {
+            printf("  %-10s not on this CPU\n", WxkName(nLevel));
+            continue;
+        }
+        for (fBest = 0, k = 0; k < 5; k++)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &tsStart);
+            BenchKernels(pCol, n, 3120, &xOut);
+            fMs = Elapsed(&tsStart);
+            if ((k == 0) || (fMs < fBest))
+                fBest = fMs;
+        }
+        if (memcmp(&xOut, &xRef, sizeof(xOut)) != 0)
+            nRet = -1;
+        printf("  %-10s %9.2f ms %7.2f ns/reading %6.1fx %s\n", WxkName(nLevel), fBest,
+               (fBest * 1000000.0) / n, fRef / fBest, (memcmp(&xOut, &xRef, sizeof(xOut)) == 0) ? "ok" : "MISMATCH");
+    }
+    WxkSetLevel(nBest);
+    printf("Using %s kernels\n", WxkName(nBest));
+
+    for (k = 0; k < WXK_COLS; k++)
+        free(pCol[k]);
+    free(pSamples);
+
+    return nRet;
+}
@@ -0,0 +1,66 @@
+// wxkern.h
+//
+// Aggregation kernels - min/max/sum, range counts and wind vector sums
+// over int16 columns of readings as logged (F, mph, inHg * 100), with
+// SSE2 and AVX2 paths picked at startup and a plain C fallback
+//
+
+#ifndef WXKERN_H_INCLUDED
+#define WXKERN_H_INCLUDED
+
+#include <stdint.h>
+
+#include "wxarch.h"
+
+// Kernel sets (best the CPU has is used)
+#define WXK_SCALAR          0
+#define WXK_SSE2            1
+#define WXK_AVX2            2
+#define WXK_LEVELS          3
+
+// Column of WxkCols (same order as WXQ_xxx, then time and direction)
+#define WXK_INDOOR          0
+#define WXK_OUTDOOR         1
+#define WXK_WIND            2
+#define WXK_PRESSURE        3
+#define WXK_TIME            4
+#define WXK_DIR             5
+#define WXK_COLS            6
+
+// Wind tables hold at most this (vector sums scaled by 1000)
+#define WXK_WIND_SCALE      1024
+
+typedef struct _WxkStat
+{
+    int         nMin, nMax;
+    int64_t     nSum;
+} WxkStat;
+
+//
+// A day's readings by column
+//
+typedef struct _WxkCols
+{
+    int         nCount;
+    int16_t     nCol[WXK_COLS][WXA_MAX_SAMPLES] __attribute__((aligned(32)));
+} WxkCols;
+
+// Startup - pick the kernels for this CPU, returns WXK_xxx
+extern int WxkInit(void);
+extern int WxkSetLevel(int nLevel);
+extern const char *WxkName(int nLevel);
+
+// Readings with times in a day (0-1439) as columns, returns count
+extern int WxkColumns(const WxaDay *pDay, WxkCols *pCols);
+
+// Kernels - n readings from pCol
+extern void WxkStats(const int16_t *pCol, int n, WxkStat *pStat);
+extern int WxkCount(const int16_t *pCol, int n, int nLo, int nHi);
+extern int WxkFind(const int16_t *pCol, int n, int nVal);
+extern void WxkWind(const int16_t *pSpeed, const int16_t *pDir, int n, const int16_t *pTabX,
+                    const int16_t *pTabY, int64_t *pnX, int64_t *pnY);
+
+// -Y - kernels against plain loops over millions of readings
+extern int WxkBench(int nMillions);
+
+#endif // WXKERN_H_INCLUDED
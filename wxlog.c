@@ -0,0 +1,638 @@
+// wxlog.c - Weather log persistence stage
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxwal.h"
+#include "wxbin.h"
+#include "wxroll.h"
+#include "wxnorm.h"
+#include "wxstage.h"
+#include "wxquery.h"
+#include "wxmemo.h"
+
+//
+// Daily CSV logs: <sWLogPath>/<Mmmyy>/<dd>. Only the persistence stage
+// touches these once the pipeline is running.
+//
+// The day file stays open. Records are formatted into a group buffer
+// and written with one write() per batch (WxLogFlush), the stage thread
+// batching whatever has queued up. fsync follows nLogSync. Each batch
+// is journaled first (wxwal.c) so a torn tail can be repaired at startup;
+// one the journal could not take is synced straight after its write.
+//
+// At one reading per 20 minutes a batch is a single reading, so what
+// counts is the cost of a flush: one call per file - the journal frame,
+// the CSV write, the binary records and the rollup rows (one pwritev).
+// The binary log's hour index and the journal header only change on
+// disk at a sync, with the rest of what the journal window covers.
+// Bytes a failed write leaves behind stay buffered for the next flush.
+//
+// nLogFormat selects the CSV log, the binary log (<dd>.wxb, wxbin.c) or
+// both. Without the CSV log, the day's CSV is made from the binary log
+// when it is closed, so uploads and readers see the usual file.
+//
+// Each reading also goes into the month's hour/day/month rollups
+// (wxroll.c), written and synced along with the logs.
+//
+// With a staging directory (wxstage.c) the day's files and journal are
+// opened there and copied into the tree on its schedule, at midnite and
+// at close; rollups are written with those copies instead of per batch.
+//
+
+// Group commit buffer (one journal frame)
+#define WX_LOG_BUFSIZE      WX_WAL_BATCH
+
+// fsync policy (WX_SYNC_ALWAYS, WX_SYNC_ROTATE or seconds)
+int nLogSync = WX_SYNC_ROTATE;
+
+// Log files written (WX_FMT_xxx)
+int nLogFormat = WX_FMT_CSV | WX_FMT_WXB;
+
+static int fdLog = -1;
+static off_t nLogSize;
+static char sLogPath[64];
+static char sBinPath[64 + sizeof(WXB_EXT)];
+static char sLogName[16];           // /Mmmyy/dd below the log (or staging) root
+static char sOpenPath[128];         // Files written - staged copies or the above
+static char sOpenBin[128 + sizeof(WXB_EXT)];
+static int nLogDate;                // yyyymmdd of open log
+static char sLogBuf[WX_LOG_BUFSIZE];
+static size_t nLogBuf;
+static int bUnsynced;
+static size_t nLogJournaled;        // Leading bytes of sLogBuf already framed
+static int bUnjournaled;            // Batch written without its frame
+static time_t ttLastSync;
+static unsigned long nLogWrites, nLogSyncs, nWalErrors;
+static time_t ttLogged, ttFlushed;  // Latest reading buffered / written
+
+static int OpenLog(void);
+static void CloseLog(void);
+static int NewLog(time_t ttStamp, int xTime);
+
+// Open current log file for append (after failure or at startup)
+static int OpenLog(void)
+{
+    struct stat xInfo;
+
+    // Do nothing if no path
+    if (!sWLogPath || !sLogPath[0])
+        return FALSE;
+
+    if (fdLog >= 0)
+        return TRUE;
+
+    fdLog = open(sOpenPath, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fdLog < 0)
+    {
+        printf("Log open failed: %s\n", strerror(errno));
+        return FALSE;
+    }
+
+    // Journal appends from here on (anything still buffered included)
+    fstat(fdLog, &xInfo);
+    nLogSize = xInfo.st_size;
+    WalBegin(sLogName, nLogSize);
+    nLogJournaled = 0;
+
+    return TRUE;
+}
+
+static void SyncLog(void)
+{
+    if (bUnsynced)
+    {
+        if (fdLog >= 0)
+        {
+            fdatasync(fdLog);
+            WalCheckpoint(nLogSize);
+        }
+        WxbSync();
+        WxRollSync();
+        nLogSyncs++;
+    }
+    bUnsynced = FALSE;
+    bUnjournaled = FALSE;
+    ttLastSync = vc_time();
+
+    return;
+}
+
+//
+// Write out CSV group buffer. TRUE if all of it went; what a failed
+// write leaves stays buffered for the next flush.
+//
+static int FlushLog(void)
+{
+    size_t nDone = 0;
+    ssize_t nOut;
+
+    if (nLogBuf == 0)
+        return FALSE;
+
+    if (!OpenLog())
+        return FALSE;
+
+    // New bytes only - the rest are in the journal from a failed flush.
+    // A batch not covered by it is synced as soon as it is written.
+    if (nLogJournaled < nLogBuf)
+    {
+        if (WalAppend(nLogSize + nLogJournaled, &sLogBuf[nLogJournaled], nLogBuf - nLogJournaled) != 0)
+        {
+            nWalErrors++;
+            bUnjournaled = TRUE;
+        }
+        nLogJournaled = nLogBuf;
+    }
+
+    while (nDone < nLogBuf)
+    {
+        nOut = write(fdLog, &sLogBuf[nDone], nLogBuf - nDone);
+        if (nOut < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("Log write failed: %s\n", strerror(errno));
+            // Re-open on next flush
+            CloseLog();
+            break;
+        }
+        nDone += nOut;
+    }
+    nLogSize += nDone;
+    nLogBuf -= nDone;
+    nLogJournaled -= nDone;
+    if (nLogBuf > 0)
+    {
+        memmove(sLogBuf, &sLogBuf[nDone], nLogBuf);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// Staged copies of the day's files (and rollups) into the tree, bDone
+// when the day is finished with
+//
+static void StageOut(int bDone)
+{
+    char sName[sizeof(sLogName) + sizeof(WXB_EXT)];
+
+    if (!sStagePath || !sLogName[0])
+        return;
+
+    if (nLogFormat & WX_FMT_CSV)
+        WxStageFlush(sLogName, bDone);
+    if (nLogFormat & WX_FMT_WXB)
+    {
+        sprintf(sName, "%s" WXB_EXT, sLogName);
+        WxStageFlush(sName, bDone);
+    }
+    WxRollFlush();
+    WxRollSync();
+
+    // Buckets ending by the last reading written are final
+    WxmSeal(ttFlushed);
+
+    return;
+}
+
+//
+// Write out group buffers, sync if policy says so
+//
+void WxLogFlush(void)
+{
+    int nCsv, nBin;
+
+    // Counted (and sealed) only once every buffered byte is out
+    nCsv = (nLogBuf == 0) ? 0 : (FlushLog() ? 1 : -1);
+    nBin = WxbFlush();
+    if ((nCsv == 0) && (nBin == 0))
+        return;
+    bUnsynced = TRUE;
+    if ((nCsv < 0) || (nBin < 0))
+        return;
+    ttFlushed = ttLogged;
+    if (!sStagePath)
+    {
+        WxRollFlush();
+        WxmSeal(ttFlushed);
+    }
+
+    nLogWrites++;
+
+    // Journal full or missing a batch forces a sync (bounds recovery)
+    if ((nLogSync == WX_SYNC_ALWAYS) || WalFull() || bUnjournaled ||
+        ((nLogSync > 0) && ((vc_time() - ttLastSync) >= nLogSync)))
+        SyncLog();
+
+    if (sStagePath && WxStageDue())
+        StageOut(FALSE);
+
+    return;
+}
+
+//
+// Stage idle - how long until timed sync is due (NULL := no wait needed)
+//
+const struct timespec *WxLogIdleWait(void)
+{
+    static struct timespec tsWait;
+
+    if ((nLogSync <= 0) || !bUnsynced)
+        return NULL;
+
+    tsWait.tv_sec = nLogSync;
+    tsWait.tv_nsec = 0;
+
+    return &tsWait;
+}
+
+// Timed sync on idle - retries anything a failed write left
+void WxLogIdle(void)
+{
+    if (nLogSync > 0)
+    {
+        WxLogFlush();
+        SyncLog();
+    }
+
+    return;
+}
+
+// Append text to group buffer
+static void LogAppend(const char *sText, size_t nCnt)
+{
+    if (!(nLogFormat & WX_FMT_CSV))
+        return;
+
+    if ((nLogBuf + nCnt) > sizeof(sLogBuf))
+        WxLogFlush();
+    if ((nLogBuf + nCnt) > sizeof(sLogBuf))
+    {
+        printf("Log buffer full, %d bytes dropped\n", (int)nCnt);
+        return;
+    }
+
+    memcpy(&sLogBuf[nLogBuf], sText, nCnt);
+    nLogBuf += nCnt;
+
+    return;
+}
+
+// Close current log file
+static void CloseLog(void)
+{
+    if (fdLog >= 0)
+    {
+        close(fdLog);
+        fdLog = -1;
+    }
+
+    return;
+}
+
+// Flush, sync and close (shutdown)
+void WxLogClose(void)
+{
+    WxLogFlush();
+    SyncLog();
+    CloseLog();
+    WxbClose();
+    StageOut(TRUE);
+    WxRollClose();
+    WalClose();
+
+    return;
+}
+
+void WxLogStats(unsigned long *pWrites, unsigned long *pSyncs, unsigned long *pWalErrors)
+{
+    *pWrites = nLogWrites;
+    *pSyncs = nLogSyncs;
+    *pWalErrors = nWalErrors;
+
+    return;
+}
+
+// Create new, empty, daily log for date of ttStamp
+static int NewLog(time_t ttStamp, int xTime)
+{
+    struct stat	xInfo;
+    struct tm   tmDate;
+    size_t	nOut;
+    char        sRestart[WX_MSG_SIZE + 8];
+    int		nRes;
+    int		nRet = FALSE;
+
+    // No action if no path
+    if (!sWLogPath)
+        return TRUE;
+
+    vc_localtime(&ttStamp, &tmDate);
+
+    // Create path name from date (/mmmyy)
+    nOut = sprintf(sLogPath, "%s/%s%02d", sWLogPath, sMonName[tmDate.tm_mon], tmDate.tm_year - 100);
+    if (stat(sLogPath, &xInfo))
+    {
+        if ((errno == ENOTDIR) || (errno == ENOENT))
+        {
+            // Create path if non-existing
+            if (mkdir(sLogPath, 0755) == 0)
+                nRet = TRUE;
+        }
+    }
+    else
+    {
+        // Must be a directory
+        nRet = TRUE;
+    }
+
+    // nRet := TRUE if path OK
+    if (nRet)
+    {
+        // Create file name from date (/mmmyy/dd)
+        sprintf(&sLogPath[nOut], "/%02d", tmDate.tm_mday);
+        sprintf(sBinPath, "%s" WXB_EXT, sLogPath);
+
+        // Staged copies picked up from the tree (in place if that fails)
+        strcpy(sLogName, &sLogPath[strlen(sWLogPath)]);
+        snprintf(sOpenPath, sizeof(sOpenPath), "%s%s", WxStageRoot(), sLogName);
+        sprintf(sOpenBin, "%s" WXB_EXT, sOpenPath);
+        if (((nLogFormat & WX_FMT_CSV) && (WxStageOpen(sLogName) != 0)) ||
+            ((nLogFormat & WX_FMT_WXB) && (WxStageOpen(&sBinPath[strlen(sWLogPath)]) != 0)))
+        {
+            printf("Staging failed, logging in place\n");
+            strcpy(sOpenPath, sLogPath);
+            strcpy(sOpenBin, sBinPath);
+        }
+        nLogDate = ((tmDate.tm_year + 1900) * 10000) + ((tmDate.tm_mon + 1) * 100) + tmDate.tm_mday;
+
+        // Create file, stays open for the day
+        if (nLogFormat & WX_FMT_CSV)
+        {
+            if (OpenLog())
+            {
+                // Check if new file
+                if (nLogSize == 0)
+                {
+                    if (bLogWeather)
+                    {
+                        // Write weather header
+                        LogAppend(WEATHER_LOG_HEADER1, sizeof(WEATHER_LOG_HEADER1) - 1);
+                    }
+                    else
+                    {
+                        // No weather date logging
+                        LogAppend(NOWEATHER_LOG_HEADER, sizeof(NOWEATHER_LOG_HEADER) -1);
+                    }
+                }
+                else
+                {
+                    // No message if no time
+                    if (xTime >= 0)
+                    {
+                        // Append restart data
+                        nRes = WxFormatMessage(sRestart, xTime, "--System restart--\n");
+                        LogAppend(sRestart, nRes);
+                    }
+                }
+            }
+            else
+                nRet = FALSE;
+        }
+
+        if (nLogFormat & WX_FMT_WXB)
+        {
+            nRes = WxbOpen(sOpenBin, ttStamp, bLogWeather ? WXB_H_WEATHER : WXB_H_NOWEATHER);
+            if ((nRes == 0) && (xTime >= 0))
+                WxbMessage(xTime, ttStamp, "--System restart--\n");
+            else if (nRes < 0)
+                nRet = FALSE;
+        }
+    }
+
+    return nRet;
+}
+
+// Message line to each log
+static void LogText(int xTime, time_t ttStamp, const char *sMsg)
+{
+    char sLine[WX_MSG_SIZE + 8];
+
+    LogAppend(sLine, WxFormatMessage(sLine, xTime, sMsg));
+    WxbMessage(xTime, ttStamp, sMsg);
+
+    return;
+}
+
+//
+// Startup -- open (or create) today's log before records flow
+//
+int WxLogStart(int xTime)
+{
+    long nDropped, nReplayed;
+    int nRet;
+
+    // Repair whatever log was open if we went down hard
+    nDropped = sWLogPath ? WalRecover(&nReplayed) : 0;
+
+    // and copy whatever it left staged into the tree
+    if (sWLogPath && sStagePath)
+        WxStageRecover(vc_time());
+
+    nRet = NewLog(vc_time(), xTime);
+    if (nRet && (nDropped > 0))
+        LogText(xTime, vc_time(), "--Torn log record dropped--\n");
+    WxLogFlush();
+
+    return nRet;
+}
+
+//
+// Binary only - make the closed day's CSV from its binary log
+//
+static void MakeCsv(void)
+{
+    FILE *fCsv;
+
+    fCsv = fopen(sLogPath, "w");
+    if (!fCsv)
+    {
+        printf("Log open failed: %s\n", strerror(errno));
+        return;
+    }
+    if (WxbToCsv(sBinPath, fCsv) != 0)
+        printf("Log conversion failed: %s\n", sBinPath);
+    fclose(fCsv);
+
+    return;
+}
+
+//
+// Midnite -- finish the day's file, hand it on, start the next
+//
+static void RotateLog(WxRecord *pRec)
+{
+    WxLogFlush();
+    SyncLog();
+    CloseLog();
+    WxbClose();
+    StageOut(TRUE);
+
+    // Only if we have path, hand closed log to export
+    if (sWLogPath && sLogPath[0])
+    {
+        if (!(nLogFormat & WX_FMT_CSV))
+            MakeCsv();
+        WxRollDayClosed(nLogDate);
+        WxnDayClosed(nLogDate);
+        if (pRec->bUpload)
+            WxExportLog(sLogPath);
+        WxExportHousekeep();
+    }
+
+    if (!NewLog(pRec->ttStamp, pRec->nTime))
+        printf("Log file creation failed: %s\n", strerror(errno));
+
+    return;
+}
+
+//
+// CSV log lines - also used to rebuild CSV from the binary log, so
+// these define the CSV format
+//
+int WxFormatMessage(char *sLine, int xTime, const char *sMsg)
+{
+    return sprintf(sLine, "%d,%s", xTime, sMsg);
+}
+
+int WxFormatMinMax(char *sLine, WxMinMax *pM)
+{
+    int nCnt;
+
+    // Log Tlow/Thigh (1440 := midnite)
+    nCnt = sprintf(sLine, "1440,%d,%02d:%02d,%d,%02d:%02d", pM->nTLow, pM->nTLowTime / 60, pM->nTLowTime % 60,
+                   pM->nTHigh, pM->nTHighTime / 60, pM->nTHighTime % 60);
+
+    // Log Wind
+    nCnt += sprintf(&sLine[nCnt], ",%d,%02d:%02d", pM->nWind, pM->nWindTime / 60, pM->nWindTime % 60);
+
+    // Log Plow
+    nCnt += sprintf(&sLine[nCnt], ",%d.%02d,%02d:%02d", pM->nPLow / 100, pM->nPLow % 100,
+                    pM->nPLowTime / 60, pM->nPLowTime % 60);
+
+    // Log Phigh
+    nCnt += sprintf(&sLine[nCnt], ",%d.%02d,%02d:%02d\n", pM->nPHigh / 100, pM->nPHigh % 100,
+                    pM->nPHighTime / 60, pM->nPHighTime % 60);
+
+    return nCnt;
+}
+
+int WxFormatWeather(char *sLine, int xTime, WxWeather *pW)
+{
+    // time, indoor, outdoor, Wind, Direction, Pressure
+    return sprintf(sLine, "%d,%d,%d,%d,%s,%d.%02d\n", xTime, pW->nIndoor, pW->nOutdoor,
+                   pW->nWind, sWinDir[pW->nDir], pW->nPressure / 100, pW->nPressure % 100);
+}
+
+static void LogMessage(WxRecord *pRec)
+{
+    if (!sWLogPath)
+        return;
+
+    LogText(pRec->nTime, pRec->ttStamp, pRec->u.sMsg);
+    printf("LOG: %d,%s", pRec->nTime, pRec->u.sMsg);
+
+    return;
+}
+
+static void LogMinMax(WxRecord *pRec)
+{
+    char    sLine[128];
+
+    if (!sWLogPath)
+        return;
+
+    // Write min/max header
+    LogAppend(WEATHER_LOG_HEADER2, sizeof(WEATHER_LOG_HEADER2) - 1);
+    LogAppend(sLine, WxFormatMinMax(sLine, &pRec->u.xMinMax));
+    WxbMinMax(pRec->ttStamp, &pRec->u.xMinMax);
+
+    return;
+}
+
+static void LogCurrentReadings(WxRecord *pRec)
+{
+    char    sLine[64];
+
+    if (!sWLogPath)
+        return;
+
+    // Cached query results it falls into go first
+    ttLogged = WxqDateTime(nLogDate, pRec->nTime);
+    WxmAppend(ttLogged);
+
+    LogAppend(sLine, WxFormatWeather(sLine, pRec->nTime, &pRec->u.xWeather));
+    WxbWeather(pRec->nTime, pRec->ttStamp, &pRec->u.xWeather);
+    WxRollAdd(nLogDate, pRec->nTime, &pRec->u.xWeather);
+    WxnCheck(nLogDate, &pRec->u.xWeather);
+
+    return;
+}
+
+//
+// Persist one decoded record (buffered until WxLogFlush)
+//
+void WxLogRecord(WxRecord *pRec)
+{
+    switch (pRec->nType)
+    {
+    case WX_REC_WEATHER:
+        LogCurrentReadings(pRec);
+        break;
+
+    case WX_REC_MINMAX:
+        LogMinMax(pRec);
+        break;
+
+    case WX_REC_MESSAGE:
+        LogMessage(pRec);
+        break;
+
+    case WX_REC_NEWLOG:
+        RotateLog(pRec);
+        break;
+
+    case WX_REC_HISTORY:
+        // Not logged - on to the export stage
+        WxExportHistory(pRec->ttStamp, pRec->u.pHistory);
+        break;
+
+    default:
+        break;
+    }
+
+    return;
+}
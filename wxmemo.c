@@ -0,0 +1,316 @@
+// wxmemo.c - Query result cache
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "wxmemo.h"
+
+//
+// A bucket's aggregate depends only on the interval it covers, so the
+// key is [ttStart, ttEnd) whatever query asked: "last 24h" by hour an
+// hour later finds all but its newest bucket, extremes over a month
+// find every day but today.
+//
+// The seal is how far the logs are final. The logger raises it as its
+// writes reach the log tree; a reading for an earlier time than the
+// seal (clock set back, replayed journal) pulls it back and drops what
+// it covers. Anything else rewriting days (archive, import, backfill)
+// drops their buckets. Either bumps the generation, so a query that
+// was already reading the old logs does not store what it found.
+//
+
+typedef struct _WxmEntry
+{
+    struct _WxmEntry    *pChain;            // Hash slot list
+    struct _WxmEntry    *pNewer, *pOlder;   // LRU list
+    time_t              ttStart, ttEnd;
+    WxqBucket           xB;
+} WxmEntry;
+
+static pthread_mutex_t memo_mutex = PTHREAD_MUTEX_INITIALIZER;
+static WxmEntry **pSlots;
+static unsigned long nSlotMask;
+static WxmEntry *pNewest, *pOldest;
+static long nMaxEntries;
+static unsigned long nMemoGen;
+static time_t ttMemoSealed;
+static WxmStats xMemoStats;
+
+//-------------------------------------------------------------------------------
+// Table (memo_mutex held)
+
+static WxmEntry **SlotOf(time_t ttStart, time_t ttEnd)
+{
+    uint64_t nHash;
+
+    nHash = ((uint64_t)ttStart * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)(ttEnd - ttStart) * 0xC2B2AE3D27D4EB4FULL);
+    nHash ^= nHash >> 29;
+
+    return &pSlots[nHash & nSlotMask];
+}
+
+static WxmEntry *Find(time_t ttStart, time_t ttEnd)
+{
+    WxmEntry *pE;
+
+    for (pE = *SlotOf(ttStart, ttEnd); pE; pE = pE->pChain)
+    {
+        if ((pE->ttStart == ttStart) && (pE->ttEnd == ttEnd))
+            break;
+    }
+
+    return pE;
+}
+
+static void LinkNewest(WxmEntry *pE)
+{
+    pE->pOlder = pNewest;
+    pE->pNewer = NULL;
+    if (pNewest)
+        pNewest->pNewer = pE;
+    else
+        pOldest = pE;
+    pNewest = pE;
+
+    return;
+}
+
+static void UnlinkLru(WxmEntry *pE)
+{
+    if (pE->pNewer)
+        pE->pNewer->pOlder = pE->pOlder;
+    else
+        pNewest = pE->pOlder;
+    if (pE->pOlder)
+        pE->pOlder->pNewer = pE->pNewer;
+    else
+        pOldest = pE->pNewer;
+
+    return;
+}
+
+static void Unlink(WxmEntry *pE)
+{
+    WxmEntry **ppE;
+
+    for (ppE = SlotOf(pE->ttStart, pE->ttEnd); *ppE && (*ppE != pE); ppE = &(*ppE)->pChain)
+        ;
+    if (*ppE)
+        *ppE = pE->pChain;
+    UnlinkLru(pE);
+    xMemoStats.nEntries--;
+
+    return;
+}
+
+// Entries overlapping [ttFrom, ttTo)
+static void DropRange(time_t ttFrom, time_t ttTo)
+{
+    WxmEntry *pE, *pOlder;
+
+    for (pE = pNewest; pE; pE = pOlder)
+    {
+        pOlder = pE->pOlder;
+        if ((pE->ttStart < ttTo) && (pE->ttEnd > ttFrom))
+        {
+            Unlink(pE);
+            free(pE);
+            xMemoStats.nDropped++;
+        }
+    }
+    nMemoGen++;
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Cache
+
+int WxmInit(long nBudget, time_t ttSealed)
+{
+    WxmEntry *pE;
+    unsigned long nSlots;
+
+    pthread_mutex_lock(&memo_mutex);
+
+    while ((pE = pOldest))
+    {
+        Unlink(pE);
+        free(pE);
+    }
+    free(pSlots);
+    pSlots = NULL;
+    nMemoGen++;
+
+    memset(&xMemoStats, 0, sizeof(xMemoStats));
+    ttMemoSealed = ttSealed;
+    nMaxEntries = (nBudget > 0) ? (nBudget / sizeof(WxmEntry)) : 0;
+    if (nMaxEntries > 0)
+    {
+        for (nSlots = 64; nSlots < (unsigned long)nMaxEntries; nSlots <<= 1)
+            ;
+        pSlots = (WxmEntry **)calloc(nSlots, sizeof(WxmEntry *));
+        nSlotMask = nSlots - 1;
+        xMemoStats.nBudget = nBudget;
+    }
+
+    pthread_mutex_unlock(&memo_mutex);
+
+    if ((nMaxEntries > 0) && !pSlots)
+    {
+        printf("Query cache: no memory for %ld entries\n", nMaxEntries);
+        return -1;
+    }
+
+    return 0;
+}
+
+unsigned long WxmBegin(time_t *pttSealed)
+{
+    unsigned long nGen;
+
+    pthread_mutex_lock(&memo_mutex);
+    nGen = nMemoGen;
+    *pttSealed = ttMemoSealed;
+    pthread_mutex_unlock(&memo_mutex);
+
+    return nGen;
+}
+
+int WxmGet(time_t ttStart, time_t ttEnd, WxqBucket *pB)
+{
+    WxmEntry *pE = NULL;
+
+    pthread_mutex_lock(&memo_mutex);
+    if (pSlots)
+    {
+        pE = Find(ttStart, ttEnd);
+        if (pE)
+        {
+            UnlinkLru(pE);
+            LinkNewest(pE);
+            *pB = pE->xB;
+            xMemoStats.nHits++;
+        }
+        else
+            xMemoStats.nMisses++;
+    }
+    pthread_mutex_unlock(&memo_mutex);
+
+    return pE != NULL;
+}
+
+void WxmPut(time_t ttStart, time_t ttEnd, const WxqBucket *pB, unsigned long nGen, time_t ttSealed)
+{
+    WxmEntry *pE, **ppSlot;
+
+    pthread_mutex_lock(&memo_mutex);
+
+    // Open, or the logs changed while it was read
+    if (!pSlots || (ttEnd > ttSealed) || (nGen != nMemoGen) || Find(ttStart, ttEnd))
+    {
+        pthread_mutex_unlock(&memo_mutex);
+        return;
+    }
+
+    if (xMemoStats.nEntries >= nMaxEntries)
+    {
+        pE = pOldest;
+        Unlink(pE);
+        xMemoStats.nEvicted++;
+    }
+    else
+        pE = (WxmEntry *)malloc(sizeof(WxmEntry));
+
+    if (pE)
+    {
+        pE->ttStart = ttStart;
+        pE->ttEnd = ttEnd;
+        pE->xB = *pB;
+        ppSlot = SlotOf(ttStart, ttEnd);
+        pE->pChain = *ppSlot;
+        *ppSlot = pE;
+        LinkNewest(pE);
+        xMemoStats.nEntries++;
+        xMemoStats.nStores++;
+    }
+
+    pthread_mutex_unlock(&memo_mutex);
+
+    return;
+}
+
+void WxmAppend(time_t ttTime)
+{
+    pthread_mutex_lock(&memo_mutex);
+    // Nothing cached ends past the seal
+    if (ttTime < ttMemoSealed)
+    {
+        DropRange(ttTime, ttMemoSealed);
+        ttMemoSealed = ttTime;
+    }
+    pthread_mutex_unlock(&memo_mutex);
+
+    return;
+}
+
+void WxmSeal(time_t ttTime)
+{
+    pthread_mutex_lock(&memo_mutex);
+    if (ttTime > ttMemoSealed)
+        ttMemoSealed = ttTime;
+    pthread_mutex_unlock(&memo_mutex);
+
+    return;
+}
+
+void WxmDrop(time_t ttFrom, time_t ttTo)
+{
+    pthread_mutex_lock(&memo_mutex);
+    DropRange(ttFrom, ttTo);
+    pthread_mutex_unlock(&memo_mutex);
+
+    return;
+}
+
+void WxmGetStats(WxmStats *pStats)
+{
+    pthread_mutex_lock(&memo_mutex);
+    *pStats = xMemoStats;
+    pStats->nBytes = (xMemoStats.nEntries * sizeof(WxmEntry)) +
+                     (pSlots ? ((nSlotMask + 1) * sizeof(WxmEntry *)) : 0);
+    pStats->ttSealed = ttMemoSealed;
+    pthread_mutex_unlock(&memo_mutex);
+
+    return;
+}
+
+void WxmPrintStats(FILE *fOut)
+{
+    WxmStats xS;
+    unsigned long nLookups;
+
+    WxmGetStats(&xS);
+    nLookups = xS.nHits + xS.nMisses;
+
+    fprintf(fOut, "Hits,Misses,HitPct,Stores,Evicted,Dropped,Entries,Bytes,Budget,Sealed\n");
+    fprintf(fOut, "%lu,%lu,%.1f,%lu,%lu,%lu,%ld,%ld,%ld,%ld\n", xS.nHits, xS.nMisses,
+            nLookups ? ((100.0 * xS.nHits) / nLookups) : 0.0, xS.nStores, xS.nEvicted, xS.nDropped,
+            xS.nEntries, xS.nBytes, xS.nBudget, (long)xS.ttSealed);
+
+    return;
+}
@@ -0,0 +1,52 @@
+// wxmemo.h
+//
+// Query result cache - aggregates of closed time buckets, keyed by the
+// interval they cover. A bucket is closed once the logger has put a
+// later reading on disk; closed buckets stay until the memory budget
+// pushes them out (least recently used first) or their days change.
+//
+
+#ifndef WXMEMO_H_INCLUDED
+#define WXMEMO_H_INCLUDED
+
+#include <stdio.h>
+#include <time.h>
+
+#include "wxquery.h"
+
+// Budget unless -q says otherwise (KB)
+#define WXM_DEF_BUDGET      2048
+
+typedef struct _WxmStats
+{
+    unsigned long   nHits, nMisses;     // Bucket lookups
+    unsigned long   nStores;            // Closed buckets added
+    unsigned long   nEvicted;           // Pushed out by the budget
+    unsigned long   nDropped;           // Days changed under them
+    long            nEntries, nBytes, nBudget;
+    time_t          ttSealed;           // Closed before this
+} WxmStats;
+
+// Budget in bytes (0 := off), buckets before ttSealed are closed
+extern int WxmInit(long nBudget, time_t ttSealed);
+
+// Before computing - generation and seal to store results under
+extern unsigned long WxmBegin(time_t *pttSealed);
+
+// Bucket [ttStart, ttEnd) if cached
+extern int WxmGet(time_t ttStart, time_t ttEnd, WxqBucket *pB);
+
+// Computed bucket - kept if closed and nothing changed since WxmBegin()
+extern void WxmPut(time_t ttStart, time_t ttEnd, const WxqBucket *pB, unsigned long nGen, time_t ttSealed);
+
+// Logger - reading at ttTime buffered / readings through ttTime on disk
+extern void WxmAppend(time_t ttTime);
+extern void WxmSeal(time_t ttTime);
+
+// Logs of [ttFrom, ttTo) rewritten
+extern void WxmDrop(time_t ttFrom, time_t ttTo);
+
+extern void WxmGetStats(WxmStats *pStats);
+extern void WxmPrintStats(FILE *fOut);
+
+#endif // WXMEMO_H_INCLUDED
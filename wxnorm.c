@@ -0,0 +1,655 @@
+// wxnorm.c - Climate normals by calendar day
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxarch.h"
+#include "wxquery.h"
+#include "wxkern.h"
+#include "wxstream.h"
+#include "wxnorm.h"
+
+//
+// Each calendar day has one slot of running sums - daily means, lows
+// and highs - and the record low and high with their years, so a day
+// closing costs one slot update and a baseline is a few divides on a
+// slot found from the date alone. Slots mark the years folded in; a day
+// is never counted twice, whichever way it arrives.
+//
+// A day's low and high are the lowest and highest of its readings and
+// of the device's min/max block logged at midnite. The whole table
+// (27 KB) is held in memory; a closed day rewrites its slot and the
+// header in place. A rebuild (no file, or -U) reads every logged day
+// before today, a month of the year per thread, and replaces the file.
+// Only the logger (at startup) and -U write it; queries and exports
+// only read it, so a day not folded in yet shows up once they have run.
+//
+
+#define WXN_CSV_HEADER      "Date,Years,Outdoor,OLow,OHigh,ORecLow,Year,ORecHigh,Year," \
+                            "Pressure,PLow,PHigh,PRecLow,Year,PRecHigh,Year\n"
+
+//
+// A day's readings, by field
+//
+typedef struct _WxnDay
+{
+    int         nCount;
+    long        nSum[WXN_FIELDS];
+    int         nMin[WXN_FIELDS], nMax[WXN_FIELDS];
+} WxnDay;
+
+static WxnSlot xSlots[WXN_SLOTS];
+static int nLastDate;
+static int bLoaded = FALSE;
+static int bOnFile = FALSE;
+static pthread_mutex_t norm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Record alerts raised today, by field (low, high)
+static int nAlertDate;
+static int bAlerted[WXN_FIELDS][2];
+
+static void StorePath(char *sPath, size_t nSize)
+{
+    snprintf(sPath, nSize, "%s/" WXN_FILE, sWLogPath);
+
+    return;
+}
+
+// Rounded nSum / nCount
+static int Avg(long nSum, int nCount)
+{
+    return (nSum >= 0) ? ((nSum + (nCount / 2)) / nCount) : -((-nSum + (nCount / 2)) / nCount);
+}
+
+//-------------------------------------------------------------------------------
+// Days and slots
+
+static int DayStats(const WxaDay *pDay, WxnDay *pStat)
+{
+    static const int nCol[WXN_FIELDS] = { WXK_OUTDOOR, WXK_PRESSURE };
+    const WxMinMax *pM;
+    WxkCols xCols;
+    WxkStat xStat;
+    int n, k;
+
+    memset(pStat, 0, sizeof(*pStat));
+    pStat->nCount = WxkColumns(pDay, &xCols);
+    if (pStat->nCount == 0)
+        return FALSE;
+
+    for (k = 0; k < WXN_FIELDS; k++)
+    {
+        WxkStats(xCols.nCol[nCol[k]], xCols.nCount, &xStat);
+        pStat->nMin[k] = xStat.nMin;
+        pStat->nMax[k] = xStat.nMax;
+        pStat->nSum[k] = (long)xStat.nSum;
+    }
+
+    // The device saw the readings in between
+    for (n = 0; n < pDay->nExtras; n++)
+    {
+        if (pDay->xExtras[n].nKind != WXA_X_MINMAX)
+            continue;
+        pM = &pDay->xExtras[n].xMinMax;
+        if (pM->nTLow <= pM->nTHigh)
+        {
+            if (pM->nTLow < pStat->nMin[WXN_OUTDOOR])
+                pStat->nMin[WXN_OUTDOOR] = pM->nTLow;
+            if (pM->nTHigh > pStat->nMax[WXN_OUTDOOR])
+                pStat->nMax[WXN_OUTDOOR] = pM->nTHigh;
+        }
+        if ((pM->nPLow > 0) && (pM->nPLow <= pM->nPHigh))
+        {
+            if (pM->nPLow < pStat->nMin[WXN_PRESSURE])
+                pStat->nMin[WXN_PRESSURE] = pM->nPLow;
+            if (pM->nPHigh > pStat->nMax[WXN_PRESSURE])
+                pStat->nMax[WXN_PRESSURE] = pM->nPHigh;
+        }
+    }
+
+    return TRUE;
+}
+
+static int HasYear(const WxnSlot *pSlot, int nYear)
+{
+    nYear -= WXN_BASE_YEAR;
+
+    return (nYear < 0) || (nYear >= WXN_YEARS) || (pSlot->nYearMap[nYear / 32] & (1U << (nYear % 32)));
+}
+
+// FALSE if the year is in already (or out of range)
+static int Fold(WxnSlot *pSlot, int nYear, const WxnDay *pDay)
+{
+    WxnStat *pF;
+    int k;
+
+    if (HasYear(pSlot, nYear))
+        return FALSE;
+
+    for (k = 0; k < WXN_FIELDS; k++)
+    {
+        pF = &pSlot->xStat[k];
+        pF->nSumMean += Avg(pDay->nSum[k] * 10, pDay->nCount);
+        pF->nSumLow += pDay->nMin[k];
+        pF->nSumHigh += pDay->nMax[k];
+
+        // Ties stay with the earlier year
+        if ((pSlot->nYears == 0) || (pDay->nMin[k] < pF->nRecLow))
+        {
+            pF->nRecLow = pDay->nMin[k];
+            pF->nRecLowYear = nYear;
+        }
+        if ((pSlot->nYears == 0) || (pDay->nMax[k] > pF->nRecHigh))
+        {
+            pF->nRecHigh = pDay->nMax[k];
+            pF->nRecHighYear = nYear;
+        }
+    }
+    pSlot->nYearMap[(nYear - WXN_BASE_YEAR) / 32] |= 1U << ((nYear - WXN_BASE_YEAR) % 32);
+    pSlot->nYears++;
+
+    return TRUE;
+}
+
+static WxnSlot *SlotOf(WxnSlot *pSlots, int nDate)
+{
+    int nMon = (nDate / 100) % 100, nMday = nDate % 100;
+
+    if ((nMon < 1) || (nMon > 12) || (nMday < 1) || (nMday > 31))
+        return NULL;
+
+    return &pSlots[WXN_SLOT(nMon, nMday)];
+}
+
+//-------------------------------------------------------------------------------
+// Store (norm_mutex held)
+
+static void Load(void)
+{
+    char sPath[PATH_MAX];
+    WxnHead xHead;
+    int fd;
+
+    if (bLoaded || !sWLogPath)
+        return;
+    bLoaded = TRUE;
+
+    StorePath(sPath, sizeof(sPath));
+    fd = open(sPath, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    if ((read(fd, &xHead, sizeof(xHead)) != sizeof(xHead)) || (xHead.nMagic != WXN_MAGIC) ||
+        (xHead.nVersion != WXN_VERSION) || (xHead.nSlotSize != sizeof(WxnSlot)) ||
+        (xHead.nSlots != WXN_SLOTS))
+        printf("Normals %s: bad header, starting over\n", sPath);
+    else if (read(fd, xSlots, sizeof(xSlots)) != sizeof(xSlots))
+    {
+        printf("Normals %s: short read\n", sPath);
+        memset(xSlots, 0, sizeof(xSlots));
+    }
+    else
+    {
+        nLastDate = xHead.nLastDate;
+        bOnFile = TRUE;
+    }
+    close(fd);
+
+    return;
+}
+
+static void MakeHead(WxnHead *pHead)
+{
+    memset(pHead, 0, sizeof(*pHead));
+    pHead->nMagic = WXN_MAGIC;
+    pHead->nVersion = WXN_VERSION;
+    pHead->nSlotSize = sizeof(WxnSlot);
+    pHead->nSlots = WXN_SLOTS;
+    pHead->nLastDate = nLastDate;
+
+    return;
+}
+
+static int Save(void)
+{
+    char sPath[PATH_MAX], sTemp[PATH_MAX + 8];
+    WxnHead xHead;
+    int fd, nRet = -1;
+
+    StorePath(sPath, sizeof(sPath));
+    snprintf(sTemp, sizeof(sTemp), "%s.tmp", sPath);
+    MakeHead(&xHead);
+
+    fd = open(sTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        if ((write(fd, &xHead, sizeof(xHead)) == sizeof(xHead)) &&
+            (write(fd, xSlots, sizeof(xSlots)) == sizeof(xSlots)) && (fdatasync(fd) == 0))
+            nRet = 0;
+        close(fd);
+        if ((nRet == 0) && (rename(sTemp, sPath) != 0))
+            nRet = -1;
+    }
+    if (nRet != 0)
+    {
+        printf("Normals write failed: %s: %s\n", sPath, strerror(errno));
+        unlink(sTemp);
+    }
+    else
+        bOnFile = TRUE;
+
+    return nRet;
+}
+
+// One slot and the header in place
+static int SaveSlot(const WxnSlot *pSlot)
+{
+    char sPath[PATH_MAX];
+    WxnHead xHead;
+    off_t nOffset;
+    int fd, nRet = -1;
+
+    if (!bOnFile)
+        return Save();
+
+    StorePath(sPath, sizeof(sPath));
+    MakeHead(&xHead);
+    nOffset = sizeof(xHead) + ((pSlot - xSlots) * sizeof(WxnSlot));
+
+    fd = open(sPath, O_WRONLY);
+    if (fd >= 0)
+    {
+        if ((pwrite(fd, pSlot, sizeof(*pSlot), nOffset) == sizeof(*pSlot)) &&
+            (pwrite(fd, &xHead, sizeof(xHead), 0) == sizeof(xHead)) && (fdatasync(fd) == 0))
+            nRet = 0;
+        close(fd);
+    }
+    if (nRet != 0)
+        printf("Normals write failed: %s: %s\n", sPath, strerror(errno));
+
+    return nRet;
+}
+
+//-------------------------------------------------------------------------------
+// Persistence stage
+
+//
+// Day's log closed - into its calendar day
+//
+void WxnDayClosed(int nDate)
+{
+    WxnSlot *pSlot;
+    WxaDay *pDay;
+    WxnDay xDay;
+
+    if (!sWLogPath || (nDate == 0))
+        return;
+
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    if (pDay && (WxqLoadDay(nDate, pDay, NULL) == 0) && DayStats(pDay, &xDay))
+    {
+        pthread_mutex_lock(&norm_mutex);
+        Load();
+        pSlot = SlotOf(xSlots, nDate);
+        if (pSlot && Fold(pSlot, nDate / 10000, &xDay))
+        {
+            if (nDate > nLastDate)
+                nLastDate = nDate;
+            SaveSlot(pSlot);
+        }
+        pthread_mutex_unlock(&norm_mutex);
+    }
+    free(pDay);
+
+    return;
+}
+
+static void Alert(int nField, int bHigh, int nVal, const WxnStat *pF)
+{
+    char sText[80];
+    int nWas = bHigh ? pF->nRecHigh : pF->nRecLow;
+
+    if (nField == WXN_PRESSURE)
+        snprintf(sText, sizeof(sText), "pressure %s %d.%02d beats %d.%02d (%d)", bHigh ? "high" : "low",
+                 nVal / 100, nVal % 100, nWas / 100, nWas % 100, bHigh ? pF->nRecHighYear : pF->nRecLowYear);
+    else
+        snprintf(sText, sizeof(sText), "outdoor %s %d beats %d (%d)", bHigh ? "high" : "low",
+                 nVal, nWas, bHigh ? pF->nRecHighYear : pF->nRecLowYear);
+
+    printf("Record %s\n", sText);
+    WxStreamEvent("record", sText);
+
+    return;
+}
+
+//
+// Logged reading - past the day's record low or high (once a day each)
+//
+void WxnCheck(int nDate, const WxWeather *pW)
+{
+    const WxnSlot *pSlot;
+    const WxnStat *pF;
+    int nVal[WXN_FIELDS];
+    int k;
+
+    if (!sWLogPath || (nDate == 0))
+        return;
+
+    pthread_mutex_lock(&norm_mutex);
+    Load();
+    pSlot = SlotOf(xSlots, nDate);
+    if (pSlot && (pSlot->nYears >= WXN_RECORD_YEARS) && !HasYear(pSlot, nDate / 10000))
+    {
+        if (nDate != nAlertDate)
+        {
+            memset(bAlerted, 0, sizeof(bAlerted));
+            nAlertDate = nDate;
+        }
+
+        nVal[WXN_OUTDOOR] = pW->nOutdoor;
+        nVal[WXN_PRESSURE] = pW->nPressure;
+        for (k = 0; k < WXN_FIELDS; k++)
+        {
+            pF = &pSlot->xStat[k];
+            if (!bAlerted[k][0] && (nVal[k] < pF->nRecLow))
+            {
+                Alert(k, FALSE, nVal[k], pF);
+                bAlerted[k][0] = TRUE;
+            }
+            if (!bAlerted[k][1] && (nVal[k] > pF->nRecHigh))
+            {
+                Alert(k, TRUE, nVal[k], pF);
+                bAlerted[k][1] = TRUE;
+            }
+        }
+    }
+    pthread_mutex_unlock(&norm_mutex);
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Rebuild
+
+typedef struct _NormJob
+{
+    WxnSlot *pSlots;
+    int     nFirst, nEnd;           // Days to read [nFirst, nEnd) (yyyymmdd)
+    int     nNext;
+    int     nDays;
+    int     nLastDate[12];
+} NormJob;
+
+static void *xNormBuild(void *args)
+{
+    NormJob *pJob = (NormJob *)args;
+    WxaDay *pDay;
+    WxnDay xDay;
+    int nMon, nYear, nMday, nDate;
+
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    if (!pDay)
+        return NULL;
+
+    // Years in order, so the earlier year keeps a tied record
+    while ((nMon = __atomic_fetch_add(&pJob->nNext, 1, __ATOMIC_RELAXED)) < 12)
+    {
+        for (nYear = pJob->nFirst / 10000; nYear <= pJob->nEnd / 10000; nYear++)
+        {
+            for (nMday = 1; nMday <= 31; nMday++)
+            {
+                nDate = (nYear * 10000) + ((nMon + 1) * 100) + nMday;
+                if ((nDate < pJob->nFirst) || (nDate >= pJob->nEnd))
+                    continue;
+                if ((WxqLoadDay(nDate, pDay, NULL) != 0) || !DayStats(pDay, &xDay))
+                    continue;
+                if (Fold(&pJob->pSlots[WXN_SLOT(nMon + 1, nMday)], nYear, &xDay))
+                {
+                    __atomic_fetch_add(&pJob->nDays, 1, __ATOMIC_RELAXED);
+                    pJob->nLastDate[nMon] = nDate;
+                }
+            }
+        }
+    }
+    free(pDay);
+
+    return NULL;
+}
+
+static int BuildAll(int nThreads, int nFirst, int nEnd)
+{
+    pthread_t *pThreads;
+    NormJob xJob;
+    int n;
+
+    memset(&xJob, 0, sizeof(xJob));
+    xJob.pSlots = (WxnSlot *)calloc(WXN_SLOTS, sizeof(WxnSlot));
+    if (!xJob.pSlots)
+        return -1;
+    xJob.nFirst = nFirst;
+    xJob.nEnd = nEnd;
+
+    if (nThreads <= 0)
+        nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nThreads > 12)
+        nThreads = 12;
+    if (nThreads < 1)
+        nThreads = 1;
+
+    pThreads = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
+    for (n = 0; pThreads && (n < nThreads); n++)
+    {
+        if (pthread_create(&pThreads[n], NULL, xNormBuild, &xJob) != 0)
+            break;
+    }
+    // Help out (and cover thread failures)
+    xNormBuild(&xJob);
+    while (pThreads && (n-- > 0))
+        pthread_join(pThreads[n], NULL);
+    free(pThreads);
+
+    memcpy(xSlots, xJob.pSlots, sizeof(xSlots));
+    free(xJob.pSlots);
+    nLastDate = 0;
+    for (n = 0; n < 12; n++)
+    {
+        if (xJob.nLastDate[n] > nLastDate)
+            nLastDate = xJob.nLastDate[n];
+    }
+
+    return (Save() == 0) ? xJob.nDays : -1;
+}
+
+//
+// Days since the last one folded in (restart after midnite)
+//
+static int CatchUp(int nFirst, int nEnd)
+{
+    WxnSlot *pSlot;
+    WxaDay *pDay;
+    WxnDay xDay;
+    int nDate, nDays = 0;
+
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    if (!pDay)
+        return -1;
+
+    nDate = nLastDate ? WxqNextDate(nLastDate) : nFirst;
+    if (nDate < nFirst)
+        nDate = nFirst;
+    for ( ; nDate < nEnd; nDate = WxqNextDate(nDate))
+    {
+        if ((WxqLoadDay(nDate, pDay, NULL) != 0) || !DayStats(pDay, &xDay))
+            continue;
+        pSlot = SlotOf(xSlots, nDate);
+        if (pSlot && Fold(pSlot, nDate / 10000, &xDay))
+        {
+            nLastDate = nDate;
+            nDays++;
+        }
+    }
+    free(pDay);
+
+    if (nDays && (Save() != 0))
+        return -1;
+
+    return nDays;
+}
+
+//
+// Fold in logged days before today not in yet (before logging starts),
+// bAll or no file := every day from scratch. Returns days folded in.
+//
+int WxnRebuild(int nThreads, int bAll)
+{
+    int nFirst, nLast, nEnd, nDays;
+
+    if (!sWLogPath || (WxqDays(&nFirst, &nLast) == 0))
+        return 0;
+
+    // Today closes at midnite
+    nEnd = WxqDateOf(vc_time());
+    if (nLast < nEnd)
+        nEnd = WxqNextDate(nLast);
+
+    pthread_mutex_lock(&norm_mutex);
+    Load();
+    if (bAll || !bOnFile)
+    {
+        nDays = BuildAll(nThreads, nFirst, nEnd);
+        if (nDays >= 0)
+            printf("Normals built from %d days\n", nDays);
+    }
+    else
+    {
+        nDays = CatchUp(nFirst, nEnd);
+        if (nDays > 0)
+            printf("Normals: %d days folded in\n", nDays);
+    }
+    pthread_mutex_unlock(&norm_mutex);
+
+    return nDays;
+}
+
+//-------------------------------------------------------------------------------
+// Readers
+
+//
+// Baseline for the calendar day of nDate - -1 if nothing logged on it
+//
+int WxnGet(int nDate, WxnNormal *pNorm)
+{
+    const WxnSlot *pSlot;
+    const WxnStat *pF;
+    int k;
+
+    memset(pNorm, 0, sizeof(*pNorm));
+    pthread_mutex_lock(&norm_mutex);
+    Load();
+    pSlot = SlotOf(xSlots, nDate);
+    if (pSlot && pSlot->nYears)
+    {
+        pNorm->nYears = pSlot->nYears;
+        for (k = 0; k < WXN_FIELDS; k++)
+        {
+            pF = &pSlot->xStat[k];
+            pNorm->xField[k].nMean = Avg(pF->nSumMean, pSlot->nYears);
+            pNorm->xField[k].nLow = Avg((long)pF->nSumLow * 10, pSlot->nYears);
+            pNorm->xField[k].nHigh = Avg((long)pF->nSumHigh * 10, pSlot->nYears);
+            pNorm->xField[k].nRecLow = pF->nRecLow;
+            pNorm->xField[k].nRecLowYear = pF->nRecLowYear;
+            pNorm->xField[k].nRecHigh = pF->nRecHigh;
+            pNorm->xField[k].nRecHighYear = pF->nRecHighYear;
+        }
+    }
+    pthread_mutex_unlock(&norm_mutex);
+
+    return pNorm->nYears ? 0 : -1;
+}
+
+// Tenths of a degree, pressure to hundredths
+static void PrintTenths(int nField, int nVal, FILE *fOut)
+{
+    if (nField == WXN_PRESSURE)
+    {
+        nVal = Avg(nVal, 10);
+        fprintf(fOut, ",%d.%02d", nVal / 100, nVal % 100);
+    }
+    else
+        fprintf(fOut, ",%s%d.%d", (nVal < 0) ? "-" : "", abs(nVal) / 10, abs(nVal) % 10);
+
+    return;
+}
+
+int WxnPrint(int nFrom, int nTo, FILE *fOut)
+{
+    WxnNormal xNorm;
+    int nDate, nCount = 0, k;
+
+    fputs(WXN_CSV_HEADER, fOut);
+    for (nDate = nFrom; nDate < nTo; nDate = WxqNextDate(nDate))
+    {
+        if (WxnGet(nDate, &xNorm) != 0)
+            continue;
+
+        fprintf(fOut, "%d-%02d-%02d,%d", nDate / 10000, (nDate / 100) % 100, nDate % 100, xNorm.nYears);
+        for (k = 0; k < WXN_FIELDS; k++)
+        {
+            PrintTenths(k, xNorm.xField[k].nMean, fOut);
+            PrintTenths(k, xNorm.xField[k].nLow, fOut);
+            PrintTenths(k, xNorm.xField[k].nHigh, fOut);
+            if (k == WXN_PRESSURE)
+                fprintf(fOut, ",%d.%02d,%d,%d.%02d,%d",
+                        xNorm.xField[k].nRecLow / 100, xNorm.xField[k].nRecLow % 100, xNorm.xField[k].nRecLowYear,
+                        xNorm.xField[k].nRecHigh / 100, xNorm.xField[k].nRecHigh % 100, xNorm.xField[k].nRecHighYear);
+            else
+                fprintf(fOut, ",%d,%d,%d,%d", xNorm.xField[k].nRecLow, xNorm.xField[k].nRecLowYear,
+                        xNorm.xField[k].nRecHigh, xNorm.xField[k].nRecHighYear);
+        }
+        fputc('\n', fOut);
+        nCount++;
+    }
+
+    return nCount;
+}
+
+FILE *WxnOpenUri(const char *sUri)
+{
+    char sFrom[24], sTo[24];
+    time_t ttFrom, ttTo;
+    FILE *fOut;
+
+    if (!sWLogPath || (sscanf(sUri, "normals/%23[^/]/%23[^.]", sFrom, sTo) != 2) ||
+        (strcmp(sUri + strlen(sUri) - 4, ".csv") != 0) ||
+        (WxqParseWhen(sFrom, &ttFrom, FALSE) != 0) || (WxqParseWhen(sTo, &ttTo, TRUE) != 0))
+        return NULL;
+
+    fOut = tmpfile();
+    if (fOut == NULL)
+        return NULL;
+
+    WxnPrint(WxqDateOf(ttFrom), WxqDateOf(ttTo), fOut);
+    rewind(fOut);
+
+    return fOut;
+}
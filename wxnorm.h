@@ -0,0 +1,101 @@
+// wxnorm.h
+//
+// Climate normals - baselines by calendar day across the logged years
+// (mean, normal low and high, record low and high of outdoor temperature
+// and pressure), folded in as each day closes and kept in one file
+// beside the logs (id4norm.wxn)
+//
+
+#ifndef WXNORM_H_INCLUDED
+#define WXNORM_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "wxpipe.h"
+
+#define WXN_FILE            "id4norm.wxn"
+
+#define WXN_MAGIC           0x314E5857      // "WXN1"
+#define WXN_VERSION         1
+
+// One slot per calendar day (Feb 29 has its own), straight from the date
+#define WXN_SLOT(m, d)      ((((m) - 1) * 31) + ((d) - 1))
+#define WXN_SLOTS           (12 * 31)
+
+// Fields
+#define WXN_OUTDOOR         0
+#define WXN_PRESSURE        1
+#define WXN_FIELDS          2
+
+// Years folded into a slot are marked from here
+#define WXN_BASE_YEAR       1970
+#define WXN_YEARS           128
+
+// Years a day needs before a new extreme is called a record
+#define WXN_RECORD_YEARS    3
+
+//
+// File header - slots follow
+//
+typedef struct _WxnHead
+{
+    uint32_t    nMagic;
+    uint16_t    nVersion;
+    uint16_t    nSlotSize;
+    uint32_t    nSlots;
+    int32_t     nLastDate;          // Folded in through (yyyymmdd)
+} WxnHead;
+
+//
+// One field of a slot - as logged (F, inHg * 100), means in tenths
+//
+typedef struct _WxnStat
+{
+    int64_t     nSumMean;           // Daily means
+    int32_t     nSumLow, nSumHigh;  // Daily extremes
+    int16_t     nRecLow, nRecHigh;
+    int16_t     nRecLowYear, nRecHighYear;
+} WxnStat;
+
+//
+// One calendar day (72 bytes)
+//
+typedef struct _WxnSlot
+{
+    uint32_t    nYears;             // Days folded in
+    uint32_t    nYearMap[WXN_YEARS / 32];
+    uint32_t    nSpare;
+    WxnStat     xStat[WXN_FIELDS];
+} WxnSlot;
+
+//
+// Baseline for a date - normals in tenths of the logged unit
+//
+typedef struct _WxnNormal
+{
+    int         nYears;
+    struct
+    {
+        int     nMean, nLow, nHigh;
+        int     nRecLow, nRecLowYear;
+        int     nRecHigh, nRecHighYear;
+    } xField[WXN_FIELDS];
+} WxnNormal;
+
+// Persistence stage - fold in a closed day, check a reading for records
+extern void WxnDayClosed(int nDate);
+extern void WxnCheck(int nDate, const WxWeather *pW);
+
+// Startup - fold in days closed while down, bAll (or no file) := from
+// scratch. nThreads == 0 := one per CPU.
+extern int WxnRebuild(int nThreads, int bAll);
+
+// Readers - dates [nFrom, nTo)
+extern int WxnGet(int nDate, WxnNormal *pNorm);
+extern int WxnPrint(int nFrom, int nTo, FILE *fOut);
+
+// Web: normals/<from>/<to>.csv - CSV in a temp file (NULL := not ours)
+extern FILE *WxnOpenUri(const char *sUri);
+
+#endif // WXNORM_H_INCLUDED
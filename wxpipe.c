@@ -0,0 +1,623 @@
+// wxpipe.c - ID4 processing pipeline
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "ID4Serial.h"
+#include "threadqueue.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxarch.h"
+#include "wxquery.h"
+#include "wxstream.h"
+#include "wxhist.h"
+#include "wxgap.h"
+#include "wxring.h"
+
+//
+// The ID4 command thread only talks to the device. Each response is
+// handed down the pipeline as a WxRecord:
+//
+//   acquisition -> [qDecode] -> decode/validate -> [qStore] -> persistence
+//                                        persistence -> [qExport] -> export
+//                                        persistence -> [spill]   -> stream
+//
+// Fast samples (-G) stop at decode/validate - they go to the recent
+// readings ring (wxring.c) with the logged readings and no further.
+//
+// Queues are bounded (WX_QUEUE_DEPTH) so a stalled disk or FTP server
+// eventually pushes back on the stage before it rather than growing
+// without limit. Unthreaded (simulation) each post runs the stages inline.
+//
+
+extern int ftpUpload(char *srcFile, char *dstFile);
+
+static struct threadqueue qDecode, qStore, qExport;
+static pthread_t tDecode, tStore, tExport;
+static int bPipeThreaded = FALSE;
+static int bPipeRunning = FALSE;
+
+static WxPipeStats xStats;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define WX_STAT_INC(x)  do { pthread_mutex_lock(&stats_mutex); xStats.x++; pthread_mutex_unlock(&stats_mutex); } while (0)
+
+static void DecodeRecord(WxRecord *pRec);
+static void ExportLog(char *sPath);
+static void Housekeep(void);
+static void MergeHistory(time_t ttStamp, const unsigned char *sRaw);
+
+static void FreeRecord(WxRecord *pRec)
+{
+    if (pRec->nType == WX_REC_HISTORY)
+        free(pRec->u.pHistory);
+    free(pRec);
+
+    return;
+}
+
+//
+// Queue record for next stage, note when backpressure applies
+//
+static int WxPipePut(struct threadqueue *pQueue, void *pData, long nType)
+{
+    int rc;
+
+    if (thread_queue_length(pQueue) >= WX_QUEUE_DEPTH)
+        WX_STAT_INC(nStalls);
+
+    rc = thread_queue_add(pQueue, pData, nType);
+    if (rc != 0)
+        printf("Pipeline queue add failed: %s\n", strerror(rc));
+
+    return rc;
+}
+
+//
+// Decode/validate stage
+//
+static void *xWxDecode(void *args)
+{
+    struct threadmsg msg;
+
+    (void)args;
+
+    while (TRUE)
+    {
+        if (thread_queue_get(&qDecode, NULL, &msg) != 0)
+            break;
+
+        // Shutdown marker passes down the line
+        if (msg.msgtype == 0)
+        {
+            WxPipePut(&qStore, NULL, 0);
+            break;
+        }
+
+        DecodeRecord((WxRecord *)msg.data);
+        if (msg.msgtype == WX_REC_SAMPLE)
+        {
+            WX_STAT_INC(nRecords[WX_REC_SAMPLE]);
+            FreeRecord((WxRecord *)msg.data);
+            continue;
+        }
+        if (WxPipePut(&qStore, msg.data, msg.msgtype) != 0)
+            FreeRecord((WxRecord *)msg.data);
+    }
+
+    return NULL;
+}
+
+//
+// Persistence stage - takes everything queued as one batch (group commit)
+//
+static void *xWxStore(void *args)
+{
+    struct threadmsg msg;
+    WxRecord *pRec;
+    int rc, nBatch;
+
+    (void)args;
+
+    while (TRUE)
+    {
+        // Wake for timed log sync if one is due
+        rc = thread_queue_get(&qStore, WxLogIdleWait(), &msg);
+        if (rc == ETIMEDOUT)
+        {
+            WxLogIdle();
+            continue;
+        }
+        if (rc != 0)
+            break;
+
+        for (nBatch = 1; ; nBatch++)
+        {
+            if (msg.msgtype == 0)
+            {
+                WxLogClose();
+                WxPipePut(&qExport, NULL, 0);
+                return NULL;
+            }
+
+            pRec = (WxRecord *)msg.data;
+            WxLogRecord(pRec);
+            WxStreamRecord(pRec);
+            WX_STAT_INC(nRecords[pRec->nType]);
+            FreeRecord(pRec);
+
+            // Sole consumer - no wait if length says there is more
+            if ((nBatch >= WX_QUEUE_DEPTH) || (thread_queue_length(&qStore) == 0))
+                break;
+            if (thread_queue_get(&qStore, NULL, &msg) != 0)
+                break;
+        }
+
+        WxLogFlush();
+    }
+
+    return NULL;
+}
+
+// Export stage jobs
+#define WX_JOB_UPLOAD   1
+#define WX_JOB_HOUSEKEEP 2
+#define WX_JOB_HISTORY  3
+
+// Device history on its way to the summary store
+typedef struct _WxHistJob
+{
+    time_t          ttStamp;
+    unsigned char   sRaw[HISTORY_BUF_SIZE];
+} WxHistJob;
+
+//
+// Export stage
+//
+static void *xWxExport(void *args)
+{
+    struct threadmsg msg;
+
+    (void)args;
+
+    while (TRUE)
+    {
+        if (thread_queue_get(&qExport, NULL, &msg) != 0)
+            break;
+
+        if (msg.msgtype == 0)
+            break;
+
+        if (msg.msgtype == WX_JOB_HOUSEKEEP)
+        {
+            Housekeep();
+            continue;
+        }
+
+        if (msg.msgtype == WX_JOB_HISTORY)
+        {
+            MergeHistory(((WxHistJob *)msg.data)->ttStamp, ((WxHistJob *)msg.data)->sRaw);
+            free(msg.data);
+            continue;
+        }
+
+        ExportLog((char *)msg.data);
+        free(msg.data);
+    }
+
+    return NULL;
+}
+
+int WxPipeStart(int bThreaded)
+{
+    int rc;
+
+    bPipeThreaded = bThreaded;
+    bPipeRunning = TRUE;
+    if (!bThreaded)
+        return 0;
+
+    thread_queue_init(&qDecode);
+    thread_queue_init(&qStore);
+    thread_queue_init(&qExport);
+    thread_queue_set_limit(&qDecode, WX_QUEUE_DEPTH);
+    thread_queue_set_limit(&qStore, WX_QUEUE_DEPTH);
+    thread_queue_set_limit(&qExport, WX_QUEUE_DEPTH);
+
+    rc = pthread_create(&tExport, NULL, xWxExport, NULL);
+    if (rc == 0)
+        rc = pthread_create(&tStore, NULL, xWxStore, NULL);
+    if (rc == 0)
+        rc = pthread_create(&tDecode, NULL, xWxDecode, NULL);
+    if (rc != 0)
+    {
+        printf("Pipeline thread create failed: %s\n", strerror(rc));
+        return rc;
+    }
+
+    return 0;
+}
+
+//
+// Drain and stop pipeline (stages exit in order behind the marker)
+//
+void WxPipeStop(void)
+{
+    if (!bPipeRunning)
+        return;
+    bPipeRunning = FALSE;
+
+    if (!bPipeThreaded)
+    {
+        WxLogClose();
+        WxStreamStop();
+        return;
+    }
+
+    WxPipePut(&qDecode, NULL, 0);
+    pthread_join(tDecode, NULL);
+    pthread_join(tStore, NULL);
+    pthread_join(tExport, NULL);
+    WxStreamStop();
+
+    thread_queue_cleanup(&qDecode, TRUE);
+    thread_queue_cleanup(&qStore, TRUE);
+    thread_queue_cleanup(&qExport, TRUE);
+
+    return;
+}
+
+void WxPipeGetStats(WxPipeStats *pStats)
+{
+    pthread_mutex_lock(&stats_mutex);
+    *pStats = xStats;
+    pthread_mutex_unlock(&stats_mutex);
+    WxLogStats(&pStats->nWrites, &pStats->nSyncs, &pStats->nWalErrors);
+
+    return;
+}
+
+//
+// Start record down the pipe
+//
+static int WxPipeSubmit(WxRecord *pRec)
+{
+    if (!bPipeThreaded)
+    {
+        DecodeRecord(pRec);
+        if (pRec->nType == WX_REC_SAMPLE)
+        {
+            WX_STAT_INC(nRecords[WX_REC_SAMPLE]);
+            FreeRecord(pRec);
+            return 0;
+        }
+        WxLogRecord(pRec);
+        WxLogFlush();
+        WxStreamRecord(pRec);
+        WX_STAT_INC(nRecords[pRec->nType]);
+        FreeRecord(pRec);
+        return 0;
+    }
+
+    if (WxPipePut(&qDecode, pRec, pRec->nType) != 0)
+    {
+        FreeRecord(pRec);
+        return -1;
+    }
+
+    return 0;
+}
+
+static WxRecord *WxNewRecord(int nType, int xTime)
+{
+    WxRecord *pRec;
+    struct timespec tsNow;
+
+    pRec = (WxRecord *)calloc(1, sizeof(WxRecord));
+    if (!pRec)
+    {
+        printf("Pipeline record alloc failed\n");
+        return NULL;
+    }
+
+    pRec->nType = nType;
+    pRec->nTime = xTime;
+    vc_gettime(&tsNow);
+    pRec->ttStamp = tsNow.tv_sec;
+    pRec->nStampNs = tsNow.tv_nsec;
+
+    return pRec;
+}
+
+int WxPostWeather(int xTime, unsigned char *sWeatherBuf)
+{
+    WxRecord *pRec = WxNewRecord(WX_REC_WEATHER, xTime);
+
+    if (!pRec)
+        return -1;
+    memcpy(pRec->sRaw, sWeatherBuf, WEATHER_BUF_SIZE);
+
+    return WxPipeSubmit(pRec);
+}
+
+int WxPostMinMax(int xTime, unsigned char *sBuf1, unsigned char *sBuf2)
+{
+    WxRecord *pRec = WxNewRecord(WX_REC_MINMAX, xTime);
+
+    if (!pRec)
+        return -1;
+    memcpy(pRec->sRaw, sBuf1, MMTEMP_BUF_SIZE);
+    memcpy(&pRec->sRaw[MMTEMP_BUF_SIZE], sBuf2, MMPRES_BUF_SIZE);
+
+    return WxPipeSubmit(pRec);
+}
+
+int WxPostMessage(int xTime, char *sMsg)
+{
+    WxRecord *pRec = WxNewRecord(WX_REC_MESSAGE, xTime);
+
+    if (!pRec)
+        return -1;
+    strncpy(pRec->u.sMsg, sMsg, WX_MSG_SIZE - 1);
+
+    return WxPipeSubmit(pRec);
+}
+
+//
+// Start new daily log named from the current date, xTime (if >= 0) marks
+// a restart in an existing log. bUpload sends the log being closed on.
+//
+int WxPostNewLog(int xTime, int bUpload)
+{
+    WxRecord *pRec = WxNewRecord(WX_REC_NEWLOG, xTime);
+
+    if (!pRec)
+        return -1;
+    pRec->bUpload = bUpload;
+
+    return WxPipeSubmit(pRec);
+}
+
+//
+// Device history down the pipe, so days closed ahead of it are on disk
+// before it is compared with them
+//
+int WxPostHistory(unsigned char *sHistBuf)
+{
+    WxRecord *pRec = WxNewRecord(WX_REC_HISTORY, -1);
+
+    if (!pRec)
+        return -1;
+    pRec->u.pHistory = (unsigned char *)malloc(HISTORY_BUF_SIZE);
+    if (!pRec->u.pHistory)
+    {
+        free(pRec);
+        return -1;
+    }
+    memcpy(pRec->u.pHistory, sHistBuf, HISTORY_BUF_SIZE);
+
+    return WxPipeSubmit(pRec);
+}
+
+//
+// Fast sample - decoded into the recent readings ring, never logged
+//
+int WxPostSample(unsigned char *sWeatherBuf)
+{
+    WxRecord *pRec = WxNewRecord(WX_REC_SAMPLE, -1);
+
+    if (!pRec)
+        return -1;
+    memcpy(pRec->sRaw, sWeatherBuf, WEATHER_BUF_SIZE);
+
+    return WxPipeSubmit(pRec);
+}
+
+//
+// Decode/validate - raw device data to engineering units. Responses with
+// out of range clock fields are taken as garbled: fast samples are
+// dropped, logged readings are logged as read (a response that fails
+// outright is "--No weather--" from acquisition, as it always was) but
+// kept out of the ring. Good readings go to the ring.
+//
+static int ValidTime(unsigned char nHour, unsigned char nMin)
+{
+    nHour &= 0x7F;
+
+    return (nHour >= 1) && (nHour <= 12) && (nMin < 60);
+}
+
+// Garbled response - TRUE if the record is to be dropped
+static int Reject(WxRecord *pRec)
+{
+    WX_STAT_INC(nRejected);
+    if (pRec->nType == WX_REC_SAMPLE)
+        return TRUE;
+    printf("Pipeline: garbled %s logged as read\n", (pRec->nType == WX_REC_WEATHER) ? "weather" : "min/max");
+
+    return FALSE;
+}
+
+static void DecodeRecord(WxRecord *pRec)
+{
+    unsigned char *sBuf1, *sBuf2;
+    WxWeather *pW;
+    WxMinMax *pM;
+    struct timespec tsStamp;
+    int bGood;
+
+    switch (pRec->nType)
+    {
+    case WX_REC_WEATHER:
+    case WX_REC_SAMPLE:
+        sBuf1 = pRec->sRaw;
+        bGood = (sBuf1[0] == 'W') && ValidTime(sBuf1[4], sBuf1[3]) && (sBuf1[2] < 60) &&
+                (sBuf1[5] >= 1) && (sBuf1[5] <= 31) && (sBuf1[6] >= 1) && (sBuf1[6] <= 12);
+        if (!bGood && Reject(pRec))
+            break;
+
+        pW = &pRec->u.xWeather;
+        pW->nIndoor = sBuf1[9] - 40;
+        pW->nOutdoor = sBuf1[10] - 40;
+        pW->nWind = (sBuf1[8] * 99) / 256;
+        // Fold input 4-bit gray code to table index (wind direction)
+        pW->nDir = ((sBuf1[1] & 0x1C) >> 2) | ((sBuf1[1] & 0x80) >> 4);
+        pW->nPressure = sBuf1[11] + 2900;
+
+        if (bGood)
+        {
+            tsStamp.tv_sec = pRec->ttStamp;
+            tsStamp.tv_nsec = pRec->nStampNs;
+            WxRingPut(&tsStamp, pW);
+        }
+        break;
+
+    case WX_REC_MINMAX:
+        sBuf1 = pRec->sRaw;
+        sBuf2 = &pRec->sRaw[MMTEMP_BUF_SIZE];
+        if ((sBuf1[0] != 'e') || (sBuf2[0] != 'b') ||
+            (sBuf1[2] >= 60) || (sBuf1[7] >= 60) || (sBuf1[12] >= 60) ||
+            (sBuf2[2] >= 60) || (sBuf2[7] >= 60))
+            Reject(pRec);
+
+        // sBuf1 contains temp high/low & wind speed, sBuf2 pressure
+        pM = &pRec->u.xMinMax;
+        pM->nTLow = sBuf1[1] - 40;
+        pM->nTLowTime = (x24hr(sBuf1[3]) * 60) + sBuf1[2];
+        pM->nTHigh = sBuf1[6] - 40;
+        pM->nTHighTime = (x24hr(sBuf1[8]) * 60) + sBuf1[7];
+        pM->nWind = (sBuf1[11] * 99) / 256;
+        pM->nWindTime = (x24hr(sBuf1[13]) * 60) + sBuf1[12];
+        pM->nPLow = sBuf2[1] + 2900;
+        pM->nPLowTime = (x24hr(sBuf2[3]) * 60) + sBuf2[2];
+        pM->nPHigh = sBuf2[6] + 2900;
+        pM->nPHighTime = (x24hr(sBuf2[8]) * 60) + sBuf2[7];
+        break;
+
+    default:
+        break;
+    }
+
+    return;
+}
+
+//
+// Persistence hands closed logs to the export stage
+//
+void WxExportLog(char *sPath)
+{
+    char *sCopy;
+
+    sCopy = strdup(sPath);
+    if (!sCopy)
+        return;
+
+    if (!bPipeThreaded)
+    {
+        ExportLog(sCopy);
+        free(sCopy);
+        return;
+    }
+
+    if (WxPipePut(&qExport, sCopy, WX_JOB_UPLOAD) != 0)
+        free(sCopy);
+
+    return;
+}
+
+//
+// Day closed - archive retention and query index, in the background
+// (behind any upload)
+//
+void WxExportHousekeep(void)
+{
+    if (!bPipeThreaded)
+    {
+        Housekeep();
+        return;
+    }
+
+    WxPipePut(&qExport, NULL, WX_JOB_HOUSEKEEP);
+
+    return;
+}
+
+//
+// Device history ('i') - merged into the summary store and used to
+// backfill the logs in the background, behind everything logged before it
+//
+void WxExportHistory(time_t ttStamp, const unsigned char *sHistBuf)
+{
+    WxHistJob *pJob;
+
+    if (!bPipeThreaded)
+    {
+        MergeHistory(ttStamp, sHistBuf);
+        return;
+    }
+
+    pJob = (WxHistJob *)malloc(sizeof(WxHistJob));
+    if (!pJob)
+        return;
+    pJob->ttStamp = ttStamp;
+    memcpy(pJob->sRaw, sHistBuf, HISTORY_BUF_SIZE);
+
+    if (WxPipePut(&qExport, pJob, WX_JOB_HISTORY) != 0)
+        free(pJob);
+
+    return;
+}
+
+static void MergeHistory(time_t ttStamp, const unsigned char *sRaw)
+{
+    WxhMerge(ttStamp, sRaw);
+    WxgBackfill(ttStamp);
+
+    return;
+}
+
+static void Housekeep(void)
+{
+    WxArchiveRun(vc_time());
+    WxqRescan();
+
+    return;
+}
+
+static void ExportLog(char *sPath)
+{
+    char sTargetName[16];
+    char *xName;
+
+    // Strip log path prefix
+    strncpy(sTargetName, &sPath[strlen(sWLogPath)], sizeof(sTargetName) - 1);
+    sTargetName[sizeof(sTargetName) - 1] = '\0';
+    // Flatten name, Ex: /May02/12 -> wMay02-12
+    sTargetName[0] = 'w';
+    for (xName = sTargetName; (xName = strchr(xName, '/')); )
+        *xName = '-';
+
+    // Send closed log to FTP server
+    printf("MIDNITE: Upload to: %s\n", sTargetName);
+    WX_STAT_INC(nUploads);
+    // Nowhere to send simulated logs
+    if (!bVirtualClock)
+        ftpUpload(sPath, sTargetName);
+
+    return;
+}
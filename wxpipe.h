@@ -0,0 +1,138 @@
+// wxpipe.h
+//
+// ID4 processing pipeline - serial acquisition, decode/validate,
+// persistence and export stages joined by bounded queues
+//
+
+#ifndef WXPIPE_H_INCLUDED
+#define WXPIPE_H_INCLUDED
+
+#include <time.h>
+
+// Records queued between stages (per queue) before producers block
+#define WX_QUEUE_DEPTH      32
+
+// Log fsync policy (nLogSync), else seconds between syncs
+#define WX_SYNC_ALWAYS      -1      // After every write
+#define WX_SYNC_ROTATE      0       // Only when closing the day's log
+
+// Log file formats (nLogFormat)
+#define WX_FMT_CSV          0x01    // Daily CSV
+#define WX_FMT_WXB          0x02    // Daily binary (wxbin.h)
+
+// Longest log message text (incl. newline)
+#define WX_MSG_SIZE         40
+
+// CSV log headers
+#define WEATHER_LOG_HEADER1	"Time,Indoor,Outdoor,Wind,Dir,Pressure\n"
+#define WEATHER_LOG_HEADER2	"Midnite,TLow,Time,THigh,Time,Wind,Time,PLow,Time,PHigh,Time\n"
+#define NOWEATHER_LOG_HEADER "*** Log start - Weather data disabled\n"
+
+//
+// Record types
+//
+typedef enum
+{
+    WX_REC_WEATHER = 1,     // 'W' response
+    WX_REC_MINMAX,          // 'e' + 'b' responses (midnite)
+    WX_REC_MESSAGE,         // Log message text
+    WX_REC_NEWLOG,          // Start new daily log
+    WX_REC_HISTORY,         // 'i' response (summary store, backfill)
+    WX_REC_SAMPLE,          // 'W' response between logged readings (ring only)
+    WX_REC_MAX
+} WX_RECTYPE;
+
+//
+// Decoded current readings
+//
+typedef struct _WxWeather
+{
+    short   nIndoor;        // deg F
+    short   nOutdoor;       // deg F
+    short   nWind;          // mph
+    short   nDir;           // sWinDir[] index
+    short   nPressure;      // 0.01 inHg
+} WxWeather;
+
+//
+// Decoded 24hr min/max (times are minutes past midnite)
+//
+typedef struct _WxMinMax
+{
+    short   nTLow, nTLowTime;
+    short   nTHigh, nTHighTime;
+    short   nWind, nWindTime;
+    short   nPLow, nPLowTime;
+    short   nPHigh, nPHighTime;
+} WxMinMax;
+
+//
+// Pipeline record
+//
+typedef struct _WxRecord
+{
+    int             nType;          // WX_RECTYPE
+    short           nTime;          // Minutes past midnite (-1 := none)
+    time_t          ttStamp;        // System time when acquired
+    long            nStampNs;       // and nanoseconds past it
+    int             bUpload;        // NEWLOG: send closed log on
+    unsigned char   sRaw[32];       // Device response(s)
+    union
+    {
+        WxWeather   xWeather;
+        WxMinMax    xMinMax;
+        char        sMsg[WX_MSG_SIZE];
+        unsigned char *pHistory;    // HISTORY: HISTORY_BUF_SIZE bytes
+    } u;
+} WxRecord;
+
+//
+// Pipeline statistics
+//
+typedef struct _WxPipeStats
+{
+    unsigned long   nRecords[WX_REC_MAX];   // Records persisted by type
+    unsigned long   nRejected;              // Garbled (samples dropped)
+    unsigned long   nUploads;               // Closed logs exported
+    unsigned long   nStalls;                // Posts that found a full queue
+    unsigned long   nWrites;                // Log write() calls
+    unsigned long   nSyncs;                 // Log fdatasync() calls
+    unsigned long   nWalErrors;             // Batches the journal missed
+} WxPipeStats;
+
+extern int nLogSync;
+extern int nLogFormat;
+
+// Pipeline control
+extern int WxPipeStart(int bThreaded);
+extern void WxPipeStop(void);
+extern void WxPipeGetStats(WxPipeStats *pStats);
+
+// Acquisition side (ID4 command thread)
+extern int WxPostWeather(int xTime, unsigned char *sWeatherBuf);
+extern int WxPostMinMax(int xTime, unsigned char *sBuf1, unsigned char *sBuf2);
+extern int WxPostMessage(int xTime, char *sMsg);
+extern int WxPostNewLog(int xTime, int bUpload);
+extern int WxPostHistory(unsigned char *sHistBuf);
+extern int WxPostSample(unsigned char *sWeatherBuf);
+
+// Persistence stage (wxlog.c)
+extern int WxLogStart(int xTime);
+extern void WxLogRecord(WxRecord *pRec);
+extern void WxLogFlush(void);
+extern void WxLogIdle(void);
+extern const struct timespec *WxLogIdleWait(void);
+extern void WxLogClose(void);
+extern void WxLogStats(unsigned long *pWrites, unsigned long *pSyncs, unsigned long *pWalErrors);
+
+// CSV log lines (return length)
+extern int WxFormatWeather(char *sLine, int xTime, WxWeather *pW);
+extern int WxFormatMinMax(char *sLine, WxMinMax *pM);
+extern int WxFormatMessage(char *sLine, int xTime, const char *sMsg);
+
+// Export stage
+extern void WxExportLog(char *sPath);
+extern void WxExportHousekeep(void);
+extern void WxExportHistory(time_t ttStamp, const unsigned char *sHistBuf);
+
+#endif // WXPIPE_H_INCLUDED
@@ -0,0 +1,224 @@
+// wxpool.c - Query worker pool
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "id4-pi.h"
+#include "wxpool.h"
+
+//
+// The workers start with the first job and stay. Jobs queue oldest
+// first; an idle worker takes the next task of the first job that has
+// one it may start, so a long query soaks up every idle CPU and a short
+// one behind it still gets going as soon as a task ends. The caller
+// works too: waiting for its next task it runs whatever of its own job
+// is free, so a job finishes even with every worker busy elsewhere.
+//
+// Results live in the caller's window slots (task % window). A task is
+// started only when its slot has been handed back, so however long the
+// range, a job holds one window of results. With so few tasks in
+// flight one shared counter deals them out - the per-worker ranges and
+// stealing of the importer (wximport.c) would have nothing to balance.
+//
+
+struct _WxpJob
+{
+    struct _WxpJob  *pNext;         // Pool's job list
+    WxpTaskFn       fnTask;
+    void            *pCtx;
+    int             nTasks;
+    int             nClaim;         // Next task to start
+    int             nTaken;         // Next task to hand back
+    int             nBusy;          // Started, not done
+    int             bHeld;          // Caller has task nTaken - 1
+    int             bCancel;
+    int             nDone[WXP_MAX_WINDOW];  // Task done in each slot (-1 := none)
+    pthread_cond_t  cDone;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static WxpJob *pJobs;
+static int nWorkers, nWindow;
+
+//-------------------------------------------------------------------------------
+// Workers (pool_mutex held)
+
+static int CanClaim(const WxpJob *pJob)
+{
+    return !pJob->bCancel && (pJob->nClaim < pJob->nTasks) &&
+           (pJob->nClaim < (pJob->nTaken - pJob->bHeld + nWindow));
+}
+
+// Next task of pJob, mutex dropped while it runs
+static void RunTask(WxpJob *pJob)
+{
+    int nTask = pJob->nClaim++;
+
+    pJob->nBusy++;
+    pthread_mutex_unlock(&pool_mutex);
+    pJob->fnTask(pJob->pCtx, nTask, nTask % nWindow);
+    pthread_mutex_lock(&pool_mutex);
+    pJob->nDone[nTask % nWindow] = nTask;
+    pJob->nBusy--;
+    pthread_cond_broadcast(&pJob->cDone);
+
+    return;
+}
+
+static void *xWorker(void *args)
+{
+    WxpJob *pJob;
+
+    (void)args;
+    pthread_mutex_lock(&pool_mutex);
+    for (;;)
+    {
+        for (pJob = pJobs; pJob && !CanClaim(pJob); pJob = pJob->pNext)
+            ;
+        if (pJob)
+            RunTask(pJob);
+        else
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+    }
+
+    return NULL;
+}
+
+static void PoolInit(void)
+{
+    pthread_attr_t xAttr;
+    pthread_t tWorker;
+    int nCpus, n;
+
+    nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nCpus < 1)
+        nCpus = 1;
+
+    pthread_attr_init(&xAttr);
+    pthread_attr_setdetachstate(&xAttr, PTHREAD_CREATE_DETACHED);
+    for (n = 0; n < nCpus; n++)
+    {
+        if (pthread_create(&tWorker, &xAttr, xWorker, NULL) != 0)
+            break;
+        nWorkers++;
+    }
+    pthread_attr_destroy(&xAttr);
+
+    // Callers do it all without workers
+    nWindow = 2 * (nWorkers + 1);
+    if (nWindow > WXP_MAX_WINDOW)
+        nWindow = WXP_MAX_WINDOW;
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Jobs
+
+int WxpWindow(void)
+{
+    pthread_once(&pool_once, PoolInit);
+
+    return nWindow;
+}
+
+WxpJob *WxpStart(int nTasks, WxpTaskFn fnTask, void *pCtx)
+{
+    WxpJob *pJob, **ppTail;
+    int n;
+
+    pthread_once(&pool_once, PoolInit);
+
+    pJob = (WxpJob *)calloc(1, sizeof(WxpJob));
+    if (!pJob)
+        return NULL;
+    pJob->fnTask = fnTask;
+    pJob->pCtx = pCtx;
+    pJob->nTasks = (nTasks > 0) ? nTasks : 0;
+    for (n = 0; n < WXP_MAX_WINDOW; n++)
+        pJob->nDone[n] = -1;
+    pthread_cond_init(&pJob->cDone, NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    for (ppTail = &pJobs; *ppTail; ppTail = &(*ppTail)->pNext)
+        ;
+    *ppTail = pJob;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    return pJob;
+}
+
+int WxpNext(WxpJob *pJob, int *pnSlot)
+{
+    int nTask;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    // Previous slot free for the next task
+    if (pJob->bHeld)
+    {
+        pJob->nDone[(pJob->nTaken - 1) % nWindow] = -1;
+        pJob->bHeld = FALSE;
+        pthread_cond_signal(&pool_cond);
+    }
+
+    nTask = pJob->nTaken;
+    while ((nTask < pJob->nTasks) && (pJob->nDone[nTask % nWindow] != nTask))
+    {
+        if (CanClaim(pJob))
+            RunTask(pJob);
+        else
+            pthread_cond_wait(&pJob->cDone, &pool_mutex);
+    }
+
+    if (nTask < pJob->nTasks)
+    {
+        pJob->nTaken++;
+        pJob->bHeld = TRUE;
+        *pnSlot = nTask % nWindow;
+    }
+    else
+        nTask = -1;
+    pthread_mutex_unlock(&pool_mutex);
+
+    return nTask;
+}
+
+void WxpEnd(WxpJob *pJob)
+{
+    WxpJob **ppJob;
+
+    if (!pJob)
+        return;
+
+    pthread_mutex_lock(&pool_mutex);
+    pJob->bCancel = TRUE;
+    while (pJob->nBusy > 0)
+        pthread_cond_wait(&pJob->cDone, &pool_mutex);
+    for (ppJob = &pJobs; *ppJob && (*ppJob != pJob); ppJob = &(*ppJob)->pNext)
+        ;
+    if (*ppJob)
+        *ppJob = pJob->pNext;
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_cond_destroy(&pJob->cDone);
+    free(pJob);
+
+    return;
+}
@@ -0,0 +1,33 @@
+// wxpool.h
+//
+// Query worker pool - one thread per CPU shared by all queries. A job
+// is a run of numbered tasks (days) done in any order on the workers
+// and handed back to the caller in task order, never more than a window
+// ahead of it.
+//
+
+#ifndef WXPOOL_H_INCLUDED
+#define WXPOOL_H_INCLUDED
+
+// Window of tasks done ahead of the caller (most)
+#define WXP_MAX_WINDOW      32
+
+// Task nTask into window slot nSlot (worker or caller thread)
+typedef void (*WxpTaskFn)(void *pCtx, int nTask, int nSlot);
+
+typedef struct _WxpJob WxpJob;
+
+// Slots a job's window will use (size per-slot results by this)
+extern int WxpWindow(void);
+
+// Tasks [0, nTasks) - NULL if out of memory
+extern WxpJob *WxpStart(int nTasks, WxpTaskFn fnTask, void *pCtx);
+
+// Next task in order once done (helping if it is not started), its
+// slot in *pnSlot - the previous slot is free again. -1 := all done.
+extern int WxpNext(WxpJob *pJob, int *pnSlot);
+
+// Drop tasks not started, wait for the rest and free the job
+extern void WxpEnd(WxpJob *pJob);
+
+#endif // WXPOOL_H_INCLUDED
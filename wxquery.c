@@ -0,0 +1,1637 @@
+// wxquery.c - Time-range queries over weather logs
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxbin.h"
+#include "wxarch.h"
+#include "wxquery.h"
+#include "wxroll.h"
+#include "wxkern.h"
+#include "wxpool.h"
+#include "wxmemo.h"
+#include "wximport.h"
+#include "wxhist.h"
+#include "wxnorm.h"
+#include "wxgap.h"
+#include "wxchart.h"
+#include "wxstage.h"
+
+//
+// The index is a sorted list of dates (yyyymmdd) with the best source
+// for each: <dd>.wxb, <dd> (CSV) or a day block in <Mmmyy>.wxa. It is
+// built at startup and rebuilt after each midnite rotation (export
+// stage); queries copy what they need under a read lock and load only
+// those days. Days after the last indexed one (today's open log) are
+// looked for directly. Days load in parallel on the query pool and are
+// added up here in date order, so results never depend on the timing.
+//
+// Readings are stamped with local time: the day's midnite plus the
+// logged minute.
+//
+
+typedef struct _WxqDay
+{
+    int             nDate;          // yyyymmdd
+    unsigned char   nSrc;           // WXQ_SRC_xxx
+    unsigned char   nRes;           // WXA_RES_xxx
+} WxqDay;
+
+static char *sQueryPath;
+static WxqDay *pIndex;
+static int nIndex;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Most buckets one query may ask for
+#define WXQ_MAX_BUCKETS     100000
+
+//-------------------------------------------------------------------------------
+// Dates
+
+int WxqDateOf(time_t ttTime)
+{
+    struct tm tmTime;
+
+    vc_localtime(&ttTime, &tmTime);
+
+    return ((tmTime.tm_year + 1900) * 10000) + ((tmTime.tm_mon + 1) * 100) + tmTime.tm_mday;
+}
+
+// Local time of nMinutes past midnite on nDate
+time_t WxqDateTime(int nDate, int nMinutes)
+{
+    struct tm tmTime;
+
+    memset(&tmTime, 0, sizeof(tmTime));
+    tmTime.tm_year = (nDate / 10000) - 1900;
+    tmTime.tm_mon = ((nDate / 100) % 100) - 1;
+    tmTime.tm_mday = nDate % 100;
+    tmTime.tm_min = nMinutes;
+    tmTime.tm_isdst = -1;
+
+    return mktime(&tmTime);
+}
+
+int WxqNextDate(int nDate)
+{
+    return WxqDateOf(WxqDateTime(nDate, 36 * 60));
+}
+
+static void DayPath(char *sPath, size_t nSize, int nDate, const char *sExt)
+{
+    int nYear = nDate / 10000;
+
+    snprintf(sPath, nSize, "%s/%s%02d/%02d%s", sQueryPath, sMonName[((nDate / 100) % 100) - 1],
+             nYear % 100, nDate % 100, sExt);
+
+    return;
+}
+
+// A day's live log - the staged copy (-K) of the open day, newer than
+// the one in the tree, if there is one
+static void LivePath(char *sPath, size_t nSize, int nDate, const char *sExt)
+{
+    if (sStagePath)
+    {
+        snprintf(sPath, nSize, "%s/%s%02d/%02d%s", sStagePath, sMonName[((nDate / 100) % 100) - 1],
+                 (nDate / 10000) % 100, nDate % 100, sExt);
+        if (access(sPath, F_OK) == 0)
+            return;
+    }
+    DayPath(sPath, nSize, nDate, sExt);
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Index
+
+static int CompareDay(const void *p1, const void *p2)
+{
+    return ((const WxqDay *)p1)->nDate - ((const WxqDay *)p2)->nDate;
+}
+
+static int AddIndex(WxqDay **ppList, int *pnList, int *pnAlloc, int nDate, int nSrc, int nRes)
+{
+    WxqDay *pNew;
+
+    if (*pnList >= *pnAlloc)
+    {
+        pNew = (WxqDay *)realloc(*ppList, (*pnAlloc + 256) * sizeof(WxqDay));
+        if (!pNew)
+            return -1;
+        *ppList = pNew;
+        *pnAlloc += 256;
+    }
+
+    (*ppList)[*pnList].nDate = nDate;
+    (*ppList)[*pnList].nSrc = nSrc;
+    (*ppList)[*pnList].nRes = nRes;
+    (*pnList)++;
+
+    return 0;
+}
+
+// Days in a month directory
+static void IndexMonth(const char *sName, int nMonth, WxqDay **ppList, int *pnList, int *pnAlloc)
+{
+    char sDir[320];
+    struct dirent *pEnt;
+    DIR *pDir;
+    int nDay, nBase;
+
+    snprintf(sDir, sizeof(sDir), "%s/%s", sQueryPath, sName);
+    pDir = opendir(sDir);
+    if (!pDir)
+        return;
+
+    nBase = (((nMonth / 12) + 1900) * 10000) + (((nMonth % 12) + 1) * 100);
+    while ((pEnt = readdir(pDir)))
+    {
+        nDay = atoi(pEnt->d_name);
+        if ((nDay < 1) || (nDay > 31) || (strlen(pEnt->d_name) < 2))
+            continue;
+
+        if (pEnt->d_name[2] == '\0')
+            AddIndex(ppList, pnList, pnAlloc, nBase + nDay, WXQ_SRC_CSV, WXA_RES_RAW);
+        else if (strcmp(&pEnt->d_name[2], WXB_EXT) == 0)
+            AddIndex(ppList, pnList, pnAlloc, nBase + nDay, WXQ_SRC_WXB, WXA_RES_RAW);
+    }
+    closedir(pDir);
+
+    return;
+}
+
+// Days in a month archive
+static void IndexArchive(const char *sName, int nMonth, WxqDay **ppList, int *pnList, int *pnAlloc)
+{
+    char sPath[320];
+    WxaHeader xHead;
+    FILE *fArch;
+    int nDay, nBase;
+
+    snprintf(sPath, sizeof(sPath), "%s/%s", sQueryPath, sName);
+    fArch = fopen(sPath, "r");
+    if (!fArch)
+        return;
+
+    if ((fread(&xHead, sizeof(xHead), 1, fArch) == 1) && (xHead.nMagic == WXA_MAGIC))
+    {
+        nBase = (((nMonth / 12) + 1900) * 10000) + (((nMonth % 12) + 1) * 100);
+        for (nDay = 1; nDay <= 31; nDay++)
+        {
+            if (xHead.nOffset[nDay] != 0)
+                AddIndex(ppList, pnList, pnAlloc, nBase + nDay, WXQ_SRC_WXA, xHead.nRes);
+        }
+    }
+    fclose(fArch);
+
+    return;
+}
+
+//
+// Cached results go for days that came, went or changed source - a run
+// of days at a time
+//
+static void DropChanged(const WxqDay *pOld, int nOld, const WxqDay *pNew, int nNew)
+{
+    int nDate, nRunFrom = 0, nRunTo = 0, bSame;
+    int i = 0, k = 0;
+
+    while ((i < nOld) || (k < nNew))
+    {
+        bSame = FALSE;
+        if ((k == nNew) || ((i < nOld) && (pOld[i].nDate < pNew[k].nDate)))
+            nDate = pOld[i++].nDate;
+        else if ((i == nOld) || (pNew[k].nDate < pOld[i].nDate))
+            nDate = pNew[k++].nDate;
+        else
+        {
+            nDate = pNew[k].nDate;
+            bSame = (pOld[i].nSrc == pNew[k].nSrc) && (pOld[i].nRes == pNew[k].nRes);
+            i++;
+            k++;
+        }
+        if (bSame)
+            continue;
+
+        if (nRunTo && (nDate == WxqNextDate(nRunTo)))
+        {
+            nRunTo = nDate;
+            continue;
+        }
+        if (nRunTo)
+            WxmDrop(WxqDateTime(nRunFrom, 0), WxqDateTime(WxqNextDate(nRunTo), 0));
+        nRunFrom = nRunTo = nDate;
+    }
+    if (nRunTo)
+        WxmDrop(WxqDateTime(nRunFrom, 0), WxqDateTime(WxqNextDate(nRunTo), 0));
+
+    return;
+}
+
+//
+// Rebuild day index from the log tree
+//
+int WxqRescan(void)
+{
+    struct dirent *pEnt;
+    WxqDay *pList = NULL;
+    int nList = 0, nAlloc = 0;
+    int nMonth, bArchive, n, k;
+    DIR *pDir;
+
+    if (!sQueryPath)
+        return -1;
+
+    pDir = opendir(sQueryPath);
+    if (!pDir)
+        return -1;
+
+    while ((pEnt = readdir(pDir)))
+    {
+        nMonth = WxaMonthIndex(pEnt->d_name, &bArchive);
+        if (nMonth < 0)
+            continue;
+        if (bArchive)
+            IndexArchive(pEnt->d_name, nMonth, &pList, &nList, &nAlloc);
+        else
+            IndexMonth(pEnt->d_name, nMonth, &pList, &nList, &nAlloc);
+    }
+    closedir(pDir);
+
+    // Sort, keep best source per day
+    if (nList > 0)
+        qsort(pList, nList, sizeof(WxqDay), CompareDay);
+    for (n = 0, k = 0; n < nList; n++)
+    {
+        if ((k > 0) && (pList[k - 1].nDate == pList[n].nDate))
+        {
+            if (pList[n].nSrc < pList[k - 1].nSrc)
+                pList[k - 1] = pList[n];
+            continue;
+        }
+        pList[k++] = pList[n];
+    }
+
+    // Queries wait until the cache is rid of what changed
+    pthread_rwlock_wrlock(&index_lock);
+    DropChanged(pIndex, nIndex, pList, k);
+    free(pIndex);
+    pIndex = pList;
+    nIndex = k;
+    pthread_rwlock_unlock(&index_lock);
+
+    return k;
+}
+
+int WxqOpen(const char *sLogPath)
+{
+    WxqClose();
+
+    sQueryPath = strdup(sLogPath);
+    if (!sQueryPath)
+        return -1;
+
+    return WxqRescan();
+}
+
+void WxqClose(void)
+{
+    pthread_rwlock_wrlock(&index_lock);
+    free(pIndex);
+    pIndex = NULL;
+    nIndex = 0;
+    pthread_rwlock_unlock(&index_lock);
+
+    free(sQueryPath);
+    sQueryPath = NULL;
+
+    return;
+}
+
+// First and last indexed dates, returns days indexed
+int WxqDays(int *pnFirst, int *pnLast)
+{
+    int nDays;
+
+    pthread_rwlock_rdlock(&index_lock);
+    nDays = nIndex;
+    *pnFirst = nIndex ? pIndex[0].nDate : 0;
+    *pnLast = nIndex ? pIndex[nIndex - 1].nDate : 0;
+    pthread_rwlock_unlock(&index_lock);
+
+    return nDays;
+}
+
+//
+// Indexed days in [nFrom, nTo] (caller frees)
+//
+static int FindDays(int nFrom, int nTo, WxqDay **ppDays, int *pnLast)
+{
+    int nLo, nHi, nMid, nCnt;
+
+    *ppDays = NULL;
+    pthread_rwlock_rdlock(&index_lock);
+
+    // First date >= nFrom
+    for (nLo = 0, nHi = nIndex; nLo < nHi; )
+    {
+        nMid = (nLo + nHi) / 2;
+        if (pIndex[nMid].nDate < nFrom)
+            nLo = nMid + 1;
+        else
+            nHi = nMid;
+    }
+    for (nCnt = 0; ((nLo + nCnt) < nIndex) && (pIndex[nLo + nCnt].nDate <= nTo); nCnt++)
+        ;
+
+    if ((nCnt > 0) && (*ppDays = (WxqDay *)malloc(nCnt * sizeof(WxqDay))))
+        memcpy(*ppDays, &pIndex[nLo], nCnt * sizeof(WxqDay));
+    else
+        nCnt = 0;
+    *pnLast = nIndex ? pIndex[nIndex - 1].nDate : 0;
+
+    pthread_rwlock_unlock(&index_lock);
+
+    return nCnt;
+}
+
+//-------------------------------------------------------------------------------
+// Day loading
+
+static int LoadWxb(const char *sPath, WxaDay *pDay)
+{
+    WxbFile xFile;
+    WxbRecord *pRec;
+    WxSample *pS;
+    WxaExtra *pX;
+    long n;
+    int nLen;
+
+    if (WxbLoad(sPath, &xFile) != 0)
+        return -1;
+
+    memset(pDay, 0, sizeof(*pDay));
+    if (xFile.xHead.nFlags & WXB_H_WEATHER)
+        pDay->nHead = WXA_HEAD_WEATHER;
+    else if (xFile.xHead.nFlags & WXB_H_NOWEATHER)
+        pDay->nHead = WXA_HEAD_NOWEATHER;
+
+    for (n = 0; n < xFile.nRecs; n++)
+    {
+        pRec = &xFile.pRecs[n];
+        if ((pRec->nFlags & WXB_F_WEATHER) && (pDay->nSamples < WXA_MAX_SAMPLES))
+        {
+            pS = &pDay->xSamples[pDay->nSamples++];
+            pS->nTime = pRec->nTime;
+            pS->nIndoor = pRec->nIndoor;
+            pS->nOutdoor = pRec->nOutdoor;
+            pS->nWind = pRec->nWind;
+            pS->nDir = pRec->nDir & 0x0F;
+            pS->nPressure = pRec->nPressure;
+        }
+        else if ((pRec->nFlags & (WXB_F_MINMAX | WXB_F_MESSAGE)) && (pDay->nExtras < WXA_MAX_EXTRAS))
+        {
+            pX = &pDay->xExtras[pDay->nExtras];
+            memset(pX, 0, sizeof(*pX));
+            pX->nAt = pDay->nSamples;
+            pX->nTime = pRec->nTime;
+            if (pRec->nFlags & WXB_F_MINMAX)
+            {
+                pX->nKind = WXA_X_MINMAX;
+                nLen = WxbPayload(&xFile, n, &pX->xMinMax, sizeof(pX->xMinMax));
+            }
+            else
+            {
+                pX->nKind = WXA_X_MESSAGE;
+                nLen = WxbPayload(&xFile, n, pX->sMsg, sizeof(pX->sMsg) - 1);
+            }
+            if (nLen >= 0)
+                pDay->nExtras++;
+        }
+    }
+    WxbFree(&xFile);
+
+    return 0;
+}
+
+static int LoadSource(int nDate, int nSrc, WxaDay *pDay)
+{
+    char sPath[128];
+
+    switch (nSrc)
+    {
+    case WXQ_SRC_WXB:
+        LivePath(sPath, sizeof(sPath), nDate, WXB_EXT);
+        return LoadWxb(sPath, pDay);
+
+    case WXQ_SRC_CSV:
+        LivePath(sPath, sizeof(sPath), nDate, "");
+        return WxaParseCsv(sPath, pDay, FALSE);
+
+    case WXQ_SRC_WXA:
+        DayPath(sPath, sizeof(sPath), nDate, "");
+        // <path>/Mmmyy/dd -> <path>/Mmmyy.wxa, day dd
+        *strrchr(sPath, '/') = '\0';
+        strcat(sPath, WXA_EXT);
+        return WxaReadDay(sPath, nDate % 100, pDay, NULL);
+
+    default:
+        return -1;
+    }
+}
+
+// Not indexed (yet) - look for a live log
+static int ProbeDay(int nDate, WxaDay *pDay)
+{
+    if (LoadSource(nDate, WXQ_SRC_WXB, pDay) == 0)
+        return 0;
+
+    return LoadSource(nDate, WXQ_SRC_CSV, pDay);
+}
+
+//
+// Load one day by date (yyyymmdd)
+//
+int WxqLoadDay(int nDate, WxaDay *pDay, int *pRes)
+{
+    WxqDay *pDays;
+    int nLast, nRet;
+
+    if (!sQueryPath)
+        return -1;
+
+    if (pRes)
+        *pRes = WXA_RES_RAW;
+
+    if (FindDays(nDate, nDate, &pDays, &nLast) == 1)
+    {
+        if (pRes)
+            *pRes = pDays[0].nRes;
+        nRet = LoadSource(nDate, pDays[0].nSrc, pDay);
+        free(pDays);
+        return nRet;
+    }
+
+    return (nDate > nLast) ? ProbeDay(nDate, pDay) : -1;
+}
+
+// Only the hours in nMask of a mapped CSV log
+static int LoadCsvHours(int nDate, const WxRollMap *pMap, uint32_t nMask, WxaDay *pDay)
+{
+    char sPath[128];
+    struct stat xInfo;
+    char *pBuf;
+    size_t nLen = 0;
+    uint32_t nEnd;
+    int fd, h, k, nRet = 0;
+
+    DayPath(sPath, sizeof(sPath), nDate, "");
+    fd = open(sPath, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    // Map must be of this log
+    if ((fstat(fd, &xInfo) != 0) || (xInfo.st_size != pMap->nSize) || !(pBuf = (char *)malloc(xInfo.st_size)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    // One read per run of wanted hours
+    for (h = 0; (h < 24) && (nRet == 0); h = k)
+    {
+        k = h + 1;
+        if (!(nMask & (1U << h)) || (pMap->nHour[h] == WXR_NO_OFFSET))
+            continue;
+        for ( ; (k < 24) && ((nMask & (1U << k)) || (pMap->nHour[k] == WXR_NO_OFFSET)); k++)
+            ;
+        nEnd = (k < 24) ? pMap->nHour[k] : pMap->nSize;
+        if (pread(fd, &pBuf[nLen], nEnd - pMap->nHour[h], pMap->nHour[h]) != (ssize_t)(nEnd - pMap->nHour[h]))
+            nRet = -1;
+        nLen += nEnd - pMap->nHour[h];
+    }
+    close(fd);
+
+    if (nRet == 0)
+        WxiParseDay(pBuf, nLen, pDay, NULL, NULL);
+    free(pBuf);
+
+    return nRet;
+}
+
+//-------------------------------------------------------------------------------
+// Queries
+
+static long ScanDay(int nDate, int nRes, WxaDay *pDay, time_t ttFrom, time_t ttTo,
+                    WxqPointFn fnPoint, void *pCtx, int *pbStop)
+{
+    WxqPoint xPt;
+    time_t ttMidnite;
+    int bDst, n;
+    long nCnt = 0;
+
+    // Minutes map straight onto the clock unless DST changes today
+    ttMidnite = WxqDateTime(nDate, 0);
+    bDst = (WxqDateTime(nDate, 1440) - ttMidnite) != (24 * 60 * 60);
+
+    xPt.nRes = nRes;
+    for (n = 0; n < pDay->nSamples; n++)
+    {
+        xPt.xS = pDay->xSamples[n];
+        xPt.ttTime = bDst ? WxqDateTime(nDate, xPt.xS.nTime) : ttMidnite + (xPt.xS.nTime * 60);
+        if ((xPt.ttTime < ttFrom) || (xPt.ttTime >= ttTo))
+            continue;
+
+        nCnt++;
+        if (fnPoint(&xPt, pCtx))
+        {
+            *pbStop = TRUE;
+            break;
+        }
+    }
+
+    return nCnt;
+}
+
+// Return non-zero to stop
+typedef int (*DayFn)(int nDate, int nRes, WxaDay *pDay, void *pCtx);
+
+//
+// A day to load - indexed, or newer than the index (nSrc 0). Where
+// queries may narrow a mapped CSV log to some hours.
+//
+typedef struct _DayTask
+{
+    int             nDate;
+    unsigned char   nSrc;           // WXQ_SRC_xxx, 0 := probe
+    unsigned char   nRes;
+    uint32_t        nMask;          // Hours to read of a mapped log
+    int             nMap;           // Map in RunCtx, -1 := whole day
+} DayTask;
+
+typedef struct _RunCtx
+{
+    const DayTask   *pTasks;
+    const WxRollMap *pMaps;
+    WxaDay          *pDays;         // Window of loaded days
+    int             nRet[WXP_MAX_WINDOW];
+} RunCtx;
+
+// Abandoned request check of this thread's queries
+static __thread WxqCancelFn fnCancel;
+static __thread void *pCancelCtx;
+static __thread int bCancelled;
+
+//
+// Days touching [ttFrom, ttTo) as tasks (caller frees), -1 on error
+//
+static int DayTasks(time_t ttFrom, time_t ttTo, DayTask **ppTasks)
+{
+    WxqDay *pDays;
+    DayTask *pTasks;
+    int nFrom, nTo, nToday, nLast, nDays, nNew, nFirst, nDate, n;
+
+    nFrom = WxqDateOf(ttFrom);
+    nTo = WxqDateOf(ttTo - 1);
+    nDays = FindDays(nFrom, nTo, &pDays, &nLast);
+
+    // Newer than the index - up to today
+    nToday = WxqDateOf(vc_time());
+    nFirst = (nLast >= nFrom) ? WxqNextDate(nLast) : nFrom;
+    for (nNew = 0, nDate = nFirst; (nDate <= nTo) && (nDate <= nToday); nDate = WxqNextDate(nDate))
+        nNew++;
+
+    *ppTasks = pTasks = (DayTask *)malloc((nDays + nNew + 1) * sizeof(DayTask));
+    if (!pTasks)
+    {
+        free(pDays);
+        return -1;
+    }
+
+    for (n = 0; n < nDays; n++)
+    {
+        pTasks[n].nDate = pDays[n].nDate;
+        pTasks[n].nSrc = pDays[n].nSrc;
+        pTasks[n].nRes = pDays[n].nRes;
+    }
+    free(pDays);
+    for (nDate = nFirst; n < (nDays + nNew); n++, nDate = WxqNextDate(nDate))
+    {
+        pTasks[n].nDate = nDate;
+        pTasks[n].nSrc = 0;
+        pTasks[n].nRes = WXA_RES_RAW;
+    }
+    for (n = 0; n < (nDays + nNew); n++)
+    {
+        pTasks[n].nMask = 0xFFFFFF;
+        pTasks[n].nMap = -1;
+    }
+
+    return nDays + nNew;
+}
+
+// On a pool worker (or the caller) - day into its window slot
+static void LoadTask(void *pCtx, int nTask, int nSlot)
+{
+    RunCtx *pR = (RunCtx *)pCtx;
+    const DayTask *pT = &pR->pTasks[nTask];
+    WxaDay *pDay = &pR->pDays[nSlot];
+    int nRet = -1;
+
+    if (pT->nMap >= 0)
+        nRet = LoadCsvHours(pT->nDate, &pR->pMaps[pT->nMap], pT->nMask, pDay);
+    if (nRet != 0)
+        nRet = pT->nSrc ? LoadSource(pT->nDate, pT->nSrc, pDay) : ProbeDay(pT->nDate, pDay);
+    pR->nRet[nSlot] = nRet;
+
+    return;
+}
+
+//
+// Load the days on the query pool and call fnDay for each in date
+// order on this thread - whatever fnDay adds up comes out the same
+// however the loads were spread. At most a window of days is held.
+//
+static int RunDays(const DayTask *pTasks, int nTasks, const WxRollMap *pMaps, DayFn fnDay, void *pCtx)
+{
+    RunCtx xR;
+    WxpJob *pJob;
+    int nTask, nSlot, nRet = 0;
+
+    if (bCancelled)
+        return -1;
+    if (nTasks == 0)
+        return 0;
+
+    xR.pTasks = pTasks;
+    xR.pMaps = pMaps;
+    xR.pDays = (WxaDay *)malloc(WxpWindow() * sizeof(WxaDay));
+    pJob = xR.pDays ? WxpStart(nTasks, LoadTask, &xR) : NULL;
+    if (!pJob)
+    {
+        free(xR.pDays);
+        return -1;
+    }
+
+    while ((nTask = WxpNext(pJob, &nSlot)) >= 0)
+    {
+        if ((xR.nRet[nSlot] == 0) && fnDay(pTasks[nTask].nDate, pTasks[nTask].nRes, &xR.pDays[nSlot], pCtx))
+            break;
+        if (fnCancel && fnCancel(pCancelCtx))
+        {
+            bCancelled = TRUE;
+            nRet = -1;
+            break;
+        }
+    }
+    WxpEnd(pJob);
+    free(xR.pDays);
+
+    return nRet;
+}
+
+//
+// Call fnDay for each logged day touching [ttFrom, ttTo), in date order
+//
+static int ScanDays(time_t ttFrom, time_t ttTo, DayFn fnDay, void *pCtx)
+{
+    DayTask *pTasks;
+    int nTasks, nRet;
+
+    nTasks = DayTasks(ttFrom, ttTo, &pTasks);
+    if (nTasks < 0)
+        return -1;
+
+    nRet = RunDays(pTasks, nTasks, NULL, fnDay, pCtx);
+    free(pTasks);
+
+    return nRet;
+}
+
+//
+// Stop this thread's queries once fnCheck says the requester is gone
+// (NULL to clear). Checked between days.
+//
+void WxqSetCancel(WxqCancelFn fnCheck, void *pCtx)
+{
+    fnCancel = fnCheck;
+    pCancelCtx = pCtx;
+    bCancelled = FALSE;
+
+    return;
+}
+
+int WxqCancelled(void)
+{
+    return bCancelled;
+}
+
+//
+// Columns of a day wholly inside [ttFrom, ttTo) - FALSE if it is not,
+// or has readings off its clock, and must go reading by reading
+//
+static int WholeDay(int nDate, const WxaDay *pDay, time_t ttFrom, time_t ttTo, WxkCols *pCols)
+{
+    if ((pDay->nSamples == 0) || (WxqDateTime(nDate, 0) < ttFrom) || (WxqDateTime(nDate, 1440) > ttTo))
+        return FALSE;
+
+    return WxkColumns(pDay, pCols) == pDay->nSamples;
+}
+
+typedef struct _ScanCtx
+{
+    time_t          ttFrom, ttTo;
+    WxqPointFn      fnPoint;
+    void            *pCtx;
+    long            nCnt;
+} ScanCtx;
+
+static int ScanPoints(int nDate, int nRes, WxaDay *pDay, void *pCtx)
+{
+    ScanCtx *pC = (ScanCtx *)pCtx;
+    int bStop = FALSE;
+
+    pC->nCnt += ScanDay(nDate, nRes, pDay, pC->ttFrom, pC->ttTo, pC->fnPoint, pC->pCtx, &bStop);
+
+    return bStop;
+}
+
+//
+// Call fnPoint for each reading in [ttFrom, ttTo), in log order.
+// Returns readings seen, -1 on error.
+//
+long WxqScan(time_t ttFrom, time_t ttTo, WxqPointFn fnPoint, void *pCtx)
+{
+    ScanCtx xC;
+
+    if (!sQueryPath || (ttTo <= ttFrom))
+        return sQueryPath ? 0 : -1;
+
+    xC.ttFrom = ttFrom;
+    xC.ttTo = ttTo;
+    xC.fnPoint = fnPoint;
+    xC.pCtx = pCtx;
+    xC.nCnt = 0;
+
+    return (ScanDays(ttFrom, ttTo, ScanPoints, &xC) < 0) ? -1 : xC.nCnt;
+}
+
+typedef struct _WhereCtx
+{
+    int             nField, nLo, nHi;
+    time_t          ttFrom, ttTo;
+    long            nCnt;
+    WxqPointFn      fnPoint;
+    void            *pCtx;
+} WhereCtx;
+
+static int SampleField(const WxSample *pS, int nField)
+{
+    switch (nField)
+    {
+    case WXQ_INDOOR:
+        return pS->nIndoor;
+    case WXQ_OUTDOOR:
+        return pS->nOutdoor;
+    case WXQ_WIND:
+        return pS->nWind;
+    default:
+        return pS->nPressure;
+    }
+}
+
+static int WherePoint(const WxqPoint *pPt, void *pCtx)
+{
+    WhereCtx *pW = (WhereCtx *)pCtx;
+    int nVal = SampleField(&pPt->xS, pW->nField);
+
+    if ((nVal < pW->nLo) || (nVal > pW->nHi))
+        return 0;
+
+    pW->nCnt++;
+
+    return pW->fnPoint(pPt, pW->pCtx);
+}
+
+static int RowMatches(const WxRollup *pRow, const WhereCtx *pW)
+{
+    return (pRow->nCount > 0) && (pRow->xStat[pW->nField].nMax >= pW->nLo) &&
+           (pRow->xStat[pW->nField].nMin <= pW->nHi);
+}
+
+static int WhereDay(int nDate, int nRes, WxaDay *pDay, void *pCtx)
+{
+    WhereCtx *pW = (WhereCtx *)pCtx;
+    int bStop = FALSE;
+
+    ScanDay(nDate, nRes, pDay, pW->ttFrom, pW->ttTo, WherePoint, pW, &bStop);
+
+    return bStop;
+}
+
+//
+// Readings in [ttFrom, ttTo) with nField in [nLo, nHi], in log order.
+// The rollups (zone maps) rule out days and hours first; what is left
+// of a CSV log is read hour by hour. Returns readings matched, -1 on
+// error.
+//
+long WxqWhere(time_t ttFrom, time_t ttTo, int nField, int nLo, int nHi, WxqPointFn fnPoint, void *pCtx)
+{
+    WhereCtx xW;
+    DayTask *pTasks, *pT;
+    WxRollZone *pZone;
+    WxRollMap *pMaps;
+    const WxRollup *pRow;
+    int nTasks, nKept, nMaps, nMday, n, h;
+    int nZone = 0, bZone = FALSE, nRet;
+
+    if (!sQueryPath || (ttTo <= ttFrom) || (nField < 0) || (nField >= WXQ_FIELDS))
+        return (sQueryPath && (ttTo <= ttFrom)) ? 0 : -1;
+
+    memset(&xW, 0, sizeof(xW));
+    xW.nField = nField;
+    xW.nLo = nLo;
+    xW.nHi = nHi;
+    xW.ttFrom = ttFrom;
+    xW.ttTo = ttTo;
+    xW.fnPoint = fnPoint;
+    xW.pCtx = pCtx;
+
+    nTasks = DayTasks(ttFrom, ttTo, &pTasks);
+    if (nTasks < 0)
+        return -1;
+    pZone = (WxRollZone *)malloc(sizeof(WxRollZone));
+    pMaps = (WxRollMap *)malloc((nTasks + 1) * sizeof(WxRollMap));
+    if (!pZone || !pMaps)
+    {
+        free(pTasks);
+        free(pZone);
+        free(pMaps);
+        return -1;
+    }
+
+    // Drop days the rollups rule out, narrow the rest to hours
+    for (n = nKept = nMaps = 0; n < nTasks; n++)
+    {
+        pT = &pTasks[n];
+        if ((pT->nDate / 100) != nZone)
+        {
+            nZone = pT->nDate / 100;
+            bZone = (WxRollLoadZone(nZone, pZone) == 0);
+        }
+
+        // Without a rollup for the day, read it all
+        nMday = pT->nDate % 100;
+        if (bZone && (pZone->xRows[WXR_ROW_DAY(nMday)].nCount > 0))
+        {
+            if (!RowMatches(&pZone->xRows[WXR_ROW_DAY(nMday)], &xW))
+                continue;
+            for (pT->nMask = 0, h = 0; h < 24; h++)
+            {
+                pRow = &pZone->xRows[WXR_ROW_HOUR(nMday, h)];
+                if (RowMatches(pRow, &xW))
+                    pT->nMask |= 1U << h;
+            }
+            if ((pT->nSrc == WXQ_SRC_CSV) && (pZone->xMap[nMday - 1].nSize != WXR_NO_OFFSET))
+            {
+                pMaps[nMaps] = pZone->xMap[nMday - 1];
+                pT->nMap = nMaps++;
+            }
+        }
+        pTasks[nKept++] = *pT;
+    }
+    free(pZone);
+
+    nRet = RunDays(pTasks, nKept, pMaps, WhereDay, &xW);
+    free(pMaps);
+    free(pTasks);
+
+    return (nRet < 0) ? -1 : xW.nCnt;
+}
+
+static void StatAdd(WxqStat *pStat, int nVal, time_t ttTime, int bFirst)
+{
+    if (bFirst || (nVal < pStat->nMin))
+    {
+        pStat->nMin = nVal;
+        pStat->ttMin = ttTime;
+    }
+    if (bFirst || (nVal > pStat->nMax))
+    {
+        pStat->nMax = nVal;
+        pStat->ttMax = ttTime;
+    }
+    pStat->nSum += nVal;
+
+    return;
+}
+
+static void BucketAdd(WxqBucket *pB, const WxqPoint *pPt)
+{
+    int bFirst = (pB->nCount == 0);
+
+    StatAdd(&pB->xStat[WXQ_INDOOR], pPt->xS.nIndoor, pPt->ttTime, bFirst);
+    StatAdd(&pB->xStat[WXQ_OUTDOOR], pPt->xS.nOutdoor, pPt->ttTime, bFirst);
+    StatAdd(&pB->xStat[WXQ_WIND], pPt->xS.nWind, pPt->ttTime, bFirst);
+    StatAdd(&pB->xStat[WXQ_PRESSURE], pPt->xS.nPressure, pPt->ttTime, bFirst);
+    pB->nCount++;
+
+    return;
+}
+
+typedef struct _BucketCtx
+{
+    WxqBucket   *pBuckets;
+    int         nBuckets;
+    time_t      ttFrom, ttTo;
+    long        nSecs;
+    const time_t *pEdges;           // Bucket starts (NULL := nSecs apart)
+    WxkCols     *pCols;
+} BucketCtx;
+
+// Bucket of ttTime - -1 before the first edge, nBuckets from the last
+static long BucketOf(const BucketCtx *pC, time_t ttTime)
+{
+    long nLo, nHi, nMid;
+
+    if (!pC->pEdges)
+        return (ttTime - pC->ttFrom) / pC->nSecs;
+
+    for (nLo = 0, nHi = pC->nBuckets + 1; nLo < nHi; )
+    {
+        nMid = (nLo + nHi) / 2;
+        if (pC->pEdges[nMid] <= ttTime)
+            nLo = nMid + 1;
+        else
+            nHi = nMid;
+    }
+
+    return nLo - 1;
+}
+
+static int BucketPoint(const WxqPoint *pPt, void *pCtx)
+{
+    BucketCtx *pC = (BucketCtx *)pCtx;
+    long nBucket;
+
+    nBucket = BucketOf(pC, pPt->ttTime);
+    if ((nBucket >= 0) && (nBucket < pC->nBuckets))
+        BucketAdd(&pC->pBuckets[nBucket], pPt);
+
+    return 0;
+}
+
+// A whole day into one bucket - as BucketAdd reading by reading
+static void BucketCols(WxqBucket *pB, int nDate, const WxkCols *pCols)
+{
+    const int16_t *pTime = pCols->nCol[WXK_TIME];
+    WxqStat *pS;
+    WxkStat xK;
+    int n = pCols->nCount, k;
+
+    for (k = 0; k < WXQ_FIELDS; k++)
+    {
+        pS = &pB->xStat[k];
+        WxkStats(pCols->nCol[k], n, &xK);
+        if ((pB->nCount == 0) || (xK.nMin < pS->nMin))
+        {
+            pS->nMin = xK.nMin;
+            pS->ttMin = WxqDateTime(nDate, pTime[WxkFind(pCols->nCol[k], n, xK.nMin)]);
+        }
+        if ((pB->nCount == 0) || (xK.nMax > pS->nMax))
+        {
+            pS->nMax = xK.nMax;
+            pS->ttMax = WxqDateTime(nDate, pTime[WxkFind(pCols->nCol[k], n, xK.nMax)]);
+        }
+        pS->nSum += (long)xK.nSum;
+    }
+    pB->nCount += n;
+
+    return;
+}
+
+// Later bucket onto pAll - as if its readings were added one by one
+static void BucketMerge(WxqBucket *pAll, const WxqBucket *pB)
+{
+    WxqStat *pS;
+    int k;
+
+    if (pB->nCount == 0)
+        return;
+
+    for (k = 0; k < WXQ_FIELDS; k++)
+    {
+        pS = &pAll->xStat[k];
+        if ((pAll->nCount == 0) || (pB->xStat[k].nMin < pS->nMin))
+        {
+            pS->nMin = pB->xStat[k].nMin;
+            pS->ttMin = pB->xStat[k].ttMin;
+        }
+        if ((pAll->nCount == 0) || (pB->xStat[k].nMax > pS->nMax))
+        {
+            pS->nMax = pB->xStat[k].nMax;
+            pS->ttMax = pB->xStat[k].ttMax;
+        }
+        pS->nSum += pB->xStat[k].nSum;
+    }
+    pAll->nCount += pB->nCount;
+
+    return;
+}
+
+static int BucketDay(int nDate, int nRes, WxaDay *pDay, void *pCtx)
+{
+    BucketCtx *pC = (BucketCtx *)pCtx;
+    long nFirst, nLast;
+    int bStop = FALSE;
+
+    // Day in one bucket goes through the kernels
+    nFirst = BucketOf(pC, WxqDateTime(nDate, 0));
+    nLast = BucketOf(pC, WxqDateTime(nDate, 1440) - 1);
+    if ((nFirst == nLast) && WholeDay(nDate, pDay, pC->ttFrom, pC->ttTo, pC->pCols))
+    {
+        BucketCols(&pC->pBuckets[nFirst], nDate, pC->pCols);
+        return 0;
+    }
+
+    ScanDay(nDate, nRes, pDay, pC->ttFrom, pC->ttTo, BucketPoint, pC, &bStop);
+
+    return bStop;
+}
+
+// Buckets between pEdges[0..nBuckets] - nSecs apart, or by the edges (0)
+static int BucketScan(const time_t *pEdges, long nSecs, WxqBucket *pBuckets, int nBuckets)
+{
+    BucketCtx xCtx;
+    int nRet;
+
+    if (!sQueryPath)
+        return -1;
+
+    xCtx.pBuckets = pBuckets;
+    xCtx.nBuckets = nBuckets;
+    xCtx.ttFrom = pEdges[0];
+    xCtx.ttTo = pEdges[nBuckets];
+    xCtx.nSecs = nSecs;
+    xCtx.pEdges = nSecs ? NULL : pEdges;
+    xCtx.pCols = (WxkCols *)malloc(sizeof(WxkCols));
+    if (!xCtx.pCols)
+        return -1;
+
+    nRet = ScanDays(xCtx.ttFrom, xCtx.ttTo, BucketDay, &xCtx);
+    free(xCtx.pCols);
+
+    return nRet;
+}
+
+//
+// Closed buckets come from the result cache; each run of the rest is
+// scanned in one go and what it found cached
+//
+static int CachedScan(const time_t *pEdges, long nSecs, WxqBucket *pBuckets, int nBuckets)
+{
+    unsigned char *bHit;
+    unsigned long nGen;
+    time_t ttSealed;
+    int n, k, j, nRet = 0;
+
+    if (!sQueryPath)
+        return -1;
+
+    bHit = (unsigned char *)malloc(nBuckets);
+    if (!bHit)
+        return -1;
+
+    nGen = WxmBegin(&ttSealed);
+    for (n = 0; n < nBuckets; n++)
+        bHit[n] = WxmGet(pEdges[n], pEdges[n + 1], &pBuckets[n]);
+
+    for (n = 0; (n < nBuckets) && (nRet == 0); n = k)
+    {
+        for (k = n + 1; (k < nBuckets) && (bHit[k] == bHit[n]); k++)
+            ;
+        if (bHit[n])
+            continue;
+
+        nRet = BucketScan(&pEdges[n], nSecs, &pBuckets[n], k - n);
+        for (j = n; (j < k) && (nRet == 0); j++)
+            WxmPut(pEdges[j], pEdges[j + 1], &pBuckets[j], nGen, ttSealed);
+    }
+    free(bHit);
+
+    return nRet;
+}
+
+//
+// min/max/avg per nSecs bucket from ttFrom. Returns bucket count
+// (*ppBuckets to be freed), -1 on error.
+//
+int WxqBuckets(time_t ttFrom, time_t ttTo, long nSecs, WxqBucket **ppBuckets)
+{
+    WxqBucket *pBuckets;
+    time_t *pEdges;
+    int nBuckets, n;
+
+    *ppBuckets = NULL;
+    if ((nSecs <= 0) || (ttTo <= ttFrom) || (((ttTo - ttFrom + nSecs - 1) / nSecs) > WXQ_MAX_BUCKETS))
+        return -1;
+
+    nBuckets = (ttTo - ttFrom + nSecs - 1) / nSecs;
+    pBuckets = (WxqBucket *)calloc(nBuckets, sizeof(WxqBucket));
+    pEdges = (time_t *)malloc((nBuckets + 1) * sizeof(time_t));
+    if (!pBuckets || !pEdges)
+    {
+        free(pBuckets);
+        free(pEdges);
+        return -1;
+    }
+
+    for (n = 0; n < nBuckets; n++)
+        pEdges[n] = pBuckets[n].ttStart = ttFrom + (n * nSecs);
+    pEdges[nBuckets] = ttTo;
+
+    n = CachedScan(pEdges, nSecs, pBuckets, nBuckets);
+    free(pEdges);
+    if (n < 0)
+    {
+        free(pBuckets);
+        return -1;
+    }
+
+    *ppBuckets = pBuckets;
+
+    return nBuckets;
+}
+
+//
+// Whole range as one bucket - extremes with their times. Added up day
+// by day, so only the open day is read again once the rest is cached.
+//
+int WxqExtremes(time_t ttFrom, time_t ttTo, WxqBucket *pAll)
+{
+    WxqBucket *pDays;
+    time_t *pEdges;
+    int nDays, nDate, nLast, n, nRet;
+
+    memset(pAll, 0, sizeof(*pAll));
+    pAll->ttStart = ttFrom;
+    if (ttTo <= ttFrom)
+        return sQueryPath ? 0 : -1;
+
+    nLast = WxqDateOf(ttTo - 1);
+    for (nDays = 1, nDate = WxqDateOf(ttFrom); (nDate < nLast) && (nDays <= WXQ_MAX_BUCKETS); nDays++)
+        nDate = WxqNextDate(nDate);
+    if (nDays > WXQ_MAX_BUCKETS)
+        return -1;
+
+    pDays = (WxqBucket *)calloc(nDays, sizeof(WxqBucket));
+    pEdges = (time_t *)malloc((nDays + 1) * sizeof(time_t));
+    if (!pDays || !pEdges)
+    {
+        free(pDays);
+        free(pEdges);
+        return -1;
+    }
+
+    pEdges[0] = ttFrom;
+    for (n = 1, nDate = WxqDateOf(ttFrom); n < nDays; n++)
+    {
+        nDate = WxqNextDate(nDate);
+        pEdges[n] = WxqDateTime(nDate, 0);
+    }
+    pEdges[nDays] = ttTo;
+    for (n = 0; n < nDays; n++)
+        pDays[n].ttStart = pEdges[n];
+
+    nRet = CachedScan(pEdges, 0, pDays, nDays);
+    for (n = 0; (n < nDays) && (nRet == 0); n++)
+        BucketMerge(pAll, &pDays[n]);
+    free(pDays);
+    free(pEdges);
+
+    return (nRet < 0) ? -1 : pAll->nCount;
+}
+
+typedef struct _CountCtx
+{
+    time_t      ttFrom, ttTo;
+    int         nField, nLo, nHi;
+    long        nCnt;
+    WxkCols     *pCols;
+} CountCtx;
+
+static int CountPoint(const WxqPoint *pPt, void *pCtx)
+{
+    CountCtx *pC = (CountCtx *)pCtx;
+    int nVal = SampleField(&pPt->xS, pC->nField);
+
+    if ((nVal >= pC->nLo) && (nVal <= pC->nHi))
+        pC->nCnt++;
+
+    return 0;
+}
+
+static int CountDay(int nDate, int nRes, WxaDay *pDay, void *pCtx)
+{
+    CountCtx *pC = (CountCtx *)pCtx;
+    int bStop = FALSE;
+
+    if (WholeDay(nDate, pDay, pC->ttFrom, pC->ttTo, pC->pCols))
+        pC->nCnt += WxkCount(pC->pCols->nCol[pC->nField], pC->pCols->nCount, pC->nLo, pC->nHi);
+    else
+        ScanDay(nDate, nRes, pDay, pC->ttFrom, pC->ttTo, CountPoint, pC, &bStop);
+
+    return bStop;
+}
+
+//
+// Readings in [ttFrom, ttTo) with nField in [nLo, nHi]. Returns the
+// count, -1 on error.
+//
+long WxqCount(time_t ttFrom, time_t ttTo, int nField, int nLo, int nHi)
+{
+    CountCtx xC;
+    int nRet;
+
+    if (!sQueryPath || (ttTo <= ttFrom) || (nField < 0) || (nField >= WXQ_FIELDS))
+        return (sQueryPath && (ttTo <= ttFrom)) ? 0 : -1;
+
+    memset(&xC, 0, sizeof(xC));
+    xC.ttFrom = ttFrom;
+    xC.ttTo = ttTo;
+    xC.nField = nField;
+    xC.nLo = nLo;
+    xC.nHi = nHi;
+    xC.pCols = (WxkCols *)malloc(sizeof(WxkCols));
+    if (!xC.pCols)
+        return -1;
+
+    nRet = ScanDays(ttFrom, ttTo, CountDay, &xC);
+    free(xC.pCols);
+
+    return (nRet < 0) ? -1 : xC.nCnt;
+}
+
+int WxqStatAvg(const WxqBucket *pB, int nField)
+{
+    long nSum = pB->xStat[nField].nSum;
+
+    if (pB->nCount == 0)
+        return 0;
+
+    return (nSum >= 0) ? ((nSum + (pB->nCount / 2)) / pB->nCount) : -((-nSum + (pB->nCount / 2)) / pB->nCount);
+}
+
+//-------------------------------------------------------------------------------
+// Command line
+
+// YYYY-MM-DD[( |T)HH:MM] - date only is midnite (bEnd: following midnite)
+int WxqParseWhen(const char *sWhen, time_t *pTime, int bEnd)
+{
+    int nYear, nMon, nDay, nHour = 0, nMin = 0, n;
+    char cSep;
+
+    n = sscanf(sWhen, "%d-%d-%d%c%d:%d", &nYear, &nMon, &nDay, &cSep, &nHour, &nMin);
+    if ((n != 3) && (n != 6))
+        return -1;
+    if ((nMon < 1) || (nMon > 12) || (nDay < 1) || (nDay > 31))
+        return -1;
+
+    bEnd = bEnd && (n == 3);
+    n = (nYear * 10000) + (nMon * 100) + nDay;
+    if (bEnd)
+        n = WxqNextDate(n);
+    *pTime = WxqDateTime(n, (nHour * 60) + nMin);
+
+    return 0;
+}
+
+static void PrintWhen(FILE *fOut, time_t ttTime)
+{
+    struct tm tmTime;
+
+    vc_localtime(&ttTime, &tmTime);
+    fprintf(fOut, "%d-%02d-%02d %02d:%02d", tmTime.tm_year + 1900, tmTime.tm_mon + 1, tmTime.tm_mday,
+            tmTime.tm_hour, tmTime.tm_min);
+
+    return;
+}
+
+static int PrintPoint(const WxqPoint *pPt, void *pCtx)
+{
+    FILE *fOut = (FILE *)pCtx;
+
+    PrintWhen(fOut, pPt->ttTime);
+    fprintf(fOut, ",%d,%d,%d,%s,%d.%02d\n", pPt->xS.nIndoor, pPt->xS.nOutdoor, pPt->xS.nWind,
+            sWinDir[pPt->xS.nDir & 0x0F], pPt->xS.nPressure / 100, pPt->xS.nPressure % 100);
+
+    return 0;
+}
+
+static void PrintValue(FILE *fOut, int nField, int nVal)
+{
+    if (nField == WXQ_PRESSURE)
+        fprintf(fOut, "%d.%02d", nVal / 100, nVal % 100);
+    else
+        fprintf(fOut, "%d", nVal);
+
+    return;
+}
+
+// Percentile (fractional) - tenths, pressure in hundredths of inHg
+static void PrintQuantile(FILE *fOut, int nField, double fVal)
+{
+    if (nField == WXQ_PRESSURE)
+        fprintf(fOut, "%.2f", fVal / 100.0);
+    else
+        fprintf(fOut, "%.1f", fVal);
+
+    return;
+}
+
+static int PrintRollup(const WxRollup *pRow, void *pCtx)
+{
+    FILE *fOut = (FILE *)pCtx;
+    int k, nDir, nSpeed;
+
+    PrintWhen(fOut, pRow->ttStart);
+    fprintf(fOut, ",%d", pRow->nCount);
+    for (k = 0; k < WXQ_FIELDS; k++)
+    {
+        fprintf(fOut, ",");
+        PrintValue(fOut, k, pRow->xStat[k].nMin);
+        fprintf(fOut, ",");
+        PrintValue(fOut, k, pRow->xStat[k].nMax);
+        fprintf(fOut, ",");
+        PrintValue(fOut, k, WxRollAvg(pRow, k));
+    }
+    nDir = WxRollWind(pRow, &nSpeed);
+    fprintf(fOut, ",%s,%d\n", sWinDir[nDir], nSpeed);
+
+    return 0;
+}
+
+//
+// <field><op><value> - field by name (case ignored), op one of < <= =
+// >= >, pressure with its decimals
+//
+static int ParsePredicate(const char *sOp, int *pnField, int *pnLo, int *pnHi)
+{
+    static const char * const sName[WXQ_FIELDS] = { "indoor", "outdoor", "wind", "pressure" };
+    const char *p;
+    char *pEnd;
+    double fVal;
+    int nLen, nVal;
+
+    for (p = sOp; *p && !strchr("<=>", *p); p++)
+        ;
+    nLen = p - sOp;
+    for (*pnField = 0; (*pnField < WXQ_FIELDS) && ((nLen != (int)strlen(sName[*pnField])) ||
+                                                  strncasecmp(sOp, sName[*pnField], nLen)); (*pnField)++)
+        ;
+    if ((*pnField == WXQ_FIELDS) || !*p)
+        return -1;
+
+    fVal = strtod(p + (((p[0] != '=') && (p[1] == '=')) ? 2 : 1), &pEnd);
+    if (*pEnd)
+        return -1;
+    if (*pnField == WXQ_PRESSURE)
+        fVal *= 100;
+    nVal = (int)((fVal < 0) ? (fVal - 0.5) : (fVal + 0.5));
+
+    *pnLo = -32768;
+    *pnHi = 32767;
+    if (p[0] == '=')
+        *pnLo = *pnHi = nVal;
+    else if (p[0] == '<')
+        *pnHi = (p[1] == '=') ? nVal : (nVal - 1);
+    else
+        *pnLo = (p[1] == '=') ? nVal : (nVal + 1);
+
+    return 0;
+}
+
+//
+// from,to[,points|extremes|history|normals|gaps|pNN[,pNN...]|chart:<field>:<points>|secs|hour|day|month|[count:]<field><op><value>]
+//
+static int RunQuery(const char *sSpec, FILE *fOut)
+{
+    static const char * const sField[WXQ_FIELDS] = { "Indoor", "Outdoor", "Wind", "Pressure" };
+    char sFrom[24], sTo[24], sOp[32], sName[16];
+    time_t ttFrom, ttTo;
+    WxqBucket *pBuckets, xAll;
+    WxRollSketch xSketch;
+    const char *p;
+    double fPct;
+    long nCount;
+    int nBuckets, n, k, nField, nLo, nHi;
+
+    strcpy(sOp, "points");
+    n = sscanf(sSpec, "%23[^,],%23[^,],%31s", sFrom, sTo, sOp);
+    if ((n < 2) || (WxqParseWhen(sFrom, &ttFrom, FALSE) != 0) || (WxqParseWhen(sTo, &ttTo, TRUE) != 0))
+    {
+        printf("Bad query: %s\n", sSpec);
+        return -1;
+    }
+
+    if (strcmp(sOp, "points") == 0)
+    {
+        fputs(WEATHER_LOG_HEADER1, fOut);
+        return (WxqScan(ttFrom, ttTo, PrintPoint, fOut) < 0) ? -1 : 0;
+    }
+
+    if (strcmp(sOp, "extremes") == 0)
+    {
+        if (WxqExtremes(ttFrom, ttTo, &xAll) < 0)
+            return -1;
+        fprintf(fOut, "Field,Low,Time,High,Time,Avg,Count\n");
+        for (k = 0; (k < WXQ_FIELDS) && (xAll.nCount > 0); k++)
+        {
+            fprintf(fOut, "%s,", sField[k]);
+            PrintValue(fOut, k, xAll.xStat[k].nMin);
+            fprintf(fOut, ",");
+            PrintWhen(fOut, xAll.xStat[k].ttMin);
+            fprintf(fOut, ",");
+            PrintValue(fOut, k, xAll.xStat[k].nMax);
+            fprintf(fOut, ",");
+            PrintWhen(fOut, xAll.xStat[k].ttMax);
+            fprintf(fOut, ",");
+            PrintValue(fOut, k, WxqStatAvg(&xAll, k));
+            fprintf(fOut, ",%d\n", xAll.nCount);
+        }
+        return 0;
+    }
+
+    if (strcmp(sOp, "history") == 0)
+        return (WxhPrint(WxqDateOf(ttFrom), WxqDateOf(ttTo), fOut) < 0) ? -1 : 0;
+
+    if (strcmp(sOp, "normals") == 0)
+        return (WxnPrint(WxqDateOf(ttFrom), WxqDateOf(ttTo), fOut) < 0) ? -1 : 0;
+
+    if (strcmp(sOp, "gaps") == 0)
+        return (WxgPrint(WxqDateOf(ttFrom), WxqDateOf(ttTo), fOut) < 0) ? -1 : 0;
+
+    if (sscanf(sOp, "chart:%15[^:]:%d", sName, &k) == 2)
+    {
+        nField = WxcField(sName);
+        return ((nField < 0) || (WxcPrint(nField, ttFrom, ttTo, k, fOut) < 0)) ? -1 : 0;
+    }
+
+    if ((sOp[0] == 'p') && (sOp[1] >= '0') && (sOp[1] <= '9'))
+    {
+        n = WxRollSketches(ttFrom, ttTo, &xSketch);
+        if (n < 0)
+            return -1;
+        fprintf(fOut, "Percentile,Count");
+        for (k = 0; k < WXQ_FIELDS; k++)
+            fprintf(fOut, ",%s", sField[k]);
+        fprintf(fOut, "\n");
+        for (p = sOp; p && (*p == 'p'); p = strchr(p, ','), p = p ? (p + 1) : NULL)
+        {
+            fPct = atof(p + 1);
+            fprintf(fOut, "%g,%d", fPct, n);
+            for (k = 0; (k < WXQ_FIELDS) && (n > 0); k++)
+            {
+                fprintf(fOut, ",");
+                PrintQuantile(fOut, k, WxtQuantile(&xSketch.xField[k], fPct / 100.0));
+            }
+            fprintf(fOut, "\n");
+        }
+        return 0;
+    }
+
+    if ((strncmp(sOp, "count:", 6) == 0) && (ParsePredicate(sOp + 6, &nField, &nLo, &nHi) == 0))
+    {
+        nCount = WxqCount(ttFrom, ttTo, nField, nLo, nHi);
+        if (nCount < 0)
+            return -1;
+        fprintf(fOut, "Count\n%ld\n", nCount);
+        return 0;
+    }
+
+    if (ParsePredicate(sOp, &nField, &nLo, &nHi) == 0)
+    {
+        fputs(WEATHER_LOG_HEADER1, fOut);
+        return (WxqWhere(ttFrom, ttTo, nField, nLo, nHi, PrintPoint, fOut) < 0) ? -1 : 0;
+    }
+
+    if ((strcmp(sOp, "hour") == 0) || (strcmp(sOp, "day") == 0) || (strcmp(sOp, "month") == 0))
+    {
+        fprintf(fOut, "Start,Count");
+        for (k = 0; k < WXQ_FIELDS; k++)
+            fprintf(fOut, ",%sLow,%sHigh,%sAvg", sField[k], sField[k], sField[k]);
+        fprintf(fOut, ",WindDir,WindVec\n");
+        n = WxRollRead((sOp[0] == 'h') ? WXR_HOUR : (sOp[0] == 'd') ? WXR_DAY : WXR_MONTH,
+                       ttFrom, ttTo, PrintRollup, fOut);
+        return (n < 0) ? -1 : 0;
+    }
+
+    nBuckets = WxqBuckets(ttFrom, ttTo, atol(sOp), &pBuckets);
+    if (nBuckets < 0)
+    {
+        printf("Bad query bucket: %s\n", sOp);
+        return -1;
+    }
+
+    fprintf(fOut, "Start,Count");
+    for (k = 0; k < WXQ_FIELDS; k++)
+        fprintf(fOut, ",%sLow,%sHigh,%sAvg", sField[k], sField[k], sField[k]);
+    fprintf(fOut, "\n");
+    for (n = 0; n < nBuckets; n++)
+    {
+        if (pBuckets[n].nCount == 0)
+            continue;
+        PrintWhen(fOut, pBuckets[n].ttStart);
+        fprintf(fOut, ",%d", pBuckets[n].nCount);
+        for (k = 0; k < WXQ_FIELDS; k++)
+        {
+            fprintf(fOut, ",");
+            PrintValue(fOut, k, pBuckets[n].xStat[k].nMin);
+            fprintf(fOut, ",");
+            PrintValue(fOut, k, pBuckets[n].xStat[k].nMax);
+            fprintf(fOut, ",");
+            PrintValue(fOut, k, WxqStatAvg(&pBuckets[n], k));
+        }
+        fprintf(fOut, "\n");
+    }
+    free(pBuckets);
+
+    return 0;
+}
+
+//
+// -Q from,to[,op]
+//
+int WxqRunCli(const char *sSpec)
+{
+    return RunQuery(sSpec, stdout);
+}
+
+//
+// query/<from>/<to>[/<op>].csv - as -Q, query/cache.csv - result cache
+// hits and misses
+//
+FILE *WxqOpenUri(const char *sUri)
+{
+    char sFrom[24], sTo[24], sOp[32], sSpec[96];
+    FILE *fOut;
+    int n;
+
+    if (!sQueryPath || (strncmp(sUri, "query/", 6) != 0) || (strlen(sUri) < 10) ||
+        (strcmp(sUri + strlen(sUri) - 4, ".csv") != 0))
+        return NULL;
+
+    if (strcmp(sUri, "query/cache.csv") == 0)
+    {
+        fOut = tmpfile();
+        if (fOut)
+        {
+            WxmPrintStats(fOut);
+            rewind(fOut);
+        }
+        return fOut;
+    }
+
+    strcpy(sOp, "points");
+    n = sscanf(sUri, "query/%23[^/]/%23[^/.]/%31[^/]", sFrom, sTo, sOp);
+    if (n < 2)
+        return NULL;
+    if (n == 3)
+        sOp[strlen(sOp) - 4] = '\0';
+    snprintf(sSpec, sizeof(sSpec), "%s,%s,%s", sFrom, sTo, sOp);
+
+    fOut = tmpfile();
+    if (fOut == NULL)
+        return NULL;
+
+    if (RunQuery(sSpec, fOut) < 0)
+    {
+        fclose(fOut);
+        return NULL;
+    }
+    rewind(fOut);
+
+    return fOut;
+}
@@ -0,0 +1,91 @@
+// wxquery.h
+//
+// Time-range queries over the weather log tree - day logs (CSV or
+// binary) and monthly archives behind one index of available days
+//
+
+#ifndef WXQUERY_H_INCLUDED
+#define WXQUERY_H_INCLUDED
+
+#include <stdio.h>
+#include <time.h>
+
+#include "wxarch.h"
+
+// Where a day's readings come from (best first)
+#define WXQ_SRC_WXB         1
+#define WXQ_SRC_CSV         2
+#define WXQ_SRC_WXA         3
+
+// Queried fields (WxqStat index)
+#define WXQ_INDOOR          0
+#define WXQ_OUTDOOR         1
+#define WXQ_WIND            2
+#define WXQ_PRESSURE        3
+#define WXQ_FIELDS          4
+
+//
+// Reading with its time
+//
+typedef struct _WxqPoint
+{
+    time_t      ttTime;
+    int         nRes;               // WXA_RES_xxx of source
+    WxSample    xS;
+} WxqPoint;
+
+typedef struct _WxqStat
+{
+    short       nMin, nMax;
+    time_t      ttMin, ttMax;       // First time each was seen
+    long        nSum;
+} WxqStat;
+
+//
+// Aggregate over a bucket (or whole range)
+//
+typedef struct _WxqBucket
+{
+    time_t      ttStart;
+    int         nCount;
+    WxqStat     xStat[WXQ_FIELDS];
+} WxqBucket;
+
+// Return non-zero to stop the scan
+typedef int (*WxqPointFn)(const WxqPoint *pPt, void *pCtx);
+
+// Return non-zero once whoever asked is gone
+typedef int (*WxqCancelFn)(void *pCtx);
+
+// Dates (yyyymmdd, local)
+extern int WxqDateOf(time_t ttTime);
+extern time_t WxqDateTime(int nDate, int nMinutes);
+extern int WxqNextDate(int nDate);
+extern int WxqParseWhen(const char *sWhen, time_t *pTime, int bEnd);
+
+// Day index
+extern int WxqOpen(const char *sLogPath);
+extern int WxqRescan(void);
+extern void WxqClose(void);
+extern int WxqDays(int *pnFirst, int *pnLast);
+
+// Queries [ttFrom, ttTo)
+extern int WxqLoadDay(int nDate, WxaDay *pDay, int *pRes);
+extern long WxqScan(time_t ttFrom, time_t ttTo, WxqPointFn fnPoint, void *pCtx);
+extern int WxqBuckets(time_t ttFrom, time_t ttTo, long nSecs, WxqBucket **ppBuckets);
+extern int WxqExtremes(time_t ttFrom, time_t ttTo, WxqBucket *pAll);
+extern int WxqStatAvg(const WxqBucket *pB, int nField);
+extern long WxqWhere(time_t ttFrom, time_t ttTo, int nField, int nLo, int nHi, WxqPointFn fnPoint, void *pCtx);
+extern long WxqCount(time_t ttFrom, time_t ttTo, int nField, int nLo, int nHi);
+
+// Cancel this thread's queries (fail with -1) once fnCheck is true
+extern void WxqSetCancel(WxqCancelFn fnCheck, void *pCtx);
+extern int WxqCancelled(void);
+
+// CLI: -Q from,to[,points|extremes|history|secs|hour|day|month|[count:]<field><op><value>]
+extern int WxqRunCli(const char *sSpec);
+
+// Web: query/<from>/<to>[/<op>].csv, query/cache.csv
+extern FILE *WxqOpenUri(const char *sUri);
+
+#endif // WXQUERY_H_INCLUDED
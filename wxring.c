@@ -0,0 +1,193 @@
+// wxring.c - Recent readings ring
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxring.h"
+
+//
+// The log keeps three readings an hour. With fast sampling (-G) the
+// command thread also reads the device every few seconds; those samples
+// are decoded and validated like logged readings but only land here.
+// Logged readings go in as well so the ring is the whole recent picture.
+//
+// The ring is allocated once for the hours asked for. The decode stage
+// is the only writer; web readers copy slots out under a per-slot
+// sequence count (as the time snapshot in timesvc.c) so neither side
+// ever waits on the other. A reader that finds a slot being rewritten
+// has been lapped - everything older is gone and it stops there.
+//
+
+typedef struct _WxRingSlot
+{
+    unsigned int    nSeq;           // Odd while being written
+    unsigned int    nIndex;         // Sample number held
+    WxRingSample    xS;
+} WxRingSlot;
+
+int nSampleSecs;
+
+static WxRingSlot *pSlots;
+static unsigned int nSlots;
+static unsigned int nHead;          // Samples written
+
+int WxRingStart(const char *sSpec)
+{
+    int nSecs, nHours = WXRING_HOURS;
+
+    if ((sscanf(sSpec, "%d,%d", &nSecs, &nHours) < 1) ||
+        (nSecs < WXRING_MIN_SECS) || (nSecs > WXRING_MAX_SECS) ||
+        (nHours < 1) || (nHours > WXRING_MAX_HOURS))
+    {
+        printf("Bad sample spec: %s (secs %d-%d, hours 1-%d)\n", sSpec,
+               WXRING_MIN_SECS, WXRING_MAX_SECS, WXRING_MAX_HOURS);
+        return -1;
+    }
+
+    // Room for logged readings and retries on top of the samples
+    nSlots = ((nHours * 60 * 60) / nSecs) + (nHours * 6) + 1;
+    pSlots = (WxRingSlot *)calloc(nSlots, sizeof(WxRingSlot));
+    if (!pSlots)
+    {
+        printf("Sample ring alloc failed (%u slots)\n", nSlots);
+        return -1;
+    }
+    nSampleSecs = nSecs;
+
+    return 0;
+}
+
+void WxRingPut(const struct timespec *pStamp, const WxWeather *pW)
+{
+    WxRingSlot *pSlot;
+    unsigned int n;
+
+    if (!pSlots)
+        return;
+
+    n = __atomic_load_n(&nHead, __ATOMIC_RELAXED);
+    pSlot = &pSlots[n % nSlots];
+
+    __atomic_store_n(&pSlot->nSeq, pSlot->nSeq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    pSlot->nIndex = n;
+    pSlot->xS.tsStamp = *pStamp;
+    pSlot->xS.xW = *pW;
+    __atomic_store_n(&pSlot->nSeq, pSlot->nSeq + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&nHead, n + 1, __ATOMIC_RELEASE);
+
+    return;
+}
+
+// Copy out sample n - FALSE if it has been overwritten
+static int ReadSlot(unsigned int n, WxRingSample *pOut)
+{
+    WxRingSlot *pSlot = &pSlots[n % nSlots];
+    unsigned int nStart, nIndex;
+
+    nStart = __atomic_load_n(&pSlot->nSeq, __ATOMIC_ACQUIRE);
+    if (nStart & 1)
+        return FALSE;
+    nIndex = pSlot->nIndex;
+    *pOut = pSlot->xS;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return (nStart == __atomic_load_n(&pSlot->nSeq, __ATOMIC_RELAXED)) && (nIndex == n);
+}
+
+int WxRingSince(time_t ttFrom, WxRingSample **ppSamples)
+{
+    WxRingSample *pOut, xTmp;
+    unsigned int nEnd, n;
+    int nCount = 0, i;
+
+    *ppSamples = NULL;
+    if (!pSlots)
+        return -1;
+
+    pOut = (WxRingSample *)malloc(nSlots * sizeof(WxRingSample));
+    if (!pOut)
+        return -1;
+
+    // Newest back, then turned around
+    nEnd = __atomic_load_n(&nHead, __ATOMIC_ACQUIRE);
+    for (n = nEnd; (n != 0) && ((nEnd - n) < nSlots); n--)
+    {
+        if (!ReadSlot(n - 1, &pOut[nCount]) || (pOut[nCount].tsStamp.tv_sec < ttFrom))
+            break;
+        nCount++;
+    }
+
+    for (i = 0; i < (nCount / 2); i++)
+    {
+        xTmp = pOut[i];
+        pOut[i] = pOut[nCount - 1 - i];
+        pOut[nCount - 1 - i] = xTmp;
+    }
+    *ppSamples = pOut;
+
+    return nCount;
+}
+
+int WxRingPrint(int nSecs, FILE *fOut)
+{
+    WxRingSample *pSamples;
+    const WxWeather *pW;
+    struct tm tmTime;
+    int nCount, n;
+
+    nCount = WxRingSince(vc_time() - nSecs, &pSamples);
+    if (nCount < 0)
+        return -1;
+
+    fputs(WEATHER_LOG_HEADER1, fOut);
+    for (n = 0; n < nCount; n++)
+    {
+        pW = &pSamples[n].xW;
+        vc_localtime(&pSamples[n].tsStamp.tv_sec, &tmTime);
+        fprintf(fOut, "%d-%02d-%02d %02d:%02d:%02d.%03ld,%d,%d,%d,%s,%d.%02d\n",
+                tmTime.tm_year + 1900, tmTime.tm_mon + 1, tmTime.tm_mday, tmTime.tm_hour, tmTime.tm_min,
+                tmTime.tm_sec, pSamples[n].tsStamp.tv_nsec / 1000000L, pW->nIndoor, pW->nOutdoor,
+                pW->nWind, sWinDir[pW->nDir & 0x0F], pW->nPressure / 100, pW->nPressure % 100);
+    }
+    free(pSamples);
+
+    return nCount;
+}
+
+FILE *WxRingOpenUri(const char *sUri)
+{
+    FILE *fOut;
+    int nMinutes;
+
+    if (!pSlots || (sscanf(sUri, "recent/%d", &nMinutes) != 1) ||
+        (strcmp(sUri + strlen(sUri) - 4, ".csv") != 0) || (nMinutes <= 0))
+        return NULL;
+    if (nMinutes > (WXRING_MAX_HOURS * 60))
+        nMinutes = WXRING_MAX_HOURS * 60;
+
+    fOut = tmpfile();
+    if (fOut == NULL)
+        return NULL;
+
+    WxRingPrint(nMinutes * 60, fOut);
+    rewind(fOut);
+
+    return fOut;
+}
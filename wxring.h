@@ -0,0 +1,49 @@
+// wxring.h
+//
+// Recent readings - optional fast sampling between the logged readings,
+// decoded samples with nanosecond stamps kept in memory for the last few
+// hours and never written to the log
+//
+
+#ifndef WXRING_H_INCLUDED
+#define WXRING_H_INCLUDED
+
+#include <stdio.h>
+#include <time.h>
+
+#include "wxpipe.h"
+
+// Sample interval limits (seconds) - one 'W' exchange each on the serial line
+#define WXRING_MIN_SECS     2
+#define WXRING_MAX_SECS     60
+
+// Hours held (default, most)
+#define WXRING_HOURS        2
+#define WXRING_MAX_HOURS    48
+
+//
+// One sample
+//
+typedef struct _WxRingSample
+{
+    struct timespec tsStamp;        // System time when read
+    WxWeather       xW;
+} WxRingSample;
+
+// Seconds between fast samples (0 := off)
+extern int nSampleSecs;
+
+// secs[,hours] - allocate the ring (before the pipeline starts)
+extern int WxRingStart(const char *sSpec);
+
+// Decode stage (the only writer) - never waits on readers
+extern void WxRingPut(const struct timespec *pStamp, const WxWeather *pW);
+
+// Samples since ttFrom, oldest first (caller frees), returns count or -1
+extern int WxRingSince(time_t ttFrom, WxRingSample **ppSamples);
+extern int WxRingPrint(int nSecs, FILE *fOut);
+
+// Web: recent/<minutes>.csv - CSV in a temp file (NULL := not ours)
+extern FILE *WxRingOpenUri(const char *sUri);
+
+#endif // WXRING_H_INCLUDED
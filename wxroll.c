@@ -0,0 +1,959 @@
+// wxroll.c - Hour/day/month rollups of the weather log
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxarch.h"
+#include "wxquery.h"
+#include "wxkern.h"
+#include "wxroll.h"
+
+//
+// <Mmmyy>.wxr is a fixed table: a row per hour of each day, per day and
+// one for the month (WXR_ROW_xxx), so any period is one pread away and a
+// year by day is 365 rows. The persistence stage adds each reading to
+// its hour, day and month rows in memory and writes the changed rows
+// with the log batch - one pwritev over the span they cover. When a day's log closes its rows are recomputed
+// from the log itself, so readings the rollup missed (crash, journal
+// replay) are picked up.
+//
+// Behind the rows, a map per day of where each hour starts in its CSV
+// log, made when the day closes. A query looking for a value range
+// checks the day and hour rows first and reads only the hours that
+// might hold it (wxquery.c).
+//
+// Last, a quantile sketch (wxsketch.c) of each field per day and for
+// the month, fed with the rows. Percentiles over a range merge the
+// month and day sketches it covers, reading only the part days at its
+// ends.
+//
+// Months with logs but no (current) rollup file are built when the
+// logger starts, one month per worker thread; -U rebuilds them all.
+// Queries and exports never write them - a month without one reads as
+// having no rows.
+//
+
+// Compass point (N = 0, clockwise) of each sWinDir[] entry
+static const unsigned char nCompass[16] = { 0, 15, 13, 14, 9, 10, 12, 11, 1, 2, 4, 3, 8, 7, 5, 6 };
+
+// sin(point * 22.5 deg) * 1000, cos is 4 points on
+static const short nSin[16] = { 0, 383, 707, 924, 1000, 924, 707, 383,
+                                0, -383, -707, -924, -1000, -924, -707, -383 };
+
+// The same by sWinDir[] entry (east, north) for the wind kernel
+static const int16_t nDirX[16] = { 0, -383, -924, -707, -383, -707, -1000, -924,
+                                   383, 707, 1000, 924, 0, 383, 924, 707 };
+static const int16_t nDirY[16] = { 1000, 924, 383, 707, -924, -707, 0, -383,
+                                   924, 707, 0, 383, -1000, -924, -383, -707 };
+
+#define WXR_ROW_OFFSET(n)   (WXR_HEAD_SIZE + ((off_t)(n) * sizeof(WxRollup)))
+#define WXR_SKETCH_AT(n)    (WXR_SKETCH_OFFSET + ((off_t)(n) * sizeof(WxRollSketch)))
+
+typedef struct _WxRollHead
+{
+    uint32_t    nMagic;
+    uint16_t    nVersion;
+    uint16_t    nRowSize;
+    uint32_t    nMonth;             // yyyymm
+    uint32_t    nSpare;
+} WxRollHead;
+
+// Month being logged (persistence stage)
+static int nRollMonth;
+static int fdRoll = -1;
+static WxRollup *pRollRows;
+static unsigned char bRowDirty[WXR_ROWS];
+static WxRollSketch *pRollSketch;
+static unsigned char bSketchDirty[WXR_SKETCHES];
+static WxRollMap xRollMap[31];
+static unsigned char bMapDirty[31];
+static int bRollDirty, bRollUnsynced;
+
+static void RollPath(char *sPath, size_t nSize, int nMonth, const char *sExt)
+{
+    snprintf(sPath, nSize, "%s/%s%02d" WXR_EXT "%s", sWLogPath, sMonName[(nMonth % 100) - 1],
+             (nMonth / 100) % 100, sExt);
+
+    return;
+}
+
+static int HeadOK(int fd, int nMonth)
+{
+    WxRollHead xHead;
+
+    return (pread(fd, &xHead, sizeof(xHead), 0) == sizeof(xHead)) && (xHead.nMagic == WXR_MAGIC) &&
+           (xHead.nVersion == WXR_VERSION) && (xHead.nRowSize == sizeof(WxRollup)) &&
+           (xHead.nMonth == (uint32_t)nMonth);
+}
+
+static void MakeHead(WxRollHead *pHead, int nMonth)
+{
+    memset(pHead, 0, sizeof(*pHead));
+    pHead->nMagic = WXR_MAGIC;
+    pHead->nVersion = WXR_VERSION;
+    pHead->nRowSize = sizeof(WxRollup);
+    pHead->nMonth = nMonth;
+
+    return;
+}
+
+//
+// Hour offsets of a day's CSV log. Left unmapped if its times run
+// backwards (clock set back) - an hour would not be one span.
+//
+static void MapDay(int nDate, WxRollMap *pMap)
+{
+    char sPath[128];
+    struct stat xInfo;
+    const char *pBuf, *p, *pNext, *pEnd;
+    int fd, nTime, nHour, nLast = 0;
+
+    memset(pMap, 0xFF, sizeof(*pMap));
+
+    snprintf(sPath, sizeof(sPath), "%s/%s%02d/%02d", sWLogPath, sMonName[((nDate / 100) % 100) - 1],
+             (nDate / 10000) % 100, nDate % 100);
+    fd = open(sPath, O_RDONLY);
+    if (fd < 0)
+        return;
+    if ((fstat(fd, &xInfo) != 0) || (xInfo.st_size == 0) || (xInfo.st_size >= WXR_NO_OFFSET) ||
+        ((pBuf = mmap(NULL, xInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+    {
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    pMap->nSize = (uint32_t)xInfo.st_size;
+    pEnd = pBuf + xInfo.st_size;
+    for (p = pBuf; p < pEnd; p = pNext)
+    {
+        pNext = memchr(p, '\n', pEnd - p);
+        pNext = pNext ? pNext + 1 : pEnd;
+
+        // Header and min/max lines belong to no hour
+        if (((unsigned)(*p - '0') > 9) || ((nTime = atoi(p)) >= 1440))
+            continue;
+
+        nHour = nTime / 60;
+        if (nHour < nLast)
+        {
+            memset(pMap, 0xFF, sizeof(*pMap));
+            break;
+        }
+        if (pMap->nHour[nHour] == WXR_NO_OFFSET)
+            pMap->nHour[nHour] = (uint32_t)(p - pBuf);
+        nLast = nHour;
+    }
+    munmap((void *)pBuf, xInfo.st_size);
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Rows
+
+static void StatAdd(WxRollStat *pStat, int nVal, int bFirst)
+{
+    if (bFirst)
+    {
+        pStat->nMin = pStat->nMax = pStat->nFirst = nVal;
+    }
+    else
+    {
+        if (nVal < pStat->nMin)
+            pStat->nMin = nVal;
+        if (nVal > pStat->nMax)
+            pStat->nMax = nVal;
+    }
+    pStat->nLast = nVal;
+    pStat->nSum += nVal;
+
+    return;
+}
+
+// Reading into row starting nMinutes into nDate
+static void RowAdd(WxRollup *pRow, const WxSample *pS, int nDate, int nMinutes)
+{
+    int bFirst = (pRow->nCount == 0);
+    int nPoint;
+
+    if (bFirst)
+    {
+        memset(pRow, 0, sizeof(*pRow));
+        pRow->ttStart = (int32_t)WxqDateTime(nDate, nMinutes);
+    }
+
+    StatAdd(&pRow->xStat[0], pS->nIndoor, bFirst);
+    StatAdd(&pRow->xStat[1], pS->nOutdoor, bFirst);
+    StatAdd(&pRow->xStat[2], pS->nWind, bFirst);
+    StatAdd(&pRow->xStat[3], pS->nPressure, bFirst);
+
+    nPoint = nCompass[pS->nDir & 0x0F];
+    pRow->nWindX += pS->nWind * nSin[nPoint];
+    pRow->nWindY += pS->nWind * nSin[(nPoint + 4) & 0x0F];
+    pRow->nCount++;
+
+    return;
+}
+
+// Later period pSrc into pDst
+static void RowMerge(WxRollup *pDst, const WxRollup *pSrc)
+{
+    WxRollStat *pD;
+    const WxRollStat *pS;
+    int k;
+
+    if (pSrc->nCount == 0)
+        return;
+    if (pDst->nCount == 0)
+    {
+        *pDst = *pSrc;
+        return;
+    }
+
+    for (k = 0; k < WXR_FIELDS; k++)
+    {
+        pD = &pDst->xStat[k];
+        pS = &pSrc->xStat[k];
+        if (pS->nMin < pD->nMin)
+            pD->nMin = pS->nMin;
+        if (pS->nMax > pD->nMax)
+            pD->nMax = pS->nMax;
+        pD->nLast = pS->nLast;
+        pD->nSum += pS->nSum;
+    }
+    pDst->nWindX += pSrc->nWindX;
+    pDst->nWindY += pSrc->nWindY;
+    pDst->nCount += pSrc->nCount;
+
+    return;
+}
+
+static void SketchAdd(WxRollSketch *pSketch, const WxSample *pS)
+{
+    WxtAdd(&pSketch->xField[0], pS->nIndoor);
+    WxtAdd(&pSketch->xField[1], pS->nOutdoor);
+    WxtAdd(&pSketch->xField[2], pS->nWind);
+    WxtAdd(&pSketch->xField[3], pS->nPressure);
+
+    return;
+}
+
+static void SketchMerge(WxRollSketch *pDst, const WxRollSketch *pSrc)
+{
+    int k;
+
+    for (k = 0; k < WXR_FIELDS; k++)
+        WxtMerge(&pDst->xField[k], &pSrc->xField[k]);
+
+    return;
+}
+
+// Whole day's row from its readings (kernels)
+static void DayRow(WxRollup *pRow, int nDate, const WxkCols *pCols)
+{
+    WxkStat xStat;
+    int64_t nX, nY;
+    int n = pCols->nCount, k;
+
+    memset(pRow, 0, sizeof(*pRow));
+    if (n == 0)
+        return;
+
+    pRow->ttStart = (int32_t)WxqDateTime(nDate, 0);
+    pRow->nCount = n;
+    for (k = 0; k < WXR_FIELDS; k++)
+    {
+        WxkStats(pCols->nCol[k], n, &xStat);
+        pRow->xStat[k].nMin = xStat.nMin;
+        pRow->xStat[k].nMax = xStat.nMax;
+        pRow->xStat[k].nFirst = pCols->nCol[k][0];
+        pRow->xStat[k].nLast = pCols->nCol[k][n - 1];
+        pRow->xStat[k].nSum = (int32_t)xStat.nSum;
+    }
+    WxkWind(pCols->nCol[WXK_WIND], pCols->nCol[WXK_DIR], n, nDirX, nDirY, &nX, &nY);
+    pRow->nWindX = (int32_t)nX;
+    pRow->nWindY = (int32_t)nY;
+
+    return;
+}
+
+// Day's hour and day rows (and sketch) from its log
+static void BuildDay(WxRollup *pRows, WxRollSketch *pSketch, int nDate, WxaDay *pDay)
+{
+    WxkCols xCols;
+    WxSample *pS;
+    int nMday = nDate % 100;
+    int n;
+
+    memset(&pRows[WXR_ROW_HOUR(nMday, 0)], 0, 24 * sizeof(WxRollup));
+    memset(&pSketch[WXR_SKETCH_DAY(nMday)], 0, sizeof(WxRollSketch));
+
+    for (n = 0; n < pDay->nSamples; n++)
+    {
+        pS = &pDay->xSamples[n];
+        if ((pS->nTime < 0) || (pS->nTime >= 1440))
+            continue;
+        RowAdd(&pRows[WXR_ROW_HOUR(nMday, pS->nTime / 60)], pS, nDate, (pS->nTime / 60) * 60);
+        SketchAdd(&pSketch[WXR_SKETCH_DAY(nMday)], pS);
+    }
+
+    WxkColumns(pDay, &xCols);
+    DayRow(&pRows[WXR_ROW_DAY(nMday)], nDate, &xCols);
+
+    return;
+}
+
+static void BuildMonth(WxRollup *pRows, WxRollSketch *pSketch, int nMonth)
+{
+    WxRollup *pMonth = &pRows[WXR_ROW_MONTH];
+    int nMday;
+
+    memset(pMonth, 0, sizeof(*pMonth));
+    memset(&pSketch[WXR_SKETCH_MONTH], 0, sizeof(WxRollSketch));
+    for (nMday = 1; nMday <= 31; nMday++)
+    {
+        RowMerge(pMonth, &pRows[WXR_ROW_DAY(nMday)]);
+        SketchMerge(&pSketch[WXR_SKETCH_MONTH], &pSketch[WXR_SKETCH_DAY(nMday)]);
+    }
+    if (pMonth->nCount)
+        pMonth->ttStart = (int32_t)WxqDateTime((nMonth * 100) + 1, 0);
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Persistence stage
+
+static int LoadMonth(int nMonth)
+{
+    char sPath[128];
+    WxRollHead xHead;
+
+    WxRollClose();
+
+    if (!pRollRows && !(pRollRows = (WxRollup *)malloc(WXR_ROWS * sizeof(WxRollup))))
+        return -1;
+    if (!pRollSketch && !(pRollSketch = (WxRollSketch *)malloc(WXR_SKETCHES * sizeof(WxRollSketch))))
+        return -1;
+
+    RollPath(sPath, sizeof(sPath), nMonth, "");
+    fdRoll = open(sPath, O_RDWR | O_CREAT, 0644);
+    if (fdRoll < 0)
+    {
+        printf("Rollup open failed: %s\n", strerror(errno));
+        return -1;
+    }
+    nRollMonth = nMonth;
+
+    if (HeadOK(fdRoll, nMonth) &&
+        (pread(fdRoll, pRollRows, WXR_ROWS * sizeof(WxRollup), WXR_HEAD_SIZE) == WXR_ROWS * sizeof(WxRollup)) &&
+        (pread(fdRoll, xRollMap, sizeof(xRollMap), WXR_MAP_OFFSET) == sizeof(xRollMap)) &&
+        (pread(fdRoll, pRollSketch, WXR_SKETCHES * sizeof(WxRollSketch), WXR_SKETCH_OFFSET) ==
+         WXR_SKETCHES * sizeof(WxRollSketch)))
+        return 0;
+
+    // New month - rows go with the next flush, days unmapped until closed
+    memset(pRollRows, 0, WXR_ROWS * sizeof(WxRollup));
+    memset(bRowDirty, TRUE, sizeof(bRowDirty));
+    memset(xRollMap, 0xFF, sizeof(xRollMap));
+    memset(bMapDirty, TRUE, sizeof(bMapDirty));
+    memset(pRollSketch, 0, WXR_SKETCHES * sizeof(WxRollSketch));
+    memset(bSketchDirty, TRUE, sizeof(bSketchDirty));
+    bRollDirty = TRUE;
+
+    MakeHead(&xHead, nMonth);
+    if ((ftruncate(fdRoll, 0) != 0) || (pwrite(fdRoll, &xHead, sizeof(xHead), 0) != sizeof(xHead)))
+        printf("Rollup write failed: %s\n", strerror(errno));
+
+    return 0;
+}
+
+static int UseMonth(int nMonth)
+{
+    if ((fdRoll >= 0) && (nMonth == nRollMonth))
+        return 0;
+
+    return LoadMonth(nMonth);
+}
+
+//
+// Add logged reading to its hour, day and month
+//
+void WxRollAdd(int nDate, int xTime, WxWeather *pW)
+{
+    WxSample xS;
+    int nMday = nDate % 100;
+
+    if (!sWLogPath || (nDate == 0) || (xTime < 0) || (xTime >= 1440))
+        return;
+    if (UseMonth(nDate / 100) != 0)
+        return;
+
+    xS.nTime = xTime;
+    xS.nIndoor = pW->nIndoor;
+    xS.nOutdoor = pW->nOutdoor;
+    xS.nWind = pW->nWind;
+    xS.nDir = pW->nDir;
+    xS.nPressure = pW->nPressure;
+
+    RowAdd(&pRollRows[WXR_ROW_HOUR(nMday, xTime / 60)], &xS, nDate, (xTime / 60) * 60);
+    RowAdd(&pRollRows[WXR_ROW_DAY(nMday)], &xS, nDate, 0);
+    RowAdd(&pRollRows[WXR_ROW_MONTH], &xS, (nDate / 100) * 100 + 1, 0);
+    SketchAdd(&pRollSketch[WXR_SKETCH_DAY(nMday)], &xS);
+    SketchAdd(&pRollSketch[WXR_SKETCH_MONTH], &xS);
+
+    bRowDirty[WXR_ROW_HOUR(nMday, xTime / 60)] = TRUE;
+    bRowDirty[WXR_ROW_DAY(nMday)] = TRUE;
+    bRowDirty[WXR_ROW_MONTH] = TRUE;
+    bSketchDirty[WXR_SKETCH_DAY(nMday)] = TRUE;
+    bSketchDirty[WXR_SKETCH_MONTH] = TRUE;
+    bRollDirty = TRUE;
+
+    return;
+}
+
+// Rows, maps and sketches follow each other in the file
+typedef struct _RollPart
+{
+    unsigned char   *bDirty;
+    int             nCount;
+    const char      *pBase;
+    size_t          nSize;
+    off_t           nOffset;
+} RollPart;
+
+//
+// Write changed rows, maps and sketches - the file span from the first
+// to the last, unchanged ones between included, in one call. A reading
+// changes three rows and two sketches, so this beats a call per run.
+// Left dirty for the next flush if the write fails.
+//
+void WxRollFlush(void)
+{
+    RollPart xPart[3] =
+    {
+        { bRowDirty, WXR_ROWS, (const char *)pRollRows, sizeof(WxRollup), WXR_ROW_OFFSET(0) },
+        { bMapDirty, 31, (const char *)xRollMap, sizeof(WxRollMap), WXR_MAP_OFFSET },
+        { bSketchDirty, WXR_SKETCHES, (const char *)pRollSketch, sizeof(WxRollSketch), WXR_SKETCH_AT(0) }
+    };
+    struct iovec xIov[3];
+    off_t nFrom = -1, nTo = 0, nLo, nHi;
+    size_t nLen = 0;
+    int n, k, nIov = 0;
+
+    if ((fdRoll < 0) || !bRollDirty)
+        return;
+
+    for (n = 0; n < 3; n++)
+    {
+        for (k = 0; (k < xPart[n].nCount) && !xPart[n].bDirty[k]; k++)
+            ;
+        if (k == xPart[n].nCount)
+            continue;
+        if (nFrom < 0)
+            nFrom = xPart[n].nOffset + (k * xPart[n].nSize);
+        for (k = xPart[n].nCount; !xPart[n].bDirty[k - 1]; k--)
+            ;
+        nTo = xPart[n].nOffset + (k * xPart[n].nSize);
+    }
+
+    for (n = 0; (n < 3) && (nFrom >= 0); n++)
+    {
+        nLo = (nFrom > xPart[n].nOffset) ? nFrom : xPart[n].nOffset;
+        nHi = xPart[n].nOffset + (xPart[n].nCount * xPart[n].nSize);
+        if (nHi > nTo)
+            nHi = nTo;
+        if (nLo >= nHi)
+            continue;
+        xIov[nIov].iov_base = (void *)&xPart[n].pBase[nLo - xPart[n].nOffset];
+        xIov[nIov].iov_len = nHi - nLo;
+        nLen += xIov[nIov++].iov_len;
+    }
+
+    if ((nIov > 0) && (pwritev(fdRoll, xIov, nIov, nFrom) != (ssize_t)nLen))
+    {
+        printf("Rollup write failed: %s\n", strerror(errno));
+        return;
+    }
+
+    memset(bRowDirty, FALSE, sizeof(bRowDirty));
+    memset(bMapDirty, FALSE, sizeof(bMapDirty));
+    memset(bSketchDirty, FALSE, sizeof(bSketchDirty));
+    bRollDirty = FALSE;
+    bRollUnsynced = TRUE;
+
+    return;
+}
+
+void WxRollSync(void)
+{
+    if ((fdRoll >= 0) && bRollUnsynced)
+        fdatasync(fdRoll);
+    bRollUnsynced = FALSE;
+
+    return;
+}
+
+//
+// Day's log closed - recompute its rows from the log
+//
+void WxRollDayClosed(int nDate)
+{
+    WxaDay *pDay;
+
+    if (!sWLogPath || (nDate == 0) || (UseMonth(nDate / 100) != 0))
+        return;
+
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    if (pDay && (WxqLoadDay(nDate, pDay, NULL) == 0))
+    {
+        BuildDay(pRollRows, pRollSketch, nDate, pDay);
+        BuildMonth(pRollRows, pRollSketch, nDate / 100);
+        memset(&bRowDirty[WXR_ROW_HOUR(nDate % 100, 0)], TRUE, 24);
+        bRowDirty[WXR_ROW_DAY(nDate % 100)] = TRUE;
+        bRowDirty[WXR_ROW_MONTH] = TRUE;
+        bSketchDirty[WXR_SKETCH_DAY(nDate % 100)] = TRUE;
+        bSketchDirty[WXR_SKETCH_MONTH] = TRUE;
+        bRollDirty = TRUE;
+    }
+    free(pDay);
+
+    MapDay(nDate, &xRollMap[(nDate % 100) - 1]);
+    bMapDirty[(nDate % 100) - 1] = TRUE;
+    bRollDirty = TRUE;
+
+    WxRollFlush();
+    WxRollSync();
+
+    return;
+}
+
+void WxRollClose(void)
+{
+    if (fdRoll >= 0)
+    {
+        WxRollFlush();
+        WxRollSync();
+        close(fdRoll);
+        fdRoll = -1;
+    }
+    nRollMonth = 0;
+
+    return;
+}
+
+//-------------------------------------------------------------------------------
+// Rebuild
+
+typedef struct _RebuildJob
+{
+    int     *pMonths;
+    int     nMonths;
+    int     nNext;
+    int     nBuilt;
+} RebuildJob;
+
+static int BuildFile(int nMonth)
+{
+    char sPath[128], sTemp[128];
+    WxRollHead xHead;
+    WxRollMap xMap[31];
+    WxRollup *pRows;
+    WxRollSketch *pSketch;
+    WxaDay *pDay;
+    int nMday, fd, nRet = -1;
+
+    pRows = (WxRollup *)calloc(WXR_ROWS, sizeof(WxRollup));
+    pSketch = (WxRollSketch *)calloc(WXR_SKETCHES, sizeof(WxRollSketch));
+    pDay = (WxaDay *)malloc(sizeof(WxaDay));
+    if (!pRows || !pSketch || !pDay)
+        goto done;
+
+    for (nMday = 1; nMday <= 31; nMday++)
+    {
+        if (WxqLoadDay((nMonth * 100) + nMday, pDay, NULL) == 0)
+            BuildDay(pRows, pSketch, (nMonth * 100) + nMday, pDay);
+        MapDay((nMonth * 100) + nMday, &xMap[nMday - 1]);
+    }
+    BuildMonth(pRows, pSketch, nMonth);
+
+    // Nothing logged
+    if (pRows[WXR_ROW_MONTH].nCount == 0)
+    {
+        nRet = 0;
+        goto done;
+    }
+
+    MakeHead(&xHead, nMonth);
+
+    RollPath(sPath, sizeof(sPath), nMonth, "");
+    RollPath(sTemp, sizeof(sTemp), nMonth, ".tmp");
+    fd = open(sTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        goto done;
+    if ((pwrite(fd, &xHead, sizeof(xHead), 0) == sizeof(xHead)) &&
+        (pwrite(fd, pRows, WXR_ROWS * sizeof(WxRollup), WXR_HEAD_SIZE) == WXR_ROWS * sizeof(WxRollup)) &&
+        (pwrite(fd, xMap, sizeof(xMap), WXR_MAP_OFFSET) == sizeof(xMap)) &&
+        (pwrite(fd, pSketch, WXR_SKETCHES * sizeof(WxRollSketch), WXR_SKETCH_OFFSET) ==
+         WXR_SKETCHES * sizeof(WxRollSketch)) && (fdatasync(fd) == 0))
+        nRet = 0;
+    close(fd);
+
+    if ((nRet == 0) && (rename(sTemp, sPath) != 0))
+        nRet = -1;
+    if (nRet != 0)
+    {
+        printf("Rollup write failed: %s\n", strerror(errno));
+        unlink(sTemp);
+    }
+    else
+        nRet = 1;
+
+done:
+    free(pDay);
+    free(pSketch);
+    free(pRows);
+
+    return nRet;
+}
+
+static void *xRebuild(void *args)
+{
+    RebuildJob *pJob = (RebuildJob *)args;
+    int n;
+
+    while ((n = __atomic_fetch_add(&pJob->nNext, 1, __ATOMIC_RELAXED)) < pJob->nMonths)
+    {
+        if (BuildFile(pJob->pMonths[n]) > 0)
+            __atomic_fetch_add(&pJob->nBuilt, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+//
+// Build rollup files missing or out of date for logged months (before
+// logging starts), bAll := all of them. nThreads == 0 := one per CPU.
+// Returns files built.
+//
+int WxRollRebuild(int nThreads, int bAll)
+{
+    char sPath[128];
+    pthread_t *pThreads;
+    RebuildJob xJob;
+    int nFirst, nLast, nMonth, nNow, n, fd;
+
+    if (!sWLogPath || (WxqDays(&nFirst, &nLast) == 0))
+        return 0;
+
+    memset(&xJob, 0, sizeof(xJob));
+    nNow = WxqDateOf(vc_time()) / 100;
+    if ((nLast / 100) > nNow)
+        nNow = nLast / 100;
+    xJob.pMonths = (int *)malloc((((nNow / 100) - (nFirst / 10000) + 1) * 12) * sizeof(int));
+    if (!xJob.pMonths)
+        return -1;
+
+    for (nMonth = nFirst / 100; nMonth <= nNow; nMonth = ((nMonth % 100) == 12) ? (nMonth + 89) : (nMonth + 1))
+    {
+        RollPath(sPath, sizeof(sPath), nMonth, "");
+        fd = bAll ? -1 : open(sPath, O_RDONLY);
+        if ((fd < 0) || !HeadOK(fd, nMonth))
+            xJob.pMonths[xJob.nMonths++] = nMonth;
+        if (fd >= 0)
+            close(fd);
+    }
+
+    if (nThreads <= 0)
+        nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nThreads > xJob.nMonths)
+        nThreads = xJob.nMonths;
+    if (nThreads < 1)
+        nThreads = 1;
+
+    pThreads = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
+    for (n = 0; pThreads && (n < nThreads); n++)
+    {
+        if (pthread_create(&pThreads[n], NULL, xRebuild, &xJob) != 0)
+            break;
+    }
+    // Help out (and cover thread failures)
+    xRebuild(&xJob);
+    while (pThreads && (n-- > 0))
+        pthread_join(pThreads[n], NULL);
+    free(pThreads);
+    free(xJob.pMonths);
+
+    if (xJob.nBuilt)
+        printf("Rollups built for %d months\n", xJob.nBuilt);
+
+    return xJob.nBuilt;
+}
+
+//-------------------------------------------------------------------------------
+// Readers
+
+//
+// Rows of nLevel (WXR_HOUR, _DAY, _MONTH) starting in [ttFrom, ttTo).
+// Returns rows passed to fnRow, -1 on error.
+//
+int WxRollRead(int nLevel, time_t ttFrom, time_t ttTo, WxRollFn fnRow, void *pCtx)
+{
+    char sPath[128];
+    WxRollup *pRows;
+    int nMonth, nLast, nFirstRow, nRows, n, fd;
+    int nCnt = 0, bStop = FALSE;
+
+    if (!sWLogPath || (ttTo <= ttFrom))
+        return sWLogPath ? 0 : -1;
+
+    switch (nLevel)
+    {
+    case WXR_HOUR:
+        nFirstRow = WXR_ROW_HOUR(1, 0);
+        nRows = 31 * 24;
+        break;
+    case WXR_DAY:
+        nFirstRow = WXR_ROW_DAY(1);
+        nRows = 31;
+        break;
+    case WXR_MONTH:
+        nFirstRow = WXR_ROW_MONTH;
+        nRows = 1;
+        break;
+    default:
+        return -1;
+    }
+
+    pRows = (WxRollup *)malloc(nRows * sizeof(WxRollup));
+    if (!pRows)
+        return -1;
+
+    nLast = WxqDateOf(ttTo - 1) / 100;
+    for (nMonth = WxqDateOf(ttFrom) / 100; !bStop && (nMonth <= nLast);
+         nMonth = ((nMonth % 100) == 12) ? (nMonth + 89) : (nMonth + 1))
+    {
+        RollPath(sPath, sizeof(sPath), nMonth, "");
+        fd = open(sPath, O_RDONLY);
+        if (fd < 0)
+            continue;
+
+        if (HeadOK(fd, nMonth) &&
+            (pread(fd, pRows, nRows * sizeof(WxRollup), WXR_ROW_OFFSET(nFirstRow)) == (ssize_t)(nRows * sizeof(WxRollup))))
+        {
+            for (n = 0; n < nRows; n++)
+            {
+                if ((pRows[n].nCount == 0) || (pRows[n].ttStart < ttFrom) || (pRows[n].ttStart >= ttTo))
+                    continue;
+                nCnt++;
+                if (fnRow(&pRows[n], pCtx))
+                {
+                    bStop = TRUE;
+                    break;
+                }
+            }
+        }
+        close(fd);
+    }
+    free(pRows);
+
+    return nCnt;
+}
+
+int WxRollAvg(const WxRollup *pRow, int nField)
+{
+    long nSum = pRow->xStat[nField].nSum;
+
+    if (pRow->nCount == 0)
+        return 0;
+
+    return (nSum >= 0) ? ((nSum + (pRow->nCount / 2)) / pRow->nCount) : -((-nSum + (pRow->nCount / 2)) / pRow->nCount);
+}
+
+static long ISqrt(long long nVal)
+{
+    long long nRoot = 0, nBit = 1LL << 62;
+
+    while (nBit > nVal)
+        nBit >>= 2;
+    while (nBit)
+    {
+        if (nVal >= nRoot + nBit)
+        {
+            nVal -= nRoot + nBit;
+            nRoot = (nRoot >> 1) + nBit;
+        }
+        else
+            nRoot >>= 1;
+        nBit >>= 2;
+    }
+
+    return (long)nRoot;
+}
+
+//
+// Prevailing wind - sWinDir[] index of the mean vector, *pnSpeed its
+// length (mph)
+//
+int WxRollWind(const WxRollup *pRow, int *pnSpeed)
+{
+    long long nX = pRow->nWindX, nY = pRow->nWindY;
+    long long nDot, nBest = 0;
+    int nPoint = 0, k;
+
+    *pnSpeed = pRow->nCount ? (int)((ISqrt((nX * nX) + (nY * nY)) + (500L * pRow->nCount)) / (1000L * pRow->nCount)) : 0;
+
+    for (k = 0; k < 16; k++)
+    {
+        nDot = (nX * nSin[k]) + (nY * nSin[(k + 4) & 0x0F]);
+        if ((k == 0) || (nDot > nBest))
+        {
+            nBest = nDot;
+            nPoint = k;
+        }
+    }
+
+    // Compass point back to sWinDir[] index
+    for (k = 0; nCompass[k] != nPoint; k++)
+        ;
+
+    return k;
+}
+
+//
+// Whole month file (rows and day maps). Returns -1 if there is none.
+//
+int WxRollLoadZone(int nMonth, WxRollZone *pZone)
+{
+    char sPath[128];
+    int fd, nRet = -1;
+
+    if (!sWLogPath)
+        return -1;
+
+    RollPath(sPath, sizeof(sPath), nMonth, "");
+    fd = open(sPath, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (HeadOK(fd, nMonth) &&
+        (pread(fd, pZone->xRows, sizeof(pZone->xRows), WXR_HEAD_SIZE) == sizeof(pZone->xRows)) &&
+        (pread(fd, pZone->xMap, sizeof(pZone->xMap), WXR_MAP_OFFSET) == sizeof(pZone->xMap)))
+        nRet = 0;
+    close(fd);
+
+    return nRet;
+}
+
+typedef struct _SketchFile
+{
+    int     nMonth;
+    int     fd;
+} SketchFile;
+
+static int ReadSketch(SketchFile *pF, int nMonth, int nIndex, WxRollSketch *pSketch)
+{
+    char sPath[128];
+
+    if (pF->nMonth != nMonth)
+    {
+        if (pF->fd >= 0)
+            close(pF->fd);
+        pF->nMonth = nMonth;
+        RollPath(sPath, sizeof(sPath), nMonth, "");
+        pF->fd = open(sPath, O_RDONLY);
+        if ((pF->fd >= 0) && !HeadOK(pF->fd, nMonth))
+        {
+            close(pF->fd);
+            pF->fd = -1;
+        }
+    }
+
+    if (pF->fd < 0)
+        return -1;
+
+    return (pread(pF->fd, pSketch, sizeof(WxRollSketch), WXR_SKETCH_AT(nIndex)) == sizeof(WxRollSketch)) ? 0 : -1;
+}
+
+static int SketchPoint(const WxqPoint *pPt, void *pCtx)
+{
+    SketchAdd((WxRollSketch *)pCtx, &pPt->xS);
+
+    return 0;
+}
+
+//
+// Sketches of the readings in [ttFrom, ttTo) - whole months and days
+// merged from their sketches, the part days at the ends read from the
+// logs. Returns readings taken.
+//
+int WxRollSketches(time_t ttFrom, time_t ttTo, WxRollSketch *pSketch)
+{
+    SketchFile xFile = { 0, -1 };
+    WxRollSketch xPart;
+    time_t ttDay, ttNext;
+    int nDate, nNext;
+
+    memset(pSketch, 0, sizeof(WxRollSketch));
+    if (!sWLogPath)
+        return -1;
+
+    for (nDate = WxqDateOf(ttFrom); (ttDay = WxqDateTime(nDate, 0)) < ttTo; nDate = nNext)
+    {
+        nNext = WxqNextDate(nDate);
+        ttNext = WxqDateTime(nNext, 0);
+
+        if ((ttDay >= ttFrom) && (ttNext <= ttTo))
+        {
+            // Whole month from the 1st
+            if ((nDate % 100) == 1)
+            {
+                nNext = ((nDate / 100) % 100 == 12) ? ((nDate / 10000) + 1) * 10000 + 101 : nDate + 100;
+                if ((WxqDateTime(nNext, 0) <= ttTo) &&
+                    (ReadSketch(&xFile, nDate / 100, WXR_SKETCH_MONTH, &xPart) == 0))
+                {
+                    SketchMerge(pSketch, &xPart);
+                    continue;
+                }
+                nNext = WxqNextDate(nDate);
+            }
+
+            if (ReadSketch(&xFile, nDate / 100, WXR_SKETCH_DAY(nDate % 100), &xPart) == 0)
+            {
+                SketchMerge(pSketch, &xPart);
+                continue;
+            }
+        }
+
+        WxqScan((ttDay > ttFrom) ? ttDay : ttFrom, (ttNext < ttTo) ? ttNext : ttTo, SketchPoint, pSketch);
+    }
+
+    if (xFile.fd >= 0)
+        close(xFile.fd);
+
+    return (int)pSketch->xField[0].nTotal;
+}
@@ -0,0 +1,116 @@
+// wxroll.h
+//
+// Rollups - hour, day and month aggregates of the weather log, kept up
+// to date as readings are logged (<Mmmyy>.wxr beside the logs). They
+// double as zone maps: with each day's hour offsets into its CSV log,
+// queries can skip days and hours that can't match and read only the
+// rest. Quantile sketches per day and month answer percentiles.
+//
+
+#ifndef WXROLL_H_INCLUDED
+#define WXROLL_H_INCLUDED
+
+#include <stdint.h>
+#include <time.h>
+
+#include "wxpipe.h"
+#include "wxsketch.h"
+
+#define WXR_EXT             ".wxr"
+
+#define WXR_MAGIC           0x31525857      // "WXR1"
+#define WXR_VERSION         3
+#define WXR_HEAD_SIZE       16
+
+// Granularity
+#define WXR_HOUR            0
+#define WXR_DAY             1
+#define WXR_MONTH           2
+
+// Row layout of a month file: hours by day, days, the month
+#define WXR_ROW_HOUR(d, h)  ((((d) - 1) * 24) + (h))
+#define WXR_ROW_DAY(d)      ((31 * 24) + ((d) - 1))
+#define WXR_ROW_MONTH       ((31 * 24) + 31)
+#define WXR_ROWS            (WXR_ROW_MONTH + 1)
+
+// Fields (same order as WXQ_xxx)
+#define WXR_FIELDS          4
+
+// Day map (after the rows)
+#define WXR_MAP_OFFSET      (WXR_HEAD_SIZE + (WXR_ROWS * 64))
+#define WXR_NO_OFFSET       0xFFFFFFFF
+
+// Quantile sketches (after the day map): days, the month
+#define WXR_SKETCH_DAY(d)   ((d) - 1)
+#define WXR_SKETCH_MONTH    31
+#define WXR_SKETCHES        (WXR_SKETCH_MONTH + 1)
+#define WXR_SKETCH_OFFSET   (WXR_MAP_OFFSET + (31 * sizeof(WxRollMap)))
+
+typedef struct _WxRollStat
+{
+    int16_t     nMin, nMax;
+    int16_t     nFirst, nLast;
+    int32_t     nSum;
+} WxRollStat;
+
+//
+// One aggregate (64 bytes)
+//
+typedef struct _WxRollup
+{
+    int32_t     ttStart;            // Local start of period
+    uint16_t    nCount;             // Readings (0 := empty)
+    uint16_t    nSpare;
+    WxRollStat  xStat[WXR_FIELDS];  // Indoor, outdoor, wind, pressure
+    int32_t     nWindX, nWindY;     // Wind vector sums (mph * 1000, east/north)
+} WxRollup;
+
+//
+// Where each hour starts in a day's CSV log. nSize is the log's size
+// when mapped (WXR_NO_OFFSET := no usable map).
+//
+typedef struct _WxRollMap
+{
+    uint32_t    nSize;
+    uint32_t    nHour[24];          // Offset of hour's first line
+} WxRollMap;
+
+//
+// Readings of a period by field (2112 bytes)
+//
+typedef struct _WxRollSketch
+{
+    WxtDigest   xField[WXR_FIELDS];
+} WxRollSketch;
+
+//
+// Month file as loaded
+//
+typedef struct _WxRollZone
+{
+    WxRollup    xRows[WXR_ROWS];
+    WxRollMap   xMap[31];
+} WxRollZone;
+
+// Return non-zero to stop
+typedef int (*WxRollFn)(const WxRollup *pRow, void *pCtx);
+
+// Persistence stage
+extern void WxRollAdd(int nDate, int xTime, WxWeather *pW);
+extern void WxRollFlush(void);
+extern void WxRollSync(void);
+extern void WxRollDayClosed(int nDate);
+extern void WxRollClose(void);
+
+// Startup - build files missing (or out of date) for logged months,
+// bAll := every month (backfill)
+extern int WxRollRebuild(int nThreads, int bAll);
+
+// Readers
+extern int WxRollRead(int nLevel, time_t ttFrom, time_t ttTo, WxRollFn fnRow, void *pCtx);
+extern int WxRollAvg(const WxRollup *pRow, int nField);
+extern int WxRollWind(const WxRollup *pRow, int *pnSpeed);
+extern int WxRollLoadZone(int nMonth, WxRollZone *pZone);
+extern int WxRollSketches(time_t ttFrom, time_t ttTo, WxRollSketch *pSketch);
+
+#endif // WXROLL_H_INCLUDED
@@ -0,0 +1,215 @@
+// wxsketch.c - Quantile sketches (merging t-digest)
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "id4-pi.h"
+#include "wxsketch.h"
+
+//
+// Every reading is one device byte scaled, so a field seldom holds more
+// than a few dozen distinct values in a day or month. A digest keeps one
+// centroid per value and is exact until it runs out of room; then it is
+// compressed the t-digest way - neighbouring centroids merged while
+// they span no more than one unit of the k1 scale function, which keeps
+// them small at the tails where percentiles are asked for. Merging
+// digests is a merge of sorted centroid lists and one more compression.
+//
+
+// Compression - k1 range is WXT_DELTA / 2, so at most WXT_DELTA + 1 are kept
+#define WXT_DELTA           (WXT_CENTROIDS - 2)
+
+static double Scale(double fQ)
+{
+    return (WXT_DELTA / (2.0 * M_PI)) * asin((2.0 * fQ) - 1.0);
+}
+
+// Sorted centroids pC[nCnt] (nTotal weight) into pD
+static void Compress(WxtDigest *pD, const WxtCentroid *pC, int nCnt, uint32_t nTotal)
+{
+    WxtCentroid xCur;
+    double fLeft;
+    uint32_t nDone = 0;
+    int n, k = 0;
+
+    if (nCnt <= WXT_CENTROIDS)
+    {
+        memmove(pD->xC, pC, nCnt * sizeof(WxtCentroid));
+        pD->nCentroids = nCnt;
+        return;
+    }
+
+    xCur = pC[0];
+    fLeft = Scale(0.0);
+    for (n = 1; n < nCnt; n++)
+    {
+        if ((k < (WXT_CENTROIDS - 1)) &&
+            ((Scale((double)(nDone + xCur.nWeight + pC[n].nWeight) / nTotal) - fLeft) > 1.0))
+        {
+            pD->xC[k++] = xCur;
+            nDone += xCur.nWeight;
+            fLeft = Scale((double)nDone / nTotal);
+            xCur = pC[n];
+            continue;
+        }
+
+        xCur.nMean = (int32_t)((((int64_t)xCur.nMean * xCur.nWeight) + ((int64_t)pC[n].nMean * pC[n].nWeight) +
+                                ((xCur.nWeight + pC[n].nWeight) / 2)) / (xCur.nWeight + pC[n].nWeight));
+        xCur.nWeight += pC[n].nWeight;
+    }
+    pD->xC[k++] = xCur;
+    pD->nCentroids = k;
+    pD->bApprox = TRUE;
+
+    return;
+}
+
+void WxtAdd(WxtDigest *pD, int nVal)
+{
+    WxtCentroid xC[WXT_CENTROIDS + 1];
+    int32_t nMean = nVal * WXT_SCALE;
+    int nLo = 0, nHi = pD->nCentroids, nMid;
+
+    if (pD->nTotal == 0)
+        pD->nMin = pD->nMax = nVal;
+    else if (nVal < pD->nMin)
+        pD->nMin = nVal;
+    else if (nVal > pD->nMax)
+        pD->nMax = nVal;
+    pD->nTotal++;
+
+    while (nLo < nHi)
+    {
+        nMid = (nLo + nHi) / 2;
+        if (pD->xC[nMid].nMean < nMean)
+            nLo = nMid + 1;
+        else
+            nHi = nMid;
+    }
+
+    // Value seen (only a single valued centroid can take it as is)
+    if ((nLo < pD->nCentroids) && (pD->xC[nLo].nMean == nMean) && !pD->bApprox)
+    {
+        pD->xC[nLo].nWeight++;
+        return;
+    }
+
+    if (pD->nCentroids < WXT_CENTROIDS)
+    {
+        memmove(&pD->xC[nLo + 1], &pD->xC[nLo], (pD->nCentroids - nLo) * sizeof(WxtCentroid));
+        pD->xC[nLo].nMean = nMean;
+        pD->xC[nLo].nWeight = 1;
+        pD->nCentroids++;
+        return;
+    }
+
+    memcpy(xC, pD->xC, nLo * sizeof(WxtCentroid));
+    xC[nLo].nMean = nMean;
+    xC[nLo].nWeight = 1;
+    memcpy(&xC[nLo + 1], &pD->xC[nLo], (pD->nCentroids - nLo) * sizeof(WxtCentroid));
+    Compress(pD, xC, pD->nCentroids + 1, pD->nTotal);
+
+    return;
+}
+
+void WxtMerge(WxtDigest *pDst, const WxtDigest *pSrc)
+{
+    WxtCentroid xC[2 * WXT_CENTROIDS];
+    int i = 0, j = 0, n = 0;
+
+    if (pSrc->nTotal == 0)
+        return;
+    if (pDst->nTotal == 0)
+    {
+        *pDst = *pSrc;
+        return;
+    }
+
+    // Same mean from both sides is one centroid either way
+    while ((i < pDst->nCentroids) || (j < pSrc->nCentroids))
+    {
+        if ((j == pSrc->nCentroids) || ((i < pDst->nCentroids) && (pDst->xC[i].nMean < pSrc->xC[j].nMean)))
+            xC[n++] = pDst->xC[i++];
+        else if ((i == pDst->nCentroids) || (pSrc->xC[j].nMean < pDst->xC[i].nMean))
+            xC[n++] = pSrc->xC[j++];
+        else
+        {
+            xC[n] = pDst->xC[i++];
+            xC[n++].nWeight += pSrc->xC[j++].nWeight;
+        }
+    }
+
+    if (pSrc->nMin < pDst->nMin)
+        pDst->nMin = pSrc->nMin;
+    if (pSrc->nMax > pDst->nMax)
+        pDst->nMax = pSrc->nMax;
+    pDst->nTotal += pSrc->nTotal;
+    pDst->bApprox |= pSrc->bApprox;
+    Compress(pDst, xC, n, pDst->nTotal);
+
+    return;
+}
+
+double WxtQuantile(const WxtDigest *pD, double fQ)
+{
+    const WxtCentroid *pC = pD->xC;
+    double fRank, fMid, fNext, fLo, fHi;
+    uint32_t nCum = 0;
+    int n;
+
+    if (pD->nTotal == 0)
+        return 0.0;
+    if (fQ <= 0.0)
+        return pD->nMin;
+    if (fQ >= 1.0)
+        return pD->nMax;
+
+    // Exact - ranks (from 0) either side of fQ * (N - 1)
+    if (!pD->bApprox)
+    {
+        fRank = fQ * (pD->nTotal - 1);
+        for (n = 0; (n < pD->nCentroids) && ((nCum + pC[n].nWeight) <= (uint32_t)fRank); n++)
+            nCum += pC[n].nWeight;
+        fLo = (double)pC[n].nMean / WXT_SCALE;
+        if (((nCum + pC[n].nWeight) > ((uint32_t)fRank + 1)) || (n == (pD->nCentroids - 1)))
+            return fLo;
+        fHi = (double)pC[n + 1].nMean / WXT_SCALE;
+
+        return fLo + ((fRank - floor(fRank)) * (fHi - fLo));
+    }
+
+    // Approximate - between centroid midpoints, min and max at the ends
+    fRank = fQ * pD->nTotal;
+    fMid = pC[0].nWeight / 2.0;
+    if (fRank < fMid)
+        return pD->nMin + ((((double)pC[0].nMean / WXT_SCALE) - pD->nMin) * (fRank / fMid));
+
+    for (n = 0; n < (pD->nCentroids - 1); n++)
+    {
+        nCum += pC[n].nWeight;
+        fNext = nCum + (pC[n + 1].nWeight / 2.0);
+        if (fRank < fNext)
+        {
+            fLo = (double)pC[n].nMean / WXT_SCALE;
+            fHi = (double)pC[n + 1].nMean / WXT_SCALE;
+            return fLo + ((fHi - fLo) * ((fRank - fMid) / (fNext - fMid)));
+        }
+        fMid = fNext;
+    }
+
+    fLo = (double)pC[n].nMean / WXT_SCALE;
+
+    return fLo + ((pD->nMax - fLo) * ((fRank - fMid) / (pD->nTotal - fMid)));
+}
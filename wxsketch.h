@@ -0,0 +1,43 @@
+// wxsketch.h
+//
+// Quantile sketches - merging t-digests of a reading field, small enough
+// to keep per day and month with the rollups and merge for any range
+//
+
+#ifndef WXSKETCH_H_INCLUDED
+#define WXSKETCH_H_INCLUDED
+
+#include <stdint.h>
+
+// Centroids held - below this many distinct values a digest is exact
+#define WXT_CENTROIDS       64
+
+// Centroid means in 1/256 units
+#define WXT_SCALE           256
+
+typedef struct _WxtCentroid
+{
+    int32_t     nMean;              // Value * WXT_SCALE
+    uint32_t    nWeight;
+} WxtCentroid;
+
+//
+// One digest (528 bytes, all zero := empty)
+//
+typedef struct _WxtDigest
+{
+    uint32_t    nTotal;             // Readings
+    uint16_t    nCentroids;
+    uint16_t    bApprox;            // Centroids merged across values
+    int16_t     nMin, nMax;
+    uint32_t    nSpare;
+    WxtCentroid xC[WXT_CENTROIDS];  // By mean
+} WxtDigest;
+
+extern void WxtAdd(WxtDigest *pD, int nVal);
+extern void WxtMerge(WxtDigest *pDst, const WxtDigest *pSrc);
+
+// fQ in [0, 1] - exact (between ranks) until the digest is compressed
+extern double WxtQuantile(const WxtDigest *pD, double fQ);
+
+#endif // WXSKETCH_H_INCLUDED
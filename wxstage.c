@@ -0,0 +1,280 @@
+// wxstage.c - Write-behind staging of the open day's logs
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxstage.h"
+
+//
+// Every batch of the day's logs is a write (and a journal frame, and
+// now and then a sync) on the SD card. With a staging directory (-K) on
+// tmpfs the persistence stage keeps the open day's files and journal
+// there instead, mirroring the tree: <sStagePath>/<Mmmyy>/<dd>[.wxb].
+//
+// Staged files are copied whole into the log tree - to a temp name,
+// synced and renamed into place, so the tree only ever holds a complete
+// earlier version - every nStageSecs, when the day is closed and at
+// shutdown (SIGTERM). A day is a few KB, so each copy is one sequential
+// write. In between, today's log in the tree lags the staged one;
+// queries (wxquery.c) read the staged copy, but today's rollup rows are
+// written with the copies and lag with them.
+//
+// A staged copy is dropped only once it is in the tree. Anything a
+// crashed run left behind is copied in at startup; the day being
+// reopened is copied too but stays staged, so it carries on from the
+// newer copy even if that fails. If the RAM copy was lost with the
+// power, the day picks up from the tree.
+//
+
+// Copy buffer
+#define WXSTAGE_BUFSIZE     (64 * 1024)
+
+char *sStagePath;
+
+static int nStageSecs = WXSTAGE_SECS;
+static time_t ttLastStage;
+
+int WxStageStart(const char *sSpec)
+{
+    struct stat xInfo;
+    const char *pComma;
+    size_t nLen;
+
+    pComma = strrchr(sSpec, ',');
+    nLen = pComma ? (size_t)(pComma - sSpec) : strlen(sSpec);
+    while ((nLen > 1) && (sSpec[nLen - 1] == '/'))
+        nLen--;
+    if (pComma)
+        nStageSecs = atoi(pComma + 1);
+
+    if ((nLen == 0) || (nStageSecs < WXSTAGE_MIN_SECS))
+    {
+        printf("Bad staging spec: %s (dir[,secs], secs >= %d)\n", sSpec, WXSTAGE_MIN_SECS);
+        return -1;
+    }
+
+    sStagePath = strndup(sSpec, nLen);
+    if (!sStagePath)
+        return -1;
+
+    // tmpfs comes up empty after a reboot
+    if (stat(sStagePath, &xInfo) != 0)
+    {
+        if (mkdir(sStagePath, 0755) != 0)
+        {
+            printf("Staging directory %s: %s\n", sStagePath, strerror(errno));
+            free(sStagePath);
+            sStagePath = NULL;
+            return -1;
+        }
+    }
+    else if (!S_ISDIR(xInfo.st_mode))
+    {
+        printf("Staging directory %s: %s\n", sStagePath, strerror(ENOTDIR));
+        free(sStagePath);
+        sStagePath = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+const char *WxStageRoot(void)
+{
+    return sStagePath ? sStagePath : sWLogPath;
+}
+
+// Directory part of sPath made if missing
+static int MakeParent(const char *sPath)
+{
+    struct stat xInfo;
+    char sDir[PATH_MAX];
+    char *pSlash;
+
+    strncpy(sDir, sPath, sizeof(sDir) - 1);
+    sDir[sizeof(sDir) - 1] = '\0';
+    pSlash = strrchr(sDir, '/');
+    if (pSlash && (pSlash != sDir))
+    {
+        *pSlash = '\0';
+        if ((mkdir(sDir, 0755) != 0) &&
+            ((errno != EEXIST) || (stat(sDir, &xInfo) != 0) || !S_ISDIR(xInfo.st_mode)))
+        {
+            printf("Staging directory %s: %s\n", sDir, strerror((errno == EEXIST) ? ENOTDIR : errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+//
+// sFrom to sTo via temp file and rename
+//
+static int CopyFile(const char *sFrom, const char *sTo)
+{
+    char sTemp[PATH_MAX + 8];
+    char *pBuf;
+    ssize_t nIn, nOut;
+    int fdIn, fdOut, nRet = -1;
+
+    pBuf = (char *)malloc(WXSTAGE_BUFSIZE);
+    if (!pBuf)
+        return -1;
+
+    snprintf(sTemp, sizeof(sTemp), "%s.tmp", sTo);
+    fdIn = open(sFrom, O_RDONLY);
+    fdOut = open(sTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((fdIn >= 0) && (fdOut >= 0))
+    {
+        while ((nIn = read(fdIn, pBuf, WXSTAGE_BUFSIZE)) > 0)
+        {
+            nOut = write(fdOut, pBuf, nIn);
+            if (nOut != nIn)
+                break;
+        }
+        if ((nIn == 0) && (fdatasync(fdOut) == 0))
+            nRet = 0;
+    }
+    if (fdIn >= 0)
+        close(fdIn);
+    if (fdOut >= 0)
+        close(fdOut);
+    free(pBuf);
+
+    if ((nRet == 0) && (rename(sTemp, sTo) != 0))
+        nRet = -1;
+    if (nRet != 0)
+    {
+        printf("Staging copy failed: %s: %s\n", sTo, strerror(errno));
+        unlink(sTemp);
+    }
+
+    return nRet;
+}
+
+int WxStageOpen(const char *sName)
+{
+    char sStaged[PATH_MAX], sTree[PATH_MAX];
+
+    if (!sStagePath || !sWLogPath)
+        return 0;
+
+    snprintf(sStaged, sizeof(sStaged), "%s%s", sStagePath, sName);
+    snprintf(sTree, sizeof(sTree), "%s%s", sWLogPath, sName);
+    if (MakeParent(sStaged) != 0)
+        return -1;
+
+    // Staged already (reopen) or nothing logged yet
+    if ((access(sStaged, F_OK) == 0) || (access(sTree, F_OK) != 0))
+        return 0;
+
+    return CopyFile(sTree, sStaged);
+}
+
+int WxStageFlush(const char *sName, int bDone)
+{
+    char sStaged[PATH_MAX], sTree[PATH_MAX];
+
+    if (!sStagePath || !sWLogPath)
+        return 0;
+
+    snprintf(sStaged, sizeof(sStaged), "%s%s", sStagePath, sName);
+    snprintf(sTree, sizeof(sTree), "%s%s", sWLogPath, sName);
+    if (access(sStaged, F_OK) != 0)
+        return 0;
+
+    if ((MakeParent(sTree) != 0) || (CopyFile(sStaged, sTree) != 0))
+        return -1;
+    if (bDone)
+        unlink(sStaged);
+
+    return 0;
+}
+
+int WxStageDue(void)
+{
+    time_t ttNow = vc_time();
+
+    if (ttLastStage == 0)
+        ttLastStage = ttNow;
+    if ((ttNow - ttLastStage) < nStageSecs)
+        return FALSE;
+    ttLastStage = ttNow;
+
+    return TRUE;
+}
+
+int WxStageRecover(time_t ttOpen)
+{
+    char sDir[PATH_MAX], sName[NAME_MAX + 16], sOpen[16];
+    struct dirent *pMonth, *pFile;
+    struct tm tmOpen;
+    DIR *dRoot, *dMonth;
+    size_t nOpen;
+    int nCopied = 0, nFailed = 0;
+    int bOpen;
+
+    if (!sStagePath || !sWLogPath)
+        return 0;
+
+    // Open day's log as NewLog() names it (/Mmmyy/dd), any extension
+    vc_localtime(&ttOpen, &tmOpen);
+    nOpen = sprintf(sOpen, "/%s%02d/%02d", sMonName[tmOpen.tm_mon], tmOpen.tm_year - 100, tmOpen.tm_mday);
+
+    dRoot = opendir(sStagePath);
+    if (!dRoot)
+        return 0;
+
+    // <Mmmyy>/<file> - the journal (dot file) stays
+    while ((pMonth = readdir(dRoot)) != NULL)
+    {
+        if ((pMonth->d_name[0] == '.') || (strlen(pMonth->d_name) != 5))
+            continue;
+        snprintf(sDir, sizeof(sDir), "%s/%s", sStagePath, pMonth->d_name);
+        dMonth = opendir(sDir);
+        if (!dMonth)
+            continue;
+
+        while ((pFile = readdir(dMonth)) != NULL)
+        {
+            if (pFile->d_name[0] == '.')
+                continue;
+            snprintf(sName, sizeof(sName), "/%s/%s", pMonth->d_name, pFile->d_name);
+            bOpen = (strncmp(sName, sOpen, nOpen) == 0) && ((sName[nOpen] == '\0') || (sName[nOpen] == '.'));
+            if (WxStageFlush(sName, !bOpen) == 0)
+                nCopied++;
+            else
+                nFailed++;
+        }
+        closedir(dMonth);
+        rmdir(sDir);
+    }
+    closedir(dRoot);
+
+    if ((nCopied + nFailed) > 0)
+        printf("Staging recovery: %d files copied to log tree, %d failed\n", nCopied, nFailed);
+
+    return nFailed ? -1 : nCopied;
+}
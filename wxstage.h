@@ -0,0 +1,39 @@
+// wxstage.h
+//
+// Write-behind staging - the open day's logs and journal kept on a RAM
+// filesystem and copied into the log tree in one go on a schedule, at
+// midnite and at shutdown
+//
+
+#ifndef WXSTAGE_H_INCLUDED
+#define WXSTAGE_H_INCLUDED
+
+#include <time.h>
+
+// Seconds between copies to the log tree (default, least)
+#define WXSTAGE_SECS        900
+#define WXSTAGE_MIN_SECS    60
+
+// Staging directory (NULL := off, logs written in place)
+extern char *sStagePath;
+
+// dir[,secs] - check the directory (before the log starts)
+extern int WxStageStart(const char *sSpec);
+
+// Where the open day's logs and journal are written
+extern const char *WxStageRoot(void);
+
+// sName is below the root ("/Mmmyy/dd") - staged copy from the tree if none
+extern int WxStageOpen(const char *sName);
+
+// Staged copy into the tree (bDone drops it once there)
+extern int WxStageFlush(const char *sName, int bDone);
+
+// TRUE once each interval
+extern int WxStageDue(void);
+
+// Startup - whatever a previous run left staged goes to the tree, the
+// day of ttOpen (about to be reopened) staying staged as well
+extern int WxStageRecover(time_t ttOpen);
+
+#endif // WXSTAGE_H_INCLUDED
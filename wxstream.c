@@ -0,0 +1,508 @@
+// wxstream.c - Line protocol export of readings and events
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "id4-pi.h"
+#include "vclock.h"
+#include "wxpipe.h"
+#include "wxstream.h"
+
+//
+// Producers format each record as a line and append it to the spill
+// ring under the lock - no I/O, so the persistence stage never waits on
+// the sink. The sender thread takes whole lines from the front, sends
+// them outside the lock and only then consumes them, so a failed send
+// leaves them for the retry (at least once - the sink dedups on series
+// and time). Positions are absolute byte counts; a full ring drops its
+// oldest lines, which may be ones being sent.
+//
+
+// Sink kinds
+#define SK_UDP              1
+#define SK_TCP              2
+#define SK_UNIX             3
+#define SK_UNIXGRAM         4
+
+// Largest send on a stream socket
+#define WXS_CHUNK_SIZE      (16 * 1024)
+
+// Socket send timeout (seconds)
+#define WXS_SEND_TIMEOUT    2
+
+static int nSinkKind;
+static struct sockaddr_storage xSinkAddr;
+static socklen_t nSinkAddrLen;
+static int fSink = -1;
+
+static int nBatchLines = WXS_BATCH_LINES;
+static int nFlushMs = WXS_FLUSH_MS;
+
+static char *pSpill;
+static uint64_t nHead, nTail;           // Absolute positions
+static int nPending;                    // Lines between them
+static int bStreaming = FALSE;
+static int bStopping = FALSE;
+static WxStreamStats xStats;
+
+static pthread_t tStream;
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stream_cond = PTHREAD_COND_INITIALIZER;
+
+//-------------------------------------------------------------------------------
+// Spill ring (stream_mutex held)
+
+static void DropOldest(void)
+{
+    while ((nHead < nTail) && (pSpill[nHead % WXS_SPILL_SIZE] != '\n'))
+        nHead++;
+    if (nHead < nTail)
+        nHead++;
+    nPending--;
+    xStats.nDropped++;
+
+    return;
+}
+
+static void Append(const char *sLine, int nLen)
+{
+    size_t nAt, nPart;
+
+    pthread_mutex_lock(&stream_mutex);
+    if (!bStreaming)
+    {
+        pthread_mutex_unlock(&stream_mutex);
+        return;
+    }
+
+    while ((nTail - nHead) + nLen > WXS_SPILL_SIZE)
+        DropOldest();
+
+    nAt = nTail % WXS_SPILL_SIZE;
+    nPart = WXS_SPILL_SIZE - nAt;
+    if (nPart > (size_t)nLen)
+        nPart = nLen;
+    memcpy(pSpill + nAt, sLine, nPart);
+    memcpy(pSpill, sLine + nPart, nLen - nPart);
+    nTail += nLen;
+    nPending++;
+    xStats.nLines++;
+
+    if (nPending >= nBatchLines)
+        pthread_cond_signal(&stream_cond);
+    pthread_mutex_unlock(&stream_mutex);
+
+    return;
+}
+
+// Copy whole lines from the front, returns length (0 := none)
+static int TakeLines(char *sBuf, int nMax)
+{
+    uint64_t nPos;
+    int nLen = 0, nLast = 0;
+
+    for (nPos = nHead; (nPos < nTail) && (nLen < nMax); nPos++)
+    {
+        sBuf[nLen++] = pSpill[nPos % WXS_SPILL_SIZE];
+        if (sBuf[nLen - 1] == '\n')
+            nLast = nLen;
+    }
+
+    return nLast;
+}
+
+//-------------------------------------------------------------------------------
+// Sink
+
+static int ParseSink(const char *sSpec)
+{
+    char sHost[64], sPort[16], sPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct sockaddr_un *pUn = (struct sockaddr_un *)&xSinkAddr;
+    struct addrinfo xHints, *pInfo;
+    const char *p;
+    int n;
+
+    memset(&xSinkAddr, 0, sizeof(xSinkAddr));
+    n = 0;
+    if ((sscanf(sSpec, "udp://%63[^:]:%15[0-9]%n", sHost, sPort, &n) == 2) && n)
+        nSinkKind = SK_UDP;
+    else if ((sscanf(sSpec, "tcp://%63[^:]:%15[0-9]%n", sHost, sPort, &n) == 2) && n)
+        nSinkKind = SK_TCP;
+    else if ((sscanf(sSpec, "unixgram:%107[^,]%n", sPath, &n) == 1) && n)
+        nSinkKind = SK_UNIXGRAM;
+    else if ((sscanf(sSpec, "unix:%107[^,]%n", sPath, &n) == 1) && n)
+        nSinkKind = SK_UNIX;
+    else
+        return -1;
+
+    // Tunables follow
+    p = sSpec + n;
+    if (*p == ',')
+    {
+        n = sscanf(p, ",%d,%d", &nBatchLines, &nFlushMs);
+        if ((n < 1) || (nBatchLines < 1) || (nFlushMs < 1))
+            return -1;
+    }
+    else if (*p)
+        return -1;
+
+    if ((nSinkKind == SK_UNIX) || (nSinkKind == SK_UNIXGRAM))
+    {
+        pUn->sun_family = AF_UNIX;
+        strcpy(pUn->sun_path, sPath);
+        nSinkAddrLen = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    memset(&xHints, 0, sizeof(xHints));
+    xHints.ai_family = AF_UNSPEC;
+    xHints.ai_socktype = (nSinkKind == SK_UDP) ? SOCK_DGRAM : SOCK_STREAM;
+    if ((n = getaddrinfo(sHost, sPort, &xHints, &pInfo)) != 0)
+    {
+        printf("Stream sink %s: %s\n", sHost, gai_strerror(n));
+        return -1;
+    }
+    memcpy(&xSinkAddr, pInfo->ai_addr, pInfo->ai_addrlen);
+    nSinkAddrLen = pInfo->ai_addrlen;
+    freeaddrinfo(pInfo);
+
+    return 0;
+}
+
+static int ConnectSink(void)
+{
+    struct timeval tvSend = { WXS_SEND_TIMEOUT, 0 };
+    int bDgram = (nSinkKind == SK_UDP) || (nSinkKind == SK_UNIXGRAM);
+
+    fSink = socket(xSinkAddr.ss_family, (bDgram ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+    if (fSink < 0)
+        return -1;
+
+    setsockopt(fSink, SOL_SOCKET, SO_SNDTIMEO, &tvSend, sizeof(tvSend));
+    if (connect(fSink, (struct sockaddr *)&xSinkAddr, nSinkAddrLen) != 0)
+    {
+        close(fSink);
+        fSink = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int SendSink(const char *sBuf, int nLen)
+{
+    ssize_t nSent;
+
+    if ((fSink < 0) && (ConnectSink() != 0))
+        return -1;
+
+    while (nLen > 0)
+    {
+        nSent = send(fSink, sBuf, nLen, MSG_NOSIGNAL);
+        if ((nSent < 0) && (errno == EINTR))
+            continue;
+        if (nSent <= 0)
+        {
+            close(fSink);
+            fSink = -1;
+            return -1;
+        }
+        sBuf += nSent;
+        nLen -= nSent;
+    }
+
+    return 0;
+}
+
+//-------------------------------------------------------------------------------
+// Sender
+
+static void Deadline(struct timespec *pWhen, int nMs)
+{
+    clock_gettime(CLOCK_MONOTONIC, pWhen);
+    pWhen->tv_sec += nMs / 1000;
+    pWhen->tv_nsec += (nMs % 1000) * 1000000L;
+    if (pWhen->tv_nsec >= 1000000000L)
+    {
+        pWhen->tv_sec++;
+        pWhen->tv_nsec -= 1000000000L;
+    }
+
+    return;
+}
+
+//
+// Send everything pending, non-zero := sink failed (lines kept)
+//
+static int Drain(char *sBuf)
+{
+    int nMax = ((nSinkKind == SK_UDP) || (nSinkKind == SK_UNIXGRAM)) ? WXS_DGRAM_SIZE : WXS_CHUNK_SIZE;
+    uint64_t nStart, nEnd;
+    int nLen, k;
+
+    while (TRUE)
+    {
+        pthread_mutex_lock(&stream_mutex);
+        nStart = nHead;
+        nLen = TakeLines(sBuf, nMax);
+        pthread_mutex_unlock(&stream_mutex);
+        if (nLen == 0)
+            return 0;
+
+        if (SendSink(sBuf, nLen) != 0)
+        {
+            pthread_mutex_lock(&stream_mutex);
+            xStats.nRetries++;
+            pthread_mutex_unlock(&stream_mutex);
+            return -1;
+        }
+
+        // Consume what is left of it (overflow may have dropped some)
+        pthread_mutex_lock(&stream_mutex);
+        nEnd = nStart + nLen;
+        if (nHead < nEnd)
+        {
+            for (k = (int)(nHead - nStart); k < nLen; k++)
+            {
+                if (sBuf[k] == '\n')
+                {
+                    nPending--;
+                    xStats.nSent++;
+                }
+            }
+            nHead = nEnd;
+        }
+        pthread_mutex_unlock(&stream_mutex);
+    }
+}
+
+//
+// Flush on batch size or interval, back off while the sink is down
+//
+static void *xWxStream(void *args)
+{
+    static char sBuf[WXS_CHUNK_SIZE];
+    struct timespec tsWhen;
+    int nBackoff = 0, bStop;
+
+    (void)args;
+    Deadline(&tsWhen, nFlushMs);
+    while (TRUE)
+    {
+        pthread_mutex_lock(&stream_mutex);
+        while (!bStopping && ((nPending < nBatchLines) || nBackoff))
+        {
+            if (pthread_cond_timedwait(&stream_cond, &stream_mutex, &tsWhen) == ETIMEDOUT)
+                break;
+        }
+        bStop = bStopping;
+        pthread_mutex_unlock(&stream_mutex);
+
+        if (Drain(sBuf) == 0)
+        {
+            nBackoff = 0;
+            Deadline(&tsWhen, nFlushMs);
+        }
+        else
+        {
+            nBackoff = (nBackoff == 0) ? nFlushMs : (nBackoff * 2);
+            if (nBackoff > WXS_RETRY_MAX_MS)
+                nBackoff = WXS_RETRY_MAX_MS;
+            Deadline(&tsWhen, nBackoff);
+        }
+
+        if (bStop)
+            break;
+    }
+
+    return NULL;
+}
+
+//-------------------------------------------------------------------------------
+// Interface
+
+int WxStreamStart(const char *sSpec)
+{
+    pthread_condattr_t xAttr;
+    int rc;
+
+    if (ParseSink(sSpec) != 0)
+    {
+        printf("Bad stream sink: %s\n", sSpec);
+        return -1;
+    }
+
+    pSpill = malloc(WXS_SPILL_SIZE);
+    if (pSpill == NULL)
+    {
+        printf("Stream spill alloc failed\n");
+        return -1;
+    }
+
+    // Deadlines on the monotonic clock (immune to clock sets)
+    pthread_condattr_init(&xAttr);
+    pthread_condattr_setclock(&xAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&stream_cond, &xAttr);
+    pthread_condattr_destroy(&xAttr);
+
+    bStreaming = TRUE;
+    rc = pthread_create(&tStream, NULL, xWxStream, NULL);
+    if (rc != 0)
+    {
+        printf("Stream thread create failed: %s\n", strerror(rc));
+        bStreaming = FALSE;
+        return -1;
+    }
+
+    WxStreamEvent("restart", "id4001 v" VERSION);
+
+    return 0;
+}
+
+//
+// Last try at the sink, then stop taking lines
+//
+void WxStreamStop(void)
+{
+    if (!bStreaming)
+        return;
+
+    pthread_mutex_lock(&stream_mutex);
+    bStopping = TRUE;
+    pthread_cond_signal(&stream_cond);
+    pthread_mutex_unlock(&stream_mutex);
+    pthread_join(tStream, NULL);
+
+    pthread_mutex_lock(&stream_mutex);
+    bStreaming = FALSE;
+    printf("Stream: %lu lines sent, %lu dropped, %lu left\n", xStats.nSent, xStats.nDropped,
+           (unsigned long)nPending);
+    pthread_mutex_unlock(&stream_mutex);
+
+    if (fSink >= 0)
+        close(fSink);
+    fSink = -1;
+
+    return;
+}
+
+void WxStreamGetStats(WxStreamStats *pStats)
+{
+    pthread_mutex_lock(&stream_mutex);
+    *pStats = xStats;
+    pthread_mutex_unlock(&stream_mutex);
+
+    return;
+}
+
+//
+// Field string - quotes and backslashes escaped, log message dashes and
+// newline trimmed
+//
+static int QuoteText(char *sOut, int nSize, const char *sText)
+{
+    const char *pEnd;
+    int nLen = 0;
+
+    while (*sText == '-')
+        sText++;
+    for (pEnd = sText + strlen(sText); (pEnd > sText) && strchr("-\r\n", pEnd[-1]); pEnd--)
+        ;
+
+    for (; (sText < pEnd) && (nLen < (nSize - 2)); sText++)
+    {
+        if ((*sText == '"') || (*sText == '\\'))
+            sOut[nLen++] = '\\';
+        sOut[nLen++] = *sText;
+    }
+    sOut[nLen] = '\0';
+
+    return nLen;
+}
+
+static void StreamEvent(time_t ttWhen, const char *sType, const char *sText)
+{
+    char sLine[WXS_LINE_SIZE], sQuoted[WX_MSG_SIZE * 2];
+    int nLen;
+
+    QuoteText(sQuoted, sizeof(sQuoted), sText ? sText : "");
+    nLen = snprintf(sLine, sizeof(sLine), "event,type=%s text=\"%s\" %ld000000000\n",
+                    sType, sQuoted, (long)ttWhen);
+    if ((nLen > 0) && (nLen < (int)sizeof(sLine)))
+        Append(sLine, nLen);
+
+    return;
+}
+
+void WxStreamEvent(const char *sType, const char *sText)
+{
+    if (bStreaming)
+        StreamEvent(vc_time(), sType, sText);
+
+    return;
+}
+
+//
+// Pipeline record (after persistence) - time is when acquired
+//
+void WxStreamRecord(const WxRecord *pRec)
+{
+    char sLine[WXS_LINE_SIZE];
+    const WxWeather *pW = &pRec->u.xWeather;
+    const WxMinMax *pM = &pRec->u.xMinMax;
+    int nLen = 0;
+
+    if (!bStreaming)
+        return;
+
+    switch (pRec->nType)
+    {
+    case WX_REC_WEATHER:
+        nLen = snprintf(sLine, sizeof(sLine),
+                        "weather indoor=%di,outdoor=%di,wind=%di,dir=\"%s\",pressure=%d.%02d %ld000000000\n",
+                        pW->nIndoor, pW->nOutdoor, pW->nWind, sWinDir[pW->nDir & 0x0F],
+                        pW->nPressure / 100, pW->nPressure % 100, (long)pRec->ttStamp);
+        break;
+
+    case WX_REC_MINMAX:
+        nLen = snprintf(sLine, sizeof(sLine),
+                        "minmax tlow=%di,thigh=%di,wind=%di,plow=%d.%02d,phigh=%d.%02d %ld000000000\n",
+                        pM->nTLow, pM->nTHigh, pM->nWind, pM->nPLow / 100, pM->nPLow % 100,
+                        pM->nPHigh / 100, pM->nPHigh % 100, (long)pRec->ttStamp);
+        break;
+
+    case WX_REC_MESSAGE:
+        StreamEvent(pRec->ttStamp, "message", pRec->u.sMsg);
+        break;
+
+    case WX_REC_NEWLOG:
+        StreamEvent(pRec->ttStamp, "newlog", pRec->bUpload ? "upload" : "");
+        break;
+    }
+
+    if ((nLen > 0) && (nLen < (int)sizeof(sLine)))
+        Append(sLine, nLen);
+
+    return;
+}
@@ -0,0 +1,49 @@
+// wxstream.h
+//
+// Streaming export - readings and events as InfluxDB line protocol to a
+// local time-series sink (UDP, TCP or Unix socket), batched and held in
+// memory while the sink is down
+//
+
+#ifndef WXSTREAM_H_INCLUDED
+#define WXSTREAM_H_INCLUDED
+
+#include "wxpipe.h"
+
+// Defaults (-P url[,lines[,ms]])
+#define WXS_BATCH_LINES     64
+#define WXS_FLUSH_MS        1000
+
+// Lines held for the sink (oldest dropped beyond this)
+#define WXS_SPILL_SIZE      (256 * 1024)
+
+// Longest line
+#define WXS_LINE_SIZE       160
+
+// Datagram payload (UDP, unixgram) - batches are split to fit
+#define WXS_DGRAM_SIZE      1400
+
+// Reconnect backoff ceiling
+#define WXS_RETRY_MAX_MS    30000
+
+//
+// Stream statistics
+//
+typedef struct _WxStreamStats
+{
+    unsigned long   nLines;             // Queued
+    unsigned long   nSent;
+    unsigned long   nDropped;           // Spill overflow
+    unsigned long   nRetries;           // Failed connects/sends
+} WxStreamStats;
+
+// udp://host:port, tcp://host:port, unix:path or unixgram:path
+extern int WxStreamStart(const char *sSpec);
+extern void WxStreamStop(void);
+extern void WxStreamGetStats(WxStreamStats *pStats);
+
+// Producers (any thread, never block on the sink)
+extern void WxStreamRecord(const WxRecord *pRec);
+extern void WxStreamEvent(const char *sType, const char *sText);
+
+#endif // WXSTREAM_H_INCLUDED
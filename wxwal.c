@@ -0,0 +1,330 @@
+// wxwal.c - Write-ahead segment for the daily weather log
+
+/*
+ * Copyright (c) 2014 by Ted Hess
+ * Kitschensync - RPi daemon for Heathkit ID4001
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "id4-pi.h"
+#include "wxpipe.h"
+#include "wxwal.h"
+#include "wxstage.h"
+
+//
+// <sWLogPath>/.wxwal (in the staging directory when staged, next to the
+// log it covers) holds everything written to the open day log since it
+// was last synced:
+//
+//   header  - log name and its size when last synced (checkpoint)
+//   frames  - CSV offset, length and CRC of each batch, then the batch
+//
+// Each batch goes to the segment before the log. A sync of the log is a
+// checkpoint: the header moves up to the synced size and the frames are
+// dropped, so the segment (and recovery) never exceeds WX_WAL_MAX.
+//
+// At startup the frames still in the segment are replayed into the log
+// and anything past the last good frame is cut back to the last whole
+// line, so a power failure mid-write leaves no partial record.
+//
+// Only with WX_SYNC_ALWAYS is a frame on disk before its batch reaches
+// the log. Otherwise frame and batch both sit in the page cache until
+// the next sync and either may be lost first, so replay is best-effort:
+// it restores what of the frames made it out, and the cut back to a
+// whole line is what is guaranteed.
+//
+
+#define WX_WAL_NAME     "/.wxwal"
+#define WX_WAL_MAGIC    0x4C415758      // "XWAL"
+#define WX_FRAME_MAGIC  0x4D415246      // "FRAM"
+
+typedef struct _WalHead
+{
+    uint32_t    nMagic;
+    uint32_t    nSize;          // Log size at checkpoint
+    char        sName[24];      // Log path below sWLogPath
+    uint32_t    nCrc;
+} WalHead;
+
+typedef struct _WalFrame
+{
+    uint32_t    nMagic;
+    uint32_t    nOffset;        // Log offset of batch
+    uint32_t    nLen;
+    uint32_t    nCrc;           // Over offset, length and batch
+} WalFrame;
+
+static int fdWal = -1;
+static WalHead xHead;
+static off_t nWalSize;
+static char sFrameBuf[sizeof(WalFrame) + WX_WAL_BATCH];
+
+//
+// CRC-32 (IEEE, reflected)
+//
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+    uint32_t c;
+    int n, k;
+
+    if (crc_table[1])
+        return;
+
+    for (n = 0; n < 256; n++)
+    {
+        c = (uint32_t)n;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+
+    return;
+}
+
+uint32_t wx_crc32(uint32_t nCrc, const void *pData, size_t nLen)
+{
+    const unsigned char *p = (const unsigned char *)pData;
+
+    crc_init();
+    nCrc = ~nCrc;
+    while (nLen--)
+        nCrc = crc_table[(nCrc ^ *p++) & 0xFF] ^ (nCrc >> 8);
+
+    return ~nCrc;
+}
+
+static uint32_t FrameCrc(WalFrame *pFrame, const char *pData)
+{
+    uint32_t nCrc;
+
+    nCrc = wx_crc32(0, &pFrame->nOffset, sizeof(pFrame->nOffset) + sizeof(pFrame->nLen));
+
+    return wx_crc32(nCrc, pData, pFrame->nLen);
+}
+
+static int WalOpen(void)
+{
+    char sPath[80];
+
+    if (fdWal >= 0)
+        return TRUE;
+    if (!sWLogPath)
+        return FALSE;
+
+    snprintf(sPath, sizeof(sPath), "%s" WX_WAL_NAME, WxStageRoot());
+    fdWal = open(sPath, O_RDWR | O_CREAT, 0644);
+    if (fdWal < 0)
+    {
+        printf("Log journal open failed: %s\n", strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void WalWriteHead(void)
+{
+    xHead.nMagic = WX_WAL_MAGIC;
+    xHead.nCrc = wx_crc32(0, &xHead, offsetof(WalHead, nCrc));
+
+    if ((pwrite(fdWal, &xHead, sizeof(xHead), 0) != sizeof(xHead)) ||
+        (ftruncate(fdWal, sizeof(xHead)) != 0))
+        printf("Log journal write failed: %s\n", strerror(errno));
+    fdatasync(fdWal);
+    nWalSize = sizeof(xHead);
+
+    return;
+}
+
+//
+// New log opened - start journal for it at its current size
+//
+void WalBegin(const char *sName, off_t nSize)
+{
+    if (!WalOpen())
+        return;
+
+    memset(&xHead, 0, sizeof(xHead));
+    strncpy(xHead.sName, sName, sizeof(xHead.sName) - 1);
+    xHead.nSize = (uint32_t)nSize;
+    WalWriteHead();
+
+    return;
+}
+
+//
+// Journal a batch about to be appended at nOffset
+//
+int WalAppend(off_t nOffset, const char *pData, size_t nLen)
+{
+    WalFrame *pFrame = (WalFrame *)sFrameBuf;
+
+    if ((fdWal < 0) || (nLen > WX_WAL_BATCH))
+        return -1;
+
+    pFrame->nMagic = WX_FRAME_MAGIC;
+    pFrame->nOffset = (uint32_t)nOffset;
+    pFrame->nLen = (uint32_t)nLen;
+    memcpy(&sFrameBuf[sizeof(WalFrame)], pData, nLen);
+    pFrame->nCrc = FrameCrc(pFrame, pData);
+
+    // One write for frame and data
+    if (pwrite(fdWal, sFrameBuf, sizeof(WalFrame) + nLen, nWalSize) != (ssize_t)(sizeof(WalFrame) + nLen))
+    {
+        printf("Log journal write failed: %s\n", strerror(errno));
+        return -1;
+    }
+    nWalSize += sizeof(WalFrame) + nLen;
+
+    // Frame ahead of the log write when every batch is to be durable
+    if ((nLogSync == WX_SYNC_ALWAYS) && (fdatasync(fdWal) != 0))
+    {
+        printf("Log journal sync failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// TRUE if the journal has grown enough to force a checkpoint
+int WalFull(void)
+{
+    return nWalSize >= WX_WAL_MAX;
+}
+
+//
+// Log synced through nSize - frames no longer needed
+//
+void WalCheckpoint(off_t nSize)
+{
+    if (fdWal < 0)
+        return;
+
+    xHead.nSize = (uint32_t)nSize;
+    WalWriteHead();
+
+    return;
+}
+
+void WalClose(void)
+{
+    if (fdWal >= 0)
+    {
+        close(fdWal);
+        fdWal = -1;
+    }
+
+    return;
+}
+
+//
+// Startup - repair the journaled log. Returns bytes dropped from the
+// log tail (torn record), *pReplayed gets bytes restored from journal.
+//
+long WalRecover(long *pReplayed)
+{
+    WalFrame xFrame;
+    struct stat xInfo;
+    char sPath[80];
+    char *pTail;
+    off_t nPos, nEnd, nKeep, nRead, nStart;
+    long nDropped = 0;
+    int fd, i, bScanned;
+
+    *pReplayed = 0;
+    if (!WalOpen())
+        return 0;
+
+    // No (or foreign) header - nothing journaled
+    if ((pread(fdWal, &xHead, sizeof(xHead), 0) != sizeof(xHead)) ||
+        (xHead.nMagic != WX_WAL_MAGIC) ||
+        (xHead.nCrc != wx_crc32(0, &xHead, offsetof(WalHead, nCrc))))
+        return 0;
+    xHead.sName[sizeof(xHead.sName) - 1] = '\0';
+
+    snprintf(sPath, sizeof(sPath), "%s%s", WxStageRoot(), xHead.sName);
+    fd = open(sPath, O_RDWR);
+    if (fd < 0)
+        return 0;
+    fstat(fd, &xInfo);
+
+    // Replay good frames (rewriting what is already there is harmless)
+    nEnd = xHead.nSize;
+    for (nPos = sizeof(xHead); ; nPos += sizeof(xFrame) + xFrame.nLen)
+    {
+        if ((pread(fdWal, &xFrame, sizeof(xFrame), nPos) != sizeof(xFrame)) ||
+            (xFrame.nMagic != WX_FRAME_MAGIC) || (xFrame.nOffset != nEnd) ||
+            (xFrame.nLen > WX_WAL_BATCH))
+            break;
+        if ((pread(fdWal, sFrameBuf, xFrame.nLen, nPos + sizeof(xFrame)) != xFrame.nLen) ||
+            (xFrame.nCrc != FrameCrc(&xFrame, sFrameBuf)))
+            break;
+
+        if ((xFrame.nOffset + xFrame.nLen) > xInfo.st_size)
+            *pReplayed += (xFrame.nOffset + xFrame.nLen) - ((xFrame.nOffset > xInfo.st_size) ? xFrame.nOffset : xInfo.st_size);
+        if (pwrite(fd, sFrameBuf, xFrame.nLen, xFrame.nOffset) != xFrame.nLen)
+            break;
+        nEnd += xFrame.nLen;
+    }
+
+    // Beyond the journal - keep whole lines, drop a torn one. Left as
+    // it is if the tail cannot be read.
+    nKeep = nEnd;
+    if (xInfo.st_size > nEnd)
+    {
+        nRead = xInfo.st_size - nEnd;
+        nStart = nEnd;
+        if (nRead > WX_WAL_MAX)
+        {
+            // Bound the scan to the last journal's worth
+            nStart = xInfo.st_size - WX_WAL_MAX;
+            nRead = WX_WAL_MAX;
+            nKeep = nStart;
+        }
+
+        pTail = (char *)malloc(nRead);
+        bScanned = pTail && (pread(fd, pTail, nRead, nStart) == nRead);
+        for (i = 0; bScanned && (i < nRead) && (pTail[i] != '\0'); i++)
+        {
+            if (pTail[i] == '\n')
+                nKeep = nStart + i + 1;
+        }
+        free(pTail);
+
+        if (!bScanned)
+        {
+            printf("Log recovery: %s - tail not checked: %s\n", xHead.sName, strerror(errno));
+            nKeep = xInfo.st_size;
+        }
+    }
+
+    if (nKeep < xInfo.st_size)
+        nDropped = xInfo.st_size - nKeep;
+    if ((nDropped != 0) || (*pReplayed != 0))
+    {
+        if ((nDropped != 0) && (ftruncate(fd, nKeep) != 0))
+            printf("Log truncate failed: %s\n", strerror(errno));
+        fdatasync(fd);
+        printf("Log recovery: %s - %ld bytes replayed, %ld bytes dropped\n", xHead.sName, *pReplayed, nDropped);
+    }
+    close(fd);
+
+    return nDropped;
+}
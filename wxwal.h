@@ -0,0 +1,27 @@
+// wxwal.h
+//
+// Write-ahead journal for the open daily weather log
+//
+
+#ifndef WXWAL_H_INCLUDED
+#define WXWAL_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Largest batch journaled in one frame (log group buffer size)
+#define WX_WAL_BATCH    4096
+
+// Journal size that forces a log sync (bounds recovery)
+#define WX_WAL_MAX      (64 * 1024)
+
+extern uint32_t wx_crc32(uint32_t nCrc, const void *pData, size_t nLen);
+
+extern void WalBegin(const char *sName, off_t nSize);
+extern int WalAppend(off_t nOffset, const char *pData, size_t nLen);
+extern int WalFull(void);
+extern void WalCheckpoint(off_t nSize);
+extern void WalClose(void);
+extern long WalRecover(long *pReplayed);
+
+#endif // WXWAL_H_INCLUDED